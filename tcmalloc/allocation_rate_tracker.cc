@@ -0,0 +1,266 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_rate_tracker.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/base/optimization.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/hash/hash.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/sampler.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class AllocationRateProfile final : public ProfileBase {
+ public:
+  AllocationRateProfile(std::vector<Profile::Sample> samples,
+                        absl::Duration duration)
+      : samples_(std::move(samples)), duration_(duration) {}
+
+  void Iterate(
+      absl::FunctionRef<void(const Profile::Sample&)> f) const override {
+    for (const auto& sample : samples_) {
+      f(sample);
+    }
+  }
+
+  ProfileType Type() const override { return ProfileType::kAllocations; }
+
+  absl::Duration Duration() const override { return duration_; }
+
+ private:
+  std::vector<Profile::Sample> samples_;
+  absl::Duration duration_;
+};
+
+}  // namespace
+
+size_t AllocationRateTracker::Epoch::Report(const Entry& sample) {
+  for (size_t i = 0; i < size; ++i) {
+    if (entries[i].hash == sample.hash) {
+      entries[i].bytes += sample.bytes;
+      entries[i].count += sample.count;
+      return i;
+    }
+  }
+  if (size < kStacksPerEpoch) {
+    entries[size] = sample;
+    return size++;
+  }
+
+  // The sketch is full: the new stack takes over the entry with the fewest
+  // bytes, inheriting its counts.
+  Entry* min = std::min_element(
+      entries, entries + size,
+      [](const Entry& a, const Entry& b) { return a.bytes < b.bytes; });
+  min->hash = sample.hash;
+  min->bytes += sample.bytes;
+  min->count += sample.count;
+  return min - entries;
+}
+
+void AllocationRateTracker::Epoch::Merge(const Epoch& other) {
+  for (size_t i = 0; i < other.size; ++i) {
+    Report(other.entries[i]);
+  }
+}
+
+void AllocationRateTracker::Init(Clock clock) {
+  clock_ = clock;
+  epoch_ticks_ = absl::ToDoubleSeconds(kWindow / kEpochs) * clock.freq();
+  const int64_t epoch = CurrentEpoch();
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    for (auto& id : epoch_ids_) {
+      id = epoch;
+    }
+  }
+  for (auto& shard : shards_) {
+    AllocationGuardSpinLockHolder h(&shard.lock);
+    shard.epoch = epoch;
+  }
+  inited_.store(true, std::memory_order_release);
+}
+
+void AllocationRateTracker::RecordStack(uint64_t hash, int64_t bytes,
+                                        const StackSlot& frames) {
+  StackSlot* set = stacks_[hash % kStackSets];
+  StackSlot* victim = &set[0];
+  for (size_t i = 0; i < kStackWays; ++i) {
+    if (set[i].hash == hash) {
+      set[i].bytes += bytes;
+      return;
+    }
+    if (set[i].bytes < victim->bytes) {
+      victim = &set[i];
+    }
+  }
+
+  for (size_t i = 0; i < kStackWays; ++i) {
+    set[i].bytes /= 2;
+  }
+  victim->hash = hash;
+  victim->bytes = bytes;
+  victim->depth = frames.depth;
+  memcpy(victim->stack, frames.stack, sizeof(frames.stack[0]) * frames.depth);
+}
+
+void AllocationRateTracker::Flush(Shard& shard, int64_t current_epoch) {
+  const int64_t epoch = shard.epoch;
+  const Epoch& sketch = shard.sketch;
+  if (!sketch.empty() && epoch > current_epoch - int64_t{kEpochs}) {
+    AllocationGuardSpinLockHolder h(&lock_);
+    const size_t slot = epoch % kEpochs;
+    // A newer epoch in the slot means that this one has expired meanwhile.
+    if (epoch_ids_[slot] <= epoch) {
+      if (epoch_ids_[slot] != epoch) {
+        epochs_[slot] = Epoch::Nil();
+        epoch_ids_[slot] = epoch;
+      }
+      epochs_[slot].Merge(sketch);
+    }
+    for (size_t i = 0; i < sketch.size; ++i) {
+      RecordStack(sketch.entries[i].hash, sketch.entries[i].bytes,
+                  shard.stacks[i]);
+    }
+  }
+  shard.sketch = Epoch::Nil();
+}
+
+void AllocationRateTracker::Report(const StackTrace& stack_trace) {
+  if (ABSL_PREDICT_FALSE(!inited_.load(std::memory_order_acquire))) return;
+
+  uint64_t hash = absl::HashOf(
+      absl::Span<void* const>(stack_trace.stack, stack_trace.depth));
+  // Zero marks unused stack slots.
+  if (ABSL_PREDICT_FALSE(hash == 0)) hash = 1;
+
+  // Same rounding as StackTraceToSample.
+  const size_t allocated_size = stack_trace.allocated_size;
+  ASSERT(allocated_size > 0);
+  const int64_t bytes = AllocatedBytes(stack_trace) + 0.5;
+  const int64_t count = (bytes + allocated_size / 2) / allocated_size;
+
+  const int64_t epoch = CurrentEpoch();
+  // The CPU may be unknown if neither rseq nor sched_getcpu() is available.
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  Shard& shard = shards_[cpu < 0 ? 0 : cpu % kShards];
+  AllocationGuardSpinLockHolder h(&shard.lock);
+  if (ABSL_PREDICT_FALSE(shard.epoch != epoch)) {
+    Flush(shard, epoch);
+    shard.epoch = epoch;
+  }
+  StackSlot& frames = shard.stacks[shard.sketch.Report({hash, bytes, count})];
+  if (frames.hash != hash) {
+    frames.hash = hash;
+    frames.depth = stack_trace.depth;
+    memcpy(frames.stack, stack_trace.stack,
+           sizeof(stack_trace.stack[0]) * stack_trace.depth);
+  }
+}
+
+std::unique_ptr<ProfileBase> AllocationRateTracker::Dump(
+    absl::Duration window) {
+  const absl::Duration epoch_length = kWindow / kEpochs;
+  const int64_t num_epochs = std::clamp<int64_t>(
+      absl::Ceil(window, epoch_length) / epoch_length, 1, kEpochs);
+
+  // Report() may be called from the allocation path, so we must not allocate
+  // while holding any of the locks: copy what we need into preallocated
+  // buffers and build the profile after releasing them.
+  std::vector<Epoch::Entry> entries;
+  entries.reserve(num_epochs * kStacksPerEpoch);
+  std::vector<StackSlot> stacks(kStackSets * kStackWays);
+  if (inited_.load(std::memory_order_acquire)) {
+    const int64_t current_epoch = CurrentEpoch();
+    // Fold what the shards have collected so far into epochs_ and stacks_.
+    for (auto& shard : shards_) {
+      AllocationGuardSpinLockHolder h(&shard.lock);
+      Flush(shard, current_epoch);
+    }
+
+    AllocationGuardSpinLockHolder h(&lock_);
+    for (int64_t epoch = current_epoch - num_epochs + 1;
+         epoch <= current_epoch; ++epoch) {
+      if (epoch < 0) continue;
+      const size_t slot = epoch % kEpochs;
+      if (epoch_ids_[slot] == epoch) {
+        const Epoch& e = epochs_[slot];
+        entries.insert(entries.end(), e.entries, e.entries + e.size);
+      }
+    }
+    memcpy(stacks.data(), stacks_, sizeof(stacks_));
+  }
+
+  absl::flat_hash_map<uint64_t, Epoch::Entry> merged;
+  for (const auto& entry : entries) {
+    auto [it, inserted] = merged.try_emplace(entry.hash, entry);
+    if (!inserted) {
+      it->second.bytes += entry.bytes;
+      it->second.count += entry.count;
+    }
+  }
+
+  absl::flat_hash_map<uint64_t, const StackSlot*> stacks_by_hash;
+  for (const auto& slot : stacks) {
+    if (slot.hash != 0) {
+      stacks_by_hash.emplace(slot.hash, &slot);
+    }
+  }
+
+  std::vector<Profile::Sample> samples;
+  samples.reserve(merged.size());
+  for (const auto& [hash, entry] : merged) {
+    Profile::Sample& sample = samples.emplace_back();
+    sample.sum = entry.bytes;
+    sample.count = entry.count;
+    auto it = stacks_by_hash.find(hash);
+    if (it != stacks_by_hash.end()) {
+      const StackSlot& slot = *it->second;
+      static_assert(kMaxStackDepth <= Profile::Sample::kMaxStackDepth,
+                    "Profile stack size smaller than internal stack sizes");
+      sample.depth = slot.depth;
+      memcpy(sample.stack, slot.stack, sizeof(slot.stack[0]) * slot.depth);
+    }
+  }
+  std::sort(samples.begin(), samples.end(),
+            [](const Profile::Sample& a, const Profile::Sample& b) {
+              return a.sum > b.sum;
+            });
+
+  return std::make_unique<AllocationRateProfile>(std::move(samples),
+                                                 num_epochs * epoch_length);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
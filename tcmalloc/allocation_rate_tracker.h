@@ -0,0 +1,154 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_ALLOCATION_RATE_TRACKER_H_
+#define TCMALLOC_ALLOCATION_RATE_TRACKER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Continuously tracks which stacks allocate the most, over a rolling window.
+//
+// Every sampled allocation is reported to the tracker.  Allocated bytes are
+// accumulated per stack hash in a fixed-size heavy-hitters sketch (the
+// Space-Saving algorithm) for each one-minute epoch of the last hour, and the
+// frames of recently reported stacks are kept in a small set-associative
+// table.  Memory use is therefore bounded regardless of how many distinct stacks
+// allocate, at the cost of the following approximations:
+//
+//  * Within an epoch, at most kStacksPerEpoch stacks are tracked.  When a new
+//    stack displaces the smallest one, it inherits that stack's counts, so
+//    reported values are upper bounds for stacks that entered the sketch late.
+//  * A stack whose frames were evicted from the stack table is reported with
+//    an empty stack.  Eviction favors stacks that allocated little.
+//
+// Reports go to one of kShards shards, chosen by the current CPU, each with its
+// own lock, a sketch for the current epoch and the frames of the stacks in that
+// sketch.  A shard is folded into the shared per-epoch sketches and stack table
+// under lock_ only when it sees its first report of a new epoch, or when a
+// profile is dumped.
+class AllocationRateTracker {
+ public:
+  static constexpr absl::Duration kWindow = absl::Hours(1);
+  static constexpr size_t kEpochs = 60;
+  static constexpr size_t kStacksPerEpoch = 32;
+  static constexpr size_t kShards = 16;
+
+  constexpr AllocationRateTracker()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+  void Init(Clock clock) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Records the sampled allocation described by stack_trace.  Should be called
+  // for every sampled allocation.
+  void Report(const StackTrace& stack_trace) ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns an allocation profile of the stacks that allocated the most during
+  // the last `window`, which is rounded up to whole epochs and capped at
+  // kWindow.
+  std::unique_ptr<ProfileBase> Dump(absl::Duration window)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  static constexpr size_t kStackSets = 64;
+  static constexpr size_t kStackWays = 4;
+
+  // Space-Saving sketch of the stacks that allocated the most during one
+  // epoch.
+  struct Epoch {
+    struct Entry {
+      uint64_t hash;
+      int64_t bytes;
+      int64_t count;
+    };
+
+    static Epoch Nil() { return Epoch(); }
+    // Returns the index of the entry that sample was added to.
+    size_t Report(const Entry& sample);
+    // Reports every entry of other.
+    void Merge(const Epoch& other);
+    bool empty() const { return size == 0; }
+
+    Entry entries[kStacksPerEpoch]{};
+    size_t size = 0;
+  };
+
+  struct StackSlot {
+    uint64_t hash;
+    // Bytes reported for this stack, halved whenever another stack is evicted
+    // from the same set.  The slot with the fewest is replaced first, so the
+    // stacks of heavy hitters survive churn from many light ones.
+    int64_t bytes;
+    size_t depth;
+    void* stack[kMaxStackDepth];
+  };
+
+  struct Shard {
+    constexpr Shard()
+        : lock(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+    absl::base_internal::SpinLock lock;
+    // The epoch that sketch accumulates reports for.
+    int64_t epoch ABSL_GUARDED_BY(lock) = 0;
+    Epoch sketch ABSL_GUARDED_BY(lock);
+    // The frames of the stack last reported to each entry of sketch.
+    StackSlot stacks[kStacksPerEpoch] ABSL_GUARDED_BY(lock){};
+  };
+
+  // Returns the number of the epoch that now falls into.
+  int64_t CurrentEpoch() const {
+    return static_cast<int64_t>(clock_.now() / epoch_ticks_);
+  }
+
+  // Folds the sketch of shard into epochs_, unless it has already expired, and
+  // its stacks into stacks_, and empties it.
+  void Flush(Shard& shard, int64_t current_epoch)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.lock) ABSL_LOCKS_EXCLUDED(lock_);
+
+  void RecordStack(uint64_t hash, int64_t bytes, const StackSlot& frames)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  absl::base_internal::SpinLock lock_;
+  // Epoch e is kept in epochs_[e % kEpochs] while epoch_ids_[e % kEpochs] == e.
+  Epoch epochs_[kEpochs] ABSL_GUARDED_BY(lock_){};
+  int64_t epoch_ids_[kEpochs] ABSL_GUARDED_BY(lock_){};
+  StackSlot stacks_[kStackSets][kStackWays] ABSL_GUARDED_BY(lock_){};
+  Shard shards_[kShards];
+
+  // Set once by Init(), before inited_.
+  Clock clock_{};
+  double epoch_ticks_ = 1;
+  std::atomic<bool> inited_{false};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_ALLOCATION_RATE_TRACKER_H_
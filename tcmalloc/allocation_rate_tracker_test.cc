@@ -0,0 +1,187 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/allocation_rate_tracker.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::Pair;
+
+class AllocationRateTrackerTest : public ::testing::Test {
+ protected:
+  AllocationRateTrackerTest() {
+    clock_ = 0;
+    tracker_ = std::make_unique<AllocationRateTracker>();
+    tracker_->Init(Clock{.now = FakeClock, .freq = GetFakeClockFrequency});
+    Advance(AllocationRateTracker::kWindow);
+  }
+
+  static void Advance(absl::Duration d) {
+    clock_ += absl::ToDoubleSeconds(d) * GetFakeClockFrequency();
+  }
+
+  // Reports a sample of `weight` bytes allocated at the stack identified by
+  // `id`.
+  void Report(uintptr_t id, size_t weight, int depth = 2) {
+    StackTrace stack_trace = {};
+    stack_trace.requested_size = 15;
+    stack_trace.allocated_size = 16;
+    stack_trace.weight = weight;
+    stack_trace.depth = depth;
+    for (int i = 0; i < depth; ++i) {
+      stack_trace.stack[i] = reinterpret_cast<void*>(id + i);
+    }
+    tracker_->Report(stack_trace);
+  }
+
+  // Returns (first frame, bytes) for each sample of the profile covering the
+  // last `window`, in the order they are reported.
+  std::vector<std::pair<uintptr_t, int64_t>> Dump(absl::Duration window) {
+    std::unique_ptr<ProfileBase> profile = tracker_->Dump(window);
+    EXPECT_EQ(profile->Type(), ProfileType::kAllocations);
+    std::vector<std::pair<uintptr_t, int64_t>> result;
+    profile->Iterate([&](const Profile::Sample& sample) {
+      result.emplace_back(
+          sample.depth > 0 ? reinterpret_cast<uintptr_t>(sample.stack[0]) : 0,
+          sample.sum);
+    });
+    return result;
+  }
+
+  std::unique_ptr<AllocationRateTracker> tracker_;
+
+ private:
+  static int64_t FakeClock() { return clock_; }
+
+  static double GetFakeClockFrequency() {
+    return absl::ToDoubleNanoseconds(absl::Seconds(2));
+  }
+
+  static int64_t clock_;
+};
+
+int64_t AllocationRateTrackerTest::clock_{0};
+
+TEST_F(AllocationRateTrackerTest, Empty) {
+  EXPECT_THAT(Dump(absl::Minutes(1)), testing::IsEmpty());
+  EXPECT_THAT(Dump(absl::Hours(1)), testing::IsEmpty());
+}
+
+TEST_F(AllocationRateTrackerTest, Windows) {
+  // 30 minutes ago.
+  Report(0x1000, 16 * 1000);
+  Advance(absl::Minutes(26));
+  // 4 minutes ago.
+  Report(0x2000, 16 * 200);
+  Report(0x1000, 16 * 100);
+  Advance(absl::Minutes(4));
+  // Now.
+  Report(0x3000, 16 * 10);
+  Report(0x3000, 16 * 20);
+
+  // The samples are ordered by decreasing bytes.
+  EXPECT_THAT(Dump(absl::Minutes(1)), ElementsAre(Pair(0x3000, 16 * 30)));
+  EXPECT_THAT(Dump(absl::Minutes(5)),
+              ElementsAre(Pair(0x2000, 16 * 200), Pair(0x1000, 16 * 100),
+                          Pair(0x3000, 16 * 30)));
+  EXPECT_THAT(Dump(absl::Minutes(60)),
+              ElementsAre(Pair(0x1000, 16 * 1100), Pair(0x2000, 16 * 200),
+                          Pair(0x3000, 16 * 30)));
+
+  std::unique_ptr<ProfileBase> profile = tracker_->Dump(absl::Seconds(90));
+  EXPECT_EQ(profile->Duration(), absl::Minutes(2));
+
+  // Everything expires after an hour, even without further reports.
+  Advance(absl::Hours(1));
+  EXPECT_THAT(Dump(absl::Hours(1)), testing::IsEmpty());
+}
+
+TEST_F(AllocationRateTrackerTest, BoundedStacksPerEpoch) {
+  // One stack that allocates much more than many others.
+  Report(0x1000, 16 * 1000000);
+  for (uintptr_t i = 0; i < 10 * AllocationRateTracker::kStacksPerEpoch; ++i) {
+    Report(0x10000 + 0x100 * i, 16);
+  }
+
+  auto samples = Dump(absl::Minutes(1));
+  EXPECT_EQ(samples.size(), AllocationRateTracker::kStacksPerEpoch);
+  // The heavy hitter is retained, with its exact count.
+  ASSERT_FALSE(samples.empty());
+  EXPECT_THAT(samples[0], Pair(0x1000, 16 * 1000000));
+
+  // Nothing is lost in aggregate: displaced stacks' bytes are attributed to
+  // the stacks that replaced them.
+  int64_t total = 0;
+  for (const auto& [id, bytes] : samples) {
+    total += bytes;
+  }
+  EXPECT_EQ(total,
+            16 * (1000000 + 10 * AllocationRateTracker::kStacksPerEpoch));
+}
+
+TEST_F(AllocationRateTrackerTest, StackFrames) {
+  Report(0x1000, 16, /*depth=*/5);
+  std::unique_ptr<ProfileBase> profile = tracker_->Dump(absl::Minutes(1));
+  int samples = 0;
+  profile->Iterate([&](const Profile::Sample& sample) {
+    ++samples;
+    EXPECT_EQ(sample.count, 1);
+    ASSERT_EQ(sample.depth, 5);
+    for (int i = 0; i < 5; ++i) {
+      EXPECT_EQ(sample.stack[i], reinterpret_cast<void*>(0x1000 + i));
+    }
+  });
+  EXPECT_EQ(samples, 1);
+}
+
+TEST_F(AllocationRateTrackerTest, ConcurrentReports) {
+  // Threads likely report to different shards; their bytes are all counted.
+  constexpr int kThreads = 8;
+  constexpr int kReports = 1000;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([&]() {
+      for (int j = 0; j < kReports; ++j) {
+        Report(0x1000, 16);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  EXPECT_THAT(Dump(absl::Minutes(1)),
+              ElementsAre(Pair(0x1000, 16 * kThreads * kReports)));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -25,16 +25,18 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
-#include "absl/debugging/stacktrace.h"
+#include "absl/functional/function_ref.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/guarded_page_allocator.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/exponential_biased.h"
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/sampled_allocation.h"
@@ -105,6 +107,45 @@ static std::unique_ptr<const ProfileBase> DumpHeapProfile(State& state) {
   return profile;
 }
 
+// A heap profile that reads the sampled allocations while it is iterated,
+// rather than copying all of them when it is created as DumpHeapProfile does.
+// Samples are copied out in fixed-size batches under their locks and passed to
+// the callback once the locks are released, so the callback may allocate and
+// memory use does not grow with the number of samples.  Each call to Iterate
+// observes the allocations that are live at that time.
+template <typename State>
+class LiveHeapProfile final : public ProfileBase {
+ public:
+  explicit LiveHeapProfile(State& state) : state_(state) {}
+
+  void Iterate(
+      absl::FunctionRef<void(const Profile::Sample&)> f) const override {
+    constexpr size_t kBatchSize = 256;
+    auto batch = std::make_unique<Profile::Sample[]>(kBatchSize);
+
+    auto& recorder = state_.sampled_allocation_recorder();
+    auto* cursor = recorder.IterationStart();
+    while (cursor != nullptr) {
+      size_t n = 0;
+      cursor = recorder.IterateBatch(
+          cursor, kBatchSize, [&](const SampledAllocation& sampled_allocation) {
+            StackTraceToSample(1.0, sampled_allocation.sampled_stack,
+                               batch[n++]);
+          });
+      for (size_t i = 0; i < n; ++i) {
+        f(batch[i]);
+      }
+    }
+  }
+
+  ProfileType Type() const override { return ProfileType::kHeap; }
+
+  absl::Duration Duration() const override { return absl::ZeroDuration(); }
+
+ private:
+  State& state_;
+};
+
 extern "C" ABSL_CONST_INIT thread_local Sampler tcmalloc_sampler
     ABSL_ATTRIBUTE_INITIAL_EXEC;
 
@@ -155,9 +196,10 @@ inline bool ShouldGuardingBeAttempted(
 // indicating why the allocation may not be guarded.
 template <typename State>
 static GuardedAllocWithStatus TrySampleGuardedAllocation(
-    State& state, size_t size, size_t alignment, Length num_pages,
+    State& state, size_t size, size_t alignment,
     const StackTrace& stack_trace) {
-  if (num_pages != Length(1)) {
+  if (size > GuardedPageAllocator::kMaxLargeAllocationSize ||
+      alignment > kPageSize) {
     return {nullptr, Profile::Sample::GuardedStatus::LargerThanOnePage};
   }
   Profile::Sample::GuardedStatus guarded_status =
@@ -181,6 +223,13 @@ static GuardedAllocWithStatus TrySampleGuardedAllocation(
     if (guarded_sampling_rate < 0) {
       return {nullptr, Profile::Sample::GuardedStatus::Disabled};
     }
+    // Spend the guard budget on rarely seen sites first.  Every sample is
+    // counted by the policy, even when the ratio below prevents guarding.
+    const Profile::Sample::GuardedStatus policy_status =
+        state.guarded_sampling_policy().Evaluate(stack_trace);
+    if (policy_status != Profile::Sample::GuardedStatus::Requested) {
+      return {nullptr, policy_status};
+    }
     // If guarded_sampling_rate == 0, then attempt to guard, as usual.
     if (guarded_sampling_rate > 0) {
       const double configured_sampled_to_guarded_ratio =
@@ -270,21 +319,34 @@ static GuardedAllocWithStatus TrySampleGuardedAllocation(
         return {nullptr, Profile::Sample::GuardedStatus::Filtered};
     }
   }
-  // The num_pages == 1 constraint ensures that size <= kPageSize.  And
-  // since alignments above kPageSize cause size_class == 0, we're also
-  // guaranteed alignment <= kPageSize
-  //
-  // In all cases kPageSize <= GPA::page_size_, so Allocate's preconditions
-  // are met.
+  // We checked that alignment <= kPageSize above, and kPageSize <=
+  // GPA::page_size_, so Allocate's preconditions are met.  Allocations larger
+  // than a page go to its large slots, which count towards the same
+  // SuccessfulAllocations() budget.
   GuardedAllocWithStatus alloc_with_status =
       state.guardedpage_allocator().Allocate(size, alignment);
   if (Parameters::improved_guarded_sampling() &&
       alloc_with_status.status == Profile::Sample::GuardedStatus::Guarded) {
     state.stacktrace_filter().Add(stack_trace);
+    state.guarded_sampling_policy().RecordGuarded(stack_trace);
   }
   return alloc_with_status;
 }
 
+// Returns a new span for the guarded allocation of size bytes at alloc, and
+// registers it in the pagemap.
+template <typename State>
+static Span* NewGuardedSpan(State& state, void* alloc, size_t size)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  const PageId p = PageIdContaining(alloc);
+  const Length n = BytesToLengthCeil(reinterpret_cast<uintptr_t>(alloc) +
+                                     size - p.start_uintptr());
+  // Guarded memory is anonymous, not backed by a file.
+  Span* span = Span::New(/*fd=*/-1, /*o=*/0, p, n);
+  state.pagemap().Set(p, span);
+  return span;
+}
+
 template <typename State>
 ABSL_ATTRIBUTE_NOINLINE static inline void FreeProxyObject(State& state,
                                                            void* ptr,
@@ -311,11 +373,13 @@ ABSL_ATTRIBUTE_NOINLINE static inline void FreeProxyObject(State& state,
 // sampling.
 //
 // For large objects (i.e. allocated with do_malloc_pages) they are
-// also fully reused and their span is marked as sampled.
+// also fully reused and their span is marked as sampled, unless they
+// are guarded: then the span is freed and replaced by one describing
+// the guarded allocation.
 //
 // Note that do_free_with_size assumes sampled objects have
-// page-aligned addresses. Please change both functions if need to
-// invalidate the assumption.
+// page-aligned addresses, except for guarded ones. Please change both
+// functions if need to invalidate the assumption.
 //
 // Note that size_class might not match requested_size in case of
 // memalign. I.e. when larger than requested allocation is done to
@@ -336,7 +400,8 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
   stack_trace.proxy = nullptr;
   stack_trace.requested_size = requested_size;
   // Grab the stack trace outside the heap lock.
-  stack_trace.depth = absl::GetStackTrace(stack_trace.stack, kMaxStackDepth, 0);
+  stack_trace.depth =
+      GetSampledStackTrace(stack_trace.stack, kMaxStackDepth, 0);
 
   // requested_alignment = 1 means 'small size table alignment was used'
   // Historically this is reported as requested_alignment = 0
@@ -361,14 +426,11 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
 
     Length num_pages = BytesToLengthCeil(stack_trace.allocated_size);
     alloc_with_status = TrySampleGuardedAllocation(
-        state, requested_size, stack_trace.requested_alignment, num_pages,
-        stack_trace);
+        state, requested_size, stack_trace.requested_alignment, stack_trace);
     if (alloc_with_status.status == Profile::Sample::GuardedStatus::Guarded) {
       ASSERT(IsSampledMemory(alloc_with_status.alloc));
-      const PageId p = PageIdContaining(alloc_with_status.alloc);
       AllocationGuardSpinLockHolder h(&pageheap_lock);
-      span = Span::New(span, p, num_pages);
-      state.pagemap().Set(p, span);
+      span = NewGuardedSpan(state, alloc_with_status.alloc, requested_size);
       // If we report capacity back from a size returning allocation, we can not
       // report the stack_trace.allocated_size, as we guard the size to
       // 'requested_size', and we maintain the invariant that GetAllocatedSize()
@@ -398,13 +460,25 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
       obj = nullptr;
     }
   } else {
-    // Set stack_trace.allocated_size to the exact size for a page allocation.
-    // NOTE: if we introduce gwp-asan sampling / guarded allocations
-    // for page allocations, then we need to revisit do_malloc_pages as
-    // the current assumption is that only class sized allocs are sampled
-    // for gwp-asan.
-    stack_trace.allocated_size = span->bytes_in_span();
-    stack_trace.cold_allocated = IsColdMemory(span->start_address());
+    alloc_with_status = TrySampleGuardedAllocation(
+        state, requested_size, stack_trace.requested_alignment, stack_trace);
+    if (alloc_with_status.status == Profile::Sample::GuardedStatus::Guarded) {
+      ASSERT(IsSampledMemory(alloc_with_status.alloc));
+      // The guarded allocation replaces the pages do_malloc_pages allocated.
+      // As for guarded small allocations, the allocated size is the requested
+      // size.
+      AllocationGuardSpinLockHolder h(&pageheap_lock);
+      state.page_allocator().Delete(span, /*objects_per_span=*/1,
+                                    GetMemoryTag(span->start_address()));
+      span = NewGuardedSpan(state, alloc_with_status.alloc, requested_size);
+      stack_trace.allocated_size = requested_size;
+      stack_trace.cold_allocated = false;
+    } else {
+      // Set stack_trace.allocated_size to the exact size for a page
+      // allocation.
+      stack_trace.allocated_size = span->bytes_in_span();
+      stack_trace.cold_allocated = IsColdMemory(span->start_address());
+    }
     capacity = stack_trace.allocated_size;
   }
 
@@ -433,6 +507,12 @@ static sized_ptr_t SampleifyAllocation(State& state, Policy policy,
 
   state.allocation_samples.ReportMalloc(stack_trace);
 
+  state.allocation_rate_tracker().Report(stack_trace);
+
+  if (Parameters::hot_site_cache_hints()) {
+    state.hot_site_tracker().Report(stack_trace, size_class);
+  }
+
   state.deallocation_samples.ReportMalloc(stack_trace);
 
   // The SampledAllocation object is visible to readers after this. Readers only
@@ -127,6 +127,10 @@ void MallocExtension_Internal_ProcessBackgroundActions() {
     }
 #endif
 
+    // Scan the residency of the next part of the heap, so that stats can
+    // report it without scanning the heap themselves.
+    tc_globals.residency_scanner().Tick();
+
     // If time goes backwards, we would like to cap the release rate at 0.
     ssize_t bytes_to_release =
         static_cast<size_t>(Parameters::background_release_rate()) *
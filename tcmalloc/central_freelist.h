@@ -35,6 +35,7 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/span_stats.h"
 
@@ -533,6 +534,7 @@ inline int CentralFreeList<Forwarder>::RemoveRange(void** batch, int N) {
 template <class Forwarder>
 inline int CentralFreeList<Forwarder>::Populate(void** batch, int N)
     ABSL_NO_THREAD_SAFETY_ANALYSIS {
+  ScopedSlowPathTimer timer(SlowPath::kCentralFreeListPopulate);
   // Release central list lock while operating on pageheap
   // Note, this could result in multiple calls to populate each allocating
   // a new span and the pushing those partially full spans onto nonempty.
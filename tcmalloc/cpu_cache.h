@@ -51,6 +51,7 @@
 #include "tcmalloc/internal/sysinfo.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/thread_cache.h"
 #include "tcmalloc/transfer_cache.h"
@@ -79,6 +80,12 @@ constexpr inline uint8_t kMaxBasePerCpuShift = 18;
 constexpr inline uint8_t kNumPossiblePerCpuShifts =
     kMaxBasePerCpuShift - kInitialBasePerCpuShift + 1;
 
+// Whether AllocateFast and DeallocateFast count their successes per CPU and
+// size class, see CpuCache::GetFastPathCounts.  The counts are kept in the
+// slab headers, see subtle::percpu::kSlabHeaderWords.
+constexpr inline bool kFastPathCountsEnabled =
+    subtle::percpu::kSlabHeaderWords > 1;
+
 // StaticForwarder provides access to the SizeMap and transfer caches.
 //
 // This is a class, rather than namespaced globals, so that it can be mocked for
@@ -147,6 +154,14 @@ class StaticForwarder {
     return tc_globals.sizemap().num_objects_to_move(size_class);
   }
 
+  static bool hot_site_cache_hints() {
+    return Parameters::hot_site_cache_hints();
+  }
+
+  static bool is_hot_size_class(size_t size_class) {
+    return tc_globals.hot_site_tracker().IsHot(size_class);
+  }
+
   static const NumaTopology<kNumaPartitions, kNumBaseClasses>& numa_topology() {
     return tc_globals.numa_topology();
   }
@@ -289,6 +304,11 @@ class CpuCache {
     int max_last_overflow_cpu_id = -1;
   };
 
+  struct FastPathCounts {
+    uint64_t allocs = 0;
+    uint64_t frees = 0;
+  };
+
   // Sets the lower limit on the capacity that can be stolen from the cpu cache.
   static constexpr double kCacheCapacityThreshold = 0.20;
 
@@ -433,6 +453,11 @@ class CpuCache {
   // maximum capacity for size class <size_class>.
   SizeClassCapacityStats GetSizeClassCapacityStats(size_t size_class) const;
 
+  // Reports the allocations and frees of <size_class> that were served by
+  // AllocateFast and DeallocateFast, summed over all CPUs.  The counts are
+  // approximate, and always 0 unless kFastPathCountsEnabled.
+  FastPathCounts GetFastPathCounts(size_t size_class) const;
+
   // Reports the number of misses encountered by a <size_class> that were
   // recorded during the previous interval for the miss <type>.
   size_t GetIntervalSizeClassMisses(int cpu, size_t size_class,
@@ -713,7 +738,11 @@ template <class Forwarder>
 inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* CpuCache<Forwarder>::AllocateFast(
     size_t size_class) {
   ASSERT(size_class > 0);
-  return freelist_.Pop(size_class);
+  void* ret = freelist_.Pop(size_class);
+  if (kFastPathCountsEnabled && ABSL_PREDICT_TRUE(ret != nullptr)) {
+    freelist_.CountFastPath(size_class, /*is_pop=*/true);
+  }
+  return ret;
 }
 
 template <class Forwarder>
@@ -732,7 +761,14 @@ ABSL_ATTRIBUTE_ALWAYS_INLINE
     bool
     CpuCache<Forwarder>::DeallocateFast(void* ptr, size_t size_class) {
   ASSERT(size_class > 0);
-  return freelist_.Push(size_class, ptr);
+  if (!kFastPathCountsEnabled) {
+    return freelist_.Push(size_class, ptr);
+  }
+  if (ABSL_PREDICT_FALSE(!freelist_.Push(size_class, ptr))) {
+    return false;
+  }
+  freelist_.CountFastPath(size_class, /*is_pop=*/false);
+  return true;
 }
 
 template <class Forwarder>
@@ -864,7 +900,8 @@ inline size_t CpuCache<Forwarder>::MaxCapacity(size_t size_class) const {
 // Returns estimated bytes required and the bytes available.
 inline std::pair<size_t, size_t> EstimateSlabBytes(
     GetShiftMaxCapacity get_shift_capacity) {
-  size_t bytes_required = sizeof(std::atomic<int64_t>) * kNumClasses;
+  size_t bytes_required = sizeof(std::atomic<int64_t>) *
+                          subtle::percpu::kSlabHeaderWords * kNumClasses;
 
   for (int size_class = 0; size_class < kNumClasses; ++size_class) {
     // Each non-empty size class region in the slab is preceded by one padding
@@ -919,10 +956,16 @@ inline void CpuCache<Forwarder>::Activate() {
   const auto& topology = forwarder_.numa_topology();
   const uint8_t numa_shift = NumaShift(topology);
   const uint8_t wider_slab_shift = UseWiderSlabs() ? 1 : 0;
+  // The fast path counts make each slab header kSlabHeaderWords words.  Double
+  // the slabs to make room for them, so that the size classes keep the
+  // capacities they have without the counts.
+  const uint8_t fast_path_counts_shift = kFastPathCountsEnabled ? 1 : 0;
 
-  shift_bounds_.initial_shift += numa_shift + wider_slab_shift;
-  shift_bounds_.max_shift += numa_shift + wider_slab_shift;
-  per_cpu_shift += numa_shift + wider_slab_shift;
+  shift_bounds_.initial_shift +=
+      numa_shift + wider_slab_shift + fast_path_counts_shift;
+  shift_bounds_.max_shift +=
+      numa_shift + wider_slab_shift + fast_path_counts_shift;
+  per_cpu_shift += numa_shift + wider_slab_shift + fast_path_counts_shift;
 
   CHECK_CONDITION(shift_bounds_.initial_shift <= shift_bounds_.max_shift);
   CHECK_CONDITION(per_cpu_shift >= shift_bounds_.initial_shift &&
@@ -1054,6 +1097,7 @@ void* CpuCache<Forwarder>::AllocateSlowNoHooks(size_t size_class) {
 // return memory to the correct CPU.)
 template <class Forwarder>
 inline void* CpuCache<Forwarder>::Refill(int cpu, size_t size_class) {
+  ScopedSlowPathTimer timer(SlowPath::kCpuCacheRefill);
   // UpdateCapacity can evict objects from other size classes as it tries to
   // increase capacity of this size class. The objects are returned in
   // to_return, we insert them into transfer cache at the end of function
@@ -1201,6 +1245,15 @@ inline size_t CpuCache<Forwarder>::UpdateCapacity(int cpu, size_t size_class,
       now, std::memory_order_relaxed);
   bool grow_by_batch =
       resize.per_class[size_class].Update(overflow, grow_by_one, &successive);
+  // A size class allocated from by a hot site (see HotSiteTracker) keeps
+  // coming back here.  If enabled, grow its cache by a batch and refill as if
+  // this were a successive underflow, so that it takes fewer trips to the slow
+  // path.
+  if (!overflow && forwarder_.hot_site_cache_hints() &&
+      forwarder_.is_hot_size_class(size_class)) {
+    grow_by_batch = true;
+    ++successive;
+  }
   if ((grow_by_one || grow_by_batch) && capacity != max_capacity) {
     size_t increase = 1;
     if (grow_by_batch) {
@@ -2244,6 +2297,21 @@ size_t CpuCache<Forwarder>::GetIntervalSizeClassMisses(int cpu,
   return resize_[cpu].per_class[size_class].GetIntervalMisses(type);
 }
 
+template <class Forwarder>
+inline typename CpuCache<Forwarder>::FastPathCounts
+CpuCache<Forwarder>::GetFastPathCounts(size_t size_class) const {
+  FastPathCounts counts;
+  if (!kFastPathCountsEnabled) return counts;
+  for (int cpu = 0, num_cpus = NumCPUs(); cpu < num_cpus; ++cpu) {
+    if (!HasPopulated(cpu)) continue;
+    const Freelist::FastPathCounts cpu_counts =
+        freelist_.GetFastPathCounts(cpu, size_class);
+    counts.allocs += cpu_counts.pops;
+    counts.frees += cpu_counts.pushes;
+  }
+  return counts;
+}
+
 template <class Forwarder>
 inline typename CpuCache<Forwarder>::SizeClassCapacityStats
 CpuCache<Forwarder>::GetSizeClassCapacityStats(size_t size_class) const {
@@ -2372,6 +2440,19 @@ inline void CpuCache<Forwarder>::Print(Printer* out) const {
         stats.max_last_overflow_cpu_id);
   }
 
+  if (kFastPathCountsEnabled) {
+    out->printf("------------------------------------------------\n");
+    out->printf("Fast path allocations and frees per size class\n");
+    out->printf("------------------------------------------------\n");
+    for (int size_class = 1; size_class < kNumClasses; ++size_class) {
+      const FastPathCounts counts = GetFastPathCounts(size_class);
+      if (counts.allocs == 0 && counts.frees == 0) continue;
+      out->printf("class %3d [ %8zu bytes ] : %12u allocs %12u frees\n",
+                  size_class, forwarder_.class_to_size(size_class),
+                  counts.allocs, counts.frees);
+    }
+  }
+
   out->printf("------------------------------------------------\n");
   out->printf("Number of per-CPU cache underflows, overflows, and reclaims\n");
   out->printf("------------------------------------------------\n");
@@ -2454,6 +2535,11 @@ inline void CpuCache<Forwarder>::PrintInPbtxt(PbtxtRegion* region) const {
                    absl::ToInt64Nanoseconds(stats.min_last_overflow));
     entry.PrintI64("max_last_overflow_ns",
                    absl::ToInt64Nanoseconds(stats.max_last_overflow));
+    if (kFastPathCountsEnabled) {
+      const FastPathCounts counts = GetFastPathCounts(size_class);
+      entry.PrintI64("fast_path_allocs", counts.allocs);
+      entry.PrintI64("fast_path_frees", counts.frees);
+    }
   }
 
   // Record dynamic slab statistics.
@@ -0,0 +1,114 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <stddef.h>
+
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/hot_site_tracker.h"
+#include "tcmalloc/internal/affinity.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kHotSizeClass = 1;
+constexpr size_t kColdSizeClass = 2;
+
+// Reports enough samples of a single allocation site to the hot site tracker
+// to make size_class hot.
+void ReportHotSite(size_t size_class) {
+  StackTrace stack_trace = {};
+  stack_trace.requested_size = 8;
+  stack_trace.allocated_size = 8;
+  stack_trace.weight = 2 << 20;
+  stack_trace.depth = 1;
+  stack_trace.stack[0] = reinterpret_cast<void*>(&ReportHotSite);
+  for (int i = 0; i < HotSiteTracker::kMinSamples; ++i) {
+    tc_globals.hot_site_tracker().Report(stack_trace, size_class);
+  }
+}
+
+// Runs a synthetic workload on the per-CPU cache in which one allocation site
+// dominates: each iteration allocates a burst of objects of kHotSizeClass and
+// then frees them, while another site allocates a single object of
+// kColdSizeClass.  Reports the underflows per iteration as "refills".
+void BM_SkewedSiteRefills(benchmark::State& state) {
+  // Make sure TCMalloc is initialized on this thread.
+  ::operator delete(::operator new(1));
+  if (!UsePerCpuCache(tc_globals)) {
+    state.SkipWithError("per-CPU caches are not active");
+    return;
+  }
+  const bool hint = state.range(0);
+  const size_t burst = state.range(1);
+
+  const bool previous_hint = Parameters::hot_site_cache_hints();
+  Parameters::set_hot_site_cache_hints(hint);
+  ReportHotSite(kHotSizeClass);
+  CpuCache& cache = tc_globals.cpu_cache();
+
+  const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
+                                           ? offsetof(kernel_rseq, vcpu_id)
+                                           : offsetof(kernel_rseq, cpu_id);
+  // Stay on one CPU, so that all the refills are counted by its cache.
+  ScopedAffinityMask mask(AllowedCpus()[0]);
+  const int cpu =
+      subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset);
+  const size_t underflows_before = cache.GetTotalCacheMissStats(cpu).underflows;
+
+  std::vector<void*> objects(burst);
+  for (auto _ : state) {
+    for (void*& object : objects) {
+      object = cache.Allocate(kHotSizeClass);
+    }
+    void* cold = cache.Allocate(kColdSizeClass);
+    for (void* object : objects) {
+      cache.Deallocate(object, kHotSizeClass);
+    }
+    cache.Deallocate(cold, kColdSizeClass);
+  }
+
+  if (mask.Tampered() ||
+      cpu != subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset)) {
+    state.SkipWithError("migrated to another CPU");
+  } else {
+    const int64_t underflows =
+        cache.GetTotalCacheMissStats(cpu).underflows - underflows_before;
+    state.counters["refills"] =
+        benchmark::Counter(underflows, benchmark::Counter::kAvgIterations);
+  }
+  state.SetItemsProcessed(state.iterations() * burst);
+
+  Parameters::set_hot_site_cache_hints(previous_hint);
+}
+BENCHMARK(BM_SkewedSiteRefills)
+    ->ArgNames({"hint", "burst"})
+    ->ArgsProduct({{0, 1}, {64, 512, 4096}});
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -31,12 +31,14 @@
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
+#include "benchmark/benchmark.h"
 #include "absl/base/optimization.h"
 #include "absl/random/bit_gen_ref.h"
 #include "absl/random/random.h"
 #include "absl/time/time.h"
 #include "absl/types/span.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/hot_site_tracker.h"
 #include "tcmalloc/internal/affinity.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/sysinfo.h"
@@ -169,6 +171,13 @@ class TestStaticForwarder {
     }
   }
 
+  bool hot_site_cache_hints() const { return hot_site_cache_hints_; }
+
+  bool is_hot_size_class(size_t size_class) const {
+    return hot_site_tracker_ != nullptr &&
+           hot_site_tracker_->IsHot(size_class);
+  }
+
   size_t num_objects_to_move(int size_class) const {
     if (size_map_.has_value()) {
       return size_map_->num_objects_to_move(size_class);
@@ -237,6 +246,8 @@ class TestStaticForwarder {
   bool resize_size_classes_enabled_ = false;
   bool use_extended_size_class_for_cold_ = false;
   std::optional<SizeMap> size_map_;
+  bool hot_site_cache_hints_ = false;
+  const HotSiteTracker* hot_site_tracker_ = nullptr;
 
  private:
   NumaTopology<kNumaPartitions, kNumBaseClasses> numa_topology_;
@@ -575,6 +586,85 @@ TEST(CpuCacheTest, CacheMissStats) {
   cache.Deactivate();
 }
 
+constexpr size_t kHotSizeClass = 1;
+constexpr size_t kColdSizeClass = 2;
+
+// Reports enough samples of a single allocation site to tracker to make
+// size_class hot.
+void ReportHotSite(HotSiteTracker& tracker, size_t size_class) {
+  StackTrace stack_trace = {};
+  stack_trace.requested_size = 8;
+  stack_trace.allocated_size = 8;
+  stack_trace.weight = 2 << 20;
+  stack_trace.depth = 1;
+  stack_trace.stack[0] = reinterpret_cast<void*>(&ReportHotSite);
+  for (int i = 0; i < HotSiteTracker::kMinSamples; ++i) {
+    tracker.Report(stack_trace, size_class);
+  }
+}
+
+// Runs a synthetic workload in which one allocation site dominates: each round,
+// it allocates a burst of objects of kHotSizeClass and then frees them, while
+// another site allocates a single object of kColdSizeClass.  Returns the number
+// of underflows, or -1 if the thread could not be kept on a single CPU.
+int64_t RunSkewedSiteWorkload(CpuCache& cache, int rounds, size_t burst) {
+  const size_t virtual_cpu_id_offset = subtle::percpu::UsingFlatVirtualCpus()
+                                           ? offsetof(kernel_rseq, vcpu_id)
+                                           : offsetof(kernel_rseq, cpu_id);
+  // See CacheMissStats for why we restrict ourselves to a single core.
+  tcmalloc_internal::ScopedAffinityMask mask(
+      tcmalloc_internal::AllowedCpus()[0]);
+  const int cpu =
+      subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset);
+  const size_t underflows_before = cache.GetTotalCacheMissStats(cpu).underflows;
+
+  std::vector<void*> objects(burst);
+  for (int round = 0; round < rounds; ++round) {
+    for (void*& object : objects) {
+      object = cache.Allocate(kHotSizeClass);
+    }
+    void* cold = cache.Allocate(kColdSizeClass);
+    for (void* object : objects) {
+      cache.Deallocate(object, kHotSizeClass);
+    }
+    cache.Deallocate(cold, kColdSizeClass);
+  }
+
+  if (mask.Tampered() ||
+      cpu != subtle::percpu::GetCurrentVirtualCpuUnsafe(virtual_cpu_id_offset)) {
+    return -1;
+  }
+  return cache.GetTotalCacheMissStats(cpu).underflows - underflows_before;
+}
+
+TEST(CpuCacheTest, HotSiteReducesRefills) {
+  if (!subtle::percpu::IsFast()) {
+    return;
+  }
+
+  HotSiteTracker tracker;
+  ReportHotSite(tracker, kHotSizeClass);
+  ASSERT_TRUE(tracker.IsHot(kHotSizeClass));
+  ASSERT_FALSE(tracker.IsHot(kColdSizeClass));
+
+  constexpr int kRounds = 100;
+  constexpr size_t kBurst = 4096;
+  int64_t underflows[2];
+  for (bool hint : {false, true}) {
+    CpuCache cache;
+    cache.forwarder().hot_site_tracker_ = &tracker;
+    cache.forwarder().hot_site_cache_hints_ = hint;
+    cache.Activate();
+    underflows[hint] = RunSkewedSiteWorkload(cache, kRounds, kBurst);
+    cache.Deactivate();
+    if (underflows[hint] < 0) {
+      return;
+    }
+  }
+
+  EXPECT_LT(underflows[true], underflows[false]);
+}
+
 static void ResizeSizeClasses(CpuCache& cache, const std::atomic<bool>& stop) {
   if (!subtle::percpu::IsFast()) {
     return;
@@ -22,6 +22,7 @@
 #include <functional>
 #include <limits>
 #include <memory>
+#include <new>
 #include <type_traits>
 #include <utility>
 
@@ -31,15 +32,17 @@
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/base/macros.h"
+#include "absl/base/optimization.h"
 #include "absl/container/flat_hash_map.h"
-#include "absl/debugging/stacktrace.h"  // for GetStackTrace
 #include "absl/functional/function_ref.h"
 #include "absl/hash/hash.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/cache_topology.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/sampled_allocation.h"
@@ -454,12 +457,15 @@ class DeallocationProfiler {
                         (stack_trace.requested_size + 1);
   }
 
-  void ReportFree(tcmalloc_internal::AllocHandle handle) {
+  // Returns false if the profiler did not observe the allocation.  If
+  // `records` is non-null, the lifetime of the allocation is also pushed to it.
+  bool ReportFree(tcmalloc_internal::AllocHandle handle,
+                  LifetimeRecordRings* records) {
     auto it = allocs_.find(handle);
 
     // Handle the case that we observed the deallocation but not the allocation
     if (it == allocs_.end()) {
-      return;
+      return false;
     }
 
     DeallocationSampleRecord sample = it->second;
@@ -475,13 +481,90 @@ class DeallocationProfiler {
         tcmalloc_internal::subtle::percpu::VirtualRseqCpuId();
     deallocation.l3_id = GetL3Id(deallocation.cpu_id);
     deallocation.thread_id = absl::base_internal::GetTID();
-    deallocation.depth =
-        absl::GetStackTrace(deallocation.stack, kMaxStackDepth, 1);
+    deallocation.depth = tcmalloc_internal::GetSampledStackTrace(
+        deallocation.stack, kMaxStackDepth, 1);
 
+    if (records != nullptr) {
+      records->Push(deallocation.cpu_id,
+                    MakeLifetimeRecord(sample, deallocation));
+    }
     reports_->AddTrace(sample, deallocation);
+    return true;
+  }
+
+ private:
+  static uint64_t StackHash(const DeallocationSampleRecord& record) {
+    return absl::HashOf(absl::Span<void* const>(record.stack, record.depth));
+  }
+
+  static MallocExtension::LifetimeRecord MakeLifetimeRecord(
+      const DeallocationSampleRecord& alloc,
+      const DeallocationSampleRecord& dealloc) {
+    return {
+        .alloc_stack_hash = StackHash(alloc),
+        .dealloc_stack_hash = StackHash(dealloc),
+        .allocated_size = alloc.allocated_size,
+        .lifetime_ns = absl::ToInt64Nanoseconds(dealloc.creation_time -
+                                                alloc.creation_time),
+        .same_cpu = alloc.cpu_id == dealloc.cpu_id,
+        .same_thread = alloc.thread_id == dealloc.thread_id,
+    };
   }
 };
 
+void LifetimeRecordRings::SetEnabled(bool enabled) {
+  if (enabled) {
+    AllocationGuardSpinLockHolder h(&drain_lock_);
+    if (rings_.load(std::memory_order_relaxed) == nullptr) {
+      // LowLevelAlloc gets its memory straight from the OS, so it does not
+      // recurse into the allocator.
+      Ring* rings = static_cast<Ring*>(
+          absl::base_internal::LowLevelAlloc::Alloc(sizeof(Ring) * kNumRings));
+      for (size_t i = 0; i < kNumRings; ++i) {
+        new (&rings[i]) Ring();
+      }
+      rings_.store(rings, std::memory_order_release);
+    }
+  }
+  enabled_.store(enabled, std::memory_order_relaxed);
+}
+
+void LifetimeRecordRings::Push(int cpu,
+                               const MallocExtension::LifetimeRecord& record) {
+  Ring* rings = rings_.load(std::memory_order_acquire);
+  if (ABSL_PREDICT_FALSE(rings == nullptr)) return;
+
+  Ring& ring = rings[static_cast<unsigned>(std::max(cpu, 0)) % kNumRings];
+  const uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  if (tail - ring.head.load(std::memory_order_acquire) >= kCapacity) {
+    ring.dropped.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  ring.records[tail % kCapacity] = record;
+  ring.tail.store(tail + 1, std::memory_order_release);
+}
+
+size_t LifetimeRecordRings::Drain(
+    absl::Span<MallocExtension::LifetimeRecord> out, uint64_t* dropped) {
+  AllocationGuardSpinLockHolder h(&drain_lock_);
+  *dropped = 0;
+  Ring* rings = rings_.load(std::memory_order_acquire);
+  if (rings == nullptr) return 0;
+
+  size_t n = 0;
+  for (size_t i = 0; i < kNumRings; ++i) {
+    Ring& ring = rings[i];
+    uint64_t head = ring.head.load(std::memory_order_relaxed);
+    const uint64_t tail = ring.tail.load(std::memory_order_acquire);
+    for (; head != tail && n < out.size(); ++head) {
+      out[n++] = ring.records[head % kCapacity];
+    }
+    ring.head.store(head, std::memory_order_release);
+    *dropped += ring.dropped.exchange(0, std::memory_order_relaxed);
+  }
+  return n;
+}
+
 void DeallocationProfilerList::Add(DeallocationProfiler* profiler) {
   AllocationGuardSpinLockHolder h(&profilers_lock_);
   profiler->next_ = first_;
@@ -521,9 +604,14 @@ void DeallocationProfilerList::ReportMalloc(
 void DeallocationProfilerList::ReportFree(
     tcmalloc_internal::AllocHandle handle) {
   AllocationGuardSpinLockHolder h(&profilers_lock_);
+  LifetimeRecordRings* records =
+      lifetime_records_.enabled() ? &lifetime_records_ : nullptr;
   DeallocationProfiler* cur = first_;
   while (cur != nullptr) {
-    cur->ReportFree(handle);
+    // Record each deallocation once, even if several profilers observed it.
+    if (cur->ReportFree(handle, records)) {
+      records = nullptr;
+    }
     cur = cur->next_;
   }
 }
@@ -15,11 +15,16 @@
 #ifndef TCMALLOC_DEALLOCATION_PROFILER_H_
 #define TCMALLOC_DEALLOCATION_PROFILER_H_
 
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/malloc_extension.h"
@@ -30,6 +35,48 @@ namespace deallocationz {
 
 class DeallocationProfiler;
 
+// Bounded per-CPU rings of MallocExtension::LifetimeRecords.
+//
+// Records are pushed while holding DeallocationProfilerList's lock, so each
+// ring has a single producer at a time, and readers synchronize with it only
+// through the ring's head and tail.  A record that finds its ring full is
+// dropped and counted instead of blocking the deallocation.  The rings are
+// allocated when recording is first enabled and never freed.
+class LifetimeRecordRings {
+ public:
+  static constexpr size_t kNumRings = 16;
+  static constexpr size_t kCapacity = 256;
+
+  constexpr LifetimeRecordRings() = default;
+
+  void SetEnabled(bool enabled) ABSL_LOCKS_EXCLUDED(drain_lock_);
+  bool enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+  // Appends `record` to the ring of `cpu`.  Calls must be serialized.
+  void Push(int cpu, const MallocExtension::LifetimeRecord& record);
+
+  // Moves up to out.size() records into `out`, and sets `dropped` to the
+  // number of records dropped since the previous call.
+  size_t Drain(absl::Span<MallocExtension::LifetimeRecord> out,
+               uint64_t* dropped) ABSL_LOCKS_EXCLUDED(drain_lock_);
+
+ private:
+  struct Ring {
+    // Index of the next record to drain.  Only written by readers.
+    std::atomic<uint64_t> head{0};
+    // Index of the next record to push.  Only written by the producer.
+    std::atomic<uint64_t> tail{0};
+    std::atomic<uint64_t> dropped{0};
+    MallocExtension::LifetimeRecord records[kCapacity];
+  };
+
+  std::atomic<bool> enabled_{false};
+  std::atomic<Ring*> rings_{nullptr};
+  // Serializes readers, and the allocation of rings_.
+  absl::base_internal::SpinLock drain_lock_{
+      absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+};
+
 class DeallocationProfilerList {
  public:
   constexpr DeallocationProfilerList() = default;
@@ -39,8 +86,11 @@ class DeallocationProfilerList {
   void Add(DeallocationProfiler* profiler);
   void Remove(DeallocationProfiler* profiler);
 
+  LifetimeRecordRings& lifetime_records() { return lifetime_records_; }
+
  private:
   DeallocationProfiler* first_ = nullptr;
+  LifetimeRecordRings lifetime_records_;
   absl::base_internal::SpinLock profilers_lock_{
       absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
 };
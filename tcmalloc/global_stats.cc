@@ -33,10 +33,14 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/memory_stats.h"
 #include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/internal/seqlock.h"
+#include "tcmalloc/internal/syscall_stats.h"
+#include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/residency_scanner.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/span_stats.h"
 #include "tcmalloc/stack_trace_table.h"
@@ -49,6 +53,33 @@
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
+namespace {
+
+// Totals that can only be read under pageheap_lock, published for
+// GetStatsSnapshot.
+struct PublishedStats {
+  int64_t timestamp_ns;
+  BackingStats pageheap;
+  ArenaStats arena;
+  uint64_t metadata_bytes;
+  uint64_t thread_bytes;
+};
+
+ABSL_CONST_INIT Seqlock<PublishedStats> published_stats;
+
+void PublishStatsLocked(const BackingStats& pageheap, const ArenaStats& arena,
+                        uint64_t metadata_bytes, uint64_t thread_bytes)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  PublishedStats published;
+  published.timestamp_ns = absl::GetCurrentTimeNanos();
+  published.pageheap = pageheap;
+  published.arena = arena;
+  published.metadata_bytes = metadata_bytes;
+  published.thread_bytes = thread_bytes;
+  published_stats.Write(published);
+}
+
+}  // namespace
 
 // Get stats into "r".  Also, if class_count != NULL, class_count[k]
 // will be set to the total number of objects of size class k in the
@@ -108,15 +139,27 @@ void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     }
 
     r->arena = tc_globals.arena().stats();
+    // We have everything the snapshot needs, so publish it while we hold the
+    // lock anyway.
+    PublishStatsLocked(r->pageheap, r->arena, r->metadata_bytes,
+                       r->thread_bytes);
     if (!report_residence) {
       r->metadata_bytes += r->arena.bytes_nonresident;
     }
   }
+  // Once the residency scanner has completed a pass, report the residency it
+  // measured rather than measuring it on the caller's thread.
+  const ResidencyScanner::Summary residency =
+      tc_globals.residency_scanner().GetSummary();
+  const bool cached_residence = report_residence && residency.passes > 0;
+
   // We can access the pagemap without holding the pageheap_lock since it
   // is static data, and we are only taking address and size which are
   // constants.
   if (report_residence) {
-    auto resident_bytes = tc_globals.pagemap_residence();
+    auto resident_bytes = cached_residence
+                              ? residency.pagemap_root_resident_bytes
+                              : tc_globals.pagemap_residence();
     r->pagemap_root_bytes_res = resident_bytes;
     ASSERT(r->metadata_bytes >= r->pagemap_bytes);
     r->metadata_bytes = r->metadata_bytes - r->pagemap_bytes + resident_bytes;
@@ -133,22 +176,45 @@ void ExtractStats(TCMallocStats* r, uint64_t* class_count,
     r->sharded_transfer_bytes =
         tc_globals.sharded_transfer_cache().TotalBytes();
 
-    if (report_residence) {
+    if (cached_residence) {
+      r->percpu_metadata_bytes_res = residency.percpu_metadata_resident_bytes;
+      r->percpu_metadata_bytes = residency.percpu_metadata_bytes;
+    } else if (report_residence) {
       auto percpu_metadata = tc_globals.cpu_cache().MetadataMemoryUsage();
       r->percpu_metadata_bytes_res = percpu_metadata.resident_size;
       r->percpu_metadata_bytes = percpu_metadata.virtual_size;
-
+    }
+    if (report_residence) {
       ASSERT(r->metadata_bytes >= r->percpu_metadata_bytes);
       r->metadata_bytes = r->metadata_bytes - r->percpu_metadata_bytes +
                           r->percpu_metadata_bytes_res;
     }
   }
+
+  // Sampling the residency of the aliases reads /proc, so do it without
+  // holding pageheap_lock.
+  r->aliases = {};
+  if (tc_globals.IsInited()) {
+    r->aliases = tc_globals.virtual_page_allocator().GetAliasStats(
+        report_residence && !cached_residence);
+    if (cached_residence) {
+      r->aliases.resident_bytes = residency.alias_resident_bytes;
+    }
+  }
 }
 
 void ExtractTCMallocStats(TCMallocStats* r, bool report_residence) {
   ExtractStats(r, nullptr, nullptr, nullptr, nullptr, report_residence);
 }
 
+void PublishPageHeapStats() {
+  uint64_t thread_bytes = 0;
+  ThreadCache::GetThreadStats(&thread_bytes, nullptr);
+  PublishStatsLocked(tc_globals.page_allocator().stats(),
+                     tc_globals.arena().stats(), tc_globals.metadata_bytes(),
+                     thread_bytes);
+}
+
 // Because different fields of stats are computed from state protected
 // by different locks, they may be inconsistent.  Prevent underflow
 // when subtracting to avoid gigantic results.
@@ -176,7 +242,9 @@ uint64_t UnmappedBytes(const TCMallocStats& stats) {
 }
 
 uint64_t PhysicalMemoryUsed(const TCMallocStats& stats) {
-  return StatSub(VirtualMemoryUsed(stats), UnmappedBytes(stats));
+  // Alias page tables take up memory but no address space.
+  return StatSub(VirtualMemoryUsed(stats), UnmappedBytes(stats)) +
+         stats.aliases.page_table_bytes;
 }
 
 // The number of bytes either in use by the app or fragmented so that
@@ -205,6 +273,56 @@ size_t SlackBytes(const BackingStats& stats) {
   return stats.free_bytes + stats.unmapped_bytes;
 }
 
+void GetStatsSnapshot(MallocExtension::StatsV1* snapshot) {
+  const PublishedStats published = published_stats.Read();
+
+  // Assemble the same stats as ExtractTCMallocStats(&stats, false), taking
+  // the page heap totals from the last publication instead of pageheap_lock.
+  TCMallocStats stats = {};
+  stats.pageheap = published.pageheap;
+  stats.arena = published.arena;
+  stats.metadata_bytes =
+      published.metadata_bytes + published.arena.bytes_nonresident;
+  stats.thread_bytes = published.thread_bytes;
+  for (int size_class = 0; size_class < kNumClasses; ++size_class) {
+    const size_t size = tc_globals.sizemap().class_to_size(size_class);
+    stats.central_bytes +=
+        size * tc_globals.central_freelist(size_class).length() +
+        tc_globals.central_freelist(size_class).OverheadBytes();
+    stats.transfer_bytes +=
+        size * tc_globals.transfer_cache().tc_length(size_class);
+  }
+  if (UsePerCpuCache(tc_globals)) {
+    // Reads each CPU's slab header with relaxed loads.
+    stats.per_cpu_bytes = tc_globals.cpu_cache().TotalUsedBytes();
+    stats.sharded_transfer_bytes =
+        tc_globals.sharded_transfer_cache().TotalBytes();
+  }
+  if (tc_globals.IsInited()) {
+    stats.aliases = tc_globals.virtual_page_allocator().GetAliasStats(
+        /*report_residence=*/false);
+  }
+
+  *snapshot = {};
+  snapshot->version = MallocExtension::StatsV1::kVersion;
+  snapshot->size = sizeof(*snapshot);
+  snapshot->pageheap_timestamp_ns = published.timestamp_ns;
+  snapshot->current_allocated_bytes = InUseByApp(stats);
+  snapshot->heap_size = HeapSizeBytes(stats.pageheap);
+  snapshot->physical_memory_used = PhysicalMemoryUsed(stats);
+  snapshot->virtual_memory_used = VirtualMemoryUsed(stats);
+  snapshot->pageheap_free_bytes = stats.pageheap.free_bytes;
+  snapshot->pageheap_unmapped_bytes = stats.pageheap.unmapped_bytes;
+  snapshot->metadata_bytes = stats.metadata_bytes;
+  snapshot->cpu_free = stats.per_cpu_bytes;
+  snapshot->sharded_transfer_cache_free = stats.sharded_transfer_bytes;
+  snapshot->transfer_cache_free = stats.transfer_bytes;
+  snapshot->central_cache_free = stats.central_bytes;
+  snapshot->thread_cache_free = stats.thread_bytes;
+  snapshot->sampled_internal_fragmentation =
+      tc_globals.sampled_internal_fragmentation_.value();
+}
+
 static int CountAllowedCpus() {
   cpu_set_t allowed_cpus;
   if (sched_getaffinity(0, sizeof(allowed_cpus), &allowed_cpus) != 0) {
@@ -252,10 +370,12 @@ void DumpStats(Printer* out, int level) {
       "MALLOC: + %12u (%7.1f MiB) Bytes in malloc metadata\n"
       "MALLOC: + %12u (%7.1f MiB) Bytes in malloc metadata Arena unallocated\n"
       "MALLOC: + %12u (%7.1f MiB) Bytes in malloc metadata Arena unavailable\n"
+      "MALLOC: + %12u (%7.1f MiB) Bytes in virtual page alias page tables\n"
 
       "MALLOC:   ------------\n"
       "MALLOC: = %12u (%7.1f MiB) Actual memory used (physical + swap)\n"
       "MALLOC: + %12u (%7.1f MiB) Bytes released to OS (aka unmapped)\n"
+      "MALLOC: - %12u (%7.1f MiB) Bytes in virtual page alias page tables\n"
       "MALLOC:   ------------\n"
       "MALLOC: = %12u (%7.1f MiB) Virtual address space used\n"
       "MALLOC:\n"
@@ -271,6 +391,8 @@ void DumpStats(Printer* out, int level) {
       "MALLOC:   %12u (%7.1f MiB) Pagemap root resident bytes\n"
       "MALLOC:   %12u (%7.1f MiB) per-CPU slab bytes used\n"
       "MALLOC:   %12u (%7.1f MiB) per-CPU slab resident bytes\n"
+      "MALLOC:   %12u               Virtual page aliases\n"
+      "MALLOC:   %12u (%7.1f MiB) Virtual page alias resident bytes (sampled)\n"
       "MALLOC:   %12u (%7.1f MiB) malloc metadata Arena non-resident bytes\n"
       "MALLOC:   %12u (%7.1f MiB) Actual memory used at peak\n"
       "MALLOC:   %12u (%7.1f MiB) Estimated in-use at peak\n"
@@ -289,8 +411,12 @@ void DumpStats(Printer* out, int level) {
       stats.metadata_bytes, stats.metadata_bytes / MiB,
       stats.arena.bytes_unallocated, stats.arena.bytes_unallocated / MiB,
       stats.arena.bytes_unavailable, stats.arena.bytes_unavailable / MiB,
+      uint64_t(stats.aliases.page_table_bytes),
+      stats.aliases.page_table_bytes / MiB,
       physical_memory_used, physical_memory_used / MiB,
       unmapped_bytes, unmapped_bytes / MiB,
+      uint64_t(stats.aliases.page_table_bytes),
+      stats.aliases.page_table_bytes / MiB,
       virtual_memory_used, virtual_memory_used / MiB,
       uint64_t(stats.span_stats.in_use),
       uint64_t(stats.span_stats.total),
@@ -310,6 +436,9 @@ void DumpStats(Printer* out, int level) {
       uint64_t(stats.percpu_metadata_bytes),
       stats.percpu_metadata_bytes / MiB,
       stats.percpu_metadata_bytes_res, stats.percpu_metadata_bytes_res / MiB,
+      uint64_t(stats.aliases.aliases),
+      uint64_t(stats.aliases.resident_bytes),
+      stats.aliases.resident_bytes / MiB,
       stats.arena.bytes_nonresident, stats.arena.bytes_nonresident / MiB,
       uint64_t(stats.peak_stats.backed_bytes),
       stats.peak_stats.backed_bytes / MiB,
@@ -409,6 +538,10 @@ void DumpStats(Printer* out, int level) {
     tc_globals.page_allocator().Print(out, MemoryTag::kSampled);
     tc_globals.page_allocator().Print(out, MemoryTag::kCold);
     tc_globals.guardedpage_allocator().Print(out);
+    tc_globals.sampled_span_quarantine().Print(out);
+    tc_globals.virtual_page_allocator().Print(out);
+    tc_globals.residency_scanner().Print(out);
+    tc_globals.slow_path_latency().Print(out);
 
     uint64_t soft_limit_bytes =
         tc_globals.page_allocator().limit(PageAllocator::kSoft);
@@ -462,6 +595,14 @@ void DumpStats(Printer* out, int level) {
     out->printf(
         "PARAMETER tcmalloc_use_all_buckets_for_few_object_spans %d\n",
         Parameters::use_all_buckets_for_few_object_spans_in_cfl() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_sampled_quarantine_bytes %zu\n",
+                Parameters::sampled_quarantine_bytes());
+    out->printf("PARAMETER tcmalloc_guarded_page_pool_size %zu\n",
+                Parameters::guarded_page_pool_size());
+    out->printf("PARAMETER tcmalloc_slow_path_latency_histograms %d\n",
+                Parameters::slow_path_latency_histograms() ? 1 : 0);
+    out->printf("PARAMETER tcmalloc_hot_site_cache_hints %d\n",
+                Parameters::hot_site_cache_hints() ? 1 : 0);
   }
 }
 
@@ -512,6 +653,11 @@ void DumpStatsInPbtxt(Printer* out, int level) {
   region.PrintI64("pagemap_root_residence", stats.pagemap_root_bytes_res);
   region.PrintI64("percpu_slab_size", stats.percpu_metadata_bytes);
   region.PrintI64("percpu_slab_residence", stats.percpu_metadata_bytes_res);
+  region.PrintI64("virtual_page_aliases", stats.aliases.aliases);
+  region.PrintI64("virtual_page_alias_page_table_bytes",
+                  stats.aliases.page_table_bytes);
+  region.PrintI64("virtual_page_alias_resident_bytes",
+                  stats.aliases.resident_bytes);
   region.PrintI64("peak_backed", stats.peak_stats.backed_bytes);
   region.PrintI64("peak_application_demand",
                   stats.peak_stats.sampled_application_bytes);
@@ -604,6 +750,23 @@ void DumpStatsInPbtxt(Printer* out, int level) {
     auto gwp_asan = region.CreateSubRegion("gwp_asan");
     tc_globals.guardedpage_allocator().PrintInPbtxt(&gwp_asan);
   }
+  {
+    auto quarantine = region.CreateSubRegion("sampled_quarantine");
+    tc_globals.sampled_span_quarantine().PrintInPbtxt(&quarantine);
+  }
+  {
+    auto virtual_pages = region.CreateSubRegion("virtual_page_protection");
+    tc_globals.virtual_page_allocator().protection().PrintInPbtxt(
+        &virtual_pages);
+  }
+  {
+    auto residency_scan = region.CreateSubRegion("residency_scan");
+    tc_globals.residency_scanner().PrintInPbtxt(&residency_scan);
+  }
+  {
+    auto slow_path_latency = region.CreateSubRegion("slow_path_latency");
+    tc_globals.slow_path_latency().PrintInPbtxt(&slow_path_latency);
+  }
 
   region.PrintI64("memory_release_failures", SystemReleaseErrors());
 
@@ -640,6 +803,14 @@ void DumpStatsInPbtxt(Printer* out, int level) {
                    tc_globals.cpu_cache().ConfigureSizeClassMaxCapacity());
   region.PrintI64("tcmalloc_use_all_buckets_for_few_object_spans",
                   Parameters::use_all_buckets_for_few_object_spans_in_cfl());
+  region.PrintI64("tcmalloc_sampled_quarantine_bytes",
+                  Parameters::sampled_quarantine_bytes());
+  region.PrintI64("tcmalloc_guarded_page_pool_size",
+                  Parameters::guarded_page_pool_size());
+  region.PrintBool("tcmalloc_slow_path_latency_histograms",
+                   Parameters::slow_path_latency_histograms());
+  region.PrintBool("tcmalloc_hot_site_cache_hints",
+                   Parameters::hot_site_cache_hints());
 }
 
 bool GetNumericProperty(const char* name_data, size_t name_size,
@@ -753,6 +924,57 @@ bool GetNumericProperty(const char* name_data, size_t name_size,
     return true;
   }
 
+  if (name == "tcmalloc.virtual_page_aliases") {
+    TCMallocStats stats;
+    ExtractTCMallocStats(&stats, false);
+    *value = stats.aliases.aliases;
+    return true;
+  }
+
+  if (name == "tcmalloc.virtual_page_alias_page_table_bytes") {
+    TCMallocStats stats;
+    ExtractTCMallocStats(&stats, false);
+    *value = stats.aliases.page_table_bytes;
+    return true;
+  }
+
+  if (name == "tcmalloc.virtual_page_alias_resident_bytes") {
+    // Only needs the aliases, so skip the rest of the residency queries.
+    if (!tc_globals.IsInited()) {
+      *value = 0;
+      return true;
+    }
+    *value = tc_globals.virtual_page_allocator()
+                 .GetAliasStats(/*report_residence=*/true)
+                 .resident_bytes;
+    return true;
+  }
+
+  {
+    // tcmalloc.<syscall>_calls and tcmalloc.<syscall>_ns.
+    absl::string_view suffix = name;
+    if (absl::ConsumePrefix(&suffix, "tcmalloc.")) {
+      for (int i = 0; i < kNumSyscalls; ++i) {
+        const Syscall syscall = static_cast<Syscall>(i);
+        absl::string_view rest = suffix;
+        if (!absl::ConsumePrefix(&rest, SyscallName(syscall))) continue;
+        if (rest == "_calls") {
+          *value = GetSyscallCount(syscall).calls;
+          return true;
+        }
+        if (rest == "_ns") {
+          *value = GetSyscallCount(syscall).ns;
+          return true;
+        }
+      }
+    }
+  }
+
+  if (name == "tcmalloc.sampled_quarantine_bytes") {
+    *value = tc_globals.sampled_span_quarantine().GetStats().quarantined_bytes;
+    return true;
+  }
+
   if (name == "tcmalloc.page_algorithm") {
     AllocationGuardSpinLockHolder l(&pageheap_lock);
     *value = tc_globals.page_allocator().algorithm();
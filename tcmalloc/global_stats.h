@@ -18,12 +18,16 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "absl/base/thread_annotations.h"
 #include "tcmalloc/arena.h"
+#include "tcmalloc/common.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/stats.h"
+#include "tcmalloc/virtual_page_allocator.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -50,6 +54,10 @@ struct TCMallocStats {
 
   ArenaStats arena;  // Stats from the metadata Arena
 
+  // Stats from the virtual page aliases of the heap.  Their page tables are
+  // counted as used memory, like metadata.
+  VirtualPageAllocator::AliasStats aliases;
+
   // Explicitly declare the ctor to put it in the google_malloc section.
   TCMallocStats() = default;
 };
@@ -66,6 +74,13 @@ size_t HeapSizeBytes(const BackingStats& stats);
 size_t LocalBytes(const TCMallocStats& stats);
 size_t SlackBytes(const BackingStats& stats);
 
+// Publishes the page heap totals that GetStatsSnapshot reports.
+void PublishPageHeapStats() ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
+
+// Fills in *snapshot from the last published page heap totals and the current
+// cache totals.  Does not take pageheap_lock.
+void GetStatsSnapshot(MallocExtension::StatsV1* snapshot);
+
 // WRITE stats to "out"
 void DumpStats(Printer* out, int level);
 void DumpStatsInPbtxt(Printer* out, int level);
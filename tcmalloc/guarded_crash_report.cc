@@ -0,0 +1,156 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/guarded_crash_report.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+ABSL_CONST_INIT std::atomic<int> crash_report_fd{-1};
+
+// Buffers a report in a small stack buffer, so that it is written with few
+// system calls without allocating.
+class ReportWriter {
+ public:
+  explicit ReportWriter(int fd) : fd_(fd) {}
+
+  void Append(const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+      if (used_ == sizeof(buffer_)) Flush();
+      const size_t n =
+          size < sizeof(buffer_) - used_ ? size : sizeof(buffer_) - used_;
+      memcpy(buffer_ + used_, p, n);
+      used_ += n;
+      p += n;
+      size -= n;
+    }
+  }
+
+  void AppendRecord(CrashReportTag tag, const void* payload, size_t length) {
+    const CrashReportRecordHeader header = {static_cast<uint32_t>(tag),
+                                            static_cast<uint32_t>(length)};
+    Append(&header, sizeof(header));
+    Append(payload, length);
+  }
+
+  void AppendStack(CrashReportTag tag, uint64_t tid, void* const* stack,
+                   size_t depth) {
+    const CrashReportStack payload = {tid, depth};
+    const CrashReportRecordHeader header = {
+        static_cast<uint32_t>(tag),
+        static_cast<uint32_t>(sizeof(payload) + depth * sizeof(uint64_t))};
+    Append(&header, sizeof(header));
+    Append(&payload, sizeof(payload));
+    for (size_t i = 0; i < depth; ++i) {
+      const uint64_t frame = reinterpret_cast<uintptr_t>(stack[i]);
+      Append(&frame, sizeof(frame));
+    }
+  }
+
+  // Writes out the buffer.  Returns false if any write failed.
+  bool Flush() {
+    const char* p = buffer_;
+    while (used_ > 0 && ok_) {
+      const ssize_t n = write(fd_, p, used_);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) continue;
+        ok_ = false;
+        break;
+      }
+      p += n;
+      used_ -= n;
+    }
+    used_ = 0;
+    return ok_;
+  }
+
+ private:
+  int fd_;
+  char buffer_[256];
+  size_t used_ = 0;
+  bool ok_ = true;
+};
+
+}  // namespace
+
+bool WriteGuardedCrashReport(int fd, const GuardedCrashReport& report) {
+  // Preserve errno for the interrupted code, in case we return to it.
+  const int saved_errno = errno;
+  ReportWriter writer(fd);
+
+  const CrashReportHeader header = {
+      kCrashReportMagic, kCrashReportVersion,
+      static_cast<uint64_t>(getpid())};
+  writer.AppendRecord(CrashReportTag::kHeader, &header, sizeof(header));
+
+  const CrashReportFault fault = {
+      report.fault_address, static_cast<uint32_t>(report.error),
+      static_cast<uint32_t>(report.write_flag),
+      static_cast<uint64_t>(report.tid)};
+  writer.AppendRecord(CrashReportTag::kFault, &fault, sizeof(fault));
+
+  const CrashReportSlot slot = {
+      report.slot_start,
+      report.slot_size,
+      report.allocation_start,
+      report.requested_size,
+      static_cast<int64_t>(report.fault_address - report.allocation_start),
+      static_cast<uint32_t>(report.slot_index),
+      report.large};
+  writer.AppendRecord(CrashReportTag::kSlot, &slot, sizeof(slot));
+
+  if (report.alloc_trace != nullptr) {
+    writer.AppendStack(CrashReportTag::kAllocStack, report.alloc_trace->tid,
+                       report.alloc_trace->stack, report.alloc_trace->depth);
+  }
+  if (report.dealloc_trace != nullptr && report.dealloc_trace->depth > 0) {
+    writer.AppendStack(CrashReportTag::kDeallocStack,
+                       report.dealloc_trace->tid, report.dealloc_trace->stack,
+                       report.dealloc_trace->depth);
+  }
+  writer.AppendStack(CrashReportTag::kFaultStack, report.tid,
+                     report.fault_stack, report.fault_depth);
+  writer.AppendRecord(CrashReportTag::kEnd, nullptr, 0);
+
+  const bool ok = writer.Flush();
+  errno = saved_errno;
+  return ok;
+}
+
+void SetGuardedCrashReportFd(int fd) {
+  crash_report_fd.store(fd < 0 ? -1 : fd, std::memory_order_relaxed);
+}
+
+int GetGuardedCrashReportFd() {
+  return crash_report_fd.load(std::memory_order_relaxed);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
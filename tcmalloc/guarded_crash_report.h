@@ -0,0 +1,131 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_GUARDED_CRASH_REPORT_H_
+#define TCMALLOC_GUARDED_CRASH_REPORT_H_
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Binary GWP-ASan crash reports, for crash collectors that should not have to
+// parse the log.
+//
+// A report is a sequence of records.  Each record is a CrashReportRecordHeader
+// followed by `length` bytes of payload, whose layout depends on the tag.  All
+// integers are in host byte order.  The first record is always kHeader and the
+// last one kEnd, so that truncated reports can be recognized.  Readers should
+// skip records with unknown tags, which later versions may add.
+inline constexpr uint32_t kCrashReportMagic = 0x52505747;  // "GWPR"
+inline constexpr uint32_t kCrashReportVersion = 1;
+
+enum class CrashReportTag : uint32_t {
+  kHeader = 1,        // CrashReportHeader
+  kFault = 2,         // CrashReportFault
+  kSlot = 3,          // CrashReportSlot
+  kAllocStack = 4,    // CrashReportStack, then `depth` uint64_t frames
+  kDeallocStack = 5,  // CrashReportStack, then `depth` uint64_t frames
+  kFaultStack = 6,    // CrashReportStack, then `depth` uint64_t frames
+  kEnd = 7,           // No payload
+};
+
+struct CrashReportRecordHeader {
+  uint32_t tag;
+  uint32_t length;
+};
+
+struct CrashReportHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t pid;
+};
+
+struct CrashReportFault {
+  uint64_t address;
+  // A GuardedAllocationsErrorType.
+  uint32_t error_type;
+  // A WriteFlag.
+  uint32_t write_flag;
+  // The thread that made the access.
+  uint64_t tid;
+};
+
+struct CrashReportSlot {
+  uint64_t slot_address;
+  uint64_t slot_size;
+  uint64_t allocation_address;
+  uint64_t requested_size;
+  // Offset of the faulting access from allocation_address.
+  int64_t access_offset;
+  uint32_t slot_index;
+  // Whether the slot is one of the large slots.
+  uint32_t large;
+};
+
+struct CrashReportStack {
+  uint64_t tid;
+  uint64_t depth;
+};
+
+// The values are part of the report format.
+static_assert(static_cast<int>(GuardedAllocationsErrorType::kUseAfterFree) ==
+              0);
+static_assert(static_cast<int>(GuardedAllocationsErrorType::kDoubleFree) == 9);
+static_assert(static_cast<int>(GuardedAllocationsErrorType::kUnknown) == 11);
+static_assert(static_cast<int>(WriteFlag::Write) == 2);
+
+struct GuardedCrashReport {
+  uintptr_t fault_address;
+  GuardedAllocationsErrorType error;
+  WriteFlag write_flag;
+  pid_t tid;
+
+  uintptr_t slot_start;
+  size_t slot_size;
+  size_t slot_index;
+  bool large;
+  uintptr_t allocation_start;
+  size_t requested_size;
+
+  const GuardedAllocationsStackTrace* alloc_trace;
+  // Only reported if its depth is nonzero, i.e., if the slot was freed.
+  const GuardedAllocationsStackTrace* dealloc_trace;
+  void* const* fault_stack;
+  size_t fault_depth;
+};
+
+// Writes report to fd with write(2), retrying interrupted and partial writes.
+// Returns false if a write failed.  Async-signal-safe.
+bool WriteGuardedCrashReport(int fd, const GuardedCrashReport& report);
+
+// Sets the file descriptor that SegvHandler writes binary crash reports to, or
+// disables the reports if fd is negative.  The descriptor must stay open.
+void SetGuardedCrashReportFd(int fd);
+
+// Returns the descriptor set by SetGuardedCrashReportFd, or -1.
+int GetGuardedCrashReportFd();
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_GUARDED_CRASH_REPORT_H_
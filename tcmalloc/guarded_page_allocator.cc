@@ -14,9 +14,8 @@
 
 #include "tcmalloc/guarded_page_allocator.h"
 
-#include <sys/mman.h>
-
 #include <algorithm>
+#include <atomic>
 #include <cmath>
 #include <cstddef>
 #include <cstdint>
@@ -29,17 +28,18 @@
 #include "absl/numeric/bits.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/guarded_sampling_policy.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/exponential_biased.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/page_protection_engine.h"
 #include "tcmalloc/pagemap.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
-#include "tcmalloc/system-alloc.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -47,12 +47,17 @@ namespace tcmalloc_internal {
 
 const size_t GuardedPageAllocator::kMagicSize;  // NOLINT
 
-void GuardedPageAllocator::Init(size_t max_alloced_pages, size_t total_pages) {
+void GuardedPageAllocator::Init(size_t max_alloced_pages, size_t total_pages,
+                                size_t deallocation_batch_size) {
   CHECK_CONDITION(max_alloced_pages > 0);
   CHECK_CONDITION(max_alloced_pages <= total_pages);
   CHECK_CONDITION(total_pages <= kGpaMaxPages);
+  CHECK_CONDITION(deallocation_batch_size > 0);
+  CHECK_CONDITION(deallocation_batch_size <= kMaxDeallocationBatch);
+  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
   max_alloced_pages_ = max_alloced_pages;
   total_pages_ = total_pages;
+  deallocation_batch_size_ = deallocation_batch_size;
 
   // If the system page size is larger than kPageSize, we need to use the
   // system page size for this allocator since mprotect operates on full pages
@@ -60,18 +65,29 @@ void GuardedPageAllocator::Init(size_t max_alloced_pages, size_t total_pages) {
   page_size_ = std::max(kPageSize, static_cast<size_t>(GetPageSize()));
   ASSERT(page_size_ % kPageSize == 0);
 
-  rand_ = reinterpret_cast<uint64_t>(this);  // Initialize RNG seed.
-  MapPages();
+  // Initialize RNG seed.
+  rand_.store(reinterpret_cast<uint64_t>(this), std::memory_order_relaxed);
+  initialized_.store(true, std::memory_order_release);
+}
+
+bool GuardedPageAllocator::SetPoolSize(size_t max_alloced_pages,
+                                       size_t total_pages) {
+  if (max_alloced_pages == 0 || max_alloced_pages > total_pages ||
+      total_pages > kGpaMaxPages) {
+    return false;
+  }
+  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  if (pool_backed_.load(std::memory_order_relaxed)) return false;
+  max_alloced_pages_ = max_alloced_pages;
+  total_pages_ = total_pages;
+  return true;
 }
 
 void GuardedPageAllocator::Destroy() {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  if (initialized_) {
-    size_t len = pages_end_addr_ - pages_base_addr_;
-    int err = munmap(reinterpret_cast<void*>(pages_base_addr_), len);
-    ASSERT(err != -1);
-    (void)err;
-    initialized_ = false;
+  if (initialized_.load(std::memory_order_relaxed)) {
+    protection_.Destroy();
+    initialized_.store(false, std::memory_order_relaxed);
   }
 }
 
@@ -80,6 +96,9 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
   if (size == 0) {
     return {nullptr, Profile::Sample::GuardedStatus::TooSmall};
   }
+  if (size > page_size_) {
+    return AllocateLarge(size, alignment);
+  }
   ssize_t free_slot = ReserveFreeSlot();
   // All slots are reserved.
   if (free_slot == -1) {
@@ -90,10 +109,9 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
   ASSERT(alignment <= page_size_);
   ASSERT(alignment == 0 || absl::has_single_bit(alignment));
   void* result = reinterpret_cast<void*>(SlotToAddr(free_slot));
-  if (mprotect(result, page_size_, PROT_READ | PROT_WRITE) == -1) {
+  if (!protection_.Grant(SlotToAddr(free_slot), page_size_)) {
     ASSERT(false && "mprotect failed");
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    num_failed_allocations_++;
+    num_failed_allocations_.fetch_add(1, std::memory_order_relaxed);
     FreeSlot(free_slot);
     return {nullptr, Profile::Sample::GuardedStatus::MProtectFailed};
   }
@@ -105,11 +123,10 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
   SlotMetadata& d = data_[free_slot];
   // Count the number of pages that have been used at least once.
   if (d.allocation_start == 0) {
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    ++total_pages_used_;
-    if (total_pages_used_ == total_pages_) {
-      alloced_page_count_when_all_used_once_ =
-          num_allocation_requests_ - num_failed_allocations_;
+    if (total_pages_used_.fetch_add(1, std::memory_order_relaxed) + 1 ==
+        total_pages_) {
+      alloced_page_count_when_all_used_once_.store(SuccessfulAllocations(),
+                                                   std::memory_order_relaxed);
     }
   }
   d.dealloc_trace.depth = 0;
@@ -125,59 +142,171 @@ GuardedAllocWithStatus GuardedPageAllocator::Allocate(size_t size,
 
 void GuardedPageAllocator::Deallocate(void* ptr) {
   ASSERT(PointerIsMine(ptr));
+  if (IsLarge(reinterpret_cast<uintptr_t>(ptr))) {
+    DeallocateLarge(ptr);
+    return;
+  }
   const uintptr_t page_addr = GetPageAddr(reinterpret_cast<uintptr_t>(ptr));
   size_t slot = AddrToSlot(page_addr);
 
-  {
+  if (IsFreed(slot) || protection_.IsPending(slot)) {
+    double_free_detected_.store(true, std::memory_order_relaxed);
+  } else if (WriteOverflowOccurred(slot)) {
+    write_overflow_detected_.store(true, std::memory_order_relaxed);
+  }
+  if (write_overflow_detected_.load(std::memory_order_relaxed) ||
+      double_free_detected_.load(std::memory_order_relaxed)) {
+    protection_.RevokeNow(page_addr, page_size_,
+                          PageProtectionEngine::Revocation::kProtect);
+    *reinterpret_cast<char*>(ptr) = 'X';  // Trigger SEGV handler.
+    CHECK_CONDITION(false);               // Unreachable.
+  }
+
+  // Record stack trace.
+  GuardedAllocationsStackTrace& trace = data_[slot].dealloc_trace;
+  trace.depth = absl::GetStackTrace(trace.stack, kMaxStackDepth,
+                                    /*skip_count=*/2);
+  trace.tid = absl::base_internal::GetTID();
+
+  // The engine frees the slot once its page is protected, which may be at the
+  // end of a later deallocation's batch.
+  protection_.Revoke(slot, page_addr, page_size_,
+                     PageProtectionEngine::Revocation::kProtect);
+}
+
+bool GuardedPageAllocator::FlushPendingDeallocations() {
+  return protection_.Flush();
+}
+
+GuardedAllocWithStatus GuardedPageAllocator::AllocateLarge(size_t size,
+                                                           size_t alignment) {
+  if (size > kMaxLargeAllocationSize) {
+    return {nullptr, Profile::Sample::GuardedStatus::LargerThanOnePage};
+  }
+  ssize_t free_slot = ReserveFreeLargeSlot();
+  if (free_slot == -1) {
+    return {nullptr, Profile::Sample::GuardedStatus::NoAvailableSlots};
+  }
+
+  ASSERT(alignment <= page_size_);
+  ASSERT(alignment == 0 || absl::has_single_bit(alignment));
+  // Only the pages holding the allocation become accessible.  The rest of the
+  // slot stays inaccessible along with the trailing guard page.
+  const uintptr_t slot_end = LargeSlotToAddr(free_slot) +
+                             kMaxLargeAllocationSize;
+  const uintptr_t start = RightAlign(slot_end, size, alignment);
+  const uintptr_t first_page = GetPageAddr(start);
+  if (!protection_.Grant(first_page, slot_end - first_page)) {
+    ASSERT(false && "mprotect failed");
+    num_failed_large_allocations_.fetch_add(1, std::memory_order_relaxed);
     AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    if (IsFreed(slot)) {
-      double_free_detected_ = true;
-    } else if (WriteOverflowOccurred(slot)) {
-      write_overflow_detected_ = true;
-    }
+    FreeLargeSlot(free_slot);
+    return {nullptr, Profile::Sample::GuardedStatus::MProtectFailed};
+  }
+  memset(reinterpret_cast<void*>(start + size),
+         GetWriteOverflowMagic(free_slot),
+         std::min(slot_end - start - size, kMagicSize));
 
-    CHECK_CONDITION(mprotect(reinterpret_cast<void*>(page_addr), page_size_,
-                             PROT_NONE) != -1);
+  // Record stack trace.
+  SlotMetadata& d = large_data_[free_slot];
+  d.dealloc_trace.depth = 0;
+  d.alloc_trace.depth = absl::GetStackTrace(d.alloc_trace.stack, kMaxStackDepth,
+                                            /*skip_count=*/4);
+  d.alloc_trace.tid = absl::base_internal::GetTID();
+  d.requested_size = size;
+  d.allocation_start = start;
+
+  ASSERT(!alignment || d.allocation_start % alignment == 0);
+  return {reinterpret_cast<void*>(start),
+          Profile::Sample::GuardedStatus::Guarded};
+}
+
+void GuardedPageAllocator::DeallocateLarge(void* ptr) {
+  const size_t slot = GetNearestLargeSlot(reinterpret_cast<uintptr_t>(ptr));
+  const SlotMetadata& d = large_data_[slot];
+  const uintptr_t slot_end = LargeSlotToAddr(slot) + kMaxLargeAllocationSize;
+
+  bool alloced;
+  {
+    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+    alloced = large_slot_alloced_[slot];
+  }
+  if (!alloced) {
+    double_free_detected_.store(true, std::memory_order_relaxed);
+  } else if (MagicOverwritten(d, slot_end, GetWriteOverflowMagic(slot))) {
+    write_overflow_detected_.store(true, std::memory_order_relaxed);
   }
 
-  if (write_overflow_detected_ || double_free_detected_) {
+  // Discarding the allocation's pages returns its memory to the OS, while
+  // keeping the address range reserved so that later accesses fault.  The
+  // large slots' FIFO reuse already quarantines them, so they are not batched.
+  const uintptr_t first_page = GetPageAddr(d.allocation_start);
+  protection_.RevokeNow(first_page, slot_end - first_page,
+                        PageProtectionEngine::Revocation::kDiscard);
+
+  if (write_overflow_detected_.load(std::memory_order_relaxed) ||
+      double_free_detected_.load(std::memory_order_relaxed)) {
     *reinterpret_cast<char*>(ptr) = 'X';  // Trigger SEGV handler.
     CHECK_CONDITION(false);               // Unreachable.
   }
 
   // Record stack trace.
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  GuardedAllocationsStackTrace& trace = data_[slot].dealloc_trace;
+  GuardedAllocationsStackTrace& trace = large_data_[slot].dealloc_trace;
   trace.depth = absl::GetStackTrace(trace.stack, kMaxStackDepth,
-                                    /*skip_count=*/2);
+                                    /*skip_count=*/3);
   trace.tid = absl::base_internal::GetTID();
 
-  FreeSlot(slot);
+  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  FreeLargeSlot(slot);
 }
 
 size_t GuardedPageAllocator::GetRequestedSize(const void* ptr) const {
   ASSERT(PointerIsMine(ptr));
-  size_t slot = AddrToSlot(GetPageAddr(reinterpret_cast<uintptr_t>(ptr)));
-  return data_[slot].requested_size;
+  return GetNearestMetadata(reinterpret_cast<uintptr_t>(ptr)).requested_size;
 }
 
 std::pair<off_t, size_t> GuardedPageAllocator::GetAllocationOffsetAndSize(
     const void* ptr) const {
   ASSERT(PointerIsMine(ptr));
   const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  const size_t slot = GetNearestSlot(addr);
-  return {addr - data_[slot].allocation_start, data_[slot].requested_size};
+  const SlotMetadata& d = GetNearestMetadata(addr);
+  return {addr - d.allocation_start, d.requested_size};
+}
+
+GuardedPageAllocator::SlotInfo GuardedPageAllocator::GetSlotInfo(
+    const void* ptr) const {
+  ASSERT(PointerIsMine(ptr));
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+  const SlotMetadata& d = GetNearestMetadata(addr);
+  SlotInfo info;
+  info.large = IsLarge(addr);
+  if (info.large) {
+    info.slot_index = GetNearestLargeSlot(addr);
+    info.slot_start = LargeSlotToAddr(info.slot_index);
+    info.slot_size = kMaxLargeAllocationSize;
+  } else {
+    info.slot_index = GetNearestSlot(addr);
+    info.slot_start = SlotToAddr(info.slot_index);
+    info.slot_size = page_size_;
+  }
+  info.allocation_start = d.allocation_start;
+  info.requested_size = d.requested_size;
+  return info;
 }
 
 GuardedAllocationsErrorType GuardedPageAllocator::GetStackTraces(
     const void* ptr, GuardedAllocationsStackTrace** alloc_trace,
     GuardedAllocationsStackTrace** dealloc_trace) const {
   ASSERT(PointerIsMine(ptr));
+  // Nothing was ever allocated from a pool that isn't backed yet.
+  if (!pool_backed_.load(std::memory_order_acquire)) {
+    return GuardedAllocationsErrorType::kUnknown;
+  }
   const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-  size_t slot = GetNearestSlot(addr);
-  *alloc_trace = &data_[slot].alloc_trace;
-  *dealloc_trace = &data_[slot].dealloc_trace;
-  return GetErrorType(addr, data_[slot]);
+  SlotMetadata& d = GetNearestMetadata(addr);
+  *alloc_trace = &d.alloc_trace;
+  *dealloc_trace = &d.dealloc_trace;
+  return GetErrorType(addr, d);
 }
 
 // We take guarded samples during periodic profiling samples.  Computes the
@@ -194,7 +323,22 @@ static int GetChainedRate() {
 }
 
 void GuardedPageAllocator::Print(Printer* out) {
+  // The pool size and protection_ are set up under the lock until the pool
+  // is backed.
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  const size_t num_allocation_requests =
+      num_allocation_requests_.load(std::memory_order_relaxed);
+  const size_t num_failed_allocations =
+      num_failed_allocations_.load(std::memory_order_relaxed);
+  const size_t num_alloced_pages =
+      num_alloced_pages_.load(std::memory_order_relaxed);
+  const size_t num_large_allocation_requests =
+      num_large_allocation_requests_.load(std::memory_order_relaxed);
+  const size_t num_failed_large_allocations =
+      num_failed_large_allocations_.load(std::memory_order_relaxed);
+  const size_t num_alloced_large_slots =
+      num_alloced_large_slots_.load(std::memory_order_relaxed);
+  const GuardedSamplingPolicy& policy = tc_globals.guarded_sampling_policy();
   out->printf(
       "\n"
       "------------------------------------------------\n"
@@ -205,124 +349,400 @@ void GuardedPageAllocator::Print(Printer* out) {
       "Slots Currently Allocated: %zu\n"
       "Slots Currently Quarantined: %zu\n"
       "Maximum Slots Allocated: %zu / %zu\n"
+      "Large Successful Allocations: %zu\n"
+      "Large Failed Allocations: %zu\n"
+      "Large Slots Currently Allocated: %zu / %zu\n"
+      "Large Slots Currently Quarantined: %zu\n",
+      num_allocation_requests - num_failed_allocations, num_failed_allocations,
+      num_alloced_pages, total_pages_ - num_alloced_pages,
+      num_alloced_pages_max_.load(std::memory_order_relaxed),
+      max_alloced_pages_,
+      num_large_allocation_requests - num_failed_large_allocations,
+      num_failed_large_allocations, num_alloced_large_slots, kLargeSlots / 2,
+      kLargeSlots - num_alloced_large_slots);
+  protection_.Print(out);
+  out->printf(
       "StackTraceFilter Max Slots Used: %zu\n"
       "StackTraceFilter Replacement Inserts: %zu\n"
+      "Distinct Sites Guarded (Estimated): %zu\n"
+      "Guard Budget Per Window: %zu\n"
+      "Samples Skipped At Common Sites: %zu\n"
+      "Samples Over Guard Budget: %zu\n"
       "Total Slots Used Once: %zu / %zu\n"
+      "Reserved Address Space: %zu bytes\n"
+      "Pool Metadata: %zu bytes\n"
       "Allocation Count When All Slots Used Once: %zu\n"
       "PARAMETER tcmalloc_guarded_sample_parameter %d\n"
       // TODO(b/263387812): remove when experiment is finished
       "PARAMETER tcmalloc_improved_guarded_sampling %d\n",
-      num_allocation_requests_ - num_failed_allocations_,
-      num_failed_allocations_, num_alloced_pages_,
-      total_pages_ - num_alloced_pages_, num_alloced_pages_max_,
-      max_alloced_pages_, tc_globals.stacktrace_filter().max_slots_used(),
-      tc_globals.stacktrace_filter().replacement_inserts(), total_pages_used_,
-      total_pages_, alloced_page_count_when_all_used_once_, GetChainedRate(),
-      Parameters::improved_guarded_sampling());
+      tc_globals.stacktrace_filter().max_slots_used(),
+      tc_globals.stacktrace_filter().replacement_inserts(),
+      policy.sites_guarded(), policy.guards_per_window(),
+      policy.common_sites_skipped(), policy.budget_exhausted(),
+      total_pages_used_.load(std::memory_order_relaxed), total_pages_,
+      reserved_bytes(), metadata_bytes(),
+      alloced_page_count_when_all_used_once_.load(std::memory_order_relaxed),
+      GetChainedRate(), Parameters::improved_guarded_sampling());
 }
 
 void GuardedPageAllocator::PrintInPbtxt(PbtxtRegion* gwp_asan) {
   AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  const size_t num_allocation_requests =
+      num_allocation_requests_.load(std::memory_order_relaxed);
+  const size_t num_failed_allocations =
+      num_failed_allocations_.load(std::memory_order_relaxed);
+  const size_t num_alloced_pages =
+      num_alloced_pages_.load(std::memory_order_relaxed);
   gwp_asan->PrintI64("successful_allocations",
-                     num_allocation_requests_ - num_failed_allocations_);
-  gwp_asan->PrintI64("failed_allocations", num_failed_allocations_);
-  gwp_asan->PrintI64("current_slots_allocated", num_alloced_pages_);
+                     num_allocation_requests - num_failed_allocations);
+  gwp_asan->PrintI64("failed_allocations", num_failed_allocations);
+  gwp_asan->PrintI64("current_slots_allocated", num_alloced_pages);
   gwp_asan->PrintI64("current_slots_quarantined",
-                     total_pages_ - num_alloced_pages_);
-  gwp_asan->PrintI64("max_slots_allocated", num_alloced_pages_max_);
+                     total_pages_ - num_alloced_pages);
+  gwp_asan->PrintI64("max_slots_allocated",
+                     num_alloced_pages_max_.load(std::memory_order_relaxed));
   gwp_asan->PrintI64("allocated_slot_limit", max_alloced_pages_);
+  const size_t num_large_allocation_requests =
+      num_large_allocation_requests_.load(std::memory_order_relaxed);
+  const size_t num_failed_large_allocations =
+      num_failed_large_allocations_.load(std::memory_order_relaxed);
+  const size_t num_alloced_large_slots =
+      num_alloced_large_slots_.load(std::memory_order_relaxed);
+  gwp_asan->PrintI64(
+      "large_successful_allocations",
+      num_large_allocation_requests - num_failed_large_allocations);
+  gwp_asan->PrintI64("large_failed_allocations", num_failed_large_allocations);
+  gwp_asan->PrintI64("large_current_slots_allocated", num_alloced_large_slots);
+  gwp_asan->PrintI64("large_current_slots_quarantined",
+                     kLargeSlots - num_alloced_large_slots);
+  gwp_asan->PrintI64("large_allocated_slot_limit", kLargeSlots / 2);
+  {
+    PbtxtRegion protection = gwp_asan->CreateSubRegion("protection");
+    protection_.PrintInPbtxt(&protection);
+  }
   gwp_asan->PrintI64("stack_trace_filter_max_slots_used",
                      tc_globals.stacktrace_filter().max_slots_used());
   gwp_asan->PrintI64("stack_trace_filter_replacement_inserts",
                      tc_globals.stacktrace_filter().replacement_inserts());
-  gwp_asan->PrintI64("total_pages_used", total_pages_used_);
+  const GuardedSamplingPolicy& policy = tc_globals.guarded_sampling_policy();
+  gwp_asan->PrintI64("distinct_sites_guarded", policy.sites_guarded());
+  gwp_asan->PrintI64("guards_per_window", policy.guards_per_window());
+  gwp_asan->PrintI64("common_site_samples_skipped",
+                     policy.common_sites_skipped());
+  gwp_asan->PrintI64("samples_over_guard_budget", policy.budget_exhausted());
+  gwp_asan->PrintI64("total_pages_used",
+                     total_pages_used_.load(std::memory_order_relaxed));
   gwp_asan->PrintI64("total_pages", total_pages_);
-  gwp_asan->PrintI64("alloced_page_count_when_all_used_once",
-                     alloced_page_count_when_all_used_once_);
+  gwp_asan->PrintI64("reserved_bytes", reserved_bytes());
+  gwp_asan->PrintI64("metadata_bytes", metadata_bytes());
+  gwp_asan->PrintI64(
+      "alloced_page_count_when_all_used_once",
+      alloced_page_count_when_all_used_once_.load(std::memory_order_relaxed));
   gwp_asan->PrintI64("tcmalloc_guarded_sample_parameter", GetChainedRate());
   // TODO(b/263387812): remove when experiment is finished
   gwp_asan->PrintI64("tcmalloc_improved_guarded_sampling",
                      Parameters::improved_guarded_sampling());
 }
 
-size_t GuardedPageAllocator::SuccessfulAllocations() {
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  ASSERT(num_allocation_requests_ >= num_failed_allocations_);
-  return num_allocation_requests_ - num_failed_allocations_;
+size_t GuardedPageAllocator::SuccessfulAllocations() const {
+  // Load the failures first: each one is preceded by its request.
+  const size_t num_failed_allocations =
+      num_failed_allocations_.load(std::memory_order_acquire) +
+      num_failed_large_allocations_.load(std::memory_order_acquire);
+  const size_t num_allocation_requests =
+      num_allocation_requests_.load(std::memory_order_acquire) +
+      num_large_allocation_requests_.load(std::memory_order_acquire);
+  ASSERT(num_allocation_requests >= num_failed_allocations);
+  return num_allocation_requests - num_failed_allocations;
 }
 
-// Maps 2 * total_pages_ + 1 pages so that there are total_pages_ unique pages
-// we can return from Allocate with guard pages before and after them.
-void GuardedPageAllocator::MapPages() {
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+// Reserves 2 * total_pages_ + 1 pages so that there are total_pages_ unique
+// pages we can return from Allocate with guard pages before and after them,
+// followed by kLargeSlots large slots that are each followed by a guard page.
+// The pages stay PROT_NONE until a slot is allocated.
+bool GuardedPageAllocator::ReservePages() {
   ASSERT(!first_page_addr_);
   ASSERT(page_size_ % GetPageSize() == 0);
-  size_t len = (2 * total_pages_ + 1) * page_size_;
-  auto base_addr = reinterpret_cast<uintptr_t>(
-      MmapAligned(len, page_size_, MemoryTag::kSampled));
-  ASSERT(base_addr);
-  if (!base_addr) return;
+  static_assert(kLargeSlots <= 256, "Large slots are stored as uint8_t");
+  ASSERT(kMaxLargeAllocationSize % page_size_ == 0);
+  const size_t small_len = (2 * total_pages_ + 1) * page_size_;
+  size_t len =
+      small_len + kLargeSlots * (kMaxLargeAllocationSize + page_size_);
+
+  PageProtectionEngine::Options options;
+  options.name = "GWP-ASan";
+  options.reservation_bytes = len;
+  options.alignment = page_size_;
+  options.tag = MemoryTag::kSampled;
+  // The guard pages between adjacent slots are always inaccessible, so a run
+  // of adjacent slots can be protected with a single call.
+  options.coalesce_gap = page_size_;
+  options.batch_size = deallocation_batch_size_;
+  options.owner = this;
+  options.release = [](void* owner, uint32_t slot) {
+    static_cast<GuardedPageAllocator*>(owner)->FreeSlot(slot);
+  };
+  if (!protection_.Init(options)) {
+    ASSERT(false && "Failed to reserve the guarded page pool.");
+    return false;
+  }
+
+  large_base_addr_ = protection_.base() + small_len;
+
+  // Align first page to page_size_.
+  first_page_addr_ = GetPageAddr(protection_.base() + page_size_);
+  return true;
+}
+
+bool GuardedPageAllocator::BackPool() {
+  AllocationGuardSpinLockHolder ph(&pageheap_lock);
+  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  // Another thread may have backed the pool while we waited for the locks.
+  if (pool_backed_.load(std::memory_order_relaxed)) return true;
+  if (!initialized_.load(std::memory_order_relaxed)) return false;
+  if (!ReservePages()) return false;
 
   // Tell TCMalloc's PageMap about the memory we own.
-  const PageId page = PageIdContaining(reinterpret_cast<void*>(base_addr));
-  const Length page_len = BytesToLengthFloor(len);
+  const PageId page =
+      PageIdContaining(reinterpret_cast<void*>(protection_.base()));
+  const Length page_len = BytesToLengthFloor(reserved_bytes());
   if (!tc_globals.pagemap().Ensure(page, page_len)) {
     ASSERT(false && "Failed to notify page map of page-guarded memory.");
-    return;
+    return false;
   }
 
   // Allocate memory for slot metadata.
+  size_t metadata_bytes = sizeof(*data_) * total_pages_;
   data_ = reinterpret_cast<SlotMetadata*>(
       tc_globals.arena().Alloc(sizeof(*data_) * total_pages_));
   for (size_t i = 0; i < total_pages_; ++i) {
     new (&data_[i]) SlotMetadata;
   }
+  metadata_bytes += sizeof(*large_data_) * kLargeSlots;
+  large_data_ = reinterpret_cast<SlotMetadata*>(
+      tc_globals.arena().Alloc(sizeof(*large_data_) * kLargeSlots));
+  for (size_t i = 0; i < kLargeSlots; ++i) {
+    new (&large_data_[i]) SlotMetadata;
+    large_free_slots_[i] = i;
+  }
+  large_free_head_ = 0;
+  num_free_large_slots_ = kLargeSlots;
+
+  // Allocate the free slot bitmap, with every slot free.
+  const size_t num_words = (total_pages_ + 63) / 64;
+  const size_t num_summary_words = (num_words + 63) / 64;
+  metadata_bytes += sizeof(*free_slots_) * num_words;
+  free_slots_ = reinterpret_cast<std::atomic<uint64_t>*>(
+      tc_globals.arena().Alloc(sizeof(*free_slots_) * num_words));
+  for (size_t i = 0; i < num_words; ++i) {
+    const size_t bits = std::min<size_t>(total_pages_ - 64 * i, 64);
+    new (&free_slots_[i])
+        std::atomic<uint64_t>(bits == 64 ? ~uint64_t{0}
+                                         : (uint64_t{1} << bits) - 1);
+  }
+  metadata_bytes += sizeof(*free_slot_words_) * num_summary_words;
+  free_slot_words_ = reinterpret_cast<std::atomic<uint64_t>*>(
+      tc_globals.arena().Alloc(sizeof(*free_slot_words_) * num_summary_words));
+  for (size_t i = 0; i < num_summary_words; ++i) {
+    const size_t bits = std::min<size_t>(num_words - 64 * i, 64);
+    new (&free_slot_words_[i])
+        std::atomic<uint64_t>(bits == 64 ? ~uint64_t{0}
+                                         : (uint64_t{1} << bits) - 1);
+  }
 
-  pages_base_addr_ = base_addr;
-  pages_end_addr_ = pages_base_addr_ + len;
-
-  // Align first page to page_size_.
-  first_page_addr_ = GetPageAddr(pages_base_addr_ + page_size_);
-
-  std::fill_n(free_pages_, total_pages_, true);
-  initialized_ = true;
+  metadata_bytes_.store(metadata_bytes, std::memory_order_relaxed);
+  pool_backed_.store(true, std::memory_order_release);
+  return true;
 }
 
-// Selects a random slot in O(total_pages_) time.
+// Selects a random slot, unless deallocations are batched.  Contention is
+// limited to the words of free_slots_ that allocations happen to pick, and a
+// search skips 64 exhausted words with each word of free_slot_words_ it reads.
 ssize_t GuardedPageAllocator::ReserveFreeSlot() {
-  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-  if (!initialized_ || !allow_allocations_) return -1;
-  num_allocation_requests_++;
-  if (num_alloced_pages_ == max_alloced_pages_) {
-    num_failed_allocations_++;
+  if (!initialized_.load(std::memory_order_acquire) ||
+      !allow_allocations_.load(std::memory_order_acquire)) {
+    return -1;
+  }
+  if (!pool_backed_.load(std::memory_order_acquire) && !BackPool()) {
     return -1;
   }
+  num_allocation_requests_.fetch_add(1, std::memory_order_release);
+
+  size_t num_alloced_pages = num_alloced_pages_.load(std::memory_order_relaxed);
+  for (;;) {
+    if (num_alloced_pages >= max_alloced_pages_) {
+      // Slots queued for protection count as allocated.  Rather than fail,
+      // protect them now.
+      if (FlushPendingDeallocations()) {
+        num_alloced_pages = num_alloced_pages_.load(std::memory_order_relaxed);
+        continue;
+      }
+      num_failed_allocations_.fetch_add(1, std::memory_order_release);
+      return -1;
+    }
+    if (num_alloced_pages_.compare_exchange_weak(
+            num_alloced_pages, num_alloced_pages + 1, std::memory_order_acquire,
+            std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  ++num_alloced_pages;
+  size_t max = num_alloced_pages_max_.load(std::memory_order_relaxed);
+  while (max < num_alloced_pages &&
+         !num_alloced_pages_max_.compare_exchange_weak(
+             max, num_alloced_pages, std::memory_order_relaxed)) {
+  }
 
-  rand_ = ExponentialBiased::NextRandom(rand_);
-  size_t num_free_pages = total_pages_ - num_alloced_pages_;
-  size_t slot = GetIthFreeSlot(rand_ % num_free_pages);
-  ASSERT(free_pages_[slot]);
-  free_pages_[slot] = false;
-  num_alloced_pages_++;
-  num_alloced_pages_max_ = std::max(num_alloced_pages_, num_alloced_pages_max_);
+  ssize_t slot;
+  if (protection_.batch_size() > 1) {
+    // Take slots in address order, so that slots that are allocated together,
+    // and often freed together, can be protected in one call.
+    const size_t next = next_slot_.load(std::memory_order_relaxed);
+    slot = TakeFreeSlot(next / 64, next % 64);
+    if (slot >= 0) {
+      next_slot_.store((slot + 1) % total_pages_, std::memory_order_relaxed);
+    }
+  } else {
+    const uint64_t rand =
+        ExponentialBiased::NextRandom(rand_.load(std::memory_order_relaxed));
+    rand_.store(rand, std::memory_order_relaxed);
+    // The low bits of the generator have short periods, so use the high ones.
+    const size_t num_words = (total_pages_ + 63) / 64;
+    slot = TakeFreeSlot((rand >> 16) % num_words, (rand >> 42) % 64);
+  }
+  if (slot < 0) {
+    // Give the reservation back; the allocation falls back to an unguarded
+    // one.
+    num_alloced_pages_.fetch_sub(1, std::memory_order_release);
+    num_failed_allocations_.fetch_add(1, std::memory_order_release);
+  }
   return slot;
 }
 
-size_t GuardedPageAllocator::GetIthFreeSlot(size_t ith_free_slot) {
-  ASSERT(ith_free_slot < total_pages_ - num_alloced_pages_);
-  for (size_t free_slot_count = 0, j = 0;; j++) {
-    if (free_pages_[j]) {
-      if (free_slot_count == ith_free_slot) return j;
-      free_slot_count++;
+ssize_t GuardedPageAllocator::TakeFreeSlot(size_t start, int bit_offset) {
+  const size_t num_words = (total_pages_ + 63) / 64;
+  const size_t num_summary_words = (num_words + 63) / 64;
+
+  // We hold a reservation in num_alloced_pages_, so a free slot exists.  It
+  // may briefly be missing from free_slot_words_ while another thread updates
+  // it, in which case we search again, a bounded number of times.
+  for (int search = 0; search < kMaxSlotSearches; ++search) {
+    // The first summary word is visited twice: from the starting word on, and
+    // in full after wrapping around.
+    for (size_t n = 0; n <= num_summary_words; ++n) {
+      const size_t i = (start / 64 + n) % num_summary_words;
+      uint64_t words = free_slot_words_[i].load(std::memory_order_acquire);
+      if (n == 0) {
+        words &= ~uint64_t{0} << (start % 64);
+      }
+      while (words != 0) {
+        const size_t word = 64 * i + absl::countr_zero(words);
+        words &= words - 1;
+        const ssize_t slot = TryTakeFromWord(word, bit_offset);
+        if (slot >= 0) return slot;
+      }
+    }
+  }
+  return -1;
+}
+
+ssize_t GuardedPageAllocator::TryTakeFromWord(size_t word, int bit_offset) {
+  std::atomic<uint64_t>& bits = free_slots_[word];
+  std::atomic<uint64_t>& summary = free_slot_words_[word / 64];
+  const uint64_t summary_bit = uint64_t{1} << (word % 64);
+  uint64_t old_bits = bits.load(std::memory_order_relaxed);
+  while (old_bits != 0) {
+    const int bit =
+        (absl::countr_zero(absl::rotr(old_bits, bit_offset)) + bit_offset) % 64;
+    const uint64_t new_bits = old_bits & ~(uint64_t{1} << bit);
+    if (!bits.compare_exchange_weak(old_bits, new_bits,
+                                    std::memory_order_acquire,
+                                    std::memory_order_relaxed)) {
+      continue;
     }
+    if (new_bits == 0) {
+      // We took the last free slot of the word.  FreeSlot sets the summary bit
+      // after the slot's bit, so check for slots freed in the meantime after
+      // clearing it.
+      summary.fetch_and(~summary_bit, std::memory_order_acq_rel);
+      if (bits.load(std::memory_order_acquire) != 0) {
+        summary.fetch_or(summary_bit, std::memory_order_release);
+      }
+    }
+    return 64 * word + bit;
   }
+  return -1;
 }
 
 void GuardedPageAllocator::FreeSlot(size_t slot) {
   ASSERT(slot < total_pages_);
-  ASSERT(!free_pages_[slot]);
-  free_pages_[slot] = true;
-  num_alloced_pages_--;
+  const size_t word = slot / 64;
+  const uint64_t bit = uint64_t{1} << (slot % 64);
+  const uint64_t old_bits =
+      free_slots_[word].fetch_or(bit, std::memory_order_release);
+  ASSERT(!(old_bits & bit));
+  if (old_bits == 0) {
+    free_slot_words_[word / 64].fetch_or(uint64_t{1} << (word % 64),
+                                         std::memory_order_release);
+  }
+  num_alloced_pages_.fetch_sub(1, std::memory_order_release);
+}
+
+// Large slots are reused in the order they were freed, which keeps each freed
+// slot in quarantine for as long as possible.
+ssize_t GuardedPageAllocator::ReserveFreeLargeSlot() {
+  if (!initialized_.load(std::memory_order_acquire) ||
+      !allow_allocations_.load(std::memory_order_acquire)) {
+    return -1;
+  }
+  if (!pool_backed_.load(std::memory_order_acquire) && !BackPool()) {
+    return -1;
+  }
+  num_large_allocation_requests_.fetch_add(1, std::memory_order_release);
+
+  AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+  if (num_alloced_large_slots_.load(std::memory_order_relaxed) >=
+      kLargeSlots / 2) {
+    num_failed_large_allocations_.fetch_add(1, std::memory_order_release);
+    return -1;
+  }
+  ASSERT(num_free_large_slots_ > 0);
+  const size_t slot = large_free_slots_[large_free_head_];
+  large_free_head_ = (large_free_head_ + 1) % kLargeSlots;
+  --num_free_large_slots_;
+  ASSERT(!large_slot_alloced_[slot]);
+  large_slot_alloced_[slot] = true;
+  num_alloced_large_slots_.fetch_add(1, std::memory_order_relaxed);
+  return slot;
+}
+
+void GuardedPageAllocator::FreeLargeSlot(size_t slot) {
+  ASSERT(slot < kLargeSlots);
+  ASSERT(large_slot_alloced_[slot]);
+  ASSERT(num_free_large_slots_ < kLargeSlots);
+  large_free_slots_[(large_free_head_ + num_free_large_slots_) % kLargeSlots] =
+      slot;
+  ++num_free_large_slots_;
+  large_slot_alloced_[slot] = false;
+  num_alloced_large_slots_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+uintptr_t GuardedPageAllocator::LargeSlotToAddr(size_t slot) const {
+  ASSERT(slot < kLargeSlots);
+  return large_base_addr_ + slot * (kMaxLargeAllocationSize + page_size_);
+}
+
+size_t GuardedPageAllocator::GetNearestLargeSlot(uintptr_t addr) const {
+  ASSERT(IsLarge(addr));
+  return std::min((addr - large_base_addr_) /
+                      (kMaxLargeAllocationSize + page_size_),
+                  kLargeSlots - 1);
+}
+
+GuardedPageAllocator::SlotMetadata& GuardedPageAllocator::GetNearestMetadata(
+    uintptr_t addr) const {
+  if (IsLarge(addr)) return large_data_[GetNearestLargeSlot(addr)];
+  return data_[GetNearestSlot(addr)];
 }
 
 uintptr_t GuardedPageAllocator::GetPageAddr(uintptr_t addr) const {
@@ -353,16 +773,21 @@ size_t GuardedPageAllocator::GetNearestSlot(uintptr_t addr) const {
 }
 
 bool GuardedPageAllocator::IsFreed(size_t slot) const {
-  return free_pages_[slot];
+  return free_slots_[slot / 64].load(std::memory_order_relaxed) &
+         (uint64_t{1} << (slot % 64));
 }
 
 bool GuardedPageAllocator::WriteOverflowOccurred(size_t slot) const {
   if (!ShouldRightAlign(slot)) return false;
-  uint8_t magic = GetWriteOverflowMagic(slot);
-  uintptr_t alloc_end =
-      data_[slot].allocation_start + data_[slot].requested_size;
-  uintptr_t page_end = SlotToAddr(slot) + page_size_;
-  uintptr_t magic_end = std::min(page_end, alloc_end + kMagicSize);
+  return MagicOverwritten(data_[slot], SlotToAddr(slot) + page_size_,
+                          GetWriteOverflowMagic(slot));
+}
+
+bool GuardedPageAllocator::MagicOverwritten(const SlotMetadata& d,
+                                            uintptr_t slot_end,
+                                            uint8_t magic) {
+  uintptr_t alloc_end = d.allocation_start + d.requested_size;
+  uintptr_t magic_end = std::min(slot_end, alloc_end + kMagicSize);
   for (uintptr_t p = alloc_end; p < magic_end; ++p) {
     if (*reinterpret_cast<uint8_t*>(p) != magic) return true;
   }
@@ -372,8 +797,10 @@ bool GuardedPageAllocator::WriteOverflowOccurred(size_t slot) const {
 GuardedAllocationsErrorType GuardedPageAllocator::GetErrorType(
     uintptr_t addr, const SlotMetadata& d) const {
   if (!d.allocation_start) return GuardedAllocationsErrorType::kUnknown;
-  if (double_free_detected_) return GuardedAllocationsErrorType::kDoubleFree;
-  if (write_overflow_detected_)
+  if (double_free_detected_.load(std::memory_order_relaxed)) {
+    return GuardedAllocationsErrorType::kDoubleFree;
+  }
+  if (write_overflow_detected_.load(std::memory_order_relaxed))
     return GuardedAllocationsErrorType::kBufferOverflowOnDealloc;
   if (d.dealloc_trace.depth > 0) {
     return GuardedAllocationsErrorType::kUseAfterFree;
@@ -404,8 +831,19 @@ size_t GuardedPageAllocator::AddrToSlot(uintptr_t addr) const {
 void GuardedPageAllocator::MaybeRightAlign(size_t slot, size_t size,
                                            size_t alignment, void** ptr) {
   if (!ShouldRightAlign(slot)) return;
-  uintptr_t adjusted_ptr =
-      reinterpret_cast<uintptr_t>(*ptr) + page_size_ - size;
+  const uintptr_t page_end = reinterpret_cast<uintptr_t>(*ptr) + page_size_;
+  uintptr_t adjusted_ptr = RightAlign(page_end, size, alignment);
+
+  // Write magic bytes in alignment padding to detect small overflow writes.
+  size_t magic_size = std::min(page_end - adjusted_ptr - size, kMagicSize);
+  memset(reinterpret_cast<void*>(adjusted_ptr + size),
+         GetWriteOverflowMagic(slot), magic_size);
+  *ptr = reinterpret_cast<void*>(adjusted_ptr);
+}
+
+uintptr_t GuardedPageAllocator::RightAlign(uintptr_t end, size_t size,
+                                           size_t alignment) {
+  uintptr_t adjusted_ptr = end - size;
 
   // If alignment == 0, the necessary alignment is never larger than the size
   // rounded up to the next power of 2.  We use this fact to minimize alignment
@@ -420,14 +858,7 @@ void GuardedPageAllocator::MaybeRightAlign(size_t slot, size_t size,
 
   // Ensure valid alignment.
   alignment = std::max(alignment, default_alignment);
-  uintptr_t alignment_padding = adjusted_ptr & (alignment - 1);
-  adjusted_ptr -= alignment_padding;
-
-  // Write magic bytes in alignment padding to detect small overflow writes.
-  size_t magic_size = std::min(alignment_padding, kMagicSize);
-  memset(reinterpret_cast<void*>(adjusted_ptr + size),
-         GetWriteOverflowMagic(slot), magic_size);
-  *ptr = reinterpret_cast<void*>(adjusted_ptr);
+  return adjusted_ptr & ~(alignment - 1);
 }
 
 }  // namespace tcmalloc_internal
@@ -15,6 +15,7 @@
 #ifndef TCMALLOC_GUARDED_PAGE_ALLOCATOR_H_
 #define TCMALLOC_GUARDED_PAGE_ALLOCATOR_H_
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <utility>
@@ -27,6 +28,7 @@
 #include "tcmalloc/guarded_allocations.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_protection_engine.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -39,9 +41,31 @@ namespace tcmalloc_internal {
 // and any future accesses to it will also cause segfaults until the page is
 // reallocated.
 //
+// Allocations larger than a page are served from a separate set of
+// kLargeSlots slots of up to kMaxLargeAllocationSize bytes each, which follow
+// the single-page slots in the same mapping.  Large allocations are always
+// right-aligned against the guard page that trails their slot.  When one is
+// freed, its pages are unmapped and the slot is quarantined: freed large slots
+// are reused in FIFO order, and at most half of them are allocated at a time.
+//
+// Init() only records the pool size.  The pool's address space, the slot
+// metadata, the free slot bitmaps and the page map entries for the pool are
+// set up when the first slot is reserved, and each slot's pages are only backed
+// once it is allocated, so processes that never guard an allocation pay for
+// none of it, and the pool can be resized until then.
+//
+// The pool's address space and the protection of its pages are managed by a
+// PageProtectionEngine.  Protecting a page on deallocation costs a system call
+// and a TLB shootdown, so Init() can instead have the engine queue deallocated
+// slots and protect them in batches, one mprotect per run of adjacent slots.
+// Queued slots are not reused until their batch is protected, but accesses to
+// them are not detected meanwhile.
+//
 // Is safe to use with static storage duration and is thread safe with the
 // exception of calls to Init() and Destroy() (see corresponding function
-// comments).
+// comments).  Allocate() and Deallocate() do not take a lock: free slots are
+// tracked in a two-level bitmap of atomic words, so the pool can hold tens of
+// thousands of slots.  The few large slots are managed under a lock.
 //
 // Example:
 //   ABSL_CONST_INIT GuardedPageAllocator gpa;
@@ -58,7 +82,7 @@ namespace tcmalloc_internal {
 //
 //   int main() {
 //     // Call Init() only once.
-//     gpa.Init(64, GuardedPageAllocator::kGpaMaxPages);
+//     gpa.Init(64, 128, 1);
 //     gpa.AllowAllocations();
 //     for (int i = 0; i < 1000; i++) foo();
 //     return 0;
@@ -66,27 +90,49 @@ namespace tcmalloc_internal {
 class GuardedPageAllocator {
  public:
   // Maximum number of pages this class can allocate.
-  static constexpr size_t kGpaMaxPages = 512;
+  static constexpr size_t kGpaMaxPages = 1 << 16;
+
+  // Largest allocation that can be guarded.
+  static constexpr size_t kMaxLargeAllocationSize = 1 << 20;
+
+  // Number of slots for allocations larger than a page.
+  static constexpr size_t kLargeSlots = 16;
+
+  // Maximum number of deallocations protected together.
+  static constexpr size_t kMaxDeallocationBatch =
+      PageProtectionEngine::kMaxBatch;
 
   constexpr GuardedPageAllocator()
       : guarded_page_lock_(absl::kConstInit,
                            absl::base_internal::SCHEDULE_KERNEL_ONLY),
-        free_pages_{},
+        free_slots_(nullptr),
+        free_slot_words_(nullptr),
         num_alloced_pages_(0),
         num_alloced_pages_max_(0),
         num_allocation_requests_(0),
         num_failed_allocations_(0),
         data_(nullptr),
-        pages_base_addr_(0),
-        pages_end_addr_(0),
+        large_data_(nullptr),
+        large_free_slots_{},
+        large_free_head_(0),
+        num_free_large_slots_(0),
+        large_slot_alloced_{},
+        num_alloced_large_slots_(0),
+        num_large_allocation_requests_(0),
+        num_failed_large_allocations_(0),
+        large_base_addr_(0),
+        next_slot_(0),
         first_page_addr_(0),
         max_alloced_pages_(0),
         total_pages_(0),
+        deallocation_batch_size_(1),
         total_pages_used_(0),
         alloced_page_count_when_all_used_once_(0),
         page_size_(0),
         rand_(0),
         initialized_(false),
+        pool_backed_(false),
+        metadata_bytes_(0),
         allow_allocations_(false),
         double_free_detected_(false),
         write_overflow_detected_(false) {}
@@ -100,13 +146,35 @@ class GuardedPageAllocator {
   // time from a pool of total_pages pages, where:
   //   1 <= max_alloced_pages <= total_pages <= kGpaMaxPages
   //
+  // Deallocated pages are protected in batches of deallocation_batch_size,
+  // where 1 <= deallocation_batch_size <= kMaxDeallocationBatch.  1 protects
+  // each page as soon as it is deallocated.
+  //
+  // Once the pool is first used, each page of the pool costs two pages of
+  // address space (for the page and its guard page) and one SlotMetadata.
+  // The large slots cost a further kLargeSlots * (kMaxLargeAllocationSize +
+  // page_size_) bytes of address space.
+  //
   // This method should be called non-concurrently and only once to complete
   // initialization.  Dynamic initialization is deliberately done here and not
   // in the constructor, thereby allowing the constructor to be constexpr and
   // avoiding static initialization order issues.
-  void Init(size_t max_alloced_pages, size_t total_pages)
+  void Init(size_t max_alloced_pages, size_t total_pages,
+            size_t deallocation_batch_size)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
 
+  // Changes the pool size given to Init(), with the same constraints.  Returns
+  // false, leaving the pool unchanged, if the arguments are out of range or
+  // the pool has already been used, since it is mapped at its first use.
+  bool SetPoolSize(size_t max_alloced_pages, size_t total_pages)
+      ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+
+  // Returns the number of pages in the pool.
+  size_t pool_size() const ABSL_LOCKS_EXCLUDED(guarded_page_lock_) {
+    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
+    return total_pages_;
+  }
+
   // Unmaps memory allocated by this class.
   //
   // This method should be called non-concurrently and only once to complete
@@ -121,19 +189,24 @@ class GuardedPageAllocator {
   // member is set to GuardedStatus::Guarded.  On failure, returns an instance
   // of GuardedAllocWithStatus (the 'alloc' member is set to 'nullptr').
   // Failure can occur if memory could not be mapped or protected, if all
-  // guarded pages are already allocated, or if size is 0.  These conditions are
-  // reflected in the 'status' member of the GuardedAllocWithStatus return
-  // value.
+  // guarded pages are already allocated, if size is 0 or if size is larger than
+  // kMaxLargeAllocationSize.  These conditions are reflected in the 'status'
+  // member of the GuardedAllocWithStatus return value.
   //
-  // Precondition:  size and alignment <= page_size_
+  // Precondition:  alignment <= page_size_
   // Precondition:  alignment is 0 or a power of 2
   GuardedAllocWithStatus Allocate(size_t size, size_t alignment)
       ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
 
   // Deallocates memory pointed to by ptr.  ptr must have been previously
-  // returned by a call to Allocate.
+  // returned by a call to Allocate.  May make system calls, so should not be
+  // called with pageheap_lock held.
   void Deallocate(void* ptr) ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
 
+  // Protects the pages of all queued deallocations and makes their slots
+  // available again.  Returns false if there were none.
+  bool FlushPendingDeallocations() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+
   // Returns the size requested when ptr was allocated.  ptr must have been
   // previously returned by a call to Allocate.
   size_t GetRequestedSize(const void* ptr) const;
@@ -142,13 +215,28 @@ class GuardedPageAllocator {
   // allocation's size.
   std::pair<off_t, size_t> GetAllocationOffsetAndSize(const void* ptr) const;
 
+  // Describes the slot nearest to ptr, for crash reports.
+  struct SlotInfo {
+    uintptr_t slot_start;
+    size_t slot_size;
+    size_t slot_index;
+    bool large;
+    uintptr_t allocation_start;
+    size_t requested_size;
+  };
+
+  // Returns the slot nearest to ptr and its most recent allocation.  Requires
+  // that ptr points to memory mapped by this class.
+  SlotInfo GetSlotInfo(const void* ptr) const;
+
   // Records stack traces in alloc_trace and dealloc_trace for the page nearest
   // to ptr.  alloc_trace is the trace at the time the page was allocated.  If
   // the page is still allocated, dealloc_trace->depth will be 0. If the page
   // has been deallocated, dealloc_trace is the trace at the time the page was
   // deallocated.
   //
-  // Returns the likely error type for an access at ptr.
+  // Returns the likely error type for an access at ptr, or kUnknown (leaving
+  // the traces unset) if nothing was ever allocated from the pool.
   //
   // Requires that ptr points to memory mapped by this class.
   GuardedAllocationsErrorType GetStackTraces(
@@ -164,27 +252,45 @@ class GuardedPageAllocator {
   // Returns true if ptr points to memory managed by this class.
   inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE
   PointerIsMine(const void* ptr) const {
-    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
-    return pages_base_addr_ <= addr && addr < pages_end_addr_;
+    return protection_.Contains(ptr);
   }
 
   // Allows Allocate() to start returning allocations.
   void AllowAllocations() ABSL_LOCKS_EXCLUDED(guarded_page_lock_) {
     AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    allow_allocations_ = true;
+    allow_allocations_.store(true, std::memory_order_release);
   }
 
   // Returns the number of pages available for allocation, based on how many are
   // currently in use.  (Should only be used in testing.)
-  size_t GetNumAvailablePages() ABSL_LOCKS_EXCLUDED(guarded_page_lock_) {
-    AllocationGuardSpinLockHolder h(&guarded_page_lock_);
-    return max_alloced_pages_ - num_alloced_pages_;
+  size_t GetNumAvailablePages() const {
+    return max_alloced_pages_ -
+           num_alloced_pages_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the number of large slots available for allocation.  (Should only
+  // be used in testing.)
+  size_t GetNumAvailableLargeSlots() const {
+    return kLargeSlots / 2 -
+           num_alloced_large_slots_.load(std::memory_order_relaxed);
   }
 
-  size_t SuccessfulAllocations() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+  // Returns the number of successful allocations, including large ones.
+  size_t SuccessfulAllocations() const;
 
   size_t page_size() const { return page_size_; }
 
+  // Returns the bytes of address space reserved for the pool.
+  size_t reserved_bytes() const {
+    return protection_.end() - protection_.base();
+  }
+
+  // Returns the bytes of metadata allocated for the pool, which is 0 until the
+  // first slot is reserved.
+  size_t metadata_bytes() const {
+    return metadata_bytes_.load(std::memory_order_relaxed);
+  }
+
  private:
   // Structure for storing data about a slot.
   struct SlotMetadata {
@@ -194,25 +300,41 @@ class GuardedPageAllocator {
     uintptr_t allocation_start = 0;
   };
 
+  // Number of times TakeFreeSlot searches the bitmap before giving up.
+  static constexpr int kMaxSlotSearches = 4;
+
   // Max number of magic bytes we use to detect write-overflows at deallocation.
   static constexpr size_t kMagicSize = 32;
 
-  // Maps pages into memory.
-  void MapPages() ABSL_LOCKS_EXCLUDED(guarded_page_lock_)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock);
-
-  // Reserves and returns a slot randomly selected from the free slots in
-  // free_pages_.  Returns -1 if no slots available, or if AllowAllocations()
-  // hasn't been called yet.
-  ssize_t ReserveFreeSlot() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
-
-  // Returns the i-th free slot of free_pages_.  i must be in the range [0,
-  // total_pages_ - num_alloced_pages_).
-  size_t GetIthFreeSlot(size_t i)
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  // Reserves address space for the pool, without access, in protection_.
+  // Returns false on failure.
+  bool ReservePages()
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock, guarded_page_lock_);
+
+  // Reserves the pool, allocates the slot metadata and free slot bitmaps, and
+  // registers the pool in the page map, unless that was already done.
+  // Returns false on failure.
+  bool BackPool() ABSL_LOCKS_EXCLUDED(guarded_page_lock_, pageheap_lock);
+
+  // Reserves and returns a slot selected from the free slots in free_slots_,
+  // randomly or, if deallocations are batched, in address order.  Returns -1
+  // if no slots available, or if AllowAllocations() hasn't been called yet.
+  ssize_t ReserveFreeSlot();
+
+  // Clears and returns a free bit of free_slots_, starting the search at bit
+  // bit_offset of word start.  The caller must already have accounted for the
+  // slot in num_alloced_pages_, which guarantees that one is free.  A free
+  // slot can still be missed while other threads update the bitmap, so
+  // returns -1 after kMaxSlotSearches unsuccessful searches.
+  ssize_t TakeFreeSlot(size_t start, int bit_offset);
+
+  // Tries to clear a free bit of free_slots_[word], preferring the first one
+  // at or after bit_offset.  Returns the slot, or -1 if the word has no free
+  // bits.
+  ssize_t TryTakeFromWord(size_t word, int bit_offset);
 
   // Marks the specified slot as unreserved.
-  void FreeSlot(size_t slot) ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  void FreeSlot(size_t slot);
 
   // Returns the address of the page that addr resides on.
   uintptr_t GetPageAddr(uintptr_t addr) const;
@@ -224,12 +346,45 @@ class GuardedPageAllocator {
   size_t GetNearestSlot(uintptr_t addr) const;
 
   // Returns true if the specified slot has already been freed.
-  bool IsFreed(size_t slot) const
-      ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+  bool IsFreed(size_t slot) const;
 
   // Returns true if magic bytes for slot were overwritten.
   bool WriteOverflowOccurred(size_t slot) const;
 
+  // Returns true if the magic bytes between the end of d's allocation and
+  // slot_end were overwritten.
+  static bool MagicOverwritten(const SlotMetadata& d, uintptr_t slot_end,
+                               uint8_t magic);
+
+  // Allocates size bytes from a large slot.  Called by Allocate for sizes
+  // larger than page_size_.
+  GuardedAllocWithStatus AllocateLarge(size_t size, size_t alignment)
+      ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+
+  // Deallocates ptr, which was returned by AllocateLarge.
+  void DeallocateLarge(void* ptr) ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+
+  // Reserves the large slot that has been free the longest.  Returns -1 if
+  // too many large slots are allocated, or if AllowAllocations() hasn't been
+  // called yet.
+  ssize_t ReserveFreeLargeSlot() ABSL_LOCKS_EXCLUDED(guarded_page_lock_);
+
+  // Appends the specified large slot to the quarantine.
+  void FreeLargeSlot(size_t slot)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(guarded_page_lock_);
+
+  // Returns true if addr is in the large slots' part of the mapping.
+  bool IsLarge(uintptr_t addr) const { return addr >= large_base_addr_; }
+
+  uintptr_t LargeSlotToAddr(size_t slot) const;
+
+  // Returns the large slot nearest to addr.  Since large allocations are
+  // right-aligned, a guard page belongs to the slot it trails.
+  size_t GetNearestLargeSlot(uintptr_t addr) const;
+
+  // Returns the metadata of the slot, large or not, nearest to addr.
+  SlotMetadata& GetNearestMetadata(uintptr_t addr) const;
+
   // Returns the likely error type for the given access address and metadata
   // associated with the nearest slot.
   GuardedAllocationsErrorType GetErrorType(uintptr_t addr,
@@ -249,57 +404,104 @@ class GuardedPageAllocator {
   // bytes are written in any alignment padding.
   void MaybeRightAlign(size_t slot, size_t size, size_t alignment, void** ptr);
 
+  // Returns the highest address at which size bytes with the specified
+  // alignment end at or before end.
+  static uintptr_t RightAlign(uintptr_t end, size_t size, size_t alignment);
+
   uintptr_t SlotToAddr(size_t slot) const;
   size_t AddrToSlot(uintptr_t addr) const;
 
-  absl::base_internal::SpinLock guarded_page_lock_;
+  // Serializes Init(), SetPoolSize(), BackPool(), Destroy() and
+  // AllowAllocations(), and protects the large slots' free list.
+  mutable absl::base_internal::SpinLock guarded_page_lock_;
+
+  // Maps each bit to one page, 64 pages per word.
+  // 1: Free.  0: Reserved.
+  std::atomic<uint64_t>* free_slots_;
 
-  // Maps each bool to one page.
-  // true: Free.  false: Reserved.
-  bool free_pages_[kGpaMaxPages] ABSL_GUARDED_BY(guarded_page_lock_);
+  // Maps each bit to one word of free_slots_.  A clear bit means that the
+  // word is (or is about to become) zero, so that searches can skip it.
+  std::atomic<uint64_t>* free_slot_words_;
 
   // Number of currently-allocated pages.
-  size_t num_alloced_pages_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_alloced_pages_;
 
   // The high-water mark for num_alloced_pages_.
-  size_t num_alloced_pages_max_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_alloced_pages_max_;
 
   // Number of calls to Allocate.
-  size_t num_allocation_requests_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_allocation_requests_;
 
   // Number of times Allocate has failed.
-  size_t num_failed_allocations_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> num_failed_allocations_;
 
   // A dynamically-allocated array of stack trace data captured when each page
   // is allocated/deallocated.  Printed by the SEGV handler when a memory error
   // is detected.
   SlotMetadata* data_;
 
-  uintptr_t pages_base_addr_;  // Points to start of mapped region.
-  uintptr_t pages_end_addr_;   // Points to the end of mapped region.
+  // Like data_, for the large slots.
+  SlotMetadata* large_data_;
+
+  // A ring of the free large slots, in the order they were freed.
+  uint8_t large_free_slots_[kLargeSlots] ABSL_GUARDED_BY(guarded_page_lock_);
+  size_t large_free_head_ ABSL_GUARDED_BY(guarded_page_lock_);
+  size_t num_free_large_slots_ ABSL_GUARDED_BY(guarded_page_lock_);
+  bool large_slot_alloced_[kLargeSlots] ABSL_GUARDED_BY(guarded_page_lock_);
+
+  // Number of currently-allocated large slots.
+  std::atomic<size_t> num_alloced_large_slots_;
+
+  // Number of calls to Allocate for more than a page.
+  std::atomic<size_t> num_large_allocation_requests_;
+
+  // Number of times such calls have failed.
+  std::atomic<size_t> num_failed_large_allocations_;
+
+  uintptr_t large_base_addr_;  // Points to the first large slot.
+
+  // Reserves the pool and protects deallocated slots.  Slots queued for
+  // protection stay reserved in free_slots_ and num_alloced_pages_ until the
+  // engine releases them.
+  PageProtectionEngine protection_;
+
+  // Where the next search for a free slot starts if deallocations are batched.
+  // Like rand_, updated without synchronization.
+  std::atomic<size_t> next_slot_;
   uintptr_t first_page_addr_;  // Points to first page returnable by Allocate.
-  size_t max_alloced_pages_;   // Max number of pages to allocate at once.
-  size_t total_pages_;         // Size of the page pool to allocate from.
+  // The pool size.  Until the pool is backed, SetPoolSize() may change them
+  // under guarded_page_lock_; they are constant afterwards.
+  size_t max_alloced_pages_;  // Max number of pages to allocate at once.
+  size_t total_pages_;        // Size of the page pool to allocate from.
+  // Passed to protection_ when the pool is reserved.
+  size_t deallocation_batch_size_;
   // Number of pages allocated at least once from page pool.
-  size_t total_pages_used_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<size_t> total_pages_used_;
   // The count of allocs when all the pages had been used at least once (i.e.
   // when total_pages_used_ == total_pages_).
-  size_t alloced_page_count_when_all_used_once_
-      ABSL_GUARDED_BY(guarded_page_lock_);
-  size_t page_size_;           // Size of pages we allocate.
-  uint64_t rand_;              // RNG seed.
+  std::atomic<size_t> alloced_page_count_when_all_used_once_;
+  size_t page_size_;  // Size of pages we allocate.
+  // RNG seed.  Updated without synchronization between threads; losing an
+  // update only makes two allocations start their search at the same word.
+  std::atomic<uint64_t> rand_;
 
   // True if this object has been fully initialized.
-  bool initialized_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<bool> initialized_;
+
+  // True once BackPool() has set up the pool.
+  std::atomic<bool> pool_backed_;
+
+  // Bytes allocated by BackPool().
+  std::atomic<size_t> metadata_bytes_;
 
   // Flag to control whether we can return allocations or not.
-  bool allow_allocations_ ABSL_GUARDED_BY(guarded_page_lock_);
+  std::atomic<bool> allow_allocations_;
 
   // Set to true if a double free has occurred.
-  bool double_free_detected_;
+  std::atomic<bool> double_free_detected_;
 
   // Set to true if a write overflow was detected on deallocation.
-  bool write_overflow_detected_;
+  std::atomic<bool> write_overflow_detected_;
 };
 
 }  // namespace tcmalloc_internal
@@ -30,8 +30,6 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 namespace {
 
-static constexpr size_t kMaxGpaPages = GuardedPageAllocator::kGpaMaxPages;
-
 // Size of pages used by GuardedPageAllocator.
 static size_t PageSize() {
   static const size_t page_size =
@@ -39,11 +37,12 @@ static size_t PageSize() {
   return page_size;
 }
 
+template <size_t kNumPages, size_t kDeallocationBatchSize = 1>
 void BM_AllocDealloc(benchmark::State& state) {
   static GuardedPageAllocator* gpa = []() {
     auto gpa = new GuardedPageAllocator;
     AllocationGuardSpinLockHolder h(&pageheap_lock);
-    gpa->Init(kMaxGpaPages, kMaxGpaPages);
+    gpa->Init(kNumPages, kNumPages, kDeallocationBatchSize);
     gpa->AllowAllocations();
     return gpa;
   }();
@@ -57,8 +56,11 @@ void BM_AllocDealloc(benchmark::State& state) {
   }
 }
 
-BENCHMARK(BM_AllocDealloc)->Range(1, PageSize());
-BENCHMARK(BM_AllocDealloc)->Arg(1)->ThreadRange(1, kMaxGpaPages);
+BENCHMARK_TEMPLATE(BM_AllocDealloc, 512)->Range(1, PageSize());
+BENCHMARK_TEMPLATE(BM_AllocDealloc, 512)->Arg(1)->ThreadRange(1, 512);
+BENCHMARK_TEMPLATE(BM_AllocDealloc, 10240)->Arg(1)->ThreadRange(1, 10240);
+BENCHMARK_TEMPLATE(BM_AllocDealloc, 512, 16)->Arg(1)->ThreadRange(1, 512);
+BENCHMARK_TEMPLATE(BM_AllocDealloc, 512, 64)->Arg(1)->ThreadRange(1, 512);
 
 }  // namespace
 }  // namespace tcmalloc_internal
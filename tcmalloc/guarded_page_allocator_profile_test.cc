@@ -15,6 +15,7 @@
 #include <stddef.h>
 
 #include <cmath>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <utility>
@@ -27,6 +28,7 @@
 #include "absl/functional/function_ref.h"
 #include "absl/log/check.h"
 #include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/guarded_page_allocator.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
@@ -101,7 +103,8 @@ class GuardedPageAllocatorProfileTest : public testing::Test {
 }  // namespace
 
 // By placing this class in the tcmalloc_internal namespace, it may call the
-// private method StackTraceFilter::Reset as a friend.
+// private methods StackTraceFilter::Reset and GuardedSamplingPolicy::Reset as
+// a friend.
 class ParameterizedGuardedPageAllocatorProfileTest
     : public GuardedPageAllocatorProfileTest,
       public testing::WithParamInterface<
@@ -112,6 +115,7 @@ class ParameterizedGuardedPageAllocatorProfileTest
       return;
     }
     tc_globals.stacktrace_filter().Reset();
+    tc_globals.guarded_sampling_policy().Reset();
   }
 
   void AllocateAndValidate(bool improved_guarded_sampling_enabled);
@@ -188,7 +192,8 @@ TEST_P(ParameterizedGuardedPageAllocatorProfileTest, LargerThanOnePage) {
   AllocateUntilGuarded();
   auto token = MallocExtension::StartAllocationProfiling();
 
-  constexpr size_t alloc_size = kPageSize + 1;
+  constexpr size_t alloc_size =
+      GuardedPageAllocator::kMaxLargeAllocationSize + 1;
   AllocateUntil(alloc_size, [&](void* alloc) -> NextSteps {
     return {true, true};
   });
@@ -206,6 +211,35 @@ TEST_P(ParameterizedGuardedPageAllocatorProfileTest, LargerThanOnePage) {
                  });
 }
 
+TEST_P(ParameterizedGuardedPageAllocatorProfileTest, LargeAllocation) {
+  ScopedAlwaysSample always_sample;
+  bool improved_guarded_sampling_enabled = GetParam();
+  ScopedImprovedGuardedSampling improved_guarded_sampling(
+      improved_guarded_sampling_enabled);
+  auto token = MallocExtension::StartAllocationProfiling();
+
+  // Allocated by do_malloc_pages, and guarded in a large slot.
+  constexpr size_t alloc_size = 100 * 1024;
+  AllocateUntil(alloc_size, [&](void* alloc) -> NextSteps {
+    if (!Static::guardedpage_allocator().PointerIsMine(alloc)) {
+      return {false, true};
+    }
+    EXPECT_EQ(MallocExtension::GetAllocatedSize(alloc), alloc_size);
+    memset(alloc, 0, alloc_size);
+    return {true, true};
+  });
+
+  auto profile = std::move(token).Stop();
+  ExamineSamples(profile, Profile::Sample::GuardedStatus::Guarded,
+                 [&](const Profile::Sample& s) {
+                   if (s.guarded_status ==
+                       Profile::Sample::GuardedStatus::Guarded) {
+                     EXPECT_EQ(s.requested_size, alloc_size);
+                     EXPECT_EQ(s.allocated_size, alloc_size);
+                   }
+                 });
+}
+
 TEST_P(ParameterizedGuardedPageAllocatorProfileTest, Disabled) {
   ScopedGuardedSamplingRate guarded_sampling_rate(-1);
   ScopedProfileSamplingRate profile_sampling_rate(1);
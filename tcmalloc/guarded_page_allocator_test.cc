@@ -32,7 +32,8 @@ namespace tcmalloc {
 namespace tcmalloc_internal {
 namespace {
 
-static constexpr size_t kMaxGpaPages = GuardedPageAllocator::kGpaMaxPages;
+// Size of the page pool used by most tests.
+static constexpr size_t kMaxGpaPages = 512;
 
 // Size of pages used by GuardedPageAllocator.
 static size_t PageSize() {
@@ -45,13 +46,14 @@ class GuardedPageAllocatorTest : public testing::Test {
  protected:
   GuardedPageAllocatorTest() {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    gpa_.Init(kMaxGpaPages, kMaxGpaPages);
+    gpa_.Init(kMaxGpaPages, kMaxGpaPages, /*deallocation_batch_size=*/1);
     gpa_.AllowAllocations();
   }
 
-  explicit GuardedPageAllocatorTest(size_t num_pages) {
+  explicit GuardedPageAllocatorTest(size_t num_pages,
+                                    size_t deallocation_batch_size = 1) {
     absl::base_internal::SpinLockHolder h(&pageheap_lock);
-    gpa_.Init(num_pages, kMaxGpaPages);
+    gpa_.Init(num_pages, kMaxGpaPages, deallocation_batch_size);
     gpa_.AllowAllocations();
   }
 
@@ -176,6 +178,163 @@ TEST_F(GuardedPageAllocatorTest, PointerIsMine) {
   EXPECT_FALSE(gpa_.PointerIsMine(malloc_ptr.get()));
 }
 
+TEST_F(GuardedPageAllocatorTest, LargeAllocDealloc) {
+  const size_t size = 3 * PageSize() + 5;
+  auto alloc_with_status = gpa_.Allocate(size, 0);
+  EXPECT_EQ(alloc_with_status.status, Profile::Sample::GuardedStatus::Guarded);
+  EXPECT_EQ(gpa_.SuccessfulAllocations(), 1);
+  EXPECT_EQ(gpa_.GetNumAvailableLargeSlots(),
+            GuardedPageAllocator::kLargeSlots / 2 - 1);
+  char* buf = static_cast<char*>(alloc_with_status.alloc);
+  ASSERT_NE(buf, nullptr);
+  EXPECT_TRUE(gpa_.PointerIsMine(buf));
+  EXPECT_EQ(gpa_.GetRequestedSize(buf), size);
+  memset(buf, 'A', size);
+  // The allocation is right-aligned, with less than 16 bytes of padding
+  // before the trailing guard page.
+  EXPECT_DEATH(buf[size + 16] = 'A', "");
+  EXPECT_DEATH(buf[-static_cast<ssize_t>(PageSize())] = 'A', "");
+  gpa_.Deallocate(buf);
+  EXPECT_EQ(gpa_.GetNumAvailableLargeSlots(),
+            GuardedPageAllocator::kLargeSlots / 2);
+  EXPECT_DEATH(buf[0] = 'B', "");
+  EXPECT_DEATH(buf[size - 1] = 'B', "");
+  EXPECT_DEATH(gpa_.Deallocate(buf), "");
+}
+
+TEST_F(GuardedPageAllocatorTest, LargeAllocLimits) {
+  EXPECT_EQ(
+      gpa_.Allocate(GuardedPageAllocator::kMaxLargeAllocationSize + 1, 0)
+          .status,
+      Profile::Sample::GuardedStatus::LargerThanOnePage);
+
+  std::vector<void*> ptrs;
+  for (size_t i = 0; i < GuardedPageAllocator::kLargeSlots / 2; ++i) {
+    auto alloc_with_status =
+        gpa_.Allocate(GuardedPageAllocator::kMaxLargeAllocationSize, PageSize());
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(alloc_with_status.alloc) % PageSize(),
+              0);
+    memset(alloc_with_status.alloc, 'A',
+           GuardedPageAllocator::kMaxLargeAllocationSize);
+    ptrs.push_back(alloc_with_status.alloc);
+  }
+  EXPECT_EQ(gpa_.Allocate(2 * PageSize(), 0).status,
+            Profile::Sample::GuardedStatus::NoAvailableSlots);
+  // Single-page slots are not affected.
+  auto small = gpa_.Allocate(PageSize(), 0);
+  EXPECT_EQ(small.status, Profile::Sample::GuardedStatus::Guarded);
+  gpa_.Deallocate(small.alloc);
+
+  for (void* ptr : ptrs) {
+    gpa_.Deallocate(ptr);
+  }
+  EXPECT_EQ(gpa_.SuccessfulAllocations(),
+            GuardedPageAllocator::kLargeSlots / 2 + 1);
+}
+
+// Freed large slots are reused in FIFO order, so a freed slot stays in
+// quarantine while every other slot is used.
+TEST_F(GuardedPageAllocatorTest, LargeSlotQuarantine) {
+  const size_t size = 2 * PageSize();
+  auto first = gpa_.Allocate(size, 0);
+  ASSERT_EQ(first.status, Profile::Sample::GuardedStatus::Guarded);
+  memset(first.alloc, 'A', size);
+  gpa_.Deallocate(first.alloc);
+
+  absl::flat_hash_set<void*> seen = {first.alloc};
+  for (size_t i = 1; i < GuardedPageAllocator::kLargeSlots; ++i) {
+    auto alloc_with_status = gpa_.Allocate(size, 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    EXPECT_TRUE(seen.insert(alloc_with_status.alloc).second);
+    gpa_.Deallocate(alloc_with_status.alloc);
+  }
+
+  auto reused = gpa_.Allocate(size, 0);
+  ASSERT_EQ(reused.status, Profile::Sample::GuardedStatus::Guarded);
+  EXPECT_EQ(reused.alloc, first.alloc);
+  // Freed pages were unmapped, so the slot comes back zeroed.
+  EXPECT_EQ(static_cast<char*>(reused.alloc)[0], 0);
+  gpa_.Deallocate(reused.alloc);
+}
+
+TEST_F(GuardedPageAllocatorTest, PoolIsBackedOnFirstUse) {
+  EXPECT_EQ(gpa_.reserved_bytes(), 0);
+  EXPECT_EQ(gpa_.metadata_bytes(), 0);
+
+  void* buf = gpa_.Allocate(1, 0).alloc;
+  ASSERT_NE(buf, nullptr);
+  EXPECT_GT(gpa_.reserved_bytes(), 0);
+  const size_t metadata_bytes = gpa_.metadata_bytes();
+  EXPECT_GT(metadata_bytes, 0);
+  gpa_.Deallocate(buf);
+
+  buf = gpa_.Allocate(1, 0).alloc;
+  ASSERT_NE(buf, nullptr);
+  EXPECT_EQ(gpa_.metadata_bytes(), metadata_bytes);
+  gpa_.Deallocate(buf);
+}
+
+TEST_F(GuardedPageAllocatorTest, SetPoolSize) {
+  EXPECT_FALSE(gpa_.SetPoolSize(0, kMaxGpaPages));
+  EXPECT_FALSE(gpa_.SetPoolSize(3, 2));
+  EXPECT_FALSE(gpa_.SetPoolSize(1, GuardedPageAllocator::kGpaMaxPages + 1));
+  EXPECT_EQ(gpa_.pool_size(), kMaxGpaPages);
+
+  constexpr size_t kPoolSize = 2 * kMaxGpaPages;
+  ASSERT_TRUE(gpa_.SetPoolSize(kPoolSize / 2, kPoolSize));
+  EXPECT_EQ(gpa_.pool_size(), kPoolSize);
+  EXPECT_EQ(gpa_.GetNumAvailablePages(), kPoolSize / 2);
+
+  std::vector<void*> bufs;
+  for (size_t i = 0; i < kPoolSize / 2; ++i) {
+    void* buf = gpa_.Allocate(1, 0).alloc;
+    ASSERT_NE(buf, nullptr);
+    bufs.push_back(buf);
+  }
+  EXPECT_EQ(gpa_.Allocate(1, 0).status,
+            Profile::Sample::GuardedStatus::NoAvailableSlots);
+
+  // The pool is mapped now, so it can no longer be resized.
+  EXPECT_FALSE(gpa_.SetPoolSize(kMaxGpaPages / 2, kMaxGpaPages));
+  EXPECT_EQ(gpa_.pool_size(), kPoolSize);
+
+  for (void* buf : bufs) {
+    gpa_.Deallocate(buf);
+  }
+}
+
+TEST_F(GuardedPageAllocatorTest, SlotInfo) {
+  auto small = gpa_.Allocate(10, 0);
+  ASSERT_EQ(small.status, Profile::Sample::GuardedStatus::Guarded);
+  char* buf = static_cast<char*>(small.alloc);
+  // Accesses in the guard page after a slot belong to that slot.
+  GuardedPageAllocator::SlotInfo info = gpa_.GetSlotInfo(buf + PageSize() / 4);
+  EXPECT_FALSE(info.large);
+  EXPECT_EQ(info.slot_size, PageSize());
+  EXPECT_EQ(info.allocation_start, reinterpret_cast<uintptr_t>(buf));
+  EXPECT_EQ(info.requested_size, 10);
+  EXPECT_LE(info.slot_start, info.allocation_start);
+  EXPECT_LE(info.allocation_start + 10, info.slot_start + info.slot_size);
+  gpa_.Deallocate(buf);
+
+  const size_t size = 2 * PageSize();
+  auto large = gpa_.Allocate(size, 0);
+  ASSERT_EQ(large.status, Profile::Sample::GuardedStatus::Guarded);
+  buf = static_cast<char*>(large.alloc);
+  info = gpa_.GetSlotInfo(buf + size);
+  EXPECT_TRUE(info.large);
+  EXPECT_EQ(info.slot_size, GuardedPageAllocator::kMaxLargeAllocationSize);
+  EXPECT_EQ(info.allocation_start, reinterpret_cast<uintptr_t>(buf));
+  EXPECT_EQ(info.requested_size, size);
+  // Large allocations are right-aligned in their slot.
+  EXPECT_EQ(info.slot_start + info.slot_size,
+            reinterpret_cast<uintptr_t>(buf) + size);
+  gpa_.Deallocate(buf);
+}
+
 TEST_F(GuardedPageAllocatorTest, Print) {
   char buf[1024] = {};
   Printer out(buf, sizeof(buf));
@@ -279,6 +438,103 @@ TEST_F(GuardedPageAllocatorTest, DeleteSizeCheck) {
   GTEST_SKIP() << "can't get a guarded allocation, giving up";
 }
 
+class GuardedPageAllocatorBatchTest : public GuardedPageAllocatorTest {
+ protected:
+  static constexpr size_t kMaxAllocedPages = 8;
+  static constexpr size_t kBatchSize = 4;
+
+  GuardedPageAllocatorBatchTest()
+      : GuardedPageAllocatorTest(kMaxAllocedPages, kBatchSize) {}
+};
+
+TEST_F(GuardedPageAllocatorBatchTest, ProtectsFullBatches) {
+  std::vector<char*> bufs;
+  for (size_t i = 0; i < kBatchSize; ++i) {
+    auto alloc_with_status = gpa_.Allocate(PageSize(), 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    bufs.push_back(static_cast<char*>(alloc_with_status.alloc));
+  }
+
+  for (size_t i = 0; i + 1 < kBatchSize; ++i) {
+    gpa_.Deallocate(bufs[i]);
+    // The page stays accessible until its batch is protected, and the slot
+    // is not reused meanwhile.
+    bufs[i][0] = 'A';
+    EXPECT_EQ(gpa_.GetNumAvailablePages(), kMaxAllocedPages - kBatchSize);
+  }
+  EXPECT_DEATH(gpa_.Deallocate(bufs[0]), "");
+
+  gpa_.Deallocate(bufs[kBatchSize - 1]);
+  EXPECT_EQ(gpa_.GetNumAvailablePages(), kMaxAllocedPages);
+  for (char* buf : bufs) {
+    EXPECT_DEATH(buf[0] = 'B', "");
+  }
+  EXPECT_DEATH(gpa_.Deallocate(bufs[0]), "");
+}
+
+TEST_F(GuardedPageAllocatorBatchTest, AllocateFlushesWhenExhausted) {
+  std::vector<char*> bufs;
+  for (size_t i = 0; i < kMaxAllocedPages; ++i) {
+    auto alloc_with_status = gpa_.Allocate(1, 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    bufs.push_back(static_cast<char*>(alloc_with_status.alloc));
+  }
+  // Less than a batch is queued, and all other slots are allocated.
+  for (size_t i = 0; i + 1 < kBatchSize; ++i) {
+    gpa_.Deallocate(bufs[i]);
+  }
+
+  auto alloc_with_status = gpa_.Allocate(1, 0);
+  EXPECT_EQ(alloc_with_status.status, Profile::Sample::GuardedStatus::Guarded);
+  for (size_t i = 0; i + 1 < kBatchSize; ++i) {
+    EXPECT_DEATH(bufs[i][0] = 'B', "");
+  }
+
+  gpa_.Deallocate(alloc_with_status.alloc);
+  for (size_t i = kBatchSize - 1; i < kMaxAllocedPages; ++i) {
+    gpa_.Deallocate(bufs[i]);
+  }
+  EXPECT_TRUE(gpa_.FlushPendingDeallocations());
+  EXPECT_FALSE(gpa_.FlushPendingDeallocations());
+  EXPECT_EQ(gpa_.GetNumAvailablePages(), kMaxAllocedPages);
+}
+
+// A pool spanning many words of the free slot bitmap, and more than one word of
+// its summary.
+TEST(GuardedPageAllocatorLargePoolTest, AllocDeallocAllPages) {
+  constexpr size_t kNumPages = 10000;
+  GuardedPageAllocator gpa;
+  {
+    absl::base_internal::SpinLockHolder h(&pageheap_lock);
+    gpa.Init(kNumPages, kNumPages, /*deallocation_batch_size=*/1);
+    gpa.AllowAllocations();
+  }
+
+  std::vector<char*> bufs;
+  bufs.reserve(kNumPages);
+  for (size_t i = 0; i < kNumPages; i++) {
+    auto alloc_with_status = gpa.Allocate(1, 0);
+    ASSERT_EQ(alloc_with_status.status,
+              Profile::Sample::GuardedStatus::Guarded);
+    bufs.push_back(reinterpret_cast<char*>(alloc_with_status.alloc));
+  }
+  EXPECT_EQ(absl::flat_hash_set<char*>(bufs.begin(), bufs.end()).size(),
+            kNumPages);
+  EXPECT_EQ(gpa.GetNumAvailablePages(), 0);
+  EXPECT_EQ(gpa.Allocate(1, 0).status,
+            Profile::Sample::GuardedStatus::NoAvailableSlots);
+
+  for (char* buf : bufs) {
+    buf[0] = 'A';
+    gpa.Deallocate(buf);
+  }
+  EXPECT_EQ(gpa.GetNumAvailablePages(), kNumPages);
+  EXPECT_EQ(gpa.SuccessfulAllocations(), kNumPages);
+  gpa.Destroy();
+}
+
 ABSL_CONST_INIT ABSL_ATTRIBUTE_UNUSED GuardedPageAllocator
     gpa_is_constant_initializable;
 
@@ -0,0 +1,115 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/guarded_sampling_policy.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/hash/hash.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/exponential_biased.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+void GuardedSamplingPolicy::Init(Clock clock, size_t guards_per_window) {
+  ASSERT(guards_per_window > 0);
+  clock_ = clock;
+  guards_per_window_.store(guards_per_window, std::memory_order_relaxed);
+  window_start_.store(clock_.now(), std::memory_order_relaxed);
+}
+
+uint64_t GuardedSamplingPolicy::Hash(const StackTrace& stack_trace) {
+  return absl::HashOf(
+      absl::Span<void* const>(stack_trace.stack, stack_trace.depth));
+}
+
+void GuardedSamplingPolicy::MaybeStartWindow() {
+  const int64_t now = clock_.now();
+  int64_t start = window_start_.load(std::memory_order_relaxed);
+  const double window_ticks = absl::ToDoubleSeconds(kWindow) * clock_.freq();
+  if (now - start < window_ticks) return;
+  // Only the thread that moves the window start refills the budget and decays
+  // the sketch.
+  if (!window_start_.compare_exchange_strong(start, now,
+                                             std::memory_order_relaxed)) {
+    return;
+  }
+  guards_in_window_.store(0, std::memory_order_relaxed);
+  sketch_.Decay();
+}
+
+void GuardedSamplingPolicy::Reset() {
+  sketch_.Clear();
+  guards_in_window_.store(0, std::memory_order_relaxed);
+}
+
+Profile::Sample::GuardedStatus GuardedSamplingPolicy::Evaluate(
+    const StackTrace& stack_trace) {
+  MaybeStartWindow();
+  const uint32_t samples = sketch_.Add(Hash(stack_trace));
+
+  if (guards_in_window_.load(std::memory_order_relaxed) >=
+      guards_per_window()) {
+    budget_exhausted_.fetch_add(1, std::memory_order_relaxed);
+    return Profile::Sample::GuardedStatus::RateLimited;
+  }
+
+  if (samples > kRareSamples) {
+    const uint64_t rnd =
+        ExponentialBiased::NextRandom(rnd_.load(std::memory_order_relaxed));
+    rnd_.store(rnd, std::memory_order_relaxed);
+    // The low bits of the generator are weak, so use the high ones.
+    if ((rnd >> 16) % samples >= kRareSamples) {
+      common_sites_skipped_.fetch_add(1, std::memory_order_relaxed);
+      return Profile::Sample::GuardedStatus::Filtered;
+    }
+  }
+  return Profile::Sample::GuardedStatus::Requested;
+}
+
+void GuardedSamplingPolicy::RecordGuarded(const StackTrace& stack_trace) {
+  guards_in_window_.fetch_add(1, std::memory_order_relaxed);
+
+  const size_t bit = Hash(stack_trace) % kCoverageBits;
+  const uint64_t mask = uint64_t{1} << (bit % kCoverageWordBits);
+  std::atomic<uint64_t>& word = coverage_[bit / kCoverageWordBits];
+  if ((word.load(std::memory_order_relaxed) & mask) != 0) return;
+  if ((word.fetch_or(mask, std::memory_order_relaxed) & mask) == 0) {
+    coverage_bits_set_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+size_t GuardedSamplingPolicy::sites_guarded() const {
+  // Linear counting: with n distinct sites hashed into m bits, the expected
+  // fraction of bits still clear is (1 - 1/m)^n ~ exp(-n/m).
+  const size_t bits_set = coverage_bits_set_.load(std::memory_order_relaxed);
+  const double m = kCoverageBits;
+  // Once every bit is set the estimate saturates.
+  const double clear = bits_set < kCoverageBits ? m - bits_set : 1;
+  return static_cast<size_t>(m * std::log(m / clear) + 0.5);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
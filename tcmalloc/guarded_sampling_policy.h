@@ -0,0 +1,122 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_GUARDED_SAMPLING_POLICY_H_
+#define TCMALLOC_GUARDED_SAMPLING_POLICY_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/count_min_sketch.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+
+class TcMallocTest;
+
+namespace tcmalloc_internal {
+
+// Decides which sampled allocations to guard, so that the limited guarded page
+// pool covers as many distinct allocation sites as possible.
+//
+// Every sampled allocation that could be guarded is counted in a decaying
+// count-min sketch keyed by its stack.  Sites seen at most kRareSamples times
+// are always eligible for guarding, while more common sites are only eligible
+// with probability kRareSamples / (estimated samples), so the guards spread
+// over the rare sites instead of going to the few sites that allocate the
+// most.  At most guards_per_window allocations are guarded per kWindow; at the
+// start of each window the budget is refilled and the sketch decays, so that
+// sites that stop allocating become rare again.
+//
+// Coverage is tracked by setting one bit per guarded site in a bitmap of
+// kCoverageBits bits, from which sites_guarded() estimates the number of
+// distinct sites guarded since startup.
+class GuardedSamplingPolicy {
+ public:
+  static constexpr absl::Duration kWindow = absl::Seconds(10);
+  static constexpr uint32_t kRareSamples = 4;
+  static constexpr size_t kCoverageBits = 1 << 15;
+
+  constexpr GuardedSamplingPolicy() = default;
+
+  void Init(Clock clock, size_t guards_per_window);
+
+  // Returns Requested if the sampled allocation described by stack_trace should
+  // be guarded, or why it should not be.
+  Profile::Sample::GuardedStatus Evaluate(const StackTrace& stack_trace);
+
+  // Records that the allocation described by stack_trace was guarded.
+  void RecordGuarded(const StackTrace& stack_trace);
+
+  // Returns an estimate of the number of distinct sites guarded so far.
+  size_t sites_guarded() const;
+
+  size_t guards_per_window() const {
+    return guards_per_window_.load(std::memory_order_relaxed);
+  }
+  // Changes the budget, e.g. when the guarded page pool is resized.  Takes
+  // effect immediately.
+  void set_guards_per_window(size_t guards_per_window) {
+    ASSERT(guards_per_window > 0);
+    guards_per_window_.store(guards_per_window, std::memory_order_relaxed);
+  }
+  size_t common_sites_skipped() const {
+    return common_sites_skipped_.load(std::memory_order_relaxed);
+  }
+  size_t budget_exhausted() const {
+    return budget_exhausted_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  static constexpr size_t kCoverageWordBits = 64;
+  static constexpr size_t kCoverageWords = kCoverageBits / kCoverageWordBits;
+
+  static uint64_t Hash(const StackTrace& stack_trace);
+
+  // Starts a new window if the current one is over.
+  void MaybeStartWindow();
+
+  // For Testing Only: forgets all sampled sites and refills the budget, so that
+  // tests can guard the same site repeatedly.
+  void Reset();
+
+  Clock clock_{};
+  std::atomic<size_t> guards_per_window_{0};
+  std::atomic<int64_t> window_start_{0};
+  std::atomic<size_t> guards_in_window_{0};
+  std::atomic<uint64_t> rnd_{0};
+
+  DecayingCountMinSketch sketch_;
+
+  std::atomic<uint64_t> coverage_[kCoverageWords] = {};
+  std::atomic<size_t> coverage_bits_set_{0};
+
+  std::atomic<size_t> common_sites_skipped_{0};
+  std::atomic<size_t> budget_exhausted_{0};
+
+  friend class ParameterizedGuardedPageAllocatorProfileTest;
+  friend class tcmalloc::TcMallocTest;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_GUARDED_SAMPLING_POLICY_H_
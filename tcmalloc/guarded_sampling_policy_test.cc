@@ -0,0 +1,138 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/guarded_sampling_policy.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "absl/time/time.h"
+#include "tcmalloc/internal/clock.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using GuardedStatus = Profile::Sample::GuardedStatus;
+
+class GuardedSamplingPolicyTest : public ::testing::Test {
+ protected:
+  static constexpr size_t kGuardsPerWindow = 100;
+
+  GuardedSamplingPolicyTest() {
+    clock_ = 0;
+    policy_ = std::make_unique<GuardedSamplingPolicy>();
+    policy_->Init(Clock{.now = FakeClock, .freq = GetFakeClockFrequency},
+                  kGuardsPerWindow);
+  }
+
+  static void Advance(absl::Duration d) {
+    clock_ += absl::ToDoubleSeconds(d) * GetFakeClockFrequency();
+  }
+
+  // Evaluates a sample from the stack identified by `id`, and records it as
+  // guarded if the policy requests it.
+  GuardedStatus Sample(uintptr_t id) {
+    StackTrace stack_trace = {};
+    stack_trace.depth = 2;
+    stack_trace.stack[0] = reinterpret_cast<void*>(id);
+    stack_trace.stack[1] = reinterpret_cast<void*>(id + 1);
+    GuardedStatus status = policy_->Evaluate(stack_trace);
+    if (status == GuardedStatus::Requested) {
+      policy_->RecordGuarded(stack_trace);
+    }
+    return status;
+  }
+
+  std::unique_ptr<GuardedSamplingPolicy> policy_;
+
+ private:
+  static int64_t FakeClock() { return clock_; }
+
+  static double GetFakeClockFrequency() {
+    return absl::ToDoubleNanoseconds(absl::Seconds(2));
+  }
+
+  static int64_t clock_;
+};
+
+int64_t GuardedSamplingPolicyTest::clock_{0};
+
+TEST_F(GuardedSamplingPolicyTest, RareSitesAreGuarded) {
+  for (uintptr_t i = 0; i < kGuardsPerWindow; ++i) {
+    EXPECT_EQ(Sample(0x1000 + 0x100 * i), GuardedStatus::Requested);
+  }
+  EXPECT_EQ(policy_->common_sites_skipped(), 0);
+  EXPECT_NEAR(policy_->sites_guarded(), kGuardsPerWindow,
+              kGuardsPerWindow / 10);
+}
+
+TEST_F(GuardedSamplingPolicyTest, CommonSitesAreSkipped) {
+  int guarded = 0;
+  for (int i = 0; i < 1000; ++i) {
+    guarded += Sample(0x1000) == GuardedStatus::Requested;
+    // Keep the budget out of the way.
+    Advance(GuardedSamplingPolicy::kWindow / 100);
+  }
+  // About kRareSamples * ln(samples) guards, while the sketch decays only
+  // every hundred samples.
+  EXPECT_GE(guarded, GuardedSamplingPolicy::kRareSamples);
+  EXPECT_LT(guarded, 200);
+  EXPECT_GT(policy_->common_sites_skipped(), 800);
+
+  // A rare site is still guarded right away.
+  EXPECT_EQ(Sample(0x2000), GuardedStatus::Requested);
+}
+
+TEST_F(GuardedSamplingPolicyTest, BudgetRefillsEachWindow) {
+  for (uintptr_t i = 0; i < kGuardsPerWindow; ++i) {
+    ASSERT_EQ(Sample(0x1000 + 0x100 * i), GuardedStatus::Requested);
+  }
+  EXPECT_EQ(Sample(0x100000), GuardedStatus::RateLimited);
+  EXPECT_EQ(policy_->budget_exhausted(), 1);
+
+  Advance(GuardedSamplingPolicy::kWindow);
+  EXPECT_EQ(Sample(0x100000), GuardedStatus::Requested);
+}
+
+TEST_F(GuardedSamplingPolicyTest, SitesBecomeRareAgain) {
+  for (int i = 0; i < 64; ++i) {
+    Sample(0x1000);
+  }
+  // The count halves every window.
+  for (int i = 0; i < 6; ++i) {
+    Advance(GuardedSamplingPolicy::kWindow);
+    Sample(0x2000);
+  }
+  EXPECT_EQ(Sample(0x1000), GuardedStatus::Requested);
+}
+
+TEST_F(GuardedSamplingPolicyTest, CoverageCountsDistinctSites) {
+  for (int round = 0; round < 10; ++round) {
+    for (uintptr_t i = 0; i < 50; ++i) {
+      Sample(0x1000 + 0x100 * i);
+    }
+    Advance(GuardedSamplingPolicy::kWindow);
+  }
+  EXPECT_NEAR(policy_->sites_guarded(), 50, 5);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
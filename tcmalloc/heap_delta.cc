@@ -0,0 +1,144 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_delta.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/hash/hash.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class HeapDeltaProfile final : public ProfileBase {
+ public:
+  explicit HeapDeltaProfile(std::vector<Profile::Sample> samples)
+      : samples_(std::move(samples)) {}
+
+  void Iterate(
+      absl::FunctionRef<void(const Profile::Sample&)> f) const override {
+    for (const auto& sample : samples_) {
+      f(sample);
+    }
+  }
+
+  ProfileType Type() const override { return ProfileType::kHeap; }
+
+  absl::Duration Duration() const override { return absl::ZeroDuration(); }
+
+ private:
+  std::vector<Profile::Sample> samples_;
+};
+
+struct StackTotal {
+  int64_t count;
+  int64_t bytes;
+  // The first sample seen with this stack, which supplies its frames.
+  Profile::Sample sample;
+};
+
+bool ByStackHash(const HeapDeltaEntry& a, const HeapDeltaEntry& b) {
+  return a.stack_hash < b.stack_hash;
+}
+
+bool Reportable(int64_t count, int64_t bytes, size_t min_change_bytes) {
+  if (count == 0 && bytes == 0) return false;
+  const uint64_t change = bytes < 0 ? -static_cast<uint64_t>(bytes) : bytes;
+  return change >= min_change_bytes;
+}
+
+}  // namespace
+
+std::unique_ptr<ProfileBase> ComputeHeapDelta(const ProfileBase& heap,
+                                              HeapDeltaBaseline& baseline,
+                                              size_t min_change_bytes) {
+  const std::vector<HeapDeltaEntry>& entries = baseline.entries;
+  ASSERT(std::is_sorted(entries.begin(), entries.end(), ByStackHash));
+
+  absl::flat_hash_map<uint64_t, size_t> stack_index;
+  std::vector<StackTotal> totals;
+  heap.Iterate([&](const Profile::Sample& sample) {
+    const uint64_t hash =
+        absl::HashOf(absl::MakeConstSpan(sample.stack, sample.depth));
+    auto [it, inserted] = stack_index.try_emplace(hash, totals.size());
+    if (inserted) {
+      totals.push_back({0, 0, sample});
+    }
+    StackTotal& total = totals[it->second];
+    total.count += sample.count;
+    total.bytes += sample.sum;
+  });
+
+  HeapDeltaBaseline current;
+  current.entries.reserve(stack_index.size());
+  std::vector<Profile::Sample> samples;
+  for (const auto& [hash, index] : stack_index) {
+    StackTotal& total = totals[index];
+    const Profile::Sample& first = total.sample;
+    current.entries.push_back({hash, total.count, total.bytes,
+                               current.frames.size(),
+                               static_cast<size_t>(first.depth)});
+    current.frames.insert(current.frames.end(), first.stack,
+                          first.stack + first.depth);
+
+    int64_t count = total.count;
+    int64_t bytes = total.bytes;
+    auto it = std::lower_bound(entries.begin(), entries.end(),
+                               HeapDeltaEntry{hash}, ByStackHash);
+    if (it != entries.end() && it->stack_hash == hash) {
+      count -= it->count;
+      bytes -= it->bytes;
+    }
+    if (!Reportable(count, bytes, min_change_bytes)) continue;
+
+    Profile::Sample& sample = samples.emplace_back(std::move(total.sample));
+    sample.count = count;
+    sample.sum = bytes;
+  }
+
+  // Stacks that are no longer live lost all of their baseline objects.
+  for (const HeapDeltaEntry& entry : entries) {
+    if (stack_index.contains(entry.stack_hash)) continue;
+    if (!Reportable(entry.count, entry.bytes, min_change_bytes)) continue;
+
+    Profile::Sample& sample = samples.emplace_back();
+    sample.count = -entry.count;
+    sample.sum = -entry.bytes;
+    sample.depth = entry.depth;
+    std::copy_n(&baseline.frames[entry.frames_offset], entry.depth,
+                sample.stack);
+  }
+
+  std::sort(current.entries.begin(), current.entries.end(), ByStackHash);
+  baseline = std::move(current);
+  return std::make_unique<HeapDeltaProfile>(std::move(samples));
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
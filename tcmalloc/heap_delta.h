@@ -0,0 +1,45 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_HEAP_DELTA_H_
+#define TCMALLOC_HEAP_DELTA_H_
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_extension.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Returns a profile of the stacks of `heap` or `baseline` whose live bytes
+// differ between the two by at least `min_change_bytes`, with the differences
+// as their count and sum, and replaces `baseline` with the per-stack totals and
+// frames of `heap`.  The entries of `baseline` must be sorted by stack hash,
+// and are left sorted.  See MallocExtension::SnapshotHeapDelta.
+//
+// `heap` is iterated once.  Apart from the new baseline and the returned
+// samples, memory use is proportional to the number of distinct stacks.
+std::unique_ptr<ProfileBase> ComputeHeapDelta(const ProfileBase& heap,
+                                              HeapDeltaBaseline& baseline,
+                                              size_t min_change_bytes);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HEAP_DELTA_H_
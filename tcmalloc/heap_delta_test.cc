@@ -0,0 +1,136 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/heap_delta.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <tuple>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/internal/fake_profile.h"
+#include "tcmalloc/malloc_extension.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using ::testing::FieldsAre;
+using ::testing::IsEmpty;
+using ::testing::UnorderedElementsAre;
+
+// Returns a sample of `count` objects of `size` bytes allocated at the stack
+// identified by `id`.
+Profile::Sample MakeSample(uintptr_t id, int64_t count, size_t size) {
+  Profile::Sample sample = {};
+  sample.count = count;
+  sample.sum = count * size;
+  sample.requested_size = size;
+  sample.allocated_size = size;
+  sample.depth = 2;
+  sample.stack[0] = reinterpret_cast<void*>(id);
+  sample.stack[1] = reinterpret_cast<void*>(id + 1);
+  return sample;
+}
+
+class HeapDeltaTest : public ::testing::Test {
+ protected:
+  // Returns (first frame, count, bytes) for each sample of the delta between
+  // the heap made of samples and baseline_.
+  std::vector<std::tuple<uintptr_t, int64_t, int64_t>> Delta(
+      std::vector<Profile::Sample> samples, size_t min_change_bytes = 0) {
+    FakeProfile heap;
+    heap.SetType(ProfileType::kHeap);
+    heap.SetSamples(std::move(samples));
+    std::unique_ptr<ProfileBase> delta =
+        ComputeHeapDelta(heap, baseline_, min_change_bytes);
+    EXPECT_EQ(delta->Type(), ProfileType::kHeap);
+
+    std::vector<std::tuple<uintptr_t, int64_t, int64_t>> result;
+    delta->Iterate([&](const Profile::Sample& sample) {
+      EXPECT_EQ(sample.depth, 2);
+      result.emplace_back(reinterpret_cast<uintptr_t>(sample.stack[0]),
+                          sample.count, sample.sum);
+    });
+    return result;
+  }
+
+  HeapDeltaBaseline baseline_;
+};
+
+TEST_F(HeapDeltaTest, EmptyBaselineReportsWholeHeap) {
+  EXPECT_THAT(Delta({MakeSample(0x1000, 2, 16), MakeSample(0x2000, 1, 64),
+                     MakeSample(0x1000, 1, 32)}),
+              UnorderedElementsAre(FieldsAre(0x1000, 3, 64),
+                                   FieldsAre(0x2000, 1, 64)));
+  EXPECT_EQ(baseline_.entries.size(), 2);
+}
+
+TEST_F(HeapDeltaTest, ReportsChanges) {
+  Delta({MakeSample(0x1000, 10, 16), MakeSample(0x2000, 10, 64),
+         MakeSample(0x3000, 1, 1024)});
+
+  // 0x1000 grew, 0x2000 shrank, 0x3000 is unchanged and 0x4000 is new.
+  EXPECT_THAT(Delta({MakeSample(0x1000, 15, 16), MakeSample(0x2000, 4, 64),
+                     MakeSample(0x3000, 1, 1024), MakeSample(0x4000, 1, 8)}),
+              UnorderedElementsAre(FieldsAre(0x1000, 5, 80),
+                                   FieldsAre(0x2000, -6, -384),
+                                   FieldsAre(0x4000, 1, 8)));
+
+  // The baseline moved forward.
+  EXPECT_THAT(Delta({MakeSample(0x1000, 15, 16), MakeSample(0x2000, 4, 64),
+                     MakeSample(0x3000, 1, 1024), MakeSample(0x4000, 1, 8)}),
+              IsEmpty());
+}
+
+TEST_F(HeapDeltaTest, Threshold) {
+  Delta({MakeSample(0x1000, 10, 16), MakeSample(0x2000, 10, 16)});
+
+  EXPECT_THAT(Delta({MakeSample(0x1000, 11, 16), MakeSample(0x2000, 1000, 16),
+                     MakeSample(0x3000, 1, 8)},
+                    /*min_change_bytes=*/1024),
+              UnorderedElementsAre(FieldsAre(0x2000, 990, 990 * 16)));
+
+  // Shrinking beyond the threshold is reported too.
+  EXPECT_THAT(Delta({MakeSample(0x2000, 1, 16)}, /*min_change_bytes=*/1024),
+              UnorderedElementsAre(FieldsAre(0x2000, -999, -999 * 16)));
+}
+
+TEST_F(HeapDeltaTest, ReportsFreedStacks) {
+  Delta({MakeSample(0x1000, 10, 16), MakeSample(0x2000, 100, 1024),
+         MakeSample(0x3000, 1, 8)});
+
+  // Everything allocated at 0x2000 and 0x3000 was freed.  Their frames come
+  // from the baseline.
+  EXPECT_THAT(Delta({MakeSample(0x1000, 10, 16)}),
+              UnorderedElementsAre(FieldsAre(0x2000, -100, -100 * 1024),
+                                   FieldsAre(0x3000, -1, -8)));
+  EXPECT_EQ(baseline_.entries.size(), 1);
+
+  // Once reported, freed stacks are gone from the baseline.
+  EXPECT_THAT(Delta({MakeSample(0x1000, 10, 16)}), IsEmpty());
+
+  // The threshold applies to freed stacks too.
+  Delta({MakeSample(0x1000, 10, 16), MakeSample(0x2000, 1, 16)});
+  EXPECT_THAT(Delta({}, /*min_change_bytes=*/64),
+              UnorderedElementsAre(FieldsAre(0x1000, -10, -160)));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -0,0 +1,140 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/hot_site_tracker.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/hash/hash.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/sampler.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+void HotSiteTracker::SetHot(Entry& entry, bool hot) {
+  if (entry.hot == hot) return;
+  entry.hot = hot;
+  std::atomic<uint8_t>& count = hot_sites_[entry.size_class];
+  if (hot) {
+    count.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    ASSERT(count.load(std::memory_order_relaxed) > 0);
+    count.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void HotSiteTracker::UpdateHints(Shard& shard) {
+  for (size_t i = 0; i < shard.size; ++i) {
+    Entry& entry = shard.entries[i];
+    SetHot(entry, entry.samples >= kMinSamples &&
+                      entry.bytes * kHotShare >= shard.total_bytes);
+  }
+}
+
+void HotSiteTracker::Report(const StackTrace& stack_trace,
+                            size_t size_class) {
+  // Allocations of whole pages never reach the per-CPU caches.
+  if (size_class == 0) return;
+  ASSERT(size_class < kNumClasses);
+
+  const uint64_t hash = absl::HashOf(
+      absl::Span<void* const>(stack_trace.stack, stack_trace.depth),
+      size_class);
+  const int64_t bytes = AllocatedBytes(stack_trace) + 0.5;
+
+  // The CPU may be unknown if neither rseq nor sched_getcpu() is available.
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  Shard& shard = shards_[cpu < 0 ? 0 : cpu % kShards];
+  AllocationGuardSpinLockHolder h(&shard.lock);
+  shard.total_bytes += bytes;
+
+  Entry* entry = nullptr;
+  for (size_t i = 0; i < shard.size; ++i) {
+    if (shard.entries[i].hash == hash &&
+        shard.entries[i].size_class == size_class) {
+      entry = &shard.entries[i];
+      break;
+    }
+  }
+  if (entry == nullptr) {
+    if (shard.size < kMaxSites) {
+      entry = &shard.entries[shard.size++];
+      *entry = {hash, size_class, 0, 0, false};
+    } else {
+      // The sketch is full: the new site takes over the entry with the fewest
+      // bytes, inheriting its bytes but not its samples.
+      entry = std::min_element(
+          shard.entries, shard.entries + shard.size,
+          [](const Entry& a, const Entry& b) { return a.bytes < b.bytes; });
+      SetHot(*entry, false);
+      entry->hash = hash;
+      entry->size_class = size_class;
+      entry->samples = 0;
+    }
+  }
+  entry->bytes += bytes;
+  ++entry->samples;
+
+  if (++shard.reports % kDecayPeriod == 0) {
+    for (size_t i = 0; i < shard.size; ++i) {
+      shard.entries[i].bytes /= 2;
+      shard.entries[i].samples /= 2;
+    }
+    shard.total_bytes /= 2;
+  }
+
+  UpdateHints(shard);
+}
+
+size_t HotSiteTracker::GetSites(absl::Span<Site> sites) const {
+  Entry entries[kShards * kMaxSites];
+  size_t size = 0;
+  for (const Shard& shard : shards_) {
+    AllocationGuardSpinLockHolder h(&shard.lock);
+    for (size_t i = 0; i < shard.size; ++i) {
+      const Entry& entry = shard.entries[i];
+      Entry* merged = std::find_if(entries, entries + size, [&](const Entry& e) {
+        return e.hash == entry.hash && e.size_class == entry.size_class;
+      });
+      if (merged == entries + size) {
+        entries[size++] = entry;
+      } else {
+        merged->bytes += entry.bytes;
+      }
+    }
+  }
+
+  const size_t n = std::min(sites.size(), size);
+  std::partial_sort(
+      entries, entries + n, entries + size,
+      [](const Entry& a, const Entry& b) { return a.bytes > b.bytes; });
+  for (size_t i = 0; i < n; ++i) {
+    sites[i] = {entries[i].hash, entries[i].size_class, entries[i].bytes};
+  }
+  return n;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
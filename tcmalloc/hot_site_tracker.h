@@ -0,0 +1,115 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_HOT_SITE_TRACKER_H_
+#define TCMALLOC_HOT_SITE_TRACKER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Finds the allocation sites that allocate the most, and derives hints for the
+// per-CPU cache slow path from them.
+//
+// A site is an allocation stack together with the size class it allocates
+// from.  While Parameters::hot_site_cache_hints() is enabled, every sampled
+// allocation is reported to the tracker.  Reports go to one of kShards shards,
+// chosen by the current CPU, each of which keeps the top kMaxSites sites by
+// sampled bytes in a Space-Saving sketch under its own lock.  Counts are halved
+// every kDecayPeriod reports to a shard, so the sketches follow shifts in the
+// workload.
+//
+// The slow path only knows the size class it is refilling, so hints are
+// aggregated per size class: a size class is hot while at least one of its
+// sites accounts for 1/kHotShare of the bytes recently sampled by its shard.
+// Hints are kept in a table of relaxed atomics and reading them never takes a
+// lock.
+class HotSiteTracker {
+ public:
+  static constexpr size_t kShards = 8;
+  static constexpr size_t kMaxSites = 16;
+  static constexpr size_t kDecayPeriod = 256;
+  static constexpr int64_t kHotShare = 8;
+  // A site needs this many samples of its own (rather than counts inherited
+  // from the site it displaced) before it can be considered hot.
+  static constexpr int64_t kMinSamples = 4;
+
+  struct Site {
+    uint64_t hash;
+    size_t size_class;
+    int64_t bytes;
+  };
+
+  constexpr HotSiteTracker() = default;
+
+  // Records the sampled allocation described by stack_trace, which was
+  // allocated from size_class.
+  void Report(const StackTrace& stack_trace, size_t size_class);
+
+  // Returns whether size_class is allocated from by a hot site.
+  bool IsHot(size_t size_class) const {
+    ASSERT(size_class < kNumClasses);
+    return hot_sites_[size_class].load(std::memory_order_relaxed) > 0;
+  }
+
+  // Copies the tracked sites, ordered by decreasing bytes, into sites.  A site
+  // tracked by several shards is reported once, with the sum of their bytes.
+  // Returns the number of sites copied.
+  size_t GetSites(absl::Span<Site> sites) const;
+
+ private:
+  struct Entry {
+    uint64_t hash;
+    size_t size_class;
+    int64_t bytes;
+    int64_t samples;
+    bool hot;
+  };
+
+  struct Shard {
+    constexpr Shard()
+        : lock(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY) {}
+
+    mutable absl::base_internal::SpinLock lock;
+    Entry entries[kMaxSites] ABSL_GUARDED_BY(lock){};
+    size_t size ABSL_GUARDED_BY(lock) = 0;
+    int64_t total_bytes ABSL_GUARDED_BY(lock) = 0;
+    size_t reports ABSL_GUARDED_BY(lock) = 0;
+  };
+
+  void SetHot(Entry& entry, bool hot);
+  void UpdateHints(Shard& shard) ABSL_EXCLUSIVE_LOCKS_REQUIRED(shard.lock);
+
+  Shard shards_[kShards];
+  // Number of hot sites, over all shards, allocating from each size class.
+  std::atomic<uint8_t> hot_sites_[kNumClasses] = {};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_HOT_SITE_TRACKER_H_
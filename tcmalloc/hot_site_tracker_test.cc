@@ -0,0 +1,150 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/hot_site_tracker.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/affinity.h"
+#include "tcmalloc/internal/logging.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class HotSiteTrackerTest : public ::testing::Test {
+ protected:
+  // Reports go to a shard chosen by the current CPU.  Stay on one CPU, so that
+  // a single shard sees the whole workload.
+  HotSiteTrackerTest()
+      : tracker_(std::make_unique<HotSiteTracker>()),
+        mask_(AllowedCpus()[0]) {}
+
+  // Reports a sample of `weight` bytes allocated from size_class at the stack
+  // identified by `id`.
+  void Report(uintptr_t id, size_t size_class, size_t weight = 16 * 1000) {
+    StackTrace stack_trace = {};
+    stack_trace.requested_size = 15;
+    stack_trace.allocated_size = 16;
+    stack_trace.weight = weight;
+    stack_trace.depth = 2;
+    stack_trace.stack[0] = reinterpret_cast<void*>(id);
+    stack_trace.stack[1] = reinterpret_cast<void*>(id + 1);
+    tracker_->Report(stack_trace, size_class);
+  }
+
+  int NumHotClasses() const {
+    int n = 0;
+    for (size_t size_class = 0; size_class < kNumClasses; ++size_class) {
+      n += tracker_->IsHot(size_class);
+    }
+    return n;
+  }
+
+  std::unique_ptr<HotSiteTracker> tracker_;
+
+ private:
+  ScopedAffinityMask mask_;
+};
+
+TEST_F(HotSiteTrackerTest, Empty) {
+  EXPECT_EQ(NumHotClasses(), 0);
+  HotSiteTracker::Site sites[HotSiteTracker::kMaxSites];
+  EXPECT_EQ(tracker_->GetSites(sites), 0);
+}
+
+TEST_F(HotSiteTrackerTest, SkewedSites) {
+  // One site allocates half the bytes, the other half is spread over many
+  // sites and size classes.
+  for (uintptr_t i = 0; i < 1000; ++i) {
+    Report(0x1000, 3);
+    Report(0x10000 + 0x100 * i, 4 + i % 8);
+  }
+
+  EXPECT_TRUE(tracker_->IsHot(3));
+  EXPECT_EQ(NumHotClasses(), 1);
+
+  HotSiteTracker::Site sites[HotSiteTracker::kMaxSites];
+  ASSERT_EQ(tracker_->GetSites(sites), HotSiteTracker::kMaxSites);
+  EXPECT_EQ(sites[0].size_class, 3);
+  for (size_t i = 1; i < HotSiteTracker::kMaxSites; ++i) {
+    EXPECT_LE(sites[i].bytes, sites[i - 1].bytes);
+  }
+}
+
+TEST_F(HotSiteTrackerTest, SitesAreSizeClassSpecific) {
+  // The same stack allocating from several size classes (e.g. a growing
+  // vector) is several sites, none of which needs to be hot.
+  for (int i = 0; i < 1000; ++i) {
+    Report(0x1000, 1 + i % 16);
+  }
+  EXPECT_EQ(NumHotClasses(), 0);
+}
+
+TEST_F(HotSiteTrackerTest, FollowsWorkloadShift) {
+  for (int i = 0; i < 1000; ++i) {
+    Report(0x1000, 3);
+  }
+  EXPECT_TRUE(tracker_->IsHot(3));
+
+  for (int i = 0; i < 10 * HotSiteTracker::kDecayPeriod; ++i) {
+    Report(0x2000, 5);
+  }
+  EXPECT_FALSE(tracker_->IsHot(3));
+  EXPECT_TRUE(tracker_->IsHot(5));
+}
+
+TEST_F(HotSiteTrackerTest, IgnoresPageAllocations) {
+  for (int i = 0; i < 1000; ++i) {
+    Report(0x1000, 0);
+  }
+  EXPECT_EQ(NumHotClasses(), 0);
+  HotSiteTracker::Site sites[HotSiteTracker::kMaxSites];
+  EXPECT_EQ(tracker_->GetSites(sites), 0);
+}
+
+TEST_F(HotSiteTrackerTest, MergesShards) {
+  std::vector<int> cpus = AllowedCpus();
+  if (cpus.size() < 2) {
+    GTEST_SKIP() << "Needs at least two CPUs";
+  }
+
+  // The same site, reported from two CPUs, is listed once.
+  constexpr int kReports = 100;
+  for (int cpu : {cpus[0], cpus[1]}) {
+    std::thread t([&]() {
+      ScopedAffinityMask mask(cpu);
+      for (int i = 0; i < kReports; ++i) {
+        Report(0x1000, 3, /*weight=*/16);
+      }
+    });
+    t.join();
+  }
+
+  EXPECT_TRUE(tracker_->IsHot(3));
+  HotSiteTracker::Site sites[HotSiteTracker::kMaxSites];
+  ASSERT_EQ(tracker_->GetSites(sites), 1);
+  EXPECT_EQ(sites[0].size_class, 3);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
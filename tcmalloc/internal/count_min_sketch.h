@@ -0,0 +1,108 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_COUNT_MIN_SKETCH_H_
+#define TCMALLOC_INTERNAL_COUNT_MIN_SKETCH_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Approximately counts occurrences of 64-bit hashes in a fixed amount of
+// memory.  Each of kDepth rows maps a hash to one of kWidth counters, using a
+// different 16-bit slice of the hash per row, and a hash's count is estimated
+// by the smallest of its counters.  Estimates never undercount, and Add() only
+// increments the counters that are at the minimum (the "conservative update"),
+// which limits overcounting from collisions.
+//
+// Decay() halves every counter, so that estimates favor recent occurrences.
+//
+// All operations are thread safe and lock free.  Concurrent updates of the
+// same counters may lose increments.
+class DecayingCountMinSketch {
+ public:
+  static constexpr size_t kDepth = 4;
+  static constexpr size_t kWidth = 1024;
+
+  constexpr DecayingCountMinSketch() = default;
+
+  // Counts one occurrence of hash, and returns the new estimate of its count.
+  uint32_t Add(uint64_t hash) {
+    uint32_t min = Estimate(hash);
+    if (min == std::numeric_limits<uint32_t>::max()) return min;
+    for (size_t row = 0; row < kDepth; ++row) {
+      std::atomic<uint32_t>& counter = counters_[row][Index(hash, row)];
+      uint32_t value = counter.load(std::memory_order_relaxed);
+      if (value == min) {
+        counter.store(value + 1, std::memory_order_relaxed);
+      }
+    }
+    return min + 1;
+  }
+
+  // Returns an estimate of the number of occurrences of hash, which is at
+  // least the number of (decayed) Add(hash) calls.
+  uint32_t Estimate(uint64_t hash) const {
+    uint32_t min = std::numeric_limits<uint32_t>::max();
+    for (size_t row = 0; row < kDepth; ++row) {
+      min = std::min(
+          min, counters_[row][Index(hash, row)].load(std::memory_order_relaxed));
+    }
+    return min;
+  }
+
+  // Resets all counts to zero.
+  void Clear() {
+    for (size_t row = 0; row < kDepth; ++row) {
+      for (size_t i = 0; i < kWidth; ++i) {
+        counters_[row][i].store(0, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Halves all counts.
+  void Decay() {
+    for (size_t row = 0; row < kDepth; ++row) {
+      for (size_t i = 0; i < kWidth; ++i) {
+        std::atomic<uint32_t>& counter = counters_[row][i];
+        counter.store(counter.load(std::memory_order_relaxed) / 2,
+                      std::memory_order_relaxed);
+      }
+    }
+  }
+
+ private:
+  static_assert(kDepth * 16 <= 64, "Each row uses 16 bits of the hash");
+  static_assert(kWidth <= 1 << 16, "Each row uses 16 bits of the hash");
+
+  static size_t Index(uint64_t hash, size_t row) {
+    return ((hash >> (16 * row)) & 0xFFFF) % kWidth;
+  }
+
+  std::atomic<uint32_t> counters_[kDepth][kWidth] = {};
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_COUNT_MIN_SKETCH_H_
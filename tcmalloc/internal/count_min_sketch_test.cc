@@ -0,0 +1,82 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/count_min_sketch.h"
+
+#include <cstdint>
+#include <memory>
+
+#include "gtest/gtest.h"
+#include "absl/hash/hash.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class DecayingCountMinSketchTest : public ::testing::Test {
+ protected:
+  DecayingCountMinSketchTest()
+      : sketch_(std::make_unique<DecayingCountMinSketch>()) {}
+
+  std::unique_ptr<DecayingCountMinSketch> sketch_;
+};
+
+TEST_F(DecayingCountMinSketchTest, Empty) {
+  EXPECT_EQ(sketch_->Estimate(absl::HashOf(1)), 0);
+}
+
+TEST_F(DecayingCountMinSketchTest, CountsExactlyWithoutCollisions) {
+  const uint64_t hash = absl::HashOf(1);
+  for (uint32_t i = 1; i <= 10; ++i) {
+    EXPECT_EQ(sketch_->Add(hash), i);
+  }
+  EXPECT_EQ(sketch_->Estimate(hash), 10);
+  EXPECT_EQ(sketch_->Estimate(absl::HashOf(2)), 0);
+}
+
+TEST_F(DecayingCountMinSketchTest, NeverUndercounts) {
+  // About as many keys as counters per row, so that many counters are shared.
+  constexpr int kKeys = 1000;
+  for (int key = 0; key < kKeys; ++key) {
+    for (int i = 0; i <= key % 4; ++i) {
+      sketch_->Add(absl::HashOf(key));
+    }
+  }
+
+  int exact = 0;
+  for (int key = 0; key < kKeys; ++key) {
+    const uint32_t estimate = sketch_->Estimate(absl::HashOf(key));
+    EXPECT_GE(estimate, key % 4 + 1);
+    exact += estimate == key % 4 + 1;
+  }
+  // Conservative updates keep most estimates exact, even at this load.
+  EXPECT_GT(exact, kKeys / 2);
+}
+
+TEST_F(DecayingCountMinSketchTest, Decay) {
+  const uint64_t hash = absl::HashOf(1);
+  for (int i = 0; i < 100; ++i) {
+    sketch_->Add(hash);
+  }
+  sketch_->Decay();
+  EXPECT_EQ(sketch_->Estimate(hash), 50);
+  for (int i = 0; i < 6; ++i) {
+    sketch_->Decay();
+  }
+  EXPECT_EQ(sketch_->Estimate(hash), 0);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
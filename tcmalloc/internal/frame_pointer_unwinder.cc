@@ -0,0 +1,186 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/attributes.h"
+#include "absl/base/call_once.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/environment.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// A frame larger than this almost certainly means that we have picked up a
+// register which is not being used as a frame pointer.
+constexpr uintptr_t kMaxFrameSize = 1 << 20;
+
+struct CachedStackBounds {
+  uintptr_t lo;
+  uintptr_t hi;
+  // Set while the bounds are being looked up. pthread_getattr_np may allocate,
+  // and a sampled allocation made from inside it must not recurse.
+  bool initializing;
+  bool initialized;
+};
+
+ABSL_CONST_INIT thread_local CachedStackBounds cached_stack_bounds
+    ABSL_ATTRIBUTE_INITIAL_EXEC = {0, 0, false, false};
+
+bool LookupThreadStackBounds(ThreadStackBounds* bounds) {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return false;
+  }
+  void* addr = nullptr;
+  size_t size = 0;
+  const bool ok = pthread_attr_getstack(&attr, &addr, &size) == 0;
+  pthread_attr_destroy(&attr);
+  if (!ok || addr == nullptr || size == 0) {
+    return false;
+  }
+  bounds->lo = reinterpret_cast<uintptr_t>(addr);
+  bounds->hi = bounds->lo + size;
+  return true;
+}
+
+// A valid frame record is pointer aligned and its two words (the caller's
+// frame pointer and the return address) lie within the stack.
+inline bool IsValidFrame(uintptr_t fp, const ThreadStackBounds& bounds) {
+  return fp % alignof(void*) == 0 && fp >= bounds.lo &&
+         fp <= bounds.hi - 2 * sizeof(void*);
+}
+
+}  // namespace
+
+bool GetThreadStackBounds(ThreadStackBounds* bounds) {
+  CachedStackBounds& cached = cached_stack_bounds;
+  if (ABSL_PREDICT_TRUE(cached.initialized)) {
+    bounds->lo = cached.lo;
+    bounds->hi = cached.hi;
+    return true;
+  }
+  if (cached.initializing) {
+    return false;
+  }
+
+  cached.initializing = true;
+  ThreadStackBounds looked_up;
+  const bool ok = LookupThreadStackBounds(&looked_up);
+  cached.initializing = false;
+  if (!ok) {
+    return false;
+  }
+
+  cached.lo = looked_up.lo;
+  cached.hi = looked_up.hi;
+  cached.initialized = true;
+  *bounds = looked_up;
+  return true;
+}
+
+int FramePointerGetStackTrace(void** result, int max_depth, int skip_count) {
+#if defined(__x86_64__) || defined(__aarch64__)
+  ThreadStackBounds bounds;
+  if (ABSL_PREDICT_FALSE(!GetThreadStackBounds(&bounds))) {
+    const int depth = absl::GetStackTrace(result, max_depth, skip_count + 1);
+    ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+    return depth;
+  }
+
+  // On both x86-64 and AArch64 a frame record is the pair {caller's frame
+  // pointer, return address}, and the frame pointer points at it.
+  uintptr_t fp = reinterpret_cast<uintptr_t>(__builtin_frame_address(0));
+  int depth = 0;
+  while (depth < max_depth && IsValidFrame(fp, bounds)) {
+    const uintptr_t* frame = reinterpret_cast<const uintptr_t*>(fp);
+    const uintptr_t next_fp = frame[0];
+    const uintptr_t return_address = frame[1];
+    if (return_address == 0) {
+      break;
+    }
+
+    if (skip_count > 0) {
+      --skip_count;
+    } else {
+      result[depth++] = reinterpret_cast<void*>(return_address);
+    }
+
+    // The stack grows down, so callers' frames are at strictly higher
+    // addresses. Anything else means the chain is broken.
+    if (next_fp <= fp || next_fp - fp > kMaxFrameSize) {
+      break;
+    }
+    fp = next_fp;
+  }
+  return depth;
+#else
+  const int depth = absl::GetStackTrace(result, max_depth, skip_count + 1);
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+  return depth;
+#endif
+}
+
+bool FramePointerUnwinderEnabled() {
+  ABSL_CONST_INIT static absl::once_flag flag;
+  ABSL_CONST_INIT static std::atomic<bool> v{false};
+  absl::base_internal::LowLevelCallOnce(&flag, [&]() {
+    const char* e = thread_safe_getenv("TCMALLOC_FRAME_POINTER_UNWINDER");
+    if (e == nullptr) return;
+    switch (e[0]) {
+      case '0':
+        break;
+      case '1':
+        v.store(true, std::memory_order_relaxed);
+        break;
+      default:
+        Crash(kCrash, __FILE__, __LINE__,
+              "bad TCMALLOC_FRAME_POINTER_UNWINDER env var", e);
+    }
+  });
+  return v.load(std::memory_order_relaxed);
+}
+
+int GetSampledStackTrace(void** result, int max_depth, int skip_count) {
+  // Both unwinders are asked to skip this frame as well, so that callers see
+  // the same result as if they had called absl::GetStackTrace directly.
+  int depth = 0;
+  if (FramePointerUnwinderEnabled()) {
+    depth = FramePointerGetStackTrace(result, max_depth, skip_count + 1);
+  }
+  // The frame-pointer walk finds nothing when an intermediate frame lacks a
+  // valid frame record before the skipped frames are consumed; fall back to
+  // the general unwinder rather than recording an empty stack.
+  if (depth == 0) {
+    depth = absl::GetStackTrace(result, max_depth, skip_count + 1);
+  }
+  // A tail call would drop this frame and make us skip one too many.
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+  return depth;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,68 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
+#define TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
+
+#include <cstdint>
+
+#include "absl/base/attributes.h"
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Bounds [lo, hi) of the calling thread's stack.
+struct ThreadStackBounds {
+  uintptr_t lo = 0;
+  uintptr_t hi = 0;
+};
+
+// Fills *bounds with the stack bounds of the calling thread. The bounds are
+// looked up once per thread and cached. Returns false if they are unknown (for
+// example, while they are being looked up on this thread).
+bool GetThreadStackBounds(ThreadStackBounds* bounds);
+
+// Walks the frame-pointer chain of the calling thread and stores up to
+// max_depth return addresses in result, skipping the innermost skip_count
+// frames. Has the same contract as absl::GetStackTrace: with skip_count == 0,
+// result[0] is the return address into the caller of this function.
+//
+// Every frame record is checked to lie within the thread's stack bounds and to
+// move strictly towards the stack base before it is dereferenced, so the walk
+// stops (rather than faults) when it reaches code built without frame
+// pointers. Only frames compiled with -fno-omit-frame-pointer are reported.
+//
+// On architectures without a supported frame record layout, or if the stack
+// bounds are unknown, this falls back to absl::GetStackTrace.
+ABSL_ATTRIBUTE_NOINLINE int FramePointerGetStackTrace(void** result,
+                                                      int max_depth,
+                                                      int skip_count);
+
+// Returns true if the frame-pointer unwinder was selected at startup by setting
+// TCMALLOC_FRAME_POINTER_UNWINDER=1 in the environment.
+bool FramePointerUnwinderEnabled();
+
+// Captures the stack trace of an allocation sample. Dispatches to
+// FramePointerGetStackTrace if FramePointerUnwinderEnabled(), and to
+// absl::GetStackTrace otherwise. Follows the absl::GetStackTrace contract.
+ABSL_ATTRIBUTE_NOINLINE int GetSampledStackTrace(void** result, int max_depth,
+                                                 int skip_count);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_FRAME_POINTER_UNWINDER_H_
@@ -0,0 +1,62 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+#include "benchmark/benchmark.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kMaxDepth = 64;
+
+using Unwinder = int (*)(void**, int, int);
+
+// Builds a stack that is n frames deeper than the caller and then runs the
+// benchmark loop from its innermost frame, so that each iteration unwinds
+// through (at least) n frames.
+ABSL_ATTRIBUTE_NOINLINE void UnwindAtDepth(benchmark::State& state, int n,
+                                           Unwinder unwind) {
+  if (n > 0) {
+    UnwindAtDepth(state, n - 1, unwind);
+    ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+    return;
+  }
+
+  void* stack[kMaxDepth];
+  for (auto s : state) {
+    benchmark::DoNotOptimize(unwind(stack, kMaxDepth, 0));
+    benchmark::DoNotOptimize(stack);
+  }
+}
+
+void BM_AbslGetStackTrace(benchmark::State& state) {
+  UnwindAtDepth(state, state.range(0), &absl::GetStackTrace);
+}
+BENCHMARK(BM_AbslGetStackTrace)->Arg(16)->Arg(32)->Arg(64);
+
+void BM_FramePointerGetStackTrace(benchmark::State& state) {
+  UnwindAtDepth(state, state.range(0), &FramePointerGetStackTrace);
+}
+BENCHMARK(BM_FramePointerGetStackTrace)->Arg(16)->Arg(32)->Arg(64);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
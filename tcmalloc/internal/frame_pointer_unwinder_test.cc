@@ -0,0 +1,120 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/frame_pointer_unwinder.h"
+
+#include <cstdint>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/base/attributes.h"
+#include "absl/base/optimization.h"
+#include "absl/debugging/stacktrace.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr int kMaxDepth = 64;
+
+struct Traces {
+  std::vector<void*> absl_trace;
+  std::vector<void*> fp_trace;
+};
+
+// Captures both traces from the same frame. Skipping this frame makes the two
+// results directly comparable, since the return addresses into it differ.
+ABSL_ATTRIBUTE_NOINLINE void CaptureTraces(Traces* traces) {
+  void* stack[kMaxDepth];
+  int depth = absl::GetStackTrace(stack, kMaxDepth, 1);
+  traces->absl_trace.assign(stack, stack + depth);
+  depth = FramePointerGetStackTrace(stack, kMaxDepth, 1);
+  traces->fp_trace.assign(stack, stack + depth);
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+}
+
+ABSL_ATTRIBUTE_NOINLINE void Recurse(int n, Traces* traces) {
+  if (n == 0) {
+    CaptureTraces(traces);
+  } else {
+    Recurse(n - 1, traces);
+  }
+  ABSL_BLOCK_TAIL_CALL_OPTIMIZATION();
+}
+
+// This test is built with -fno-omit-frame-pointer, so every frame from
+// CaptureTraces up to the test body has a frame record and the two unwinders
+// must agree on them. Frames beyond that (gtest, libc) may lack frame pointers.
+TEST(FramePointerUnwinderTest, MatchesGetStackTrace) {
+  for (int n : {0, 1, 8, 20}) {
+    SCOPED_TRACE(n);
+    Traces traces;
+    Recurse(n, &traces);
+
+    // Recurse frames plus the test body.
+    const int expected_frames = n + 2;
+    ASSERT_GE(traces.absl_trace.size(), expected_frames);
+    ASSERT_GE(traces.fp_trace.size(), expected_frames);
+    for (int i = 0; i < expected_frames; ++i) {
+      EXPECT_EQ(traces.absl_trace[i], traces.fp_trace[i]) << i;
+    }
+  }
+}
+
+TEST(FramePointerUnwinderTest, RespectsMaxDepth) {
+  Traces traces;
+  Recurse(8, &traces);
+  ASSERT_GE(traces.fp_trace.size(), 4);
+
+  void* stack[4];
+  EXPECT_EQ(FramePointerGetStackTrace(stack, 0, 0), 0);
+  EXPECT_EQ(FramePointerGetStackTrace(stack, 1, 0), 1);
+}
+
+TEST(FramePointerUnwinderTest, StackBounds) {
+  ThreadStackBounds bounds;
+  ASSERT_TRUE(GetThreadStackBounds(&bounds));
+  int local;
+  const uintptr_t addr = reinterpret_cast<uintptr_t>(&local);
+  EXPECT_LT(bounds.lo, addr);
+  EXPECT_LT(addr, bounds.hi);
+
+  // Other threads have their own bounds.
+  std::thread t([&]() {
+    ThreadStackBounds thread_bounds;
+    ASSERT_TRUE(GetThreadStackBounds(&thread_bounds));
+    EXPECT_NE(thread_bounds.lo, bounds.lo);
+
+    void* stack[kMaxDepth];
+    EXPECT_GT(FramePointerGetStackTrace(stack, kMaxDepth, 0), 0);
+  });
+  t.join();
+}
+
+TEST(FramePointerUnwinderTest, GetSampledStackTraceSkipsItself) {
+  void* expected[kMaxDepth];
+  void* actual[kMaxDepth];
+  // Both calls are made from this frame, so only the first entry differs.
+  const int expected_depth = absl::GetStackTrace(expected, kMaxDepth, 0);
+  const int actual_depth = GetSampledStackTrace(actual, kMaxDepth, 0);
+  ASSERT_GE(expected_depth, 2);
+  ASSERT_GE(actual_depth, 2);
+  EXPECT_EQ(expected[1], actual[1]);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -20,7 +20,6 @@
 #include <stddef.h>
 #include <unistd.h>
 
-#include <algorithm>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
@@ -94,25 +93,21 @@ PageFlags::~PageFlags() {
   }
 }
 
-absl::StatusCode PageFlags::Seek(const uintptr_t vaddr) {
-  size_t offset = vaddr / kPageSize * kPagemapEntrySize;
-  // Note: lseek can't be interrupted.
-  off_t status = ::lseek(fd_, offset, SEEK_SET);
-  if (status != offset) {
+absl::StatusCode PageFlags::ReadNext(uint64_t& flags) {
+  size_t num_read;
+  const uint64_t* entries = buffer_.Read(fd_, next_page_, 1, &num_read);
+  if (entries == nullptr || num_read != 1) {
     return absl::StatusCode::kUnavailable;
   }
+  flags = entries[0];
+  ++next_page_;
   return absl::StatusCode::kOk;
 }
 
 absl::StatusCode PageFlags::MaybeReadOne(uintptr_t vaddr, uint64_t& flags,
                                          bool& is_huge) {
-  if (auto res = Seek(vaddr); res != absl::StatusCode::kOk) return res;
-  static_assert(sizeof(flags) == kPagemapEntrySize);
-  auto status = signal_safe_read(fd_, reinterpret_cast<char*>(&flags),
-                                 kPagemapEntrySize, nullptr);
-  if (status != kPagemapEntrySize) {
-    return absl::StatusCode::kUnavailable;
-  }
+  Seek(vaddr);
+  if (auto res = ReadNext(flags); res != absl::StatusCode::kOk) return res;
 
   if (ABSL_PREDICT_FALSE((PageHead(flags) || PageTail(flags)) &&
                          !PageThp(flags))) {
@@ -122,14 +117,8 @@ absl::StatusCode PageFlags::MaybeReadOne(uintptr_t vaddr, uint64_t& flags,
   }
 
   if (PageTail(flags)) {
-    if (auto res = Seek(vaddr & kHugePageMask); res != absl::StatusCode::kOk) {
-      return res;
-    }
-    auto status = signal_safe_read(fd_, reinterpret_cast<char*>(&flags),
-                                   kPagemapEntrySize, nullptr);
-    if (status != kPagemapEntrySize) {
-      return absl::StatusCode::kUnavailable;
-    }
+    Seek(vaddr & kHugePageMask);
+    if (auto res = ReadNext(flags); res != absl::StatusCode::kOk) return res;
     if (ABSL_PREDICT_FALSE(PageTail(flags))) {
       Log(kLog, __FILE__, __LINE__,
           "Somehow still at tail page even after seeking?");
@@ -150,33 +139,32 @@ absl::StatusCode PageFlags::MaybeReadOne(uintptr_t vaddr, uint64_t& flags,
 
 absl::StatusCode PageFlags::ReadMany(int64_t num_pages, PageStats& output) {
   while (num_pages > 0) {
-    const size_t batch_size = std::min<int64_t>(kEntriesInBuf, num_pages);
-    const size_t to_read = kPagemapEntrySize * batch_size;
-
     // We read continuously. For the first read, this starts at wherever the
-    // first ReadOne ended. See above note for the reinterpret_cast.
-    auto status =
-        signal_safe_read(fd_, reinterpret_cast<char*>(buf_), to_read, nullptr);
-    if (status != to_read) {
+    // first MaybeReadOne ended.
+    size_t batch_size;
+    const uint64_t* entries =
+        buffer_.Read(fd_, next_page_, num_pages, &batch_size);
+    if (entries == nullptr || batch_size == 0) {
       return absl::StatusCode::kUnavailable;
     }
     for (int i = 0; i < batch_size; ++i) {
-      if (PageHead(buf_[i])) {
-        last_head_read_ = buf_[i];
+      if (PageHead(entries[i])) {
+        last_head_read_ = entries[i];
       }
 
-      if (PageTail(buf_[i])) {
+      if (PageTail(entries[i])) {
         if (ABSL_PREDICT_FALSE(last_head_read_ == -1)) {
           Log(kLog, __FILE__, __LINE__,
-              "Did not see head page before tail page", i, buf_[i]);
+              "Did not see head page before tail page", i, entries[i]);
           return absl::StatusCode::kFailedPrecondition;
         }
         auto last_read = last_head_read_;
         MaybeAddToStats(output, last_read, kPageSize);
       } else {
-        MaybeAddToStats(output, buf_[i], kPageSize);
+        MaybeAddToStats(output, entries[i], kPageSize);
       }
     }
+    next_page_ += batch_size;
     num_pages -= batch_size;
   }
   return absl::StatusCode::kOk;
@@ -257,10 +245,7 @@ std::optional<PageFlags::PageStats> PageFlags::Get(const void* const addr,
     // pages. So the next page that is of interest is one hugepage away -- seek
     // to make sure the next read doesn't double-count the native pages in
     // between the two head pages.
-    if (auto res = Seek((basePage & kHugePageMask) + kHugePageSize);
-        res != absl::StatusCode::kOk) {
-      return std::nullopt;
-    }
+    Seek((basePage & kHugePageMask) + kHugePageSize);
   } else {
     remainingPages--;
     MaybeAddToStats(ret, result_flags, firstPageSize);
@@ -28,6 +28,7 @@
 #include "absl/status/status.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pagemap_buffer.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -75,9 +76,12 @@ class PageFlags {
   std::optional<PageStats> Get(const void* addr, size_t size);
 
  private:
-  // This helper seeks the internal file to the correct location for the given
-  // virtual address.
-  [[nodiscard]] absl::StatusCode Seek(uintptr_t vaddr);
+  // This helper sets the page that the next read starts at to the one
+  // containing the given virtual address.
+  void Seek(uintptr_t vaddr) { next_page_ = vaddr / kPageSize; }
+
+  // Reads the flags of the page that the next read starts at.
+  absl::StatusCode ReadNext(uint64_t& flags);
 
   // Tries to read staleness information about the page that contains vaddr.
   // Possibly seeks backwards in an effort to find head hugepages.
@@ -85,18 +89,13 @@ class PageFlags {
                                 bool& is_huge);
   // This helper reads staleness information for `num_pages` worth of _full_
   // pages and puts the results into `output`. It continues the read from the
-  // last Seek() or last Read operation.
+  // last Seek() or last Read operation, in as few reads as the buffer allows.
   absl::StatusCode ReadMany(int64_t num_pages, PageStats& output);
 
   // For testing.
   friend class PageFlagsFriend;
   explicit PageFlags(const char* alternate_filename);
 
-  // Size of the buffer used to gather results.
-  static constexpr int kBufferLength = 4096;
-  static constexpr int kPagemapEntrySize = 8;
-  static constexpr int kEntriesInBuf = kBufferLength / kPagemapEntrySize;
-
   const size_t kPageSize = GetPageSize();
   // You can technically not hard-code this but it would involve many more
   // queries to figure out the size of every page. It's a lot easier to just
@@ -105,7 +104,9 @@ class PageFlags {
   static constexpr uintptr_t kHugePageMask = ~(kHugePageSize - 1);
   const size_t kPagesInHugePage = kHugePageSize / kPageSize;
 
-  uint64_t buf_[kEntriesInBuf];
+  PagemapBuffer buffer_;
+  // The page that the next read starts at.
+  uint64_t next_page_ = 0;
   // Information about the previous head page. For any future-encountered tail
   // pages, we use the information from this page to determine staleness of the
   // tail page.
@@ -0,0 +1,71 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/pagemap_buffer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include <algorithm>
+
+#include "absl/numeric/bits.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/syscall_stats.h"
+#include "tcmalloc/internal/util.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+PagemapBuffer::~PagemapBuffer() {
+  if (buf_ != inline_) {
+    CountedMunmap(buf_, capacity_ * kEntrySize);
+  }
+}
+
+void PagemapBuffer::Grow(size_t n) {
+  const size_t capacity = std::min(absl::bit_ceil(n), kMaxEntries);
+  if (capacity <= capacity_) return;
+
+  void* buf =
+      CountedMmap(nullptr, capacity * kEntrySize, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) return;
+  if (buf_ != inline_) {
+    CountedMunmap(buf_, capacity_ * kEntrySize);
+  }
+  buf_ = static_cast<uint64_t*>(buf);
+  capacity_ = capacity;
+}
+
+const uint64_t* PagemapBuffer::Read(int fd, uint64_t page, size_t n,
+                                    size_t* read) {
+  if (n > capacity_) Grow(n);
+  n = std::min(n, capacity_);
+
+  // The files are a sequence of 64-bit values in machine endianness, so we
+  // read them straight into the buffer.
+  const ssize_t bytes =
+      signal_safe_pread(fd, reinterpret_cast<char*>(buf_), n * kEntrySize,
+                        static_cast<off_t>(page * kEntrySize));
+  if (bytes < 0) return nullptr;
+  *read = bytes / kEntrySize;
+  return buf_;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
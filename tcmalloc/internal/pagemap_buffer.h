@@ -0,0 +1,70 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_PAGEMAP_BUFFER_H_
+#define TCMALLOC_INTERNAL_PAGEMAP_BUFFER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Reads files that hold one 64-bit entry per page of the address space, such as
+// /proc/self/pagemap.
+//
+// Reads start out in a small inline buffer.  Once a read asks for more entries
+// than fit, the buffer is replaced by a larger one from mmap, up to
+// kMaxEntries, so that scanning a large range takes a few large reads rather
+// than one read per kInlineEntries pages.  If mmap fails, reads continue in the
+// buffer at hand.  Does not allocate from malloc, and is not thread-safe.
+class PagemapBuffer {
+ public:
+  static constexpr size_t kEntrySize = sizeof(uint64_t);
+  static constexpr size_t kInlineEntries = 512;
+  // 1 MiB, which covers 512 MiB of 4 KiB pages.
+  static constexpr size_t kMaxEntries = 128 << 10;
+
+  PagemapBuffer() = default;
+  ~PagemapBuffer();
+
+  PagemapBuffer(const PagemapBuffer&) = delete;
+  PagemapBuffer& operator=(const PagemapBuffer&) = delete;
+
+  // Reads the entries of fd for up to n pages, starting with page, and returns
+  // them, or nullptr on error.  Sets *read to the number of entries read, which
+  // is less than n if the buffer is smaller, and 0 at end of file.  The entries
+  // stay valid until the next call.
+  const uint64_t* Read(int fd, uint64_t page, size_t n, size_t* read);
+
+  // The number of entries that fit in the buffer.
+  size_t capacity() const { return capacity_; }
+
+ private:
+  // Replaces the buffer with one that holds at least n entries, if possible.
+  void Grow(size_t n);
+
+  uint64_t inline_[kInlineEntries];
+  uint64_t* buf_ = inline_;
+  size_t capacity_ = kInlineEntries;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_PAGEMAP_BUFFER_H_
@@ -0,0 +1,117 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/pagemap_buffer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+class PagemapBufferTest : public ::testing::Test {
+ protected:
+  // Writes a file whose entry for page i is i.
+  void SetUp() override {
+    char path[] = "/tmp/pagemap_buffer_test.XXXXXX";
+    fd_ = mkstemp(path);
+    ASSERT_NE(fd_, -1);
+    unlink(path);
+
+    std::vector<uint64_t> entries(kNumEntries);
+    for (size_t i = 0; i < kNumEntries; ++i) {
+      entries[i] = i;
+    }
+    const size_t bytes = entries.size() * sizeof(entries[0]);
+    ASSERT_EQ(write(fd_, entries.data(), bytes), bytes);
+  }
+
+  void TearDown() override { close(fd_); }
+
+  static constexpr size_t kNumEntries = 3 * PagemapBuffer::kMaxEntries;
+  int fd_;
+};
+
+TEST_F(PagemapBufferTest, SmallReadsStayInline) {
+  PagemapBuffer buffer;
+  size_t read;
+  const uint64_t* entries = buffer.Read(fd_, 10, 5, &read);
+  ASSERT_NE(entries, nullptr);
+  ASSERT_EQ(read, 5);
+  for (size_t i = 0; i < read; ++i) {
+    EXPECT_EQ(entries[i], 10 + i);
+  }
+  EXPECT_EQ(buffer.capacity(), PagemapBuffer::kInlineEntries);
+}
+
+TEST_F(PagemapBufferTest, GrowsForLargeReads) {
+  PagemapBuffer buffer;
+  size_t read;
+  const uint64_t* entries = buffer.Read(fd_, 7, 5000, &read);
+  ASSERT_NE(entries, nullptr);
+  ASSERT_EQ(read, 5000);
+  EXPECT_EQ(buffer.capacity(), 8192);
+  for (size_t i = 0; i < read; ++i) {
+    ASSERT_EQ(entries[i], 7 + i);
+  }
+}
+
+TEST_F(PagemapBufferTest, ReadsAreCappedAtMaxEntries) {
+  PagemapBuffer buffer;
+  uint64_t page = 1;
+  size_t remaining = kNumEntries - page;
+  int reads = 0;
+  while (remaining > 0) {
+    size_t read;
+    const uint64_t* entries = buffer.Read(fd_, page, remaining, &read);
+    ASSERT_NE(entries, nullptr);
+    ASSERT_GT(read, 0);
+    ASSERT_LE(read, PagemapBuffer::kMaxEntries);
+    EXPECT_EQ(entries[0], page);
+    EXPECT_EQ(entries[read - 1], page + read - 1);
+    page += read;
+    remaining -= read;
+    ++reads;
+  }
+  EXPECT_EQ(reads, 3);
+  EXPECT_EQ(buffer.capacity(), PagemapBuffer::kMaxEntries);
+}
+
+TEST_F(PagemapBufferTest, EndOfFile) {
+  PagemapBuffer buffer;
+  size_t read;
+  ASSERT_NE(buffer.Read(fd_, kNumEntries - 2, 5, &read), nullptr);
+  EXPECT_EQ(read, 2);
+  ASSERT_NE(buffer.Read(fd_, kNumEntries, 5, &read), nullptr);
+  EXPECT_EQ(read, 0);
+}
+
+TEST(PagemapBufferErrorTest, BadFile) {
+  PagemapBuffer buffer;
+  size_t read;
+  EXPECT_EQ(buffer.Read(-1, 0, 1, &read), nullptr);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
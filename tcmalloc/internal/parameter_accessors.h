@@ -92,6 +92,14 @@ ABSL_ATTRIBUTE_WEAK void
 TCMalloc_Internal_SetPerCpuCachesDynamicSlabShrinkThreshold(double v);
 ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetMadviseFree();
 ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetMadviseFree(bool v);
+ABSL_ATTRIBUTE_WEAK size_t TCMalloc_Internal_GetSampledQuarantineBytes();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSampledQuarantineBytes(size_t v);
+ABSL_ATTRIBUTE_WEAK size_t TCMalloc_Internal_GetGuardedPagePoolSize();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetGuardedPagePoolSize(size_t v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetSlowPathLatencyHistograms();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetSlowPathLatencyHistograms(bool v);
+ABSL_ATTRIBUTE_WEAK bool TCMalloc_Internal_GetHotSiteCacheHints();
+ABSL_ATTRIBUTE_WEAK void TCMalloc_Internal_SetHotSiteCacheHints(bool v);
 }
 
 #endif  // TCMALLOC_INTERNAL_PARAMETER_ACCESSORS_H_
@@ -97,6 +97,16 @@ inline size_t GetSlabsAllocSize(Shift shift, int num_cpus) {
   return static_cast<size_t>(num_cpus) << ToUint8(shift);
 }
 
+// The number of words each size class' slab header occupies.  With
+// TCMALLOC_PER_CPU_CLASS_COUNTERS the header is followed by counts of the Pops
+// and Pushes that succeeded on the fast path.  Four words keep each header and
+// its counts within one cache line, so counting touches no other line.
+#ifdef TCMALLOC_PER_CPU_CLASS_COUNTERS
+inline constexpr size_t kSlabHeaderWords = 4;
+#else
+inline constexpr size_t kSlabHeaderWords = 1;
+#endif
+
 // Since we lazily initialize our slab, we expect it to be mmap'd and not
 // resident.  We align it to a page size so neighboring allocations (from
 // TCMalloc's internal arena) do not necessarily cause the metadata to be
@@ -125,13 +135,21 @@ class TcmallocSlab {
 
   // We use a single continuous region of memory for all slabs on all CPUs.
   // This region is split into NumCPUs regions of size kPerCpuMem (256k).
-  // First NumClasses words of each CPU region are occupied by slab
-  // headers (Header struct). The remaining memory contain slab arrays.
+  // First NumClasses * kSlabHeaderWords words of each CPU region are occupied
+  // by slab headers (Header struct, followed by the fast path counts if there
+  // are any). The remaining memory contain slab arrays.
   struct Slabs {
-    std::atomic<int64_t> header[NumClasses];
+    std::atomic<int64_t> header[NumClasses * kSlabHeaderWords];
     void* mem[];
   };
 
+  // Pops and Pushes of one cpu/size_class slab that succeeded on the fast
+  // path, as counted by CountFastPath.
+  struct FastPathCounts {
+    uint64_t pops = 0;
+    uint64_t pushes = 0;
+  };
+
   constexpr TcmallocSlab() = default;
 
   // Init must be called before any other methods.
@@ -203,6 +221,16 @@ class TcmallocSlab {
   // invokes <underflow_handler> and returns its result.
   ABSL_MUST_USE_RESULT void* Pop(size_t class_size);
 
+  // Counts a Pop (<is_pop>) or Push of <size_class> that just succeeded in
+  // the slab header of the cached CPU.  The count is a relaxed load and store,
+  // so it may be lost if the thread is preempted in between.  No-op unless
+  // kSlabHeaderWords > 1.
+  static void CountFastPath(size_t size_class, bool is_pop);
+
+  // Returns the fast path counts of cpu/size_class.  Always 0 unless
+  // kSlabHeaderWords > 1.
+  FastPathCounts GetFastPathCounts(int cpu, size_t size_class) const;
+
   // Add up to <len> items to the current cpu slab from the array located at
   // <batch>. Returns the number of items that were added (possibly 0). All
   // items not added will be returned at the start of <batch>. Items are not
@@ -703,7 +731,9 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE bool TcmallocSlab<NumClasses>::Push(
   // annotation.
   TSANRelease(item);
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
-  return TcmallocSlab_Internal_Push(size_class, item);
+  // The rseq code indexes the 8-byte header words, so scale size_class by the
+  // header size.
+  return TcmallocSlab_Internal_Push(size_class * kSlabHeaderWords, item);
 #else
   return false;
 #endif
@@ -786,7 +816,7 @@ inline ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
 #if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
         [cached_slabs_mask] "r"(TCMALLOC_CACHED_SLABS_MASK),
 #endif
-        [size_class] "r"(size_class)
+        [size_class] "r"(size_class * kSlabHeaderWords)
       : "cc", "memory"
 #if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
       : underflow_path
@@ -872,7 +902,8 @@ ABSL_ATTRIBUTE_ALWAYS_INLINE void* TcmallocSlab<NumClasses>::Pop(
 #if !TCMALLOC_INTERNAL_PERCPU_USE_RSEQ_ASM_GOTO_OUTPUT
         [cached_slabs_mask] "r"(TCMALLOC_CACHED_SLABS_MASK),
 #endif
-        [size_class] "r"(size_class), [size_class_lsl3] "r"(size_class << 3)
+        [size_class] "r"(size_class),
+        [size_class_lsl3] "r"((size_class * kSlabHeaderWords) << 3)
       // Add x16 and x17 as an explicit clobber registers:
       // The RSEQ code above uses non-local branches in the restart sequence
       // which is located inside .text.unlikely. The maximum distance of B
@@ -975,14 +1006,16 @@ inline size_t TcmallocSlab<NumClasses>::PushBatch(size_t size_class,
   //
   // This oversynchronizes slightly, since PushBatch may succeed only partially.
   TSANReleaseBatch(batch, len);
-  return TcmallocSlab_Internal_PushBatch(size_class, batch, len);
+  return TcmallocSlab_Internal_PushBatch(size_class * kSlabHeaderWords, batch,
+                                         len);
 }
 
 template <size_t NumClasses>
 inline size_t TcmallocSlab<NumClasses>::PopBatch(size_t size_class,
                                                  void** batch, size_t len) {
   ASSERT(len != 0);
-  const size_t n = TcmallocSlab_Internal_PopBatch(size_class, batch, len);
+  const size_t n =
+      TcmallocSlab_Internal_PopBatch(size_class * kSlabHeaderWords, batch, len);
   ASSERT(n <= len);
 
   // PopBatch is implemented in assembly, msan does not know that the returned
@@ -992,6 +1025,38 @@ inline size_t TcmallocSlab<NumClasses>::PopBatch(size_t size_class,
   return n;
 }
 
+template <size_t NumClasses>
+inline ABSL_ATTRIBUTE_ALWAYS_INLINE void
+TcmallocSlab<NumClasses>::CountFastPath(size_t size_class, bool is_pop) {
+#if TCMALLOC_INTERNAL_PERCPU_USE_RSEQ
+  if (kSlabHeaderWords == 1) return;
+  // The Pop or Push just succeeded, so tcmalloc_slabs almost always still
+  // caches the region it used, and the header it wrote is in cache.  If the
+  // thread was preempted and the region uncached, we drop the count.
+  const uintptr_t slabs = tcmalloc_slabs;
+  if (ABSL_PREDICT_FALSE((slabs & TCMALLOC_CACHED_SLABS_MASK) == 0)) return;
+  std::atomic<int64_t>* hdrp =
+      reinterpret_cast<Slabs*>(slabs & ~TCMALLOC_CACHED_SLABS_MASK)->header +
+      size_class * kSlabHeaderWords;
+  std::atomic<int64_t>& count = hdrp[is_pop ? 1 : 2];
+  count.store(count.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+#endif
+}
+
+template <size_t NumClasses>
+inline auto TcmallocSlab<NumClasses>::GetFastPathCounts(int cpu,
+                                                        size_t size_class) const
+    -> FastPathCounts {
+  FastPathCounts counts;
+  if (kSlabHeaderWords == 1) return counts;
+  const auto [slabs, shift] = GetSlabsAndShift(std::memory_order_relaxed);
+  std::atomic<int64_t>* hdrp = GetHeader(slabs, shift, cpu, size_class);
+  counts.pops = hdrp[1].load(std::memory_order_relaxed);
+  counts.pushes = hdrp[2].load(std::memory_order_relaxed);
+  return counts;
+}
+
 template <size_t NumClasses>
 inline auto TcmallocSlab<NumClasses>::CpuMemoryStart(Slabs* slabs, Shift shift,
                                                      int cpu) -> Slabs* {
@@ -1002,7 +1067,8 @@ inline auto TcmallocSlab<NumClasses>::CpuMemoryStart(Slabs* slabs, Shift shift,
 template <size_t NumClasses>
 inline std::atomic<int64_t>* TcmallocSlab<NumClasses>::GetHeader(
     Slabs* slabs, Shift shift, int cpu, size_t size_class) {
-  return &CpuMemoryStart(slabs, shift, cpu)->header[size_class];
+  return &CpuMemoryStart(slabs, shift, cpu)
+              ->header[size_class * kSlabHeaderWords];
 }
 
 template <size_t NumClasses>
@@ -1269,10 +1335,22 @@ auto TcmallocSlab<NumClasses>::ResizeSlabs(
   // Phase 3: Atomically update slabs and shift.
   slabs_and_shift_.store({new_slabs, new_shift}, std::memory_order_relaxed);
 
-  // Phase 4: Return pointers from the old slab to the TransferCache.
+  // Phase 4: Return pointers from the old slab to the TransferCache, and add
+  // the fast path counts to the new slab, which may have counted some already.
   for (size_t cpu = 0; cpu < num_cpus; ++cpu) {
     if (!populated(cpu)) continue;
     DrainCpu(old_slabs, old_shift, cpu, &resize_begins_[cpu][0], drain_handler);
+    for (size_t size_class = 0;
+         kSlabHeaderWords > 1 && size_class < NumClasses; ++size_class) {
+      std::atomic<int64_t>* old_hdrp =
+          GetHeader(old_slabs, old_shift, cpu, size_class);
+      std::atomic<int64_t>* new_hdrp =
+          GetHeader(new_slabs, new_shift, cpu, size_class);
+      for (size_t word = 1; word < kSlabHeaderWords; ++word) {
+        new_hdrp[word].fetch_add(old_hdrp[word].load(std::memory_order_relaxed),
+                                 std::memory_order_relaxed);
+      }
+    }
   }
 
   // Phase 5: Update all the `current` values to 0 and fence all CPUs. In RSEQ
@@ -0,0 +1,68 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// Helpers to fill freed memory with a pattern and to find bytes that were
+// written after it was freed.
+
+#ifndef TCMALLOC_INTERNAL_POISON_H_
+#define TCMALLOC_INTERNAL_POISON_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Fills [p, p + n) with pattern.
+inline void Poison(void* p, size_t n, uint8_t pattern) {
+  memset(p, pattern, n);
+}
+
+// Returns the offset of the first byte of [p, p + n) that differs from
+// pattern, or n if all of them match.
+//
+// The common case is that nothing was written, so whole blocks are checked by
+// OR-ing the XOR of each word with the pattern, without branching per word.
+// The compiler vectorizes the block loop on targets with vector registers.
+inline size_t FindUnpoisoned(const void* p, size_t n, uint8_t pattern) {
+  constexpr size_t kWords = 8;
+  constexpr size_t kBlock = kWords * sizeof(uint64_t);
+  const uint64_t expected = 0x0101010101010101ull * pattern;
+  const unsigned char* const bytes = static_cast<const unsigned char*>(p);
+
+  size_t offset = 0;
+  for (; offset + kBlock <= n; offset += kBlock) {
+    uint64_t words[kWords];
+    memcpy(words, bytes + offset, kBlock);
+    uint64_t diff = 0;
+    for (size_t i = 0; i < kWords; ++i) {
+      diff |= words[i] ^ expected;
+    }
+    if (diff != 0) break;
+  }
+  for (; offset < n; ++offset) {
+    if (bytes[offset] != pattern) return offset;
+  }
+  return n;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_POISON_H_
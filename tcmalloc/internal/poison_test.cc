@@ -0,0 +1,67 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/poison.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr uint8_t kPattern = 0xa5;
+
+TEST(PoisonTest, Empty) {
+  EXPECT_EQ(FindUnpoisoned(nullptr, 0, kPattern), 0);
+}
+
+TEST(PoisonTest, FindsEveryOffset) {
+  // Cover sizes that are not a multiple of the block size, and writes in both
+  // the blocks and the tail.
+  for (size_t size : {1, 7, 63, 64, 65, 200, 4096}) {
+    std::vector<uint8_t> buffer(size);
+    Poison(buffer.data(), size, kPattern);
+    EXPECT_EQ(FindUnpoisoned(buffer.data(), size, kPattern), size);
+
+    for (size_t offset = 0; offset < size; ++offset) {
+      buffer[offset] = kPattern ^ 1;
+      EXPECT_EQ(FindUnpoisoned(buffer.data(), size, kPattern), offset)
+          << size;
+      buffer[offset] = kPattern;
+    }
+  }
+}
+
+TEST(PoisonTest, ReportsFirstWrite) {
+  std::vector<uint8_t> buffer(256);
+  Poison(buffer.data(), buffer.size(), kPattern);
+  buffer[130] = 0;
+  buffer[70] = 0;
+  EXPECT_EQ(FindUnpoisoned(buffer.data(), buffer.size(), kPattern), 70);
+}
+
+TEST(PoisonTest, Unaligned) {
+  std::vector<uint8_t> buffer(300);
+  Poison(buffer.data(), buffer.size(), kPattern);
+  buffer[3 + 100] = 0;
+  EXPECT_EQ(FindUnpoisoned(buffer.data() + 3, 290, kPattern), 100);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
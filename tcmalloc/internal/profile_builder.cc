@@ -40,6 +40,7 @@
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "tcmalloc/internal/profile.pb.h"
 #include "absl/base/attributes.h"
@@ -47,6 +48,7 @@
 #include "absl/status/status.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/residency.h"
 
@@ -135,56 +137,63 @@ using SampleMergedMap =
     absl::flat_hash_map<const tcmalloc::Profile::Sample, SampleMergedData,
                         SampleHashWithSubFields, SampleEqWithSubFields>;
 
-SampleMergedMap MergeProfileSamplesAndMaybeGetResidencyInfo(
-    const tcmalloc::Profile& profile, PageFlags* pageflags,
-    Residency* residency) {
-  SampleMergedMap map;
-
-  profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
-    SampleMergedData& data = map[entry];
-    data.count += entry.count;
-    data.sum += entry.sum;
-    if (residency) {
-      auto residency_info =
-          residency->Get(entry.span_start_address, entry.allocated_size);
-      // As long as `residency_info` provides data in some samples, the merged
-      // data will have their sums.
-      // NOTE: The data here is comparable to `tcmalloc::Profile::Sample::sum`,
-      // not to `tcmalloc::Profile::Sample::requested_size` (it's pre-multiplied
-      // by count and represents all of the resident memory).
-      if (residency_info.has_value()) {
-        size_t resident_size = entry.count * residency_info->bytes_resident;
-        size_t swapped_size = entry.count * residency_info->bytes_swapped;
-        if (!data.resident_size.has_value()) {
-          data.resident_size = resident_size;
-          data.swapped_size = swapped_size;
-        } else {
-          data.resident_size.value() += resident_size;
-          data.swapped_size.value() += swapped_size;
-        }
+// Adds entry to data, along with its residency information if residency and
+// pageflags are provided.
+void AccumulateSample(const tcmalloc::Profile::Sample& entry,
+                      PageFlags* pageflags, Residency* residency,
+                      SampleMergedData& data) {
+  data.count += entry.count;
+  data.sum += entry.sum;
+  if (residency) {
+    auto residency_info =
+        residency->Get(entry.span_start_address, entry.allocated_size);
+    // As long as `residency_info` provides data in some samples, the merged
+    // data will have their sums.
+    // NOTE: The data here is comparable to `tcmalloc::Profile::Sample::sum`,
+    // not to `tcmalloc::Profile::Sample::requested_size` (it's pre-multiplied
+    // by count and represents all of the resident memory).
+    if (residency_info.has_value()) {
+      size_t resident_size = entry.count * residency_info->bytes_resident;
+      size_t swapped_size = entry.count * residency_info->bytes_swapped;
+      if (!data.resident_size.has_value()) {
+        data.resident_size = resident_size;
+        data.swapped_size = swapped_size;
+      } else {
+        data.resident_size.value() += resident_size;
+        data.swapped_size.value() += swapped_size;
       }
     }
+  }
 
-    // TODO(b/266739315): This is "tested" by the fact that it is a clone of the
-    // above logic. But that's not sufficient -- we need to refactor this code
-    // to actually allow pageflags to return a non-zero number. Until then, be
-    // very careful while changing the below -- it needs to match entirely the
-    // form above.
-    if (pageflags) {
-      auto page_stats =
-          pageflags->Get(entry.span_start_address, entry.allocated_size);
-      if (page_stats.has_value()) {
-        if (!data.stale_size.has_value()) {
-          data.stale_size.emplace();
-        }
-        data.stale_size.value() += entry.count * page_stats->bytes_stale;
+  // TODO(b/266739315): This is "tested" by the fact that it is a clone of the
+  // above logic. But that's not sufficient -- we need to refactor this code
+  // to actually allow pageflags to return a non-zero number. Until then, be
+  // very careful while changing the below -- it needs to match entirely the
+  // form above.
+  if (pageflags) {
+    auto page_stats =
+        pageflags->Get(entry.span_start_address, entry.allocated_size);
+    if (page_stats.has_value()) {
+      if (!data.stale_size.has_value()) {
+        data.stale_size.emplace();
+      }
+      data.stale_size.value() += entry.count * page_stats->bytes_stale;
 
-        if (!data.locked_size.has_value()) {
-          data.locked_size.emplace();
-        }
-        data.locked_size.value() += entry.count * page_stats->bytes_locked;
+      if (!data.locked_size.has_value()) {
+        data.locked_size.emplace();
       }
+      data.locked_size.value() += entry.count * page_stats->bytes_locked;
     }
+  }
+}
+
+SampleMergedMap MergeProfileSamplesAndMaybeGetResidencyInfo(
+    const tcmalloc::Profile& profile, PageFlags* pageflags,
+    Residency* residency) {
+  SampleMergedMap map;
+
+  profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
+    AccumulateSample(entry, pageflags, residency, map[entry]);
   });
   return map;
 }
@@ -326,7 +335,7 @@ int ProfileBuilder::InternString(absl::string_view sv) {
     return 0;
   }
 
-  const int index = profile_->string_table_size();
+  const int index = flushed_strings_ + profile_->string_table_size();
   const auto inserted = strings_.emplace(sv, index);
   if (!inserted.second) {
     // Failed to insert -- use existing id.
@@ -336,68 +345,143 @@ int ProfileBuilder::InternString(absl::string_view sv) {
   return index;
 }
 
-int ProfileBuilder::InternLocation(const void* ptr) {
-  uintptr_t address = absl::bit_cast<uintptr_t>(ptr);
-
-  // Avoid assigning location ID 0 by incrementing by 1.
-  const int index = profile_->location_size() + 1;
-  const auto inserted = locations_.emplace(address, index);
-  if (!inserted.second) {
-    // Failed to insert -- use existing id.
-    return inserted.first->second;
-  }
-  perftools::profiles::Location& location = *profile_->add_location();
-  ASSERT(inserted.first->second == index);
-  location.set_id(index);
-  location.set_address(address);
-
+int ProfileBuilder::FindMappingId(uintptr_t address) const {
   if (mappings_.empty()) {
-    return index;
+    return 0;
   }
 
-  // Find the mapping ID.
   auto it = mappings_.upper_bound(address);
   if (it != mappings_.begin()) {
     --it;
   }
 
   // If *it contains address, add mapping to location.
-  const int mapping_index = it->second;
-  const perftools::profiles::Mapping& mapping =
-      profile_->mapping(mapping_index);
-  const int mapping_id = mapping.id();
-  ASSERT(it->first == mapping.memory_start());
+  const MappingInfo& mapping = it->second;
+  if (it->first <= address && address < mapping.memory_limit) {
+    return mapping.id;
+  }
+  return 0;
+}
 
-  if (it->first <= address && address < mapping.memory_limit()) {
+int ProfileBuilder::AddLocation(uintptr_t address, int mapping_id) {
+  // Avoid assigning location ID 0 by incrementing by 1.
+  const int index = flushed_locations_ + profile_->location_size() + 1;
+  const bool inserted = locations_.emplace(address, index).second;
+  ASSERT(inserted);
+  (void)inserted;
+
+  perftools::profiles::Location& location = *profile_->add_location();
+  location.set_id(index);
+  location.set_address(address);
+  if (mapping_id != 0) {
     location.set_mapping_id(mapping_id);
   }
-
   return index;
 }
 
+int ProfileBuilder::InternLocation(const void* ptr) {
+  uintptr_t address = absl::bit_cast<uintptr_t>(ptr);
+
+  auto it = locations_.find(address);
+  if (it != locations_.end()) {
+    return it->second;
+  }
+  return AddLocation(address, FindMappingId(address));
+}
+
 void ProfileBuilder::InternCallstack(absl::Span<const void* const> stack,
                                      perftools::profiles::Sample& sample) {
   // Profile addresses are raw stack unwind addresses, so they should be
   // adjusted by -1 to land inside the call instruction (although potentially
   // misaligned).
-  for (const void* frame : stack) {
-    int id = InternLocation(
-        absl::bit_cast<const void*>(absl::bit_cast<uintptr_t>(frame) - 1));
-    sample.add_location_id(id);
+  auto location_address = [](const void* frame) {
+    return absl::bit_cast<uintptr_t>(frame) - 1;
+  };
+
+  if (cached_mappings_ == nullptr) {
+    for (const void* frame : stack) {
+      int id = InternLocation(
+          absl::bit_cast<const void*>(location_address(frame)));
+      sample.add_location_id(id);
+    }
+    ASSERT(sample.location_id().size() == stack.size());
+    return;
+  }
+
+  // Look up the mappings of the locations that are new to this profile in the
+  // process-wide cache, in batches to take its lock only once per stack in the
+  // common case.
+  constexpr size_t kBatch = Profile::Sample::kMaxStackDepth;
+  while (!stack.empty()) {
+    const absl::Span<const void* const> batch = stack.subspan(0, kBatch);
+    stack.remove_prefix(batch.size());
+
+    uintptr_t missing[kBatch];
+    int mapping_indices[kBatch];
+    size_t num_missing = 0;
+    for (const void* frame : batch) {
+      const uintptr_t address = location_address(frame);
+      if (!locations_.contains(address)) {
+        missing[num_missing++] = address;
+      }
+    }
+    if (num_missing > 0) {
+      MappingCache::Global().LookupLocations(
+          *cached_mappings_, absl::MakeConstSpan(missing, num_missing),
+          absl::MakeSpan(mapping_indices, num_missing));
+    }
+
+    size_t next_missing = 0;
+    for (const void* frame : batch) {
+      const uintptr_t address = location_address(frame);
+      int id;
+      if (next_missing < num_missing && missing[next_missing] == address) {
+        const int mapping_index = mapping_indices[next_missing++];
+        // The same address may occur twice in the batch.
+        auto it = locations_.find(address);
+        if (it != locations_.end()) {
+          id = it->second;
+        } else {
+          id = AddLocation(address, mapping_index < 0
+                                        ? 0
+                                        : cached_mappings_base_id_ +
+                                              mapping_index);
+        }
+      } else {
+        id = locations_.find(address)->second;
+      }
+      sample.add_location_id(id);
+    }
   }
-  ASSERT(sample.location_id().size() == stack.size());
 }
 
-void ProfileBuilder::AddCurrentMappings() {
+namespace {
+
 #if defined(__linux__)
+// Reads the mappings of the loaded modules into mappings, reusing the file
+// names of previous, which was read earlier, for the mappings that did not
+// change.
+void ReadMappings(const MappingCache::Mappings* previous,
+                  MappingCache::Mappings& mappings) {
+  struct State {
+    const MappingCache::Mappings* previous;
+    MappingCache::Mappings& mappings;
+  } state{previous, mappings};
+
   auto dl_iterate_callback = +[](dl_phdr_info* info, size_t size, void* data) {
+    State& state = *static_cast<State*>(data);
+    if (size >= offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+      state.mappings.adds = info->dlpi_adds;
+      state.mappings.subs = info->dlpi_subs;
+    }
+
     // Skip dummy entry introduced since glibc 2.18.
     if (info->dlpi_phdr == nullptr && info->dlpi_phnum == 0) {
       return 0;
     }
 
-    ProfileBuilder& builder = *static_cast<ProfileBuilder*>(data);
-    const bool is_main_executable = builder.profile_->mapping_size() == 0;
+    const bool is_main_executable = state.mappings.mappings.empty();
+    const std::string build_id = GetBuildId(info);
 
     // Evaluate all the loadable segments.
     for (int i = 0; i < info->dlpi_phnum; ++i) {
@@ -413,6 +497,29 @@ void ProfileBuilder::AddCurrentMappings() {
       const size_t memory_limit = memory_start + pt_load->p_memsz;
       const size_t file_offset = pt_load->p_offset;
 
+      MappingCache::Mapping& mapping = state.mappings.mappings.emplace_back();
+      mapping.memory_start = memory_start;
+      mapping.memory_limit = memory_limit;
+      mapping.file_offset = file_offset;
+      mapping.build_id = build_id;
+
+      // Resolving the file name involves system calls, so reuse it if the
+      // same module is still loaded at the same address.
+      if (state.previous != nullptr && !build_id.empty()) {
+        bool found = false;
+        for (const auto& old : state.previous->mappings) {
+          if (old.memory_start == memory_start &&
+              old.memory_limit == memory_limit && old.build_id == build_id) {
+            mapping.filename = old.filename;
+            found = true;
+            break;
+          }
+        }
+        if (found) {
+          continue;
+        }
+      }
+
       // Storage for path to executable as dlpi_name isn't populated for the
       // main executable.  +1 to allow for the null terminator that readlink
       // does not add.
@@ -436,33 +543,190 @@ void ProfileBuilder::AddCurrentMappings() {
       }
 
       char resolved_path[PATH_MAX];
-      absl::string_view resolved_filename;
       if (realpath(filename, resolved_path)) {
-        resolved_filename = resolved_path;
-      } else {
-        resolved_filename = filename;
+        mapping.filename = resolved_path;
+      } else if (filename != nullptr) {
+        mapping.filename = filename;
       }
-
-      const std::string build_id = GetBuildId(info);
-
-      // Add to profile.
-      builder.AddMapping(memory_start, memory_limit, file_offset,
-                         resolved_filename, build_id);
     }
     // Keep going.
     return 0;
   };
 
-  dl_iterate_phdr(dl_iterate_callback, this);
+  dl_iterate_phdr(dl_iterate_callback, &state);
+}
+
+// Reads the dlpi_adds and dlpi_subs counters of dl_iterate_phdr.  Returns
+// false if they are not available.
+bool ReadLoadCounters(uint64_t& adds, uint64_t& subs) {
+  struct Counters {
+    uint64_t adds;
+    uint64_t subs;
+  } counters;
+  auto dl_iterate_callback = +[](dl_phdr_info* info, size_t size, void* data) {
+    if (size < offsetof(dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+      return -1;
+    }
+    Counters& counters = *static_cast<Counters*>(data);
+    counters.adds = info->dlpi_adds;
+    counters.subs = info->dlpi_subs;
+    // The counters are the same for every module, so stop here.
+    return 1;
+  };
+  if (dl_iterate_phdr(dl_iterate_callback, &counters) != 1) {
+    return false;
+  }
+  adds = counters.adds;
+  subs = counters.subs;
+  return true;
+}
 #endif  // defined(__linux__)
+
+}  // namespace
+
+MappingCache& MappingCache::Global() {
+  static MappingCache* cache = new MappingCache();
+  return *cache;
+}
+
+std::shared_ptr<const MappingCache::Mappings> MappingCache::Refresh() {
+  absl::MutexLock l(&mu_);
+#if defined(__linux__)
+  uint64_t adds, subs;
+  const bool have_counters = ReadLoadCounters(adds, subs);
+  if (mappings_ != nullptr && have_counters && mappings_->adds == adds &&
+      mappings_->subs == subs) {
+    return mappings_;
+  }
+
+  auto mappings = std::make_shared<Mappings>();
+  ReadMappings(mappings_.get(), *mappings);
+#else
+  if (mappings_ != nullptr) {
+    return mappings_;
+  }
+  auto mappings = std::make_shared<Mappings>();
+#endif  // defined(__linux__)
+
+  mappings->by_start.resize(mappings->mappings.size());
+  for (int i = 0; i < mappings->by_start.size(); ++i) {
+    mappings->by_start[i] = i;
+  }
+  std::sort(mappings->by_start.begin(), mappings->by_start.end(),
+            [&](int a, int b) {
+              return mappings->mappings[a].memory_start <
+                     mappings->mappings[b].memory_start;
+            });
+
+  // Keep the cached locations whose mapping is still there, identified by its
+  // build ID and address range.
+  if (mappings_ != nullptr && !locations_.empty()) {
+    absl::flat_hash_map<int, int> new_index;
+    for (int i = 0; i < mappings_->mappings.size(); ++i) {
+      const Mapping& old = mappings_->mappings[i];
+      if (old.build_id.empty()) continue;
+      const int j = FindMapping(*mappings, old.memory_start);
+      if (j < 0) continue;
+      const Mapping& current = mappings->mappings[j];
+      if (current.memory_start == old.memory_start &&
+          current.memory_limit == old.memory_limit &&
+          current.build_id == old.build_id) {
+        new_index[i] = j;
+      }
+    }
+    for (auto it = locations_.begin(); it != locations_.end();) {
+      // Addresses outside of any mapping may now be covered by a new one, so
+      // they are dropped as well.
+      auto new_it = new_index.find(it->second);
+      if (new_it == new_index.end()) {
+        locations_.erase(it++);
+      } else {
+        it->second = new_it->second;
+        ++it;
+      }
+    }
+  }
+
+  mappings_ = std::move(mappings);
+  return mappings_;
+}
+
+int MappingCache::FindMapping(const Mappings& mappings, uintptr_t address) {
+  auto it = std::upper_bound(mappings.by_start.begin(), mappings.by_start.end(),
+                             address, [&](uintptr_t address, int index) {
+                               return address <
+                                      mappings.mappings[index].memory_start;
+                             });
+  if (it == mappings.by_start.begin()) {
+    return -1;
+  }
+  --it;
+  const Mapping& mapping = mappings.mappings[*it];
+  if (mapping.memory_start <= address && address < mapping.memory_limit) {
+    return *it;
+  }
+  return -1;
+}
+
+void MappingCache::LookupLocations(const Mappings& mappings,
+                                   absl::Span<const uintptr_t> addresses,
+                                   absl::Span<int> indices) {
+  ASSERT(addresses.size() == indices.size());
+  absl::MutexLock l(&mu_);
+  if (&mappings != mappings_.get()) {
+    // The mappings have been read again since, so the cached indices refer to
+    // different ones.
+    for (size_t i = 0; i < addresses.size(); ++i) {
+      indices[i] = FindMapping(mappings, addresses[i]);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    auto it = locations_.find(addresses[i]);
+    if (it != locations_.end()) {
+      indices[i] = it->second;
+      continue;
+    }
+    indices[i] = FindMapping(mappings, addresses[i]);
+    if (locations_.size() >= kMaxLocations) {
+      // Start over rather than tracking recency: this only happens if the
+      // profiled stacks span more than kMaxLocations locations.
+      locations_.clear();
+    }
+    locations_.emplace(addresses[i], indices[i]);
+  }
+}
+
+size_t MappingCache::cached_locations() const {
+  absl::MutexLock l(&mu_);
+  return locations_.size();
+}
+
+void ProfileBuilder::AddCurrentMappings() {
+  const bool only_cached_mappings = mappings_.empty();
+  std::shared_ptr<const MappingCache::Mappings> mappings =
+      MappingCache::Global().Refresh();
+  const int base_id = flushed_mappings_ + profile_->mapping_size() + 1;
+  for (const MappingCache::Mapping& mapping : mappings->mappings) {
+    AddMapping(mapping.memory_start, mapping.memory_limit, mapping.file_offset,
+               mapping.filename, mapping.build_id);
+  }
+  if (only_cached_mappings) {
+    cached_mappings_ = std::move(mappings);
+    cached_mappings_base_id_ = base_id;
+  }
 }
 
 int ProfileBuilder::AddMapping(uintptr_t memory_start, uintptr_t memory_limit,
                                uintptr_t file_offset,
                                absl::string_view filename,
                                absl::string_view build_id) {
+  // Locations in this mapping would not be found in cached_mappings_.
+  cached_mappings_ = nullptr;
+
   perftools::profiles::Mapping& mapping = *profile_->add_mapping();
-  const int mapping_id = profile_->mapping_size();
+  const int mapping_id = flushed_mappings_ + profile_->mapping_size();
   mapping.set_id(mapping_id);
   mapping.set_memory_start(memory_start);
   mapping.set_memory_limit(memory_limit);
@@ -470,7 +734,7 @@ int ProfileBuilder::AddMapping(uintptr_t memory_start, uintptr_t memory_limit,
   mapping.set_filename(InternString(filename));
   mapping.set_build_id(InternString(build_id));
 
-  mappings_.emplace(memory_start, mapping_id - 1);
+  mappings_.emplace(memory_start, MappingInfo{memory_limit, mapping_id});
   return mapping_id;
 }
 
@@ -609,52 +873,74 @@ static void MakeLifetimeProfileProto(const tcmalloc::Profile& profile,
   });
 }
 
+bool ProfileBuilder::Flush(google::protobuf::io::ZeroCopyOutputStream* output) {
+  if (!profile_->SerializeToZeroCopyStream(output)) {
+    return false;
+  }
+  flushed_strings_ += profile_->string_table_size();
+  flushed_mappings_ += profile_->mapping_size();
+  flushed_locations_ += profile_->location_size();
+  profile_->Clear();
+  return true;
+}
+
 std::unique_ptr<perftools::profiles::Profile> ProfileBuilder::Finalize() && {
   return std::move(profile_);
 }
 
-absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
-    const ::tcmalloc::Profile& profile, PageFlags* pageflags,
-    Residency* residency) {
-  ProfileBuilder builder;
-  builder.AddCurrentMappings();
+namespace {
 
-  if (profile.Type() == ProfileType::kLifetimes) {
-    MakeLifetimeProfileProto(profile, &builder);
-    return std::move(builder).Finalize();
-  }
+// String IDs shared by the samples of a (non-lifetime) memory profile.
+struct MemoryProfileIds {
+  int alignment_id;
+  int bytes_id;
+  int request_id;
+  int size_returning_id;
+  int access_hint_id;
+  int access_allocated_id;
+  int cold_id;
+  int hot_id;
+  int sampled_resident_id;
+  int swapped_id;
+  int stale_id;
+  bool exporting_residency;
+};
 
-  const int alignment_id = builder.InternString("alignment");
-  const int bytes_id = builder.InternString("bytes");
+// Populates the header fields (sample types, period, drop frames, etc.) of a
+// memory profile and interns the strings used by its samples.
+absl::StatusOr<MemoryProfileIds> SetUpMemoryProfile(
+    const ::tcmalloc::Profile& profile, ProfileBuilder& builder) {
+  MemoryProfileIds ids;
+  ids.alignment_id = builder.InternString("alignment");
+  ids.bytes_id = builder.InternString("bytes");
   const int count_id = builder.InternString("count");
   const int objects_id = builder.InternString("objects");
-  const int request_id = builder.InternString("request");
-  const int size_returning_id = builder.InternString("size_returning");
+  ids.request_id = builder.InternString("request");
+  ids.size_returning_id = builder.InternString("size_returning");
   const int space_id = builder.InternString("space");
   const int resident_space_id = builder.InternString("resident_space");
   const int swapped_space_id = builder.InternString("swapped_space");
   const int stale_space_id = builder.InternString("stale_space");
   const int locked_space_id = builder.InternString("locked_space");
-  const int access_hint_id = builder.InternString("access_hint");
-  const int access_allocated_id = builder.InternString("access_allocated");
-  const int cold_id = builder.InternString("cold");
-  const int hot_id = builder.InternString("hot");
+  ids.access_hint_id = builder.InternString("access_hint");
+  ids.access_allocated_id = builder.InternString("access_allocated");
+  ids.cold_id = builder.InternString("cold");
+  ids.hot_id = builder.InternString("hot");
 
   // NOTE: Do not rely on these string constants. They will be removed!
   // TODO(b/259585789): Remove all of these tags when sample type rollout
   // and collection hits close to 100%; certainly by Q3 2023, but could consider
   // earlier.
-  const int sampled_resident_id =
-      builder.InternString("sampled_resident_bytes");
-  const int swapped_id = builder.InternString("swapped_bytes");
-  const int stale_id = builder.InternString("stale_bytes");
+  ids.sampled_resident_id = builder.InternString("sampled_resident_bytes");
+  ids.swapped_id = builder.InternString("swapped_bytes");
+  ids.stale_id = builder.InternString("stale_bytes");
 
   perftools::profiles::Profile& converted = builder.profile();
 
   perftools::profiles::ValueType& period_type =
       *converted.mutable_period_type();
   period_type.set_type(space_id);
-  period_type.set_unit(bytes_id);
+  period_type.set_unit(ids.bytes_id);
   converted.set_drop_frames(builder.InternString(kProfileDropFrames));
 
   converted.set_duration_nanos(absl::ToInt64Nanoseconds(profile.Duration()));
@@ -668,27 +954,26 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
   {
     perftools::profiles::ValueType& sample_type = *converted.add_sample_type();
     sample_type.set_type(space_id);
-    sample_type.set_unit(bytes_id);
+    sample_type.set_unit(ids.bytes_id);
   }
 
-  const bool exporting_residency =
-      (profile.Type() == tcmalloc::ProfileType::kHeap);
-  if (exporting_residency) {
+  ids.exporting_residency = (profile.Type() == tcmalloc::ProfileType::kHeap);
+  if (ids.exporting_residency) {
     perftools::profiles::ValueType* sample_type = converted.add_sample_type();
     sample_type->set_type(resident_space_id);
-    sample_type->set_unit(bytes_id);
+    sample_type->set_unit(ids.bytes_id);
 
     sample_type = converted.add_sample_type();
     sample_type->set_type(swapped_space_id);
-    sample_type->set_unit(bytes_id);
+    sample_type->set_unit(ids.bytes_id);
 
     sample_type = converted.add_sample_type();
     sample_type->set_type(stale_space_id);
-    sample_type->set_unit(bytes_id);
+    sample_type->set_unit(ids.bytes_id);
 
     sample_type = converted.add_sample_type();
     sample_type->set_type(locked_space_id);
-    sample_type->set_unit(bytes_id);
+    sample_type->set_unit(ids.bytes_id);
   }
 
   int default_sample_type_id;
@@ -713,136 +998,218 @@ absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
   }
 
   converted.set_default_sample_type(default_sample_type_id);
+  return ids;
+}
 
-  SampleMergedMap samples = MergeProfileSamplesAndMaybeGetResidencyInfo(
-      profile, pageflags, residency);
-  for (const auto& [entry, data] : samples) {
-    perftools::profiles::Profile& profile = builder.profile();
-    perftools::profiles::Sample& sample = *profile.add_sample();
-
-    CHECK_CONDITION(entry.depth <= ABSL_ARRAYSIZE(entry.stack));
-    builder.InternCallstack(absl::MakeSpan(entry.stack, entry.depth), sample);
-
-    sample.add_value(data.count);
-    sample.add_value(data.sum);
-    if (exporting_residency) {
-      sample.add_value(data.resident_size.value_or(0));
-      sample.add_value(data.swapped_size.value_or(0));
-      sample.add_value(data.stale_size.value_or(0));
-      sample.add_value(data.locked_size.value_or(0));
-    }
-
-    // add fields that are common to all memory profiles
-    auto add_label = [&](int key, int unit, size_t value) {
-      perftools::profiles::Label& label = *sample.add_label();
-      label.set_key(key);
-      label.set_num(value);
-      label.set_num_unit(unit);
-    };
+// Adds a sample for entry, whose values are given by data, to the profile.
+void AddMemorySample(ProfileBuilder& builder, const MemoryProfileIds& ids,
+                     const tcmalloc::Profile::Sample& entry,
+                     const SampleMergedData& data) {
+  perftools::profiles::Profile& profile = builder.profile();
+  perftools::profiles::Sample& sample = *profile.add_sample();
+
+  CHECK_CONDITION(entry.depth <= ABSL_ARRAYSIZE(entry.stack));
+  builder.InternCallstack(absl::MakeSpan(entry.stack, entry.depth), sample);
+
+  sample.add_value(data.count);
+  sample.add_value(data.sum);
+  if (ids.exporting_residency) {
+    sample.add_value(data.resident_size.value_or(0));
+    sample.add_value(data.swapped_size.value_or(0));
+    sample.add_value(data.stale_size.value_or(0));
+    sample.add_value(data.locked_size.value_or(0));
+  }
 
-    auto add_positive_label = [&](int key, int unit, size_t value) {
-      if (value <= 0) return;
-      add_label(key, unit, value);
-    };
+  // add fields that are common to all memory profiles
+  auto add_label = [&](int key, int unit, size_t value) {
+    perftools::profiles::Label& label = *sample.add_label();
+    label.set_key(key);
+    label.set_num(value);
+    label.set_num_unit(unit);
+  };
 
-    add_positive_label(bytes_id, bytes_id, entry.allocated_size);
-    add_positive_label(request_id, bytes_id, entry.requested_size);
-    add_positive_label(alignment_id, bytes_id, entry.requested_alignment);
-    add_positive_label(size_returning_id, 0, entry.requested_size_returning);
-    // TODO(b/259585789): Remove all of these when sample type rollout is
-    // complete.
-    if (data.resident_size.has_value()) {
-      add_label(sampled_resident_id, bytes_id, data.resident_size.value());
-      add_label(swapped_id, bytes_id, data.swapped_size.value());
-    }
-    if (data.stale_size.has_value()) {
-      add_label(stale_id, bytes_id, data.stale_size.value());
-    }
+  auto add_positive_label = [&](int key, int unit, size_t value) {
+    if (value <= 0) return;
+    add_label(key, unit, value);
+  };
 
-    auto add_access_label = [&](int key,
-                                tcmalloc::Profile::Sample::Access access) {
-      switch (access) {
-        case tcmalloc::Profile::Sample::Access::Hot: {
-          perftools::profiles::Label& access_label = *sample.add_label();
-          access_label.set_key(key);
-          access_label.set_str(hot_id);
-          break;
-        }
-        case tcmalloc::Profile::Sample::Access::Cold: {
-          perftools::profiles::Label& access_label = *sample.add_label();
-          access_label.set_key(key);
-          access_label.set_str(cold_id);
-          break;
-        }
-        default:
-          break;
-      }
-    };
+  add_positive_label(ids.bytes_id, ids.bytes_id, entry.allocated_size);
+  add_positive_label(ids.request_id, ids.bytes_id, entry.requested_size);
+  add_positive_label(ids.alignment_id, ids.bytes_id,
+                     entry.requested_alignment);
+  add_positive_label(ids.size_returning_id, 0,
+                     entry.requested_size_returning);
+  // TODO(b/259585789): Remove all of these when sample type rollout is
+  // complete.
+  if (data.resident_size.has_value()) {
+    add_label(ids.sampled_resident_id, ids.bytes_id,
+              data.resident_size.value());
+    add_label(ids.swapped_id, ids.bytes_id, data.swapped_size.value());
+  }
+  if (data.stale_size.has_value()) {
+    add_label(ids.stale_id, ids.bytes_id, data.stale_size.value());
+  }
 
-    add_label(access_hint_id, access_hint_id,
-              static_cast<uint8_t>(entry.access_hint));
-    add_access_label(access_allocated_id, entry.access_allocated);
-
-    const int guarded_status_id = builder.InternString("guarded_status");
-    const int larger_than_one_page_id =
-        builder.InternString("LargerThanOnePage");
-    const int disabled_id = builder.InternString("Disabled");
-    const int rate_limited_id = builder.InternString("RateLimited");
-    const int too_small_id = builder.InternString("TooSmall");
-    const int no_available_slots_id = builder.InternString("NoAvailableSlots");
-    const int m_protect_failed_id = builder.InternString("MProtectFailed");
-    const int filtered_id = builder.InternString("Filtered");
-    const int unknown_id = builder.InternString("Unknown");
-    const int not_attempted_id = builder.InternString("NotAttempted");
-    const int requested_id = builder.InternString("Requested");
-    const int required_id = builder.InternString("Required");
-    const int guarded_id = builder.InternString("Guarded");
-
-    perftools::profiles::Label& guarded_status_label = *sample.add_label();
-    guarded_status_label.set_key(guarded_status_id);
-    switch (entry.guarded_status) {
-      case Profile::Sample::GuardedStatus::LargerThanOnePage:
-        guarded_status_label.set_str(larger_than_one_page_id);
-        break;
-      case Profile::Sample::GuardedStatus::Disabled:
-        guarded_status_label.set_str(disabled_id);
-        break;
-      case Profile::Sample::GuardedStatus::RateLimited:
-        guarded_status_label.set_str(rate_limited_id);
-        break;
-      case Profile::Sample::GuardedStatus::TooSmall:
-        guarded_status_label.set_str(too_small_id);
-        break;
-      case Profile::Sample::GuardedStatus::NoAvailableSlots:
-        guarded_status_label.set_str(no_available_slots_id);
-        break;
-      case Profile::Sample::GuardedStatus::MProtectFailed:
-        guarded_status_label.set_str(m_protect_failed_id);
-        break;
-      case Profile::Sample::GuardedStatus::Filtered:
-        guarded_status_label.set_str(filtered_id);
-        break;
-      case Profile::Sample::GuardedStatus::Unknown:
-        guarded_status_label.set_str(unknown_id);
-        break;
-      case Profile::Sample::GuardedStatus::NotAttempted:
-        guarded_status_label.set_str(not_attempted_id);
-        break;
-      case Profile::Sample::GuardedStatus::Requested:
-        guarded_status_label.set_str(requested_id);
+  auto add_access_label = [&](int key,
+                              tcmalloc::Profile::Sample::Access access) {
+    switch (access) {
+      case tcmalloc::Profile::Sample::Access::Hot: {
+        perftools::profiles::Label& access_label = *sample.add_label();
+        access_label.set_key(key);
+        access_label.set_str(ids.hot_id);
         break;
-      case Profile::Sample::GuardedStatus::Required:
-        guarded_status_label.set_str(required_id);
+      }
+      case tcmalloc::Profile::Sample::Access::Cold: {
+        perftools::profiles::Label& access_label = *sample.add_label();
+        access_label.set_key(key);
+        access_label.set_str(ids.cold_id);
         break;
-      case Profile::Sample::GuardedStatus::Guarded:
-        guarded_status_label.set_str(guarded_id);
+      }
+      default:
         break;
     }
+  };
+
+  add_label(ids.access_hint_id, ids.access_hint_id,
+            static_cast<uint8_t>(entry.access_hint));
+  add_access_label(ids.access_allocated_id, entry.access_allocated);
+
+  const int guarded_status_id = builder.InternString("guarded_status");
+  const int larger_than_one_page_id = builder.InternString("LargerThanOnePage");
+  const int disabled_id = builder.InternString("Disabled");
+  const int rate_limited_id = builder.InternString("RateLimited");
+  const int too_small_id = builder.InternString("TooSmall");
+  const int no_available_slots_id = builder.InternString("NoAvailableSlots");
+  const int m_protect_failed_id = builder.InternString("MProtectFailed");
+  const int filtered_id = builder.InternString("Filtered");
+  const int unknown_id = builder.InternString("Unknown");
+  const int not_attempted_id = builder.InternString("NotAttempted");
+  const int requested_id = builder.InternString("Requested");
+  const int required_id = builder.InternString("Required");
+  const int guarded_id = builder.InternString("Guarded");
+
+  perftools::profiles::Label& guarded_status_label = *sample.add_label();
+  guarded_status_label.set_key(guarded_status_id);
+  switch (entry.guarded_status) {
+    case Profile::Sample::GuardedStatus::LargerThanOnePage:
+      guarded_status_label.set_str(larger_than_one_page_id);
+      break;
+    case Profile::Sample::GuardedStatus::Disabled:
+      guarded_status_label.set_str(disabled_id);
+      break;
+    case Profile::Sample::GuardedStatus::RateLimited:
+      guarded_status_label.set_str(rate_limited_id);
+      break;
+    case Profile::Sample::GuardedStatus::TooSmall:
+      guarded_status_label.set_str(too_small_id);
+      break;
+    case Profile::Sample::GuardedStatus::NoAvailableSlots:
+      guarded_status_label.set_str(no_available_slots_id);
+      break;
+    case Profile::Sample::GuardedStatus::MProtectFailed:
+      guarded_status_label.set_str(m_protect_failed_id);
+      break;
+    case Profile::Sample::GuardedStatus::Filtered:
+      guarded_status_label.set_str(filtered_id);
+      break;
+    case Profile::Sample::GuardedStatus::Unknown:
+      guarded_status_label.set_str(unknown_id);
+      break;
+    case Profile::Sample::GuardedStatus::NotAttempted:
+      guarded_status_label.set_str(not_attempted_id);
+      break;
+    case Profile::Sample::GuardedStatus::Requested:
+      guarded_status_label.set_str(requested_id);
+      break;
+    case Profile::Sample::GuardedStatus::Required:
+      guarded_status_label.set_str(required_id);
+      break;
+    case Profile::Sample::GuardedStatus::Guarded:
+      guarded_status_label.set_str(guarded_id);
+      break;
+  }
+}
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
+    const ::tcmalloc::Profile& profile, PageFlags* pageflags,
+    Residency* residency) {
+  ProfileBuilder builder;
+  builder.AddCurrentMappings();
+
+  if (profile.Type() == ProfileType::kLifetimes) {
+    MakeLifetimeProfileProto(profile, &builder);
+    return std::move(builder).Finalize();
+  }
+
+  absl::StatusOr<MemoryProfileIds> ids = SetUpMemoryProfile(profile, builder);
+  if (!ids.ok()) {
+    return ids.status();
+  }
+
+  SampleMergedMap samples = MergeProfileSamplesAndMaybeGetResidencyInfo(
+      profile, pageflags, residency);
+  for (const auto& [entry, data] : samples) {
+    AddMemorySample(builder, *ids, entry, data);
   }
 
   return std::move(builder).Finalize();
 }
 
+absl::Status WriteProfileProto(
+    const ::tcmalloc::Profile& profile,
+    google::protobuf::io::ZeroCopyOutputStream* output) {
+  // Lifetime profiles are aggregated per pair of stacks by the profiler itself,
+  // so they are small enough to convert in one piece.
+  if (profile.Type() == ProfileType::kLifetimes) {
+    auto converted_or = MakeProfileProto(profile);
+    if (!converted_or.ok()) {
+      return converted_or.status();
+    }
+    if (!(*converted_or)->SerializeToZeroCopyStream(output)) {
+      return absl::InternalError("Failed to serialize profile");
+    }
+    return absl::OkStatus();
+  }
+
+  // Used to populate residency info in heap profile.
+  std::optional<PageFlags> pageflags;
+  std::optional<Residency> residency;
+  if (profile.Type() == ProfileType::kHeap) {
+    pageflags.emplace();
+    residency.emplace();
+  }
+
+  ProfileBuilder builder;
+  builder.AddCurrentMappings();
+
+  absl::StatusOr<MemoryProfileIds> ids = SetUpMemoryProfile(profile, builder);
+  if (!ids.ok()) {
+    return ids.status();
+  }
+
+  // Bounds the size of each message we hand to the output stream.
+  constexpr int kSamplesPerFlush = 1024;
+  int pending = 0;
+  bool ok = true;
+  profile.Iterate([&](const tcmalloc::Profile::Sample& entry) {
+    if (!ok) return;
+    SampleMergedData data;
+    AccumulateSample(entry, pageflags.has_value() ? &*pageflags : nullptr,
+                     residency.has_value() ? &*residency : nullptr, data);
+    AddMemorySample(builder, *ids, entry, data);
+    if (++pending == kSamplesPerFlush) {
+      ok = builder.Flush(output);
+      pending = 0;
+    }
+  });
+  if (!ok || !builder.Flush(output)) {
+    return absl::InternalError("Failed to serialize profile");
+  }
+  return absl::OkStatus();
+}
+
 absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     const ::tcmalloc::Profile& profile) {
   // Used to populate residency info in heap profile.
@@ -20,16 +20,22 @@
 #include <link.h>
 #endif  // defined(__linux__)
 
+#include <cstddef>
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
 #include "tcmalloc/internal/profile.pb.h"
 #include "absl/container/btree_map.h"
+#include "absl/base/thread_annotations.h"
 #include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/types/span.h"
+#include "google/protobuf/io/zero_copy_stream.h"
 #include "tcmalloc/malloc_extension.h"
 
 namespace tcmalloc {
@@ -39,6 +45,68 @@ namespace tcmalloc_internal {
 std::string GetBuildId(const dl_phdr_info* const info);
 #endif  // defined(__linux__)
 
+// Process-wide cache of the mappings of the loaded modules, and of the mapping
+// that each recently profiled address falls into.  It lets repeated profiles
+// skip re-reading the modules (which resolves paths and parses build IDs) and
+// re-resolving the mappings of the locations they have in common.
+//
+// The mappings are read again only when dl_iterate_phdr reports that modules
+// have been loaded or unloaded since they were last read.  Cached locations
+// are then kept for the mappings whose build ID and address range did not
+// change, so loading one library does not invalidate all of them.  At most
+// kMaxLocations locations are cached.
+//
+// Thread safe.
+class MappingCache {
+ public:
+  static constexpr size_t kMaxLocations = 1 << 16;
+
+  struct Mapping {
+    uintptr_t memory_start;
+    uintptr_t memory_limit;
+    uintptr_t file_offset;
+    std::string filename;
+    std::string build_id;
+  };
+
+  struct Mappings {
+    // Values of dlpi_adds and dlpi_subs when the mappings were read.
+    uint64_t adds = 0;
+    uint64_t subs = 0;
+    // In the order reported by dl_iterate_phdr, so the main executable's
+    // mappings come first.
+    std::vector<Mapping> mappings;
+    // Indices into mappings, sorted by memory_start.
+    std::vector<int> by_start;
+  };
+
+  // Returns the instance shared by all profiles.
+  static MappingCache& Global();
+
+  // Returns the current mappings, reading them again if modules have been
+  // loaded or unloaded since the last call.
+  std::shared_ptr<const Mappings> Refresh() ABSL_LOCKS_EXCLUDED(mu_);
+
+  // For each address, stores in indices[i] the index in mappings.mappings of
+  // the mapping containing addresses[i], or -1 if there is none.  mappings
+  // must have been returned by Refresh().
+  void LookupLocations(const Mappings& mappings,
+                       absl::Span<const uintptr_t> addresses,
+                       absl::Span<int> indices) ABSL_LOCKS_EXCLUDED(mu_);
+
+  size_t cached_locations() const ABSL_LOCKS_EXCLUDED(mu_);
+
+ private:
+  // Returns the index of the mapping containing address, or -1.
+  static int FindMapping(const Mappings& mappings, uintptr_t address);
+
+  mutable absl::Mutex mu_;
+  std::shared_ptr<const Mappings> mappings_ ABSL_GUARDED_BY(mu_);
+  // Index in mappings_->mappings of the mapping containing each cached
+  // address, or -1.
+  absl::flat_hash_map<uintptr_t, int> locations_ ABSL_GUARDED_BY(mu_);
+};
+
 // ProfileBuilder manages building up a profile.proto instance and populating
 // common parts using the string/pointer table conventions expected by pprof.
 class ProfileBuilder {
@@ -47,7 +115,9 @@ class ProfileBuilder {
 
   perftools::profiles::Profile& profile() { return *profile_; }
 
-  // Adds the current process mappings to the profile.
+  // Adds the current process mappings to the profile.  They are taken from
+  // MappingCache::Global(), which then also resolves the mappings of the
+  // locations interned by InternCallstack().
   void AddCurrentMappings();
 
   // Adds a single mapping to the profile and to lookup cache and returns the
@@ -66,15 +136,39 @@ class ProfileBuilder {
   void InternCallstack(absl::Span<const void* const> stack,
                        perftools::profiles::Sample& sample);
 
+  // Serializes everything added to profile() since the previous call to
+  // output and clears it, keeping the interning tables so that IDs handed out
+  // earlier remain valid.  Protocol buffers merge concatenated messages, so the
+  // output of successive calls parses as a single profile.  Returns false if
+  // serialization fails.
+  bool Flush(google::protobuf::io::ZeroCopyOutputStream* output);
+
   std::unique_ptr<perftools::profiles::Profile> Finalize() &&;
 
  private:
+  struct MappingInfo {
+    uintptr_t memory_limit;
+    int id;
+  };
+
+  // Returns the ID of the mapping containing address, or 0 if there is none.
+  int FindMappingId(uintptr_t address) const;
+  // Adds a location that is not yet in the location table.
+  int AddLocation(uintptr_t address, int mapping_id);
+
   std::unique_ptr<perftools::profiles::Profile> profile_;
-  // mappings_ stores the start address of each mapping in profile_->mapping()
-  // to its index.
-  absl::btree_map<uintptr_t, int> mappings_;
+  // mappings_ stores the start address of each mapping to its limit and ID.
+  absl::btree_map<uintptr_t, MappingInfo> mappings_;
   absl::flat_hash_map<std::string, int> strings_;
   absl::flat_hash_map<uintptr_t, int> locations_;
+  // Set if all the mappings come from AddCurrentMappings(), in which case
+  // mapping i of cached_mappings_ has ID cached_mappings_base_id_ + i.
+  std::shared_ptr<const MappingCache::Mappings> cached_mappings_;
+  int cached_mappings_base_id_ = 0;
+  // Number of entries of each table already written out by Flush().
+  int flushed_strings_ = 0;
+  int flushed_mappings_ = 0;
+  int flushed_locations_ = 0;
 };
 
 extern const absl::string_view kProfileDropFrames;
@@ -82,6 +176,15 @@ extern const absl::string_view kProfileDropFrames;
 absl::StatusOr<std::unique_ptr<perftools::profiles::Profile>> MakeProfileProto(
     const ::tcmalloc::Profile& profile);
 
+// Writes profile to output in the format produced by MakeProfileProto, except
+// that samples with identical stacks and labels are not merged (pprof merges
+// them when reading the profile).  Samples are converted and flushed in batches
+// as profile.Iterate produces them, so memory use is bounded by the number of
+// distinct locations rather than by the number of samples.
+absl::Status WriteProfileProto(
+    const ::tcmalloc::Profile& profile,
+    google::protobuf::io::ZeroCopyOutputStream* output);
+
 class PageFlags;
 class Residency;
 
@@ -44,6 +44,8 @@
 #include "absl/strings/str_cat.h"
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/fake_profile.h"
 #include "tcmalloc/internal/page_size.h"
@@ -95,6 +97,103 @@ TEST(ProfileBuilderTest, Mappings) {
   EXPECT_THAT(mapping_ids, Not(testing::Contains(0)));
 }
 
+TEST(MappingCacheTest, ReusesMappings) {
+  MappingCache& cache = MappingCache::Global();
+  std::shared_ptr<const MappingCache::Mappings> mappings = cache.Refresh();
+  // Nothing has been loaded or unloaded in between.
+  EXPECT_EQ(cache.Refresh(), mappings);
+
+  absl::flat_hash_set<std::string> filenames;
+  for (const auto& mapping : mappings->mappings) {
+    filenames.insert(mapping.filename);
+  }
+  EXPECT_THAT(filenames, testing::Contains(RealPath()));
+
+  ASSERT_EQ(mappings->by_start.size(), mappings->mappings.size());
+  for (int i = 1; i < mappings->by_start.size(); ++i) {
+    EXPECT_LE(mappings->mappings[mappings->by_start[i - 1]].memory_start,
+              mappings->mappings[mappings->by_start[i]].memory_start);
+  }
+}
+
+TEST(MappingCacheTest, LookupLocations) {
+  MappingCache& cache = MappingCache::Global();
+  std::shared_ptr<const MappingCache::Mappings> mappings = cache.Refresh();
+
+  const uintptr_t addresses[] = {absl::bit_cast<uintptr_t>(&RealPath),
+                                 uintptr_t{0x150}};
+  int indices[2];
+  cache.LookupLocations(*mappings, addresses, absl::MakeSpan(indices));
+  ASSERT_GE(indices[0], 0);
+  const MappingCache::Mapping& mapping = mappings->mappings[indices[0]];
+  EXPECT_LE(mapping.memory_start, addresses[0]);
+  EXPECT_LT(addresses[0], mapping.memory_limit);
+  EXPECT_EQ(mapping.filename, RealPath());
+  EXPECT_EQ(indices[1], -1);
+
+  // Both are now cached, and served from the cache.
+  const size_t cached = cache.cached_locations();
+  EXPECT_GE(cached, 2);
+  int cached_indices[2];
+  cache.LookupLocations(*mappings, addresses, absl::MakeSpan(cached_indices));
+  EXPECT_EQ(cached_indices[0], indices[0]);
+  EXPECT_EQ(cached_indices[1], indices[1]);
+  EXPECT_EQ(cache.cached_locations(), cached);
+}
+
+TEST(MappingCacheTest, Bounded) {
+  MappingCache& cache = MappingCache::Global();
+  std::shared_ptr<const MappingCache::Mappings> mappings = cache.Refresh();
+
+  std::vector<uintptr_t> addresses(MappingCache::kMaxLocations + 100);
+  for (size_t i = 0; i < addresses.size(); ++i) {
+    addresses[i] = 0x1000 + 16 * i;
+  }
+  std::vector<int> indices(addresses.size());
+  cache.LookupLocations(*mappings, addresses, absl::MakeSpan(indices));
+  EXPECT_LE(cache.cached_locations(), MappingCache::kMaxLocations);
+}
+
+// Locations interned through InternCallstack() have their mapping resolved by
+// MappingCache, and must agree with InternLocation().
+TEST(ProfileBuilderTest, CallstackMappings) {
+  const void* const stack[] = {
+      absl::bit_cast<const void*>(absl::bit_cast<uintptr_t>(&RealPath) + 1),
+      absl::bit_cast<const void*>(uintptr_t{0x151}),
+      absl::bit_cast<const void*>(absl::bit_cast<uintptr_t>(&RealPath) + 1),
+  };
+
+  ProfileBuilder builder;
+  builder.AddCurrentMappings();
+  perftools::profiles::Sample sample;
+  builder.InternCallstack(stack, sample);
+  const int loc1 =
+      builder.InternLocation(absl::bit_cast<const void*>(&RealPath));
+  auto profile = std::move(builder).Finalize();
+
+  ASSERT_EQ(sample.location_id_size(), 3);
+  EXPECT_EQ(sample.location_id(0), loc1);
+  EXPECT_EQ(sample.location_id(2), loc1);
+  ASSERT_EQ(profile->location_size(), 2);
+
+  absl::flat_hash_map<uint64_t, const perftools::profiles::Mapping*> mappings;
+  for (const auto& mapping : profile->mapping()) {
+    mappings[mapping.id()] = &mapping;
+  }
+  for (const auto& location : profile->location()) {
+    if (location.address() == 0x150) {
+      EXPECT_EQ(location.mapping_id(), 0);
+      continue;
+    }
+    EXPECT_EQ(location.id(), loc1);
+    ASSERT_TRUE(mappings.contains(location.mapping_id()));
+    const auto& mapping = *mappings[location.mapping_id()];
+    EXPECT_LE(mapping.memory_start(), location.address());
+    EXPECT_LT(location.address(), mapping.memory_limit());
+    EXPECT_EQ(profile->string_table(mapping.filename()), RealPath());
+  }
+}
+
 TEST(ProfileBuilderTest, LocationTableNoMappings) {
   const uintptr_t kAddress = uintptr_t{0x150};
 
@@ -647,6 +746,172 @@ TEST(ProfileBuilderTest, PeakHeapProfile) {
             converted.sample(1).location_id(0));
 }
 
+// Returns the addresses and values of each sample of profile, so that
+// profiles can be compared regardless of how their tables are numbered.
+std::vector<std::pair<std::vector<uint64_t>, std::vector<int64_t>>>
+ExtractStacksAndValues(const perftools::profiles::Profile& profile) {
+  absl::flat_hash_map<uint64_t, uint64_t> addresses;
+  for (const auto& location : profile.location()) {
+    addresses.emplace(location.id(), location.address());
+  }
+  std::vector<std::pair<std::vector<uint64_t>, std::vector<int64_t>>> result;
+  for (const auto& sample : profile.sample()) {
+    auto& [stack, values] = result.emplace_back();
+    for (uint64_t id : sample.location_id()) {
+      stack.push_back(addresses[id]);
+    }
+    values.assign(sample.value().begin(), sample.value().end());
+  }
+  return result;
+}
+
+TEST(ProfileBuilderTest, WriteProfileProto) {
+  constexpr absl::Duration kDuration = absl::Milliseconds(1500);
+  // Enough samples with distinct stacks that the output is flushed several
+  // times, so string, mapping and location IDs need to be stable across
+  // flushes.
+  constexpr int kSamples = 3000;
+
+  std::vector<Profile::Sample> samples;
+  for (int i = 0; i < kSamples; ++i) {
+    auto& sample = samples.emplace_back();
+    sample.sum = 16 * (i + 1);
+    sample.count = i + 1;
+    sample.requested_size = 12;
+    sample.requested_alignment = i % 2 == 0 ? 0 : 8;
+    sample.allocated_size = 16;
+    sample.depth = 3;
+    sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x100000} + 16 * i);
+    sample.stack[1] = reinterpret_cast<void*>(&RealPath);
+    sample.stack[2] = reinterpret_cast<void*>(&ProfileAccessor::MakeProfile);
+    sample.access_hint = hot_cold_t{static_cast<uint8_t>(i % 256)};
+    sample.access_allocated = Profile::Sample::Access::Hot;
+    sample.guarded_status = i % 3 == 0
+                                ? Profile::Sample::GuardedStatus::Guarded
+                                : Profile::Sample::GuardedStatus::RateLimited;
+  }
+
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kAllocations);
+  fake_profile->SetDuration(kDuration);
+  fake_profile->SetSamples(std::move(samples));
+  Profile profile = ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  std::string serialized;
+  {
+    google::protobuf::io::StringOutputStream stream(&serialized);
+    ASSERT_TRUE(WriteProfileProto(profile, &stream).ok());
+  }
+  perftools::profiles::Profile streamed;
+  ASSERT_TRUE(streamed.ParseFromString(serialized));
+
+  auto expected_or = MakeProfileProto(profile);
+  ASSERT_TRUE(expected_or.ok());
+  const auto& expected = **expected_or;
+
+  // The header and the tables match exactly, as they are built in the same
+  // order.
+  EXPECT_EQ(streamed.duration_nanos(), expected.duration_nanos());
+  EXPECT_EQ(streamed.default_sample_type(), expected.default_sample_type());
+  EXPECT_EQ(streamed.drop_frames(), expected.drop_frames());
+  EXPECT_EQ(streamed.sample_type_size(), expected.sample_type_size());
+  EXPECT_THAT(streamed.string_table(),
+              testing::ElementsAreArray(expected.string_table()));
+  EXPECT_EQ(streamed.mapping_size(), expected.mapping_size());
+  EXPECT_EQ(streamed.location_size(), expected.location_size());
+
+  // The samples only match up to ordering.
+  SampleLabels streamed_labels, expected_labels;
+  {
+    SCOPED_TRACE("Streamed");
+    ASSERT_NO_FATAL_FAILURE(
+        CheckAndExtractSampleLabels(streamed, streamed_labels));
+  }
+  {
+    SCOPED_TRACE("Expected");
+    ASSERT_NO_FATAL_FAILURE(
+        CheckAndExtractSampleLabels(expected, expected_labels));
+  }
+  EXPECT_EQ(streamed.sample_size(), kSamples);
+  EXPECT_THAT(streamed_labels,
+              testing::UnorderedElementsAreArray(expected_labels));
+  EXPECT_THAT(ExtractStacksAndValues(streamed),
+              testing::UnorderedElementsAreArray(
+                  ExtractStacksAndValues(expected)));
+}
+
+TEST(ProfileBuilderTest, GuardedStatusLabels) {
+  using GuardedStatus = Profile::Sample::GuardedStatus;
+  const std::vector<std::pair<GuardedStatus, std::string>> kStatuses = {
+      {GuardedStatus::LargerThanOnePage, "LargerThanOnePage"},
+      {GuardedStatus::Disabled, "Disabled"},
+      {GuardedStatus::RateLimited, "RateLimited"},
+      {GuardedStatus::TooSmall, "TooSmall"},
+      {GuardedStatus::NoAvailableSlots, "NoAvailableSlots"},
+      {GuardedStatus::MProtectFailed, "MProtectFailed"},
+      {GuardedStatus::Filtered, "Filtered"},
+      {GuardedStatus::Unknown, "Unknown"},
+      {GuardedStatus::NotAttempted, "NotAttempted"},
+      {GuardedStatus::Requested, "Requested"},
+      {GuardedStatus::Required, "Required"},
+      {GuardedStatus::Guarded, "Guarded"},
+  };
+
+  // Each sample is told apart by its requested size.
+  std::vector<Profile::Sample> samples;
+  std::vector<std::pair<int64_t, std::string>> expected;
+  for (size_t i = 0; i < kStatuses.size(); ++i) {
+    auto& sample = samples.emplace_back();
+    sample.sum = 64;
+    sample.count = 1;
+    sample.requested_size = i + 1;
+    sample.allocated_size = 64;
+    sample.depth = 2;
+    sample.stack[0] = absl::bit_cast<void*>(uintptr_t{0x100000} + 16 * i);
+    sample.stack[1] = reinterpret_cast<void*>(&RealPath);
+    sample.guarded_status = kStatuses[i].first;
+    expected.emplace_back(i + 1, kStatuses[i].second);
+  }
+
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kAllocations);
+  fake_profile->SetDuration(absl::Milliseconds(1500));
+  fake_profile->SetSamples(std::move(samples));
+  Profile profile = ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  auto extract = [](const perftools::profiles::Profile& converted) {
+    std::vector<std::pair<int64_t, std::string>> result;
+    for (const auto& sample : converted.sample()) {
+      int64_t request = 0;
+      std::string status;
+      for (const auto& label : sample.label()) {
+        const std::string& key = converted.string_table(label.key());
+        if (key == "request") {
+          request = label.num();
+        } else if (key == "guarded_status") {
+          status = converted.string_table(label.str());
+        }
+      }
+      result.emplace_back(request, status);
+    }
+    return result;
+  };
+
+  auto converted_or = MakeProfileProto(profile);
+  ASSERT_TRUE(converted_or.ok());
+  EXPECT_THAT(extract(**converted_or),
+              testing::UnorderedElementsAreArray(expected));
+
+  std::string serialized;
+  {
+    google::protobuf::io::StringOutputStream stream(&serialized);
+    ASSERT_TRUE(WriteProfileProto(profile, &stream).ok());
+  }
+  perftools::profiles::Profile streamed;
+  ASSERT_TRUE(streamed.ParseFromString(serialized));
+  EXPECT_THAT(extract(streamed), testing::UnorderedElementsAreArray(expected));
+}
+
 TEST(ProfileBuilderTest, LifetimeProfile) {
   constexpr absl::Duration kDuration = absl::Milliseconds(1500);
   auto fake_profile = std::make_unique<FakeProfile>();
@@ -20,10 +20,10 @@
 
 #include <algorithm>
 #include <cstdint>
-#include <cstdio>
 #include <optional>
 
 #include "absl/status/status.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/util.h"
 
@@ -46,6 +46,10 @@ void Update(const uint64_t input, const size_t size, Residency::Info& info) {
   }
 }
 
+uintptr_t RangeEnd(const Residency::Range& range) {
+  return reinterpret_cast<uintptr_t>(range.addr) + range.size;
+}
+
 }  // namespace
 
 Residency::Residency()
@@ -60,52 +64,76 @@ Residency::~Residency() {
   }
 }
 
-absl::StatusCode Residency::Seek(const uintptr_t vaddr) {
-  size_t offset = vaddr / kPageSize * kPagemapEntrySize;
-  // Note: lseek can't be interrupted.
-  off_t status = ::lseek(fd_, offset, SEEK_SET);
-  if (status != offset) {
-    return absl::StatusCode::kUnavailable;
-  }
-  return absl::StatusCode::kOk;
-}
-
-std::optional<uint64_t> Residency::ReadOne() {
-  static_assert(sizeof(buf_) >= kPagemapEntrySize);
-  // /proc/pid/pagemap is a sequence of 64-bit values in machine endianness, one
-  // per page. The style guide really does not want me to do this "unsafe
-  // conversion", but the conversion is done in reverse by the kernel and we
-  // never persist it anywhere, so we actually do want this.
-  auto status = signal_safe_read(fd_, reinterpret_cast<char*>(buf_),
-                                 kPagemapEntrySize, nullptr);
-  if (status != kPagemapEntrySize) {
-    return std::nullopt;
-  }
-  return buf_[0];
-}
-
-absl::StatusCode Residency::ReadMany(int64_t num_pages, Residency::Info& info) {
-  while (num_pages > 0) {
-    const size_t batch_size = std::min<int64_t>(kEntriesInBuf, num_pages);
-    const size_t to_read = kPagemapEntrySize * batch_size;
+absl::StatusCode Residency::Read(const uintptr_t start, const uintptr_t end,
+                                  absl::Span<const Range> unbacked,
+                                  Residency::Info& info) {
+  const uintptr_t kPageMask = ~(kPageSize - 1);
+  uintptr_t page = start & kPageMask;
+  while (page < end) {
+    while (!unbacked.empty() && RangeEnd(unbacked.front()) <= page) {
+      unbacked.remove_prefix(1);
+    }
 
-    // We read continuously. For the first read, this starts at wherever the
-    // first ReadOne ended. See above note for the reinterpret_cast.
-    auto status =
-        signal_safe_read(fd_, reinterpret_cast<char*>(buf_), to_read, nullptr);
-    if (status != to_read) {
+    // Jump over the next long unbacked range if we're at it, or else read up
+    // to it.  Shorter ones are cheaper to read through than to skip.
+    uintptr_t read_end = end;
+    bool skipped = false;
+    for (const Range& range : unbacked) {
+      const uintptr_t range_start = reinterpret_cast<uintptr_t>(range.addr);
+      if (range_start >= end) break;
+      if (range.size < kMinSkippedPages * kPageSize) continue;
+      if (range_start > page) {
+        read_end = range_start;
+        break;
+      }
+      // The page that the range ends on may be partially backed.
+      const uintptr_t range_end_page = RangeEnd(range) & kPageMask;
+      if (range_end_page > page) {
+        page = range_end_page;
+        skipped = true;
+        break;
+      }
+    }
+    if (skipped) continue;
+
+    const uintptr_t read_end_page = (read_end + kPageSize - 1) & kPageMask;
+    size_t num_read;
+    const uint64_t* entries =
+        buffer_.Read(fd_, page / kPageSize, (read_end_page - page) / kPageSize,
+                     &num_read);
+    if (entries == nullptr || num_read == 0) {
       return absl::StatusCode::kUnavailable;
     }
-    for (int i = 0; i < batch_size; ++i) {
-      Update(buf_[i], kPageSize, info);
+    for (size_t i = 0; i < num_read; ++i, page += kPageSize) {
+      // Since the input address might not be page-aligned (it can possibly
+      // point to an arbitrary object), and neither need the unbacked ranges,
+      // we count the bytes of each page that are in range and backed.
+      const uintptr_t page_end = page + kPageSize;
+      size_t bytes = std::min(page_end, end) - std::max(page, start);
+      while (!unbacked.empty() && RangeEnd(unbacked.front()) <= page) {
+        unbacked.remove_prefix(1);
+      }
+      for (const Range& range : unbacked) {
+        const uintptr_t range_start = reinterpret_cast<uintptr_t>(range.addr);
+        if (range_start >= page_end) break;
+        const uintptr_t lo = std::max({page, start, range_start});
+        const uintptr_t hi = std::min({page_end, end, RangeEnd(range)});
+        if (hi > lo) bytes -= hi - lo;
+      }
+      if (bytes != 0) Update(entries[i], bytes, info);
     }
-    num_pages -= batch_size;
   }
   return absl::StatusCode::kOk;
 }
 
 std::optional<Residency::Info> Residency::Get(const void* const addr,
                                               const size_t size) {
+  return Get(addr, size, {});
+}
+
+std::optional<Residency::Info> Residency::Get(
+    const void* const addr, const size_t size,
+    absl::Span<const Range> unbacked) {
   if (fd_ < 0) {
     return std::nullopt;
   }
@@ -113,49 +141,10 @@ std::optional<Residency::Info> Residency::Get(const void* const addr,
   Residency::Info info;
   if (size == 0) return info;
 
-  uintptr_t uaddr = reinterpret_cast<uintptr_t>(addr);
-  // Round address down to get the start of the page containing the data.
-  uintptr_t basePage = uaddr & ~(kPageSize - 1);
-  // Round end address up to get the end of the page containing the data.
-  // The data is in [basePage, endPage).
-  uintptr_t endPage = (uaddr + size + kPageSize - 1) & ~(kPageSize - 1);
-
-  int64_t remainingPages = (endPage - basePage) / kPageSize;
-
-  if (auto res = Seek(basePage); res != absl::StatusCode::kOk) {
+  const uintptr_t start = reinterpret_cast<uintptr_t>(addr);
+  if (Read(start, start + size, unbacked, info) != absl::StatusCode::kOk) {
     return std::nullopt;
   }
-
-  if (remainingPages == 1) {
-    auto res = ReadOne();
-    if (!res.has_value()) return std::nullopt;
-    Update(res.value(), size, info);
-    return info;
-  }
-
-  // Since the input address might not be page-aligned (it can possibly point to
-  // an arbitrary object), we read the information about the first page
-  // separately with ReadOne, then read the complete pages with ReadMany, and
-  // then read the last page with ReadOne again if needed.
-  auto res = ReadOne();
-  if (!res.has_value()) return std::nullopt;
-
-  // Handle the first page.
-  size_t firstPageSize = kPageSize - (uaddr - basePage);
-  Update(res.value(), firstPageSize, info);
-  remainingPages--;
-
-  // Handle all pages but the last page.
-  if (auto res = ReadMany(remainingPages - 1, info);
-      res != absl::StatusCode::kOk) {
-    return std::nullopt;
-  }
-
-  // Check final page
-  size_t lastPageSize = kPageSize - (endPage - uaddr - size);
-  res = ReadOne();
-  if (!res.has_value()) return std::nullopt;
-  Update(res.value(), lastPageSize, info);
   return info;
 }
 
@@ -22,8 +22,10 @@
 #include <optional>
 
 #include "absl/status/status.h"
+#include "absl/types/span.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pagemap_buffer.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -55,30 +57,35 @@ class Residency {
   };
   std::optional<Info> Get(const void* addr, size_t size);
 
+  // A range of memory that the caller knows not to be backed, e.g. because it
+  // was returned to the OS.
+  struct Range {
+    const void* addr;
+    size_t size;
+  };
+
+  // As Get(), but the ranges in `unbacked` count as neither resident nor
+  // swapped, and the pagemap entries of long ones aren't read at all.
+  // `unbacked` must be sorted by address and its ranges must not overlap.
+  std::optional<Info> Get(const void* addr, size_t size,
+                          absl::Span<const Range> unbacked);
+
  private:
-  // This helper seeks the internal file to the correct location for the given
-  // virtual address.
-  absl::StatusCode Seek(uintptr_t vaddr);
-  // This helper reads information for a single page. This is useful for the
-  // boundaries. It continues the read from the last Seek() or last Read
-  // operation.
-  std::optional<uint64_t> ReadOne();
-  // This helper reads information for `num_pages` worth of _full_ pages and
-  // puts the results into `info`. It continues the read from the last Seek() or
-  // last Read operation.
-  absl::StatusCode ReadMany(int64_t num_pages, Info& info);
+  // Unbacked ranges of at least this many pages are skipped rather than read
+  // through, which takes an extra read.
+  static constexpr size_t kMinSkippedPages = 256;
+
+  // Adds the information for [start, end) less `unbacked` to `info`.  The
+  // pagemap is read in as few reads as the buffer allows.
+  absl::StatusCode Read(uintptr_t start, uintptr_t end,
+                        absl::Span<const Range> unbacked, Info& info);
 
   // For testing.
   friend class ResidencySpouse;
   explicit Residency(const char* alternate_filename);
 
-  // Size of the buffer used to gather results.
-  static constexpr int kBufferLength = 4096;
-  static constexpr int kPagemapEntrySize = 8;
-  static constexpr int kEntriesInBuf = kBufferLength / kPagemapEntrySize;
-
   const size_t kPageSize = GetPageSize();
-  uint64_t buf_[kEntriesInBuf];
+  PagemapBuffer buffer_;
   const int fd_;
 };
 
@@ -0,0 +1,112 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pageflags.h"
+#include "tcmalloc/internal/residency.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+constexpr size_t kScannedPages = 1 << 20;
+
+// A mapping of kScannedPages pages, of which every 256th is resident.
+class ScannedRegion {
+ public:
+  ScannedRegion() : size_(kScannedPages * GetPageSize()) {
+    p_ = static_cast<char*>(mmap(nullptr, size_, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                                 -1, 0));
+    CHECK_CONDITION(p_ != MAP_FAILED);
+    for (size_t offset = 0; offset < size_; offset += 256 * GetPageSize()) {
+      p_[offset] = 1;
+    }
+  }
+  ~ScannedRegion() { munmap(p_, size_); }
+
+  const char* data() const { return p_; }
+  size_t size() const { return size_; }
+
+ private:
+  char* p_;
+  size_t size_;
+};
+
+void BM_ResidencyGet(benchmark::State& state) {
+  ScannedRegion region;
+  Residency residency;
+  for (auto s : state) {
+    std::optional<Residency::Info> info =
+        residency.Get(region.data(), region.size());
+    CHECK_CONDITION(info.has_value());
+    benchmark::DoNotOptimize(info);
+  }
+  state.SetItemsProcessed(state.iterations() * kScannedPages);
+}
+BENCHMARK(BM_ResidencyGet);
+
+// Marks every other range of state.range(0) pages as unbacked, as if it had
+// been returned to the OS.
+void BM_ResidencyGetSkippingUnbacked(benchmark::State& state) {
+  ScannedRegion region;
+  const size_t range_size = state.range(0) * GetPageSize();
+  std::vector<Residency::Range> unbacked;
+  for (size_t offset = range_size; offset < region.size();
+       offset += 2 * range_size) {
+    unbacked.push_back({region.data() + offset, range_size});
+  }
+
+  Residency residency;
+  for (auto s : state) {
+    std::optional<Residency::Info> info =
+        residency.Get(region.data(), region.size(), unbacked);
+    CHECK_CONDITION(info.has_value());
+    benchmark::DoNotOptimize(info);
+  }
+  state.SetItemsProcessed(state.iterations() * kScannedPages);
+}
+BENCHMARK(BM_ResidencyGetSkippingUnbacked)->Range(1, 64 << 10);
+
+void BM_PageFlagsGet(benchmark::State& state) {
+  ScannedRegion region;
+  PageFlags pageflags;
+  if (!pageflags.Get(region.data(), region.size()).has_value()) {
+    state.SkipWithError("page flags are not available");
+    return;
+  }
+  for (auto s : state) {
+    std::optional<PageFlags::PageStats> stats =
+        pageflags.Get(region.data(), region.size());
+    benchmark::DoNotOptimize(stats);
+  }
+  state.SetItemsProcessed(state.iterations() * kScannedPages);
+}
+BENCHMARK(BM_PageFlagsGet);
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
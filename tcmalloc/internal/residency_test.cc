@@ -28,6 +28,7 @@
 #include "gtest/gtest.h"
 #include "absl/strings/str_format.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/pagemap_buffer.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -107,6 +108,85 @@ TEST(ResidenceTest, ThisProcess) {
   }
 }
 
+// Covers more pages than a single read of the pagemap returns.
+TEST(ResidenceTest, LargeRange) {
+  const size_t kPageSize = GetPageSize();
+  const size_t kNumPages = 3 * PagemapBuffer::kMaxEntries / 2;
+  const size_t kSize = kNumPages * kPageSize;
+  char* p = static_cast<char*>(mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE,
+                                    -1, 0));
+  ASSERT_NE(p, MAP_FAILED) << errno;
+  // Keep each write to a single page.
+  ASSERT_EQ(madvise(p, kSize, MADV_NOHUGEPAGE), 0) << errno;
+  size_t touched = 0;
+  for (size_t offset = 0; offset < kSize; offset += 1024 * kPageSize) {
+    p[offset] = 1;
+    ++touched;
+  }
+  p[kSize - 1] = 1;
+  ++touched;
+
+  Residency r;
+  EXPECT_THAT(r.Get(p, kSize), Optional(FieldsAre(touched * kPageSize, 0)));
+  EXPECT_THAT(r.Get(p + 1, kSize - 2),
+              Optional(FieldsAre(touched * kPageSize - 2, 0)));
+  ASSERT_EQ(munmap(p, kSize), 0);
+}
+
+TEST(ResidenceTest, SkipsUnbacked) {
+  const size_t kPageSize = GetPageSize();
+  const size_t kNumPages = 8;
+  char* p = static_cast<char*>(mmap(nullptr, kNumPages * kPageSize,
+                                    PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+  ASSERT_NE(p, MAP_FAILED) << errno;
+  memset(p, 1, kNumPages * kPageSize);
+
+  Residency r;
+  EXPECT_THAT(r.Get(p, kNumPages * kPageSize, {}),
+              Optional(FieldsAre(kNumPages * kPageSize, 0)));
+
+  // Ranges that start before or end after the queried range are clipped.
+  const Residency::Range unbacked[] = {
+      {p - kPageSize, 2 * kPageSize},
+      {p + 3 * kPageSize, 2 * kPageSize},
+      {p + 7 * kPageSize, 4 * kPageSize},
+  };
+  EXPECT_THAT(r.Get(p, kNumPages * kPageSize, unbacked),
+              Optional(FieldsAre(4 * kPageSize, 0)));
+  EXPECT_THAT(r.Get(p + 5 * kPageSize, kPageSize, unbacked),
+              Optional(FieldsAre(kPageSize, 0)));
+  EXPECT_THAT(r.Get(p + 3 * kPageSize, 2 * kPageSize, unbacked),
+              Optional(FieldsAre(0, 0)));
+  ASSERT_EQ(munmap(p, kNumPages * kPageSize), 0);
+}
+
+// Long unbacked ranges are skipped rather than read, which must not change the
+// result, even if they don't start or end on a page boundary.
+TEST(ResidenceTest, SkipsLongUnbacked) {
+  const size_t kPageSize = GetPageSize();
+  const size_t kNumPages = 1024;
+  const size_t kSize = kNumPages * kPageSize;
+  char* p = static_cast<char*>(mmap(nullptr, kSize, PROT_READ | PROT_WRITE,
+                                    MAP_ANONYMOUS | MAP_PRIVATE, -1, 0));
+  ASSERT_NE(p, MAP_FAILED) << errno;
+  memset(p, 1, kSize);
+
+  Residency r;
+  const Residency::Range unbacked[] = {
+      {p + 10 * kPageSize + 100, 300 * kPageSize},
+      {p + 400 * kPageSize, 2 * kPageSize + 5},
+      {p + 500 * kPageSize - 7, 500 * kPageSize},
+  };
+  const size_t kUnbacked = 802 * kPageSize + 5;
+  EXPECT_THAT(r.Get(p, kSize, unbacked),
+              Optional(FieldsAre(kSize - kUnbacked, 0)));
+  EXPECT_THAT(r.Get(p + 3, kSize - 6, unbacked),
+              Optional(FieldsAre(kSize - kUnbacked - 6, 0)));
+  ASSERT_EQ(munmap(p, kSize), 0);
+}
+
 TEST(ResidenceTest, CannotOpen) {
   ResidencySpouse r("/tmp/a667ba48-18ba-4523-a8a7-b49ece3a6c2b");
   EXPECT_FALSE(r.Get(nullptr, 1).has_value());
@@ -15,6 +15,7 @@
 #ifndef TCMALLOC_INTERNAL_SAMPLED_ALLOCATION_H_
 #define TCMALLOC_INTERNAL_SAMPLED_ALLOCATION_H_
 
+#include <cstdint>
 #include <utility>
 
 #include "tcmalloc/internal/logging.h"
@@ -50,10 +51,17 @@ struct SampledAllocation : public tcmalloc_internal::Sample<SampledAllocation> {
   void PrepareForSampling(StackTrace&& stack_trace)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock) {
     sampled_stack = std::move(stack_trace);
+    refs = 0;
   }
 
   // The stack trace of the sampled allocation.
   StackTrace sampled_stack = {};
+
+  // For recorders that share a copy of an allocation between several
+  // snapshots of the heap, a bitmask of the snapshots that reference it.  The
+  // copy is unregistered once the last one drops its reference.  See
+  // PeakHeapTracker.
+  uint32_t refs = 0;
 };
 
 }  // namespace tcmalloc_internal
@@ -23,13 +23,17 @@
 #define TCMALLOC_INTERNAL_SAMPLED_ALLOCATION_RECORDER_H_
 
 #include <atomic>
+#include <cstddef>
 
+#include "absl/base/config.h"
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
+#include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
 #include "absl/functional/function_ref.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/percpu.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
@@ -64,7 +68,11 @@ class SampleRecorder {
   SampleRecorder(SampleRecorder&&) = delete;
   SampleRecorder& operator=(SampleRecorder&&) = delete;
 
-  // Sets up the dead pointer of `graveyard_` to make it a circular linked list.
+  // Number of pools that dead samples are recycled through.  Each CPU uses the
+  // pool `cpu % kDeadPools`.
+  static constexpr size_t kDeadPools = 32;
+
+  // Sets up the dead lists of the pools, which are terminated by `graveyard_`.
   void Init();
 
   // Registers for sampling.  Returns an opaque registration info.
@@ -90,42 +98,80 @@ class SampleRecorder {
   // passed to `Unregister()` which assumes the sample is live.
   void UnregisterAll();
 
+  // Like `UnregisterAll()`, but only unregisters the live samples for which
+  // `pred` returns true.  `pred` is called with the sample's lock held and may
+  // update the sample.
+  void UnregisterIf(const absl::FunctionRef<bool(T& sample)>& pred);
+
   // Iterates over all the registered samples.
   void Iterate(const absl::FunctionRef<void(const T& sample)>& f);
 
+  // Incremental version of `Iterate()`.  Visits samples starting at `start`
+  // until `max_samples` live samples have been passed to `f`, and returns the
+  // sample to resume from, or nullptr once the end has been reached.  Iteration
+  // begins at `IterationStart()`.
+  //
+  // Samples are never removed from `all_`, so the returned position remains
+  // valid while no sample locks are held, e.g. while the caller processes the
+  // samples copied out by `f`.
+  T* IterateBatch(T* start, size_t max_samples,
+                  const absl::FunctionRef<void(const T& sample)>& f);
+  T* IterationStart() const { return all_.load(std::memory_order_acquire); }
+
  private:
+  // A list of dead samples that can be revived by Register().  Dead samples
+  // are kept in per-CPU pools so that threads registering and unregistering
+  // samples on different CPUs do not contend on a single lock.
+  struct ABSL_CACHELINE_ALIGNED DeadPool {
+    absl::base_internal::SpinLock lock{
+        absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY};
+    // Head of the dead list, written with `lock` held.  It may be read without
+    // the lock as a hint of whether the pool is empty.
+    std::atomic<T*> head{nullptr};
+  };
+
+  DeadPool& LocalPool();
   void PushNew(T* sample);
   void PushDead(T* sample);
   template <typename... Targs>
-  T* PopDead(Targs&&... args);
+  T* PopDead(DeadPool& pool, Targs&&... args);
+  template <typename... Targs>
+  T* PopAnyDead(Targs&&... args);
 
   // Intrusive lock free linked lists for tracking samples.
   //
   // `all_` records all samples (they are never removed from this list) and is
   // terminated with a `nullptr`.
   //
-  // `graveyard_.dead` is a circular linked list.  When it is empty,
-  // `graveyard_.dead == &graveyard`.  The list is circular so that
-  // every item on it (even the last) has a non-null dead pointer.  This allows
-  // `Iterate` to determine if a given sample is live or dead using only
-  // information on the sample itself.
+  // Each `pools_[i].head` is a linked list of dead samples, linked through
+  // their dead pointers and terminated with `&graveyard_`.  When it is empty,
+  // `pools_[i].head == &graveyard_`.  Every item on a dead list (even the last)
+  // therefore has a non-null dead pointer.  This allows `Iterate` to determine
+  // if a given sample is live or dead using only information on the sample
+  // itself, without looking at the pools.
   //
-  // For example, nodes [A, B, C, D, E] with [A, C, E] alive and [B, D] dead
-  // looks like this (G is the Graveyard):
+  // For example, nodes [A, B, C, D, E] with [A, C, E] alive and [B, D] dead in
+  // one pool looks like this (P is the pool's head, G is the Graveyard):
   //
   //           +---+    +---+    +---+    +---+    +---+
   //    all -->| A |--->| B |--->| C |--->| D |--->| E |
   //           |   |    |   |    |   |    |   |    |   |
   //   +---+   |   | +->|   |-+  |   | +->|   |-+  |   |
-  //   | G |   +---+ |  +---+ |  +---+ |  +---+ |  +---+
-  //   |   |         |        |        |        |
+  //   | P |   +---+ |  +---+ |  +---+ |  +---+ |  +---+
   //   |   | --------+        +--------+        |
   //   +---+                                    |
-  //     ^                                      |
-  //     +--------------------------------------+
+  //                                            |
+  //   +---+                                    |
+  //   | G |<-----------------------------------+
+  //   +---+
   //
+  // Registration and unregistration take the lock of one pool, normally the
+  // one of the current CPU, and the lock of the sample whose state changes.
+  // A new sample is published on `all_` with a single compare-and-swap, after
+  // it has been fully initialized.
   std::atomic<T*> all_;
   T graveyard_;
+  DeadPool pools_[kDeadPools];
 
   std::atomic<DisposeCallback> dispose_;
   Allocator* const allocator_;
@@ -153,8 +199,18 @@ SampleRecorder<T, Allocator>::~SampleRecorder() {
 
 template <typename T, typename Allocator>
 void SampleRecorder<T, Allocator>::Init() {
-  AllocationGuardSpinLockHolder l(&graveyard_.lock);
-  graveyard_.dead = &graveyard_;
+  for (DeadPool& pool : pools_) {
+    AllocationGuardSpinLockHolder l(&pool.lock);
+    pool.head.store(&graveyard_, std::memory_order_relaxed);
+  }
+}
+
+template <typename T, typename Allocator>
+typename SampleRecorder<T, Allocator>::DeadPool&
+SampleRecorder<T, Allocator>::LocalPool() {
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  // The CPU may be unknown if neither rseq nor sched_getcpu() is available.
+  return pools_[cpu >= 0 ? cpu % kDeadPools : 0];
 }
 
 template <typename T, typename Allocator>
@@ -172,35 +228,57 @@ void SampleRecorder<T, Allocator>::PushDead(T* sample) {
     dispose(*sample);
   }
 
-  AllocationGuardSpinLockHolder graveyard_lock(&graveyard_.lock);
+  DeadPool& pool = LocalPool();
+  AllocationGuardSpinLockHolder pool_lock(&pool.lock);
   AllocationGuardSpinLockHolder sample_lock(&sample->lock);
-  sample->dead = graveyard_.dead;
-  graveyard_.dead = sample;
+  sample->dead = pool.head.load(std::memory_order_relaxed);
+  pool.head.store(sample, std::memory_order_relaxed);
 }
 
 template <typename T, typename Allocator>
 template <typename... Targs>
-T* SampleRecorder<T, Allocator>::PopDead(Targs&&... args) {
-  AllocationGuardSpinLockHolder graveyard_lock(&graveyard_.lock);
+T* SampleRecorder<T, Allocator>::PopDead(DeadPool& pool, Targs&&... args) {
+  // Skip empty pools without touching their lock.
+  if (pool.head.load(std::memory_order_relaxed) == &graveyard_) {
+    return nullptr;
+  }
 
-  // The list is circular, so eventually it collapses down to
-  //   graveyard_.dead == &graveyard_
-  // when it is empty.
-  T* sample = graveyard_.dead;
+  AllocationGuardSpinLockHolder pool_lock(&pool.lock);
+  T* sample = pool.head.load(std::memory_order_relaxed);
   if (sample == &graveyard_) return nullptr;
 
   AllocationGuardSpinLockHolder sample_lock(&sample->lock);
-  graveyard_.dead = sample->dead;
+  pool.head.store(sample->dead, std::memory_order_relaxed);
   sample->dead = nullptr;
   sample->PrepareForSampling(std::forward<Targs>(args)...);
   return sample;
 }
 
+template <typename T, typename Allocator>
+template <typename... Targs>
+T* SampleRecorder<T, Allocator>::PopAnyDead(Targs&&... args) {
+  DeadPool& local = LocalPool();
+  if (T* sample = PopDead(local, std::forward<Targs>(args)...)) {
+    return sample;
+  }
+  // Samples are often unregistered on a different CPU than they were
+  // registered on.  Take one from another pool rather than growing `all_`, so
+  // that the number of samples stays bounded by the peak number of live ones.
+  const size_t start = &local - pools_;
+  for (size_t i = 1; i < kDeadPools; ++i) {
+    DeadPool& pool = pools_[(start + i) % kDeadPools];
+    if (T* sample = PopDead(pool, std::forward<Targs>(args)...)) {
+      return sample;
+    }
+  }
+  return nullptr;
+}
+
 template <typename T, typename Allocator>
 template <typename... Targs>
 T* SampleRecorder<T, Allocator>::Register(Targs&&... args) {
-  T* sample = PopDead(std::forward<Targs>(args)...);
-  if (sample == nullptr) {
+  T* sample = PopAnyDead(std::forward<Targs>(args)...);
+  if (ABSL_PREDICT_FALSE(sample == nullptr)) {
     // Resurrection failed.  Hire a new warlock.
     sample = allocator_->New(std::forward<Targs>(args)...);
     PushNew(sample);
@@ -216,16 +294,23 @@ void SampleRecorder<T, Allocator>::Unregister(T* sample) {
 
 template <typename T, typename Allocator>
 void SampleRecorder<T, Allocator>::UnregisterAll() {
-  AllocationGuardSpinLockHolder graveyard_lock(&graveyard_.lock);
+  UnregisterIf([](T&) { return true; });
+}
+
+template <typename T, typename Allocator>
+void SampleRecorder<T, Allocator>::UnregisterIf(
+    const absl::FunctionRef<bool(T& sample)>& pred) {
+  DeadPool& pool = LocalPool();
+  AllocationGuardSpinLockHolder pool_lock(&pool.lock);
   T* sample = all_.load(std::memory_order_acquire);
   auto* dispose = dispose_.load(std::memory_order_relaxed);
   while (sample != nullptr) {
     {
       AllocationGuardSpinLockHolder sample_lock(&sample->lock);
-      if (sample->dead == nullptr) {
+      if (sample->dead == nullptr && pred(*sample)) {
         if (dispose) dispose(*sample);
-        sample->dead = graveyard_.dead;
-        graveyard_.dead = sample;
+        sample->dead = pool.head.load(std::memory_order_relaxed);
+        pool.head.store(sample, std::memory_order_relaxed);
       }
     }
     sample = sample->next;
@@ -245,6 +330,23 @@ void SampleRecorder<T, Allocator>::Iterate(
   }
 }
 
+template <typename T, typename Allocator>
+T* SampleRecorder<T, Allocator>::IterateBatch(
+    T* start, size_t max_samples,
+    const absl::FunctionRef<void(const T& sample)>& f) {
+  T* s = start;
+  size_t visited = 0;
+  while (s != nullptr && visited < max_samples) {
+    AllocationGuardSpinLockHolder l(&s->lock);
+    if (s->dead == nullptr) {
+      f(*s);
+      ++visited;
+    }
+    s = s->next;
+  }
+  return s;
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -22,16 +22,19 @@
 #include <cstdint>
 #include <random>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
 #include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/synchronization/notification.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
 #include "tcmalloc/testing/thread_manager.h"
+#include "benchmark/benchmark.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -174,6 +177,68 @@ TEST_F(SampleRecorderTest, Unregistration) {
   EXPECT_EQ(alloc_count1, alloc_count2);
 }
 
+TEST_F(SampleRecorderTest, UnregisterIf) {
+  for (size_t i = 0; i < 6; ++i) {
+    Register(i);
+  }
+  sample_recorder_.UnregisterIf([](Info& info) {
+    const size_t size = info.size.load(std::memory_order_relaxed);
+    // The predicate may update the samples it keeps.
+    info.size.store(size * 10, std::memory_order_relaxed);
+    return size % 2 == 1;
+  });
+  EXPECT_THAT(GetSizes(), UnorderedElementsAre(0, 20, 40));
+
+  // The unregistered samples are reused.
+  const uint64_t alloc_count = allocator_.alloc_count();
+  for (size_t i = 0; i < 3; ++i) {
+    Register(i);
+  }
+  EXPECT_EQ(allocator_.alloc_count(), alloc_count);
+}
+
+TEST_F(SampleRecorderTest, IterateBatch) {
+  std::vector<Info*> infos;
+  for (size_t i = 0; i < 7; ++i) {
+    infos.push_back(Register(i));
+  }
+  // Dead samples are skipped and do not count towards the batch size.
+  sample_recorder_.Unregister(infos[2]);
+  sample_recorder_.Unregister(infos[5]);
+
+  std::vector<size_t> sizes;
+  sizes.reserve(infos.size());
+  int batches = 0;
+  Info* cursor = sample_recorder_.IterationStart();
+  while (cursor != nullptr) {
+    size_t batch_size = 0;
+    cursor = sample_recorder_.IterateBatch(cursor, 2, [&](const Info& info) {
+      sizes.push_back(info.size.load(std::memory_order_acquire));
+      ++batch_size;
+    });
+    EXPECT_LE(batch_size, 2);
+    ++batches;
+  }
+  EXPECT_THAT(sizes, UnorderedElementsAre(0, 1, 3, 4, 6));
+  EXPECT_EQ(batches, 3);
+
+  // Registering samples while a batched iteration is suspended does not
+  // invalidate the cursor.  Here the registration revives one of the dead
+  // samples after the cursor, so it is visited.
+  cursor = sample_recorder_.IterationStart();
+  sizes.clear();
+  cursor = sample_recorder_.IterateBatch(cursor, 1, [&](const Info& info) {
+    sizes.push_back(info.size.load(std::memory_order_acquire));
+  });
+  Register(7);
+  while (cursor != nullptr) {
+    cursor = sample_recorder_.IterateBatch(cursor, 1, [&](const Info& info) {
+      sizes.push_back(info.size.load(std::memory_order_acquire));
+    });
+  }
+  EXPECT_THAT(sizes, UnorderedElementsAre(0, 1, 3, 4, 6, 7));
+}
+
 TEST_F(SampleRecorderTest, MultiThreaded) {
   absl::Notification stop;
   ThreadManager threads;
@@ -233,6 +298,63 @@ TEST_F(SampleRecorderTest, MultiThreaded) {
   threads.Stop();
 }
 
+// Registers and unregisters samples from many threads, which are likely to
+// migrate between CPUs and hence between the recorder's pools of dead samples,
+// while other threads iterate.
+TEST_F(SampleRecorderTest, StressRecycling) {
+  constexpr int kThreads = 16;
+  constexpr int kLivePerThread = 8;
+  constexpr int kIterations = 20000;
+
+  const uint64_t alloc_count_before = allocator_.alloc_count();
+  absl::Notification stop;
+  ThreadManager iterators;
+  iterators.Start(2, [&](int) {
+    absl::flat_hash_set<const Info*> seen;
+    seen.reserve(kThreads * kLivePerThread * 2);
+    while (!stop.HasBeenNotified()) {
+      seen.clear();
+      sample_recorder_.Iterate([&](const Info& info) {
+        ASSERT_TRUE(info.initialized);
+        // A sample must not be visited twice in a single pass.
+        ASSERT_TRUE(seen.insert(&info).second);
+      });
+      ASSERT_LE(seen.size(), kThreads * kLivePerThread);
+    }
+  });
+
+  std::vector<std::thread> threads;
+  threads.reserve(kThreads);
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&]() {
+      std::vector<Info*> live;
+      live.reserve(kLivePerThread);
+      for (int i = 0; i < kIterations; ++i) {
+        if (live.size() == kLivePerThread) {
+          sample_recorder_.Unregister(live[i % kLivePerThread]);
+          live[i % kLivePerThread] = Register(i);
+        } else {
+          live.push_back(Register(i));
+        }
+      }
+      for (Info* info : live) {
+        sample_recorder_.Unregister(info);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  stop.Notify();
+  iterators.Stop();
+
+  EXPECT_THAT(GetSizes(), IsEmpty());
+  // Dead samples are recycled across pools, so no more samples are allocated
+  // than were ever live at once.
+  EXPECT_LE(allocator_.alloc_count() - alloc_count_before,
+            kThreads * kLivePerThread);
+}
+
 TEST_F(SampleRecorderTest, Callback) {
   auto* info1 = Register(1);
   auto* info2 = Register(2);
@@ -295,6 +417,22 @@ TEST(SampleRecorderWithParamTest, RegisterWithParam) {
   EXPECT_TRUE(info->initialized);
 }
 
+void BM_RegisterUnregister(benchmark::State& state) {
+  static TestAllocator allocator;
+  static auto* sample_recorder = [] {
+    auto* recorder = new SampleRecorder<Info, TestAllocator>(&allocator);
+    recorder->Init();
+    return recorder;
+  }();
+
+  for (auto s : state) {
+    Info* info = sample_recorder->Register();
+    benchmark::DoNotOptimize(info);
+    sample_recorder->Unregister(info);
+  }
+}
+BENCHMARK(BM_RegisterUnregister)->ThreadRange(1, 64)->UseRealTime();
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
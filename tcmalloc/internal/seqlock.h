@@ -0,0 +1,100 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_SEQLOCK_H_
+#define TCMALLOC_INTERNAL_SEQLOCK_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Publishes a value of trivially copyable type T to readers that must not
+// block writers, or each other.
+//
+// Writes must be serialized by the caller, e.g. by a lock that writers already
+// hold.  Reads never block: they copy the value and retry if a write ran
+// concurrently.  The value is stored as relaxed atomic words, so that racing
+// reads are well-defined.
+//
+// Is safe to use with static storage duration.
+template <typename T>
+class Seqlock {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "T must be trivially copyable");
+
+ public:
+  constexpr Seqlock() : sequence_(0), words_{} {}
+
+  Seqlock(const Seqlock&) = delete;
+  Seqlock& operator=(const Seqlock&) = delete;
+
+  // Publishes value.  REQUIRES: no concurrent calls to Write().
+  void Write(const T& value) {
+    uint64_t words[kWords] = {};
+    memcpy(words, &value, sizeof(T));
+
+    const uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    // An odd sequence marks a write in progress.
+    sequence_.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  // Returns the last published value, or a value-initialized T if nothing was
+  // published yet.
+  T Read() const {
+    uint64_t words[kWords];
+    while (true) {
+      const uint64_t before = sequence_.load(std::memory_order_acquire);
+      if (before & 1) continue;
+      for (size_t i = 0; i < kWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (sequence_.load(std::memory_order_relaxed) == before) break;
+    }
+    T value;
+    memcpy(&value, words, sizeof(T));
+    return value;
+  }
+
+  // Returns the number of writes so far.
+  uint64_t writes() const {
+    return sequence_.load(std::memory_order_relaxed) / 2;
+  }
+
+ private:
+  static constexpr size_t kWords =
+      (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint64_t> sequence_;
+  std::atomic<uint64_t> words_[kWords];
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_SEQLOCK_H_
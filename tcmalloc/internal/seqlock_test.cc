@@ -0,0 +1,78 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/seqlock.h"
+
+#include <atomic>
+#include <cstdint>
+#include <thread>  // NOLINT(build/c++11)
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// Fields are written with related values, so that torn reads are detectable.
+struct Totals {
+  uint64_t a;
+  uint64_t b;
+  uint32_t c;
+};
+
+TEST(SeqlockTest, ReadsLastWrite) {
+  Seqlock<Totals> seqlock;
+  Totals totals = seqlock.Read();
+  EXPECT_EQ(totals.a, 0);
+  EXPECT_EQ(totals.b, 0);
+  EXPECT_EQ(totals.c, 0);
+  EXPECT_EQ(seqlock.writes(), 0);
+
+  seqlock.Write({1, 2, 3});
+  seqlock.Write({4, 5, 6});
+  totals = seqlock.Read();
+  EXPECT_EQ(totals.a, 4);
+  EXPECT_EQ(totals.b, 5);
+  EXPECT_EQ(totals.c, 6);
+  EXPECT_EQ(seqlock.writes(), 2);
+}
+
+TEST(SeqlockTest, ReadsAreNotTorn) {
+  Seqlock<Totals> seqlock;
+  std::atomic<bool> done{false};
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.emplace_back([&] {
+      while (!done.load(std::memory_order_relaxed)) {
+        const Totals totals = seqlock.Read();
+        ASSERT_EQ(totals.b, 2 * totals.a);
+        ASSERT_EQ(totals.c, static_cast<uint32_t>(3 * totals.a));
+      }
+    });
+  }
+
+  for (uint64_t i = 0; i < 100000; ++i) {
+    seqlock.Write({i, 2 * i, static_cast<uint32_t>(3 * i)});
+  }
+  done.store(true, std::memory_order_relaxed);
+  for (auto& reader : readers) {
+    reader.join();
+  }
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
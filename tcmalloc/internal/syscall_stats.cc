@@ -0,0 +1,130 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/syscall_stats.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/optimization.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+// The syscalls are much slower than a contended atomic add, so a single
+// counter per syscall is enough.
+struct Counter {
+  std::atomic<uint64_t> calls;
+  std::atomic<uint64_t> cycles;
+};
+
+ABSL_CONST_INIT Counter counters[kNumSyscalls] = {};
+
+// Counts the time from its construction to its destruction as a call of
+// syscall.  Doesn't change errno.
+class ScopedSyscall {
+ public:
+  explicit ScopedSyscall(Syscall syscall)
+      : counter_(counters[static_cast<int>(syscall)]),
+        start_(absl::base_internal::CycleClock::Now()) {}
+
+  ~ScopedSyscall() {
+    const int64_t cycles = absl::base_internal::CycleClock::Now() - start_;
+    counter_.calls.fetch_add(1, std::memory_order_relaxed);
+    // The cycle counter may go backwards if we migrated between CPUs.
+    if (cycles > 0) {
+      counter_.cycles.fetch_add(cycles, std::memory_order_relaxed);
+    }
+  }
+
+  ScopedSyscall(const ScopedSyscall&) = delete;
+  ScopedSyscall& operator=(const ScopedSyscall&) = delete;
+
+ private:
+  Counter& counter_;
+  const int64_t start_;
+};
+
+}  // namespace
+
+SyscallCount GetSyscallCount(Syscall syscall) {
+  const Counter& counter = counters[static_cast<int>(syscall)];
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  return {
+      .calls = counter.calls.load(std::memory_order_relaxed),
+      .ns = static_cast<uint64_t>(
+          counter.cycles.load(std::memory_order_relaxed) * ns_per_cycle),
+  };
+}
+
+const char* SyscallName(Syscall syscall) {
+  switch (syscall) {
+    case Syscall::kMmap:
+      return "mmap";
+    case Syscall::kMprotect:
+      return "mprotect";
+    case Syscall::kMunmap:
+      return "munmap";
+    case Syscall::kMemfdCreate:
+      return "memfd_create";
+    case Syscall::kFtruncate:
+      return "ftruncate";
+    case Syscall::kNumSyscalls:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+void* CountedMmap(void* addr, size_t length, int prot, int flags, int fd,
+                  off_t offset) {
+  ScopedSyscall s(Syscall::kMmap);
+  return mmap(addr, length, prot, flags, fd, offset);
+}
+
+int CountedMprotect(void* addr, size_t length, int prot) {
+  ScopedSyscall s(Syscall::kMprotect);
+  return mprotect(addr, length, prot);
+}
+
+int CountedMunmap(void* addr, size_t length) {
+  ScopedSyscall s(Syscall::kMunmap);
+  return munmap(addr, length);
+}
+
+int CountedMemfdCreate(const char* name, unsigned int flags) {
+  ScopedSyscall s(Syscall::kMemfdCreate);
+  return memfd_create(name, flags);
+}
+
+int CountedFtruncate(int fd, off_t length) {
+  ScopedSyscall s(Syscall::kFtruncate);
+  return ftruncate(fd, length);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
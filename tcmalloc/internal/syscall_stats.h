@@ -0,0 +1,68 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_INTERNAL_SYSCALL_STATS_H_
+#define TCMALLOC_INTERNAL_SYSCALL_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tcmalloc/internal/config.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The memory management syscalls whose calls the allocator counts.
+enum class Syscall {
+  kMmap,
+  kMprotect,
+  kMunmap,
+  kMemfdCreate,
+  kFtruncate,
+  kNumSyscalls,
+};
+
+inline constexpr int kNumSyscalls = static_cast<int>(Syscall::kNumSyscalls);
+
+struct SyscallCount {
+  // The number of calls, whether or not they failed, and the total time spent
+  // in them.
+  uint64_t calls;
+  uint64_t ns;
+};
+
+// Returns the calls of syscall made through the wrappers below since the
+// process started.
+SyscallCount GetSyscallCount(Syscall syscall);
+
+// Returns the name of syscall, e.g. "mmap".
+const char* SyscallName(Syscall syscall);
+
+// Like the syscalls they are named after, and preserve errno, but count the
+// call and the time it took.  The allocator makes these syscalls through
+// them, so that GetSyscallCount() covers all of its calls.
+void* CountedMmap(void* addr, size_t length, int prot, int flags, int fd,
+                  off_t offset);
+int CountedMprotect(void* addr, size_t length, int prot);
+int CountedMunmap(void* addr, size_t length);
+int CountedMemfdCreate(const char* name, unsigned int flags);
+int CountedFtruncate(int fd, off_t length);
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_INTERNAL_SYSCALL_STATS_H_
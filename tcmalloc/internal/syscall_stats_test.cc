@@ -0,0 +1,72 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/internal/syscall_stats.h"
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "gtest/gtest.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+TEST(SyscallStatsTest, CountsCalls) {
+  const SyscallCount mmaps = GetSyscallCount(Syscall::kMmap);
+  const SyscallCount mprotects = GetSyscallCount(Syscall::kMprotect);
+  const SyscallCount munmaps = GetSyscallCount(Syscall::kMunmap);
+  const SyscallCount memfds = GetSyscallCount(Syscall::kMemfdCreate);
+  const SyscallCount ftruncates = GetSyscallCount(Syscall::kFtruncate);
+
+  const size_t kSize = getpagesize();
+  const int fd = CountedMemfdCreate("syscall_stats_test", MFD_CLOEXEC);
+  ASSERT_NE(fd, -1);
+  ASSERT_EQ(CountedFtruncate(fd, kSize), 0);
+  void* p = CountedMmap(nullptr, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                        0);
+  ASSERT_NE(p, MAP_FAILED);
+  ASSERT_EQ(CountedMprotect(p, kSize, PROT_NONE), 0);
+  ASSERT_EQ(CountedMunmap(p, kSize), 0);
+  close(fd);
+
+  EXPECT_EQ(GetSyscallCount(Syscall::kMmap).calls, mmaps.calls + 1);
+  EXPECT_EQ(GetSyscallCount(Syscall::kMprotect).calls, mprotects.calls + 1);
+  EXPECT_EQ(GetSyscallCount(Syscall::kMunmap).calls, munmaps.calls + 1);
+  EXPECT_EQ(GetSyscallCount(Syscall::kMemfdCreate).calls, memfds.calls + 1);
+  EXPECT_EQ(GetSyscallCount(Syscall::kFtruncate).calls, ftruncates.calls + 1);
+  EXPECT_GE(GetSyscallCount(Syscall::kMmap).ns, mmaps.ns);
+}
+
+TEST(SyscallStatsTest, CountsFailuresAndPreservesErrno) {
+  const SyscallCount munmaps = GetSyscallCount(Syscall::kMunmap);
+
+  // munmap fails on an address that isn't page-aligned.
+  errno = 0;
+  EXPECT_EQ(CountedMunmap(reinterpret_cast<void*>(1), 1), -1);
+  EXPECT_EQ(errno, EINVAL);
+  EXPECT_EQ(GetSyscallCount(Syscall::kMunmap).calls, munmaps.calls + 1);
+}
+
+TEST(SyscallStatsTest, Names) {
+  EXPECT_STREQ(SyscallName(Syscall::kMmap), "mmap");
+  EXPECT_STREQ(SyscallName(Syscall::kMemfdCreate), "memfd_create");
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -73,6 +73,19 @@ ssize_t signal_safe_write(int fd, const char* buf, size_t count,
   return rc;
 }
 
+ssize_t signal_safe_pread(int fd, char* buf, size_t count, off_t offset) {
+  size_t total_bytes = 0;
+  while (total_bytes < count) {
+    const ssize_t rc =
+        pread(fd, buf + total_bytes, count - total_bytes, offset + total_bytes);
+    if (rc == -1 && errno == EINTR) continue;
+    if (rc == -1) return total_bytes > 0 ? total_bytes : -1;
+    if (rc == 0) break;  // EOF
+    total_bytes += rc;
+  }
+  return total_bytes;
+}
+
 int signal_safe_poll(struct pollfd* fds, int nfds, absl::Duration timeout) {
   int rc = 0;
   absl::Duration elapsed = absl::ZeroDuration();
@@ -81,6 +81,12 @@ ssize_t signal_safe_write(int fd, const char* buf, size_t count,
 // read before any error.
 ssize_t signal_safe_read(int fd, char* buf, size_t count, size_t* bytes_read);
 
+// signal_safe_pread() - a wrapper for pread(2) which ignores signals
+// Reads until count bytes were read, end of file or an error, continuing at
+// the offset after the bytes already read.  Returns the number of bytes read,
+// or -1 on an error before any byte was read, error in errno.
+ssize_t signal_safe_pread(int fd, char* buf, size_t count, off_t offset);
+
 // signal_safe_poll() - a wrapper for poll(2) which ignores signals
 // Semantics equivalent to poll(2):
 //   Returns number of structures with non-zero revent fields.
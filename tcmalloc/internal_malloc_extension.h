@@ -26,6 +26,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/time/time.h"
@@ -68,13 +69,31 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetRegionFactory(
 
 ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
 MallocExtension_Internal_SnapshotCurrent(tcmalloc::ProfileType type);
+ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
+MallocExtension_Internal_LiveHeapProfile();
+ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
+MallocExtension_Internal_SnapshotAllocationRate(absl::Duration window);
+ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
+MallocExtension_Internal_SnapshotPeakHeapWindow(size_t window);
+ABSL_ATTRIBUTE_WEAK const tcmalloc::tcmalloc_internal::ProfileBase*
+MallocExtension_Internal_SnapshotHeapDelta(
+    tcmalloc::tcmalloc_internal::HeapDeltaBaseline* baseline,
+    size_t min_change_bytes);
 
 ABSL_ATTRIBUTE_WEAK tcmalloc::tcmalloc_internal::AllocationProfilingTokenBase*
 MallocExtension_Internal_StartAllocationProfiling();
 ABSL_ATTRIBUTE_WEAK tcmalloc::tcmalloc_internal::AllocationProfilingTokenBase*
 MallocExtension_Internal_StartLifetimeProfiling();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetLifetimeRecordingEnabled(
+    bool enabled);
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_DrainLifetimeRecords(
+    tcmalloc::MallocExtension::LifetimeRecord* records, size_t max_records,
+    uint64_t* dropped);
 
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ActivateGuardedSampling();
+ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_GetGuardedPagePoolSize();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetGuardedPagePoolSize(
+    size_t value);
 ABSL_ATTRIBUTE_WEAK tcmalloc::MallocExtension::Ownership
 MallocExtension_Internal_GetOwnership(const void* ptr);
 ABSL_ATTRIBUTE_WEAK size_t MallocExtension_Internal_GetMemoryLimit(
@@ -96,6 +115,8 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetSkipSubreleaseLongInterval(
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetProperties(
     std::map<std::string, tcmalloc::MallocExtension::Property>* ret);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_GetStats(std::string* ret);
+ABSL_ATTRIBUTE_WEAK bool MallocExtension_Internal_GetStatsSnapshot(
+    tcmalloc::MallocExtension::StatsV1* stats);
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetMaxPerCpuCacheSize(
     int32_t value);
 ABSL_ATTRIBUTE_WEAK void
@@ -123,6 +144,10 @@ ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_MarkThreadIdle();
 ABSL_ATTRIBUTE_WEAK int64_t MallocExtension_Internal_GetProfileSamplingRate();
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetProfileSamplingRate(
     int64_t);
+ABSL_ATTRIBUTE_WEAK int64_t
+MallocExtension_Internal_GetThreadProfileSamplingRate();
+ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_SetThreadProfileSamplingRate(
+    int64_t);
 
 ABSL_ATTRIBUTE_WEAK void MallocExtension_Internal_ProcessBackgroundActions();
 
@@ -267,6 +267,64 @@ Profile MallocExtension::SnapshotCurrent(tcmalloc::ProfileType type) {
 #endif
 }
 
+Profile MallocExtension::LiveHeapProfile() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_LiveHeapProfile == nullptr) {
+    return Profile();
+  }
+
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::unique_ptr<const tcmalloc_internal::ProfileBase>(
+          MallocExtension_Internal_LiveHeapProfile()));
+#else
+  return Profile();
+#endif
+}
+
+Profile MallocExtension::SnapshotAllocationRate(absl::Duration window) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SnapshotAllocationRate == nullptr) {
+    return Profile();
+  }
+
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::unique_ptr<const tcmalloc_internal::ProfileBase>(
+          MallocExtension_Internal_SnapshotAllocationRate(window)));
+#else
+  return Profile();
+#endif
+}
+
+Profile MallocExtension::SnapshotPeakHeapWindow(size_t window) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SnapshotPeakHeapWindow == nullptr) {
+    return Profile();
+  }
+
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::unique_ptr<const tcmalloc_internal::ProfileBase>(
+          MallocExtension_Internal_SnapshotPeakHeapWindow(window)));
+#else
+  return Profile();
+#endif
+}
+
+Profile MallocExtension::SnapshotHeapDelta(HeapDeltaToken& token,
+                                           size_t min_change_bytes) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SnapshotHeapDelta == nullptr) {
+    return Profile();
+  }
+
+  return tcmalloc_internal::ProfileAccessor::MakeProfile(
+      std::unique_ptr<const tcmalloc_internal::ProfileBase>(
+          MallocExtension_Internal_SnapshotHeapDelta(&token.baseline_,
+                                                     min_change_bytes)));
+#else
+  return Profile();
+#endif
+}
+
 MallocExtension::AllocationProfilingToken
 MallocExtension::StartAllocationProfiling() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
@@ -297,6 +355,30 @@ MallocExtension::StartLifetimeProfiling() {
 #endif
 }
 
+void MallocExtension::SetLifetimeRecordingEnabled(bool enabled) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetLifetimeRecordingEnabled != nullptr) {
+    MallocExtension_Internal_SetLifetimeRecordingEnabled(enabled);
+  }
+#endif
+  (void)enabled;
+}
+
+size_t MallocExtension::DrainLifetimeRecords(
+    absl::Span<LifetimeRecord> records, uint64_t* dropped) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_DrainLifetimeRecords != nullptr) {
+    uint64_t unused;
+    return MallocExtension_Internal_DrainLifetimeRecords(
+        records.data(), records.size(), dropped != nullptr ? dropped : &unused);
+  }
+#endif
+  if (dropped != nullptr) {
+    *dropped = 0;
+  }
+  return 0;
+}
+
 void MallocExtension::MarkThreadIdle() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (&MallocExtension_Internal_MarkThreadIdle == nullptr) {
@@ -373,6 +455,24 @@ void MallocExtension::SetProfileSamplingRate(int64_t rate) {
   (void)rate;
 }
 
+int64_t MallocExtension::GetThreadProfileSamplingRate() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetThreadProfileSamplingRate != nullptr) {
+    return MallocExtension_Internal_GetThreadProfileSamplingRate();
+  }
+#endif
+  return -1;
+}
+
+void MallocExtension::SetThreadProfileSamplingRate(int64_t rate) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_SetThreadProfileSamplingRate != nullptr) {
+    MallocExtension_Internal_SetThreadProfileSamplingRate(rate);
+  }
+#endif
+  (void)rate;
+}
+
 int64_t MallocExtension::GetGuardedSamplingRate() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (MallocExtension_Internal_GetGuardedSamplingRate == nullptr) {
@@ -431,6 +531,30 @@ void MallocExtension::ActivateGuardedSampling() {
 #endif
 }
 
+size_t MallocExtension::GetGuardedPagePoolSize() {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_GetGuardedPagePoolSize == nullptr) {
+    return 0;
+  }
+
+  return MallocExtension_Internal_GetGuardedPagePoolSize();
+#else
+  return 0;
+#endif
+}
+
+void MallocExtension::SetGuardedPagePoolSize(size_t value) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (MallocExtension_Internal_SetGuardedPagePoolSize == nullptr) {
+    return;
+  }
+
+  MallocExtension_Internal_SetGuardedPagePoolSize(value);
+#else
+  (void)value;
+#endif
+}
+
 bool MallocExtension::PerCpuCachesActive() {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
   if (MallocExtension_Internal_GetPerCpuCachesActive == nullptr) {
@@ -619,6 +743,16 @@ void MallocExtension::SetSkipSubreleaseLongInterval(absl::Duration value) {
 #endif
 }
 
+bool MallocExtension::GetStatsSnapshot(StatsV1* stats) {
+#if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
+  if (&MallocExtension_Internal_GetStatsSnapshot != nullptr) {
+    return MallocExtension_Internal_GetStatsSnapshot(stats);
+  }
+#endif
+  (void)stats;
+  return false;
+}
+
 absl::optional<size_t> MallocExtension::GetNumericProperty(
     absl::string_view property) {
 #if ABSL_INTERNAL_HAVE_WEAK_MALLOCEXTENSION_STUBS
@@ -33,6 +33,7 @@
 #include <string>
 #include <tuple>
 #include <utility>
+#include <vector>
 
 #include "absl/base/attributes.h"
 #include "absl/functional/function_ref.h"
@@ -84,6 +85,24 @@ class AllocationProfilingTokenAccessor;
 class AllocationProfilingTokenBase;
 class ProfileAccessor;
 class ProfileBase;
+
+// The sampled live objects and bytes of one allocation stack, identified by a
+// hash of the stack.  See MallocExtension::SnapshotHeapDelta.
+struct HeapDeltaEntry {
+  uint64_t stack_hash;
+  int64_t count;
+  int64_t bytes;
+  // The frames of the stack are HeapDeltaBaseline::frames[frames_offset,
+  // frames_offset + depth).
+  size_t frames_offset;
+  size_t depth;
+};
+
+struct HeapDeltaBaseline {
+  // Sorted by stack_hash.
+  std::vector<HeapDeltaEntry> entries;
+  std::vector<void*> frames;
+};
 }  // namespace tcmalloc_internal
 
 enum class ProfileType {
@@ -344,11 +363,56 @@ class MallocExtension final {
   //
   //  "tcmalloc.per_cpu_caches_active"
   //      Whether tcmalloc is using per-CPU caches (1 or 0 respectively).
+  //
+  //  "tcmalloc.mmap_calls", "tcmalloc.mmap_ns"
+  //      Number of mmap calls made by tcmalloc, and the total nanoseconds
+  //      spent in them.  Likewise for mprotect, munmap, memfd_create and
+  //      ftruncate.
   // -------------------------------------------------------------------
 
   // Gets the named property's value or a nullopt if the property is not valid.
   static absl::optional<size_t> GetNumericProperty(absl::string_view property);
 
+  // A fixed-layout snapshot of the allocator's main counters, filled in by
+  // GetStatsSnapshot.  Fields are only ever appended; callers should check
+  // `version` before reading fields added by later versions.
+  struct StatsV1 {
+    static constexpr uint32_t kVersion = 1;
+
+    uint32_t version;
+    // sizeof(StatsV1) of the implementation that filled in the snapshot.
+    uint32_t size;
+
+    // Wall time, in nanoseconds since the epoch, at which the page heap
+    // totals below were last published, or 0 if they have not been yet.
+    // They are published whenever the allocator gathers its stats, e.g. for
+    // GetStats, and whenever ReleaseMemoryToSystem runs, so at least once per
+    // GetBackgroundProcessSleepInterval while ProcessBackgroundActions runs.
+    int64_t pageheap_timestamp_ns;
+
+    // As the properties of the same name.  Derived totals combine page heap
+    // totals as of pageheap_timestamp_ns with cache totals read at the time of
+    // the call.
+    uint64_t current_allocated_bytes;
+    uint64_t heap_size;
+    uint64_t physical_memory_used;
+    uint64_t virtual_memory_used;
+    uint64_t pageheap_free_bytes;
+    uint64_t pageheap_unmapped_bytes;
+    uint64_t metadata_bytes;
+    uint64_t cpu_free;
+    uint64_t sharded_transfer_cache_free;
+    uint64_t transfer_cache_free;
+    uint64_t central_cache_free;
+    uint64_t thread_cache_free;
+    uint64_t sampled_internal_fragmentation;
+  };
+
+  // Fills in *stats without taking any lock shared with allocating threads,
+  // so that it can be polled frequently.  Returns false if the implementation
+  // does not support snapshots.
+  static bool GetStatsSnapshot(StatsV1* stats);
+
   // Marks the current thread as "idle".  This function may optionally be called
   // by threads as a hint to the malloc implementation that any thread-specific
   // resources should be released.  Note: this may be an expensive function, so
@@ -453,6 +517,17 @@ class MallocExtension final {
   // every rate bytes allocated.
   static void SetProfileSamplingRate(int64_t rate);
 
+  // Gets the sampling rate set for the calling thread by
+  // SetThreadProfileSamplingRate, or 0 if the thread uses the process-wide
+  // rate.  Returns a value < 0 if unknown.
+  static int64_t GetThreadProfileSamplingRate();
+  // Overrides the sampling rate for heap profiles for allocations made by the
+  // calling thread, for example to profile one thread pool in more detail
+  // than the rest of the process.  Each sample is weighted by the rate it was
+  // taken at, so profiles remain unbiased.  A rate <= 0 restores the
+  // process-wide rate.
+  static void SetThreadProfileSamplingRate(int64_t rate);
+
   // Gets the guarded sampling rate.  Returns a value < 0 if unknown.
   static int64_t GetGuardedSamplingRate();
   // Sets the guarded sampling rate for sampled allocations.  TCMalloc samples
@@ -472,6 +547,13 @@ class MallocExtension final {
   // use-after-free according to the guarded sample parameter value.
   static void ActivateGuardedSampling();
 
+  // Gets the number of slots in the guarded page pool, or 0 if unavailable.
+  static size_t GetGuardedPagePoolSize();
+  // Sets the number of slots in the guarded page pool, of which half may be
+  // allocated at a time.  Has no effect once an allocation has been guarded,
+  // so call it before ActivateGuardedSampling.
+  static void SetGuardedPagePoolSize(size_t value);
+
   // Gets whether TCMalloc is using per-CPU caches.
   static bool PerCpuCachesActive();
 
@@ -567,6 +649,56 @@ class MallocExtension final {
 
   static Profile SnapshotCurrent(tcmalloc::ProfileType type);
 
+  // Returns a heap profile which, unlike SnapshotCurrent(ProfileType::kHeap),
+  // does not copy the sampled allocations when it is created.  Instead they
+  // are read in small batches each time the profile is iterated, so memory use
+  // does not depend on the number of samples; each iteration reports the
+  // allocations live at that time.  Pair it with the fd overload of
+  // tcmalloc::Marshal to stream a heap profile to a file.
+  static Profile LiveHeapProfile();
+
+  // Returns an allocation profile of the stacks that allocated the most during
+  // the last `window` (rounded up to whole minutes, at most one hour).  Unlike
+  // StartAllocationProfiling, this profile is always collected from the
+  // sampled allocations in bounded memory, so it can be queried at any time.
+  // Values are estimates: only the heaviest stacks of each minute are kept.
+  static Profile SnapshotAllocationRate(absl::Duration window);
+
+  // Returns the peak heap profile of one of the last 24 hours, where window 0
+  // is the current hour, 1 the previous one, and so on.  While
+  // SnapshotCurrent(ProfileType::kPeakHeap) reports the all-time peak, this
+  // shows recurring peaks after an early spike.  The profile is empty if no
+  // allocation was sampled during that hour.
+  static Profile SnapshotPeakHeapWindow(size_t window);
+
+  // HeapDeltaToken holds the baseline of SnapshotHeapDelta: the sampled live
+  // objects and bytes of each allocation stack, keyed by a hash of the stack,
+  // and the frames of the stack.  It takes a few dozen bytes per stack plus
+  // one pointer per frame.  A default-constructed token has an empty baseline.
+  class HeapDeltaToken {
+   public:
+    // Returns the number of stacks in the baseline.
+    size_t size() const { return baseline_.entries.size(); }
+
+   private:
+    friend class MallocExtension;
+
+    tcmalloc_internal::HeapDeltaBaseline baseline_;
+  };
+
+  // Returns a heap profile of the stacks whose sampled live bytes changed by
+  // at least `min_change_bytes`, in either direction, since the baseline held
+  // by `token`, and makes the current heap the new baseline.  The count and
+  // sum of each sample are the change in objects and bytes, negative if they
+  // decreased.  Stacks that no longer have live allocations are reported with
+  // all of their baseline objects and bytes as a decrease.
+  //
+  // The first call with a token reports the whole heap.  Calling it
+  // periodically with the same token reports where the heap grew in between,
+  // which is far smaller than two full heap profiles when looking for leaks.
+  static Profile SnapshotHeapDelta(HeapDeltaToken& token,
+                                   size_t min_change_bytes = 0);
+
   // AllocationProfilingToken tracks an active profiling session started with
   // StartAllocationProfiling.  Profiling continues until Stop() is called.
   class AllocationProfilingToken {
@@ -602,6 +734,32 @@ class MallocExtension final {
   // session. Returns null if the implementation does not support profiling.
   static AllocationProfilingToken StartLifetimeProfiling();
 
+  // The lifetime of one sampled allocation, as observed by a lifetime profile
+  // when the allocation was freed.  Stacks are identified by a hash of their
+  // frames, which is stable within a process.
+  struct LifetimeRecord {
+    uint64_t alloc_stack_hash;
+    uint64_t dealloc_stack_hash;
+    size_t allocated_size;
+    int64_t lifetime_ns;
+    bool same_cpu;
+    bool same_thread;
+  };
+
+  // Enables or disables the recording of LifetimeRecords.  While enabled and
+  // a session started with StartLifetimeProfiling is active, each sampled
+  // deallocation it observes appends a record to a fixed-size per-CPU buffer,
+  // in addition to being aggregated into the profile.  Records that do not
+  // fit are dropped and counted, so memory use stays bounded when
+  // DrainLifetimeRecords is not called often enough.
+  static void SetLifetimeRecordingEnabled(bool enabled);
+
+  // Moves up to `records.size()` buffered records into `records`, and returns
+  // how many were moved.  If `dropped` is non-null, it is set to the number
+  // of records dropped since the previous call.
+  static size_t DrainLifetimeRecords(absl::Span<LifetimeRecord> records,
+                                     uint64_t* dropped = nullptr);
+
   // Runs housekeeping actions for the allocator off of the main allocation path
   // of new/delete.  As of 2020, this includes:
   // * Inspecting the current CPU mask and releasing memory from inaccessible
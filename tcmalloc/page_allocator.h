@@ -32,6 +32,7 @@
 #include "tcmalloc/page_allocator_interface.h"
 #include "tcmalloc/page_heap.h"
 #include "tcmalloc/pages.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stats.h"
 
@@ -191,12 +192,14 @@ inline PageAllocator::Interface* PageAllocator::impl(MemoryTag tag) const {
 
 inline Span* PageAllocator::New(Length n, SpanAllocInfo span_alloc_info,
                                 MemoryTag tag) {
+  ScopedSlowPathTimer timer(SlowPath::kPageAllocatorNew);
   return impl(tag)->New(n, span_alloc_info);
 }
 
 inline Span* PageAllocator::NewAligned(Length n, Length align,
                                        SpanAllocInfo span_alloc_info,
                                        MemoryTag tag) {
+  ScopedSlowPathTimer timer(SlowPath::kPageAllocatorNew);
   return impl(tag)->NewAligned(n, align, span_alloc_info);
 }
 
@@ -0,0 +1,267 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/page_protection_engine.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/spinlock.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/syscall_stats.h"
+#include "tcmalloc/system-alloc.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+ABSL_CONST_INIT std::atomic<PageProtectionEngine*>
+    registered_engines[PageProtectionEngine::kMaxEngines] = {};
+
+}  // namespace
+
+bool PageProtectionEngine::Init(const Options& options) {
+  CHECK_CONDITION(options.batch_size > 0);
+  CHECK_CONDITION(options.batch_size <= kMaxBatch);
+  CHECK_CONDITION(options.release != nullptr);
+  name_ = options.name;
+  coalesce_gap_ = options.coalesce_gap;
+  batch_size_ = options.batch_size;
+  owner_ = options.owner;
+  release_ = options.release;
+
+  void* base = MmapAligned(options.reservation_bytes, options.alignment,
+                           options.tag);
+  if (base == nullptr) return false;
+  base_.store(reinterpret_cast<uintptr_t>(base), std::memory_order_relaxed);
+  end_.store(reinterpret_cast<uintptr_t>(base) + options.reservation_bytes,
+             std::memory_order_release);
+
+  for (auto& engine : registered_engines) {
+    PageProtectionEngine* expected = nullptr;
+    if (engine.compare_exchange_strong(expected, this,
+                                       std::memory_order_release,
+                                       std::memory_order_relaxed)) {
+      return true;
+    }
+  }
+  Crash(kCrash, __FILE__, __LINE__, "too many page protection engines");
+}
+
+void PageProtectionEngine::Destroy() {
+  for (auto& engine : registered_engines) {
+    PageProtectionEngine* expected = this;
+    if (engine.compare_exchange_strong(expected, nullptr,
+                                       std::memory_order_relaxed)) {
+      break;
+    }
+  }
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    num_pending_ = 0;
+  }
+  const uintptr_t base = base_.load(std::memory_order_relaxed);
+  if (base != 0) {
+    int err = CountedMunmap(reinterpret_cast<void*>(base), end() - base);
+    ASSERT(err != -1);
+    (void)err;
+    end_.store(0, std::memory_order_relaxed);
+    base_.store(0, std::memory_order_relaxed);
+  }
+}
+
+bool PageProtectionEngine::Grant(uintptr_t start, size_t len) {
+  ASSERT(base() <= start && start + len <= end());
+  if (CountedMprotect(reinterpret_cast<void*>(start), len,
+                      PROT_READ | PROT_WRITE) == -1) {
+    failed_grants_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  grants_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+bool PageProtectionEngine::GrantAlias(uintptr_t start, size_t len, int fd,
+                                      off_t offset) {
+  ASSERT(base() <= start && start + len <= end());
+  if (CountedMmap(reinterpret_cast<void*>(start), len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED) {
+    failed_grants_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  grants_.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+void PageProtectionEngine::RevokeRange(uintptr_t start, uintptr_t end,
+                                       Revocation how) {
+  void* const p = reinterpret_cast<void*>(start);
+  switch (how) {
+    case Revocation::kProtect:
+      CHECK_CONDITION(CountedMprotect(p, end - start, PROT_NONE) != -1);
+      break;
+    case Revocation::kDiscard:
+      CHECK_CONDITION(CountedMmap(p, end - start, PROT_NONE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED |
+                                      MAP_NORESERVE,
+                                  -1, 0) != MAP_FAILED);
+      break;
+  }
+}
+
+void PageProtectionEngine::RevokeNow(uintptr_t start, size_t len,
+                                     Revocation how) {
+  ASSERT(base() <= start && start + len <= end());
+  RevokeRange(start, start + len, how);
+  revoke_calls_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PageProtectionEngine::Revoke(uint32_t slot, uintptr_t start, size_t len,
+                                  Revocation how) {
+  ASSERT(base() <= start && start + len <= end());
+  if (batch_size_ == 1) {
+    RevokeRange(start, start + len, how);
+    revoked_slots_.fetch_add(1, std::memory_order_relaxed);
+    revoke_calls_.fetch_add(1, std::memory_order_relaxed);
+    release_(owner_, slot);
+    return;
+  }
+
+  PendingRange batch[kMaxBatch];
+  size_t n;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    ASSERT(num_pending_ < batch_size_);
+    pending_[num_pending_++] = {start, len, slot, how};
+    if (num_pending_ < batch_size_) return;
+    n = num_pending_;
+    std::copy(pending_, pending_ + n, batch);
+    num_pending_ = 0;
+  }
+  // Revoke the batch outside the lock, so that other revocations can queue
+  // meanwhile.
+  RevokeBatch(batch, n);
+}
+
+bool PageProtectionEngine::Flush() {
+  PendingRange batch[kMaxBatch];
+  size_t n;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    n = num_pending_;
+    std::copy(pending_, pending_ + n, batch);
+    num_pending_ = 0;
+  }
+  if (n == 0) return false;
+  RevokeBatch(batch, n);
+  return true;
+}
+
+void PageProtectionEngine::RevokeBatch(PendingRange* ranges, size_t n) {
+  std::sort(ranges, ranges + n,
+            [](const PendingRange& a, const PendingRange& b) {
+              return a.start < b.start;
+            });
+  size_t calls = 0;
+  for (size_t i = 0; i < n;) {
+    uintptr_t end = ranges[i].start + ranges[i].len;
+    size_t j = i + 1;
+    while (j < n && ranges[j].how == ranges[i].how &&
+           ranges[j].start <= end + coalesce_gap_) {
+      end = ranges[j].start + ranges[j].len;
+      ++j;
+    }
+    RevokeRange(ranges[i].start, end, ranges[i].how);
+    ++calls;
+    i = j;
+  }
+  revoked_slots_.fetch_add(n, std::memory_order_relaxed);
+  batched_slots_.fetch_add(n, std::memory_order_relaxed);
+  revoke_calls_.fetch_add(calls, std::memory_order_relaxed);
+
+  for (size_t i = 0; i < n; ++i) {
+    release_(owner_, ranges[i].slot);
+  }
+}
+
+bool PageProtectionEngine::IsPending(uint32_t slot) const {
+  if (batch_size_ == 1) return false;
+  AllocationGuardSpinLockHolder h(&lock_);
+  return std::any_of(
+      pending_, pending_ + num_pending_,
+      [slot](const PendingRange& range) { return range.slot == slot; });
+}
+
+PageProtectionEngine::Stats PageProtectionEngine::GetStats() const {
+  Stats stats;
+  stats.reserved_bytes = end() - base();
+  stats.batch_size = batch_size_;
+  stats.grants = grants_.load(std::memory_order_relaxed);
+  stats.failed_grants = failed_grants_.load(std::memory_order_relaxed);
+  stats.revoked_slots = revoked_slots_.load(std::memory_order_relaxed);
+  stats.revoke_calls = revoke_calls_.load(std::memory_order_relaxed);
+  stats.batched_slots = batched_slots_.load(std::memory_order_relaxed);
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    stats.pending_slots = num_pending_;
+  }
+  stats.faults = faults_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void PageProtectionEngine::Print(Printer* out) const {
+  const Stats stats = GetStats();
+  out->printf(
+      "%s Protection: %zu MiB reserved, %zu grants (%zu failed), "
+      "%zu slots revoked in %zu calls, %zu pending (batch size %zu), "
+      "%zu faults\n",
+      name_, stats.reserved_bytes >> 20, stats.grants, stats.failed_grants,
+      stats.revoked_slots, stats.revoke_calls, stats.pending_slots,
+      stats.batch_size, stats.faults);
+}
+
+void PageProtectionEngine::PrintInPbtxt(PbtxtRegion* region) const {
+  const Stats stats = GetStats();
+  region->PrintI64("reserved_bytes", stats.reserved_bytes);
+  region->PrintI64("batch_size", stats.batch_size);
+  region->PrintI64("grants", stats.grants);
+  region->PrintI64("failed_grants", stats.failed_grants);
+  region->PrintI64("revoked_slots", stats.revoked_slots);
+  region->PrintI64("revoke_calls", stats.revoke_calls);
+  region->PrintI64("batched_slots", stats.batched_slots);
+  region->PrintI64("pending_slots", stats.pending_slots);
+  region->PrintI64("faults", stats.faults);
+}
+
+PageProtectionEngine* PageProtectionEngine::Find(const void* addr) {
+  for (const auto& registered : registered_engines) {
+    PageProtectionEngine* engine =
+        registered.load(std::memory_order_acquire);
+    if (engine != nullptr && engine->Contains(addr)) return engine;
+  }
+  return nullptr;
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,236 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_PAGE_PROTECTION_ENGINE_H_
+#define TCMALLOC_PAGE_PROTECTION_ENGINE_H_
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "absl/base/attributes.h"
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Manages the protection of a reserved range of address space that is handed
+// out in slots, for allocators that rely on faults to catch invalid accesses.
+//
+// The engine reserves the range without access.  Its owner decides which
+// slots are free and how to pick one; the engine does not track them.  The
+// owner grants access to a slot's pages when the slot is allocated and revokes
+// it when the slot is freed.  Revocations can be batched: a revoked slot is
+// queued, and once batch_size slots are queued, their ranges are sorted and
+// revoked with one system call per run of ranges that are adjacent or
+// separated by at most coalesce_gap bytes that the owner keeps inaccessible
+// (e.g., guard pages).
+// Queued slots stay quarantined: they are only handed back to the owner
+// through the release callback once their pages are inaccessible.
+//
+// Engines register themselves on Init(), so that the SEGV handler can find
+// the engine, and thus the allocator, that a faulting address belongs to.
+//
+// Is safe to use with static storage duration and is thread safe with the
+// exception of calls to Init() and Destroy().
+class PageProtectionEngine {
+ public:
+  // Maximum number of slots revoked together.
+  static constexpr size_t kMaxBatch = 64;
+
+  // Maximum number of engines that can be registered at a time.
+  static constexpr size_t kMaxEngines = 8;
+
+  // How access to a range is revoked.
+  enum class Revocation : uint8_t {
+    // mprotect the range: its pages keep their contents and backing.
+    kProtect,
+    // Map fresh inaccessible memory over the range, which returns its pages to
+    // the OS and drops any file mapped there, but keeps the range reserved.
+    kDiscard,
+  };
+
+  // Hands slot back to owner once its pages are inaccessible.
+  using ReleaseFn = void (*)(void* owner, uint32_t slot);
+
+  struct Options {
+    // Describes the engine in stats.
+    const char* name = "";
+    size_t reservation_bytes = 0;
+    // Alignment of the reservation, which must be a multiple of the system
+    // page size.
+    size_t alignment = 0;
+    MemoryTag tag = MemoryTag::kSampled;
+    // Ranges separated by at most this many inaccessible bytes are revoked
+    // together.
+    size_t coalesce_gap = 0;
+    // Number of slots revoked together, 1 <= batch_size <= kMaxBatch.  1
+    // revokes each slot as soon as it is freed.
+    size_t batch_size = 1;
+    void* owner = nullptr;
+    ReleaseFn release = nullptr;
+  };
+
+  // Per-engine counters, for stats.
+  struct Stats {
+    size_t reserved_bytes;
+    size_t batch_size;
+    // Successful and failed calls to Grant().
+    size_t grants;
+    size_t failed_grants;
+    // Slots revoked, and the system calls that took.
+    size_t revoked_slots;
+    size_t revoke_calls;
+    // Slots revoked in batches and still queued.
+    size_t batched_slots;
+    size_t pending_slots;
+    // Faults attributed to this engine.
+    size_t faults;
+  };
+
+  constexpr PageProtectionEngine()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        name_(""),
+        base_(0),
+        end_(0),
+        coalesce_gap_(0),
+        batch_size_(1),
+        owner_(nullptr),
+        release_(nullptr),
+        pending_{},
+        num_pending_(0),
+        grants_(0),
+        failed_grants_(0),
+        revoked_slots_(0),
+        revoke_calls_(0),
+        batched_slots_(0),
+        faults_(0) {}
+
+  PageProtectionEngine(const PageProtectionEngine&) = delete;
+  PageProtectionEngine& operator=(const PageProtectionEngine&) = delete;
+
+  // Reserves options.reservation_bytes of inaccessible address space and
+  // registers this engine.  Returns false if the space could not be reserved.
+  // Should be called non-concurrently and only once.
+  bool Init(const Options& options);
+
+  // Unregisters this engine and unmaps its reservation.  Queued slots are
+  // dropped without being released.
+  void Destroy() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns true if ptr is in this engine's reservation.
+  inline bool ABSL_ATTRIBUTE_ALWAYS_INLINE Contains(const void* ptr) const {
+    const uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    // Init() publishes end_ after base_, so a reservation being set up
+    // concurrently is never seen as [0, end_).
+    const uintptr_t end = end_.load(std::memory_order_acquire);
+    return base_.load(std::memory_order_relaxed) <= addr && addr < end;
+  }
+
+  uintptr_t base() const { return base_.load(std::memory_order_relaxed); }
+  uintptr_t end() const { return end_.load(std::memory_order_relaxed); }
+  const char* name() const { return name_; }
+
+  // Makes [start, start + len) readable and writable.  Returns false on
+  // failure.
+  bool Grant(uintptr_t start, size_t len);
+
+  // Maps len bytes of fd at offset over [start, start + len), readable and
+  // writable and shared with other mappings of the file.  Returns false on
+  // failure.
+  bool GrantAlias(uintptr_t start, size_t len, int fd, off_t offset);
+
+  // Revokes access to [start, start + len), which holds slot, and then releases
+  // slot.  If revocations are batched, both may happen later, on this or
+  // another thread.  Must not be called with pageheap_lock held.
+  void Revoke(uint32_t slot, uintptr_t start, size_t len, Revocation how)
+      ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Revokes access to [start, start + len) immediately, without releasing
+  // anything.
+  void RevokeNow(uintptr_t start, size_t len, Revocation how);
+
+  // Revokes and releases all queued slots.  Returns false if there were none.
+  bool Flush() ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns true if slot is queued for revocation.
+  bool IsPending(uint32_t slot) const ABSL_LOCKS_EXCLUDED(lock_);
+
+  size_t batch_size() const { return batch_size_; }
+
+  // Counts a fault in this engine's reservation.  Async-signal-safe.
+  void RecordFault() { faults_.fetch_add(1, std::memory_order_relaxed); }
+
+  Stats GetStats() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Writes the engine's stats to *out, one line, prefixed by its name.
+  void Print(Printer* out) const ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintInPbtxt(PbtxtRegion* region) const ABSL_LOCKS_EXCLUDED(lock_);
+
+  // Returns the registered engine whose reservation contains addr, or nullptr.
+  // Async-signal-safe.
+  static PageProtectionEngine* Find(const void* addr);
+
+ private:
+  struct PendingRange {
+    uintptr_t start;
+    size_t len;
+    uint32_t slot;
+    Revocation how;
+  };
+
+  // Revokes the n ranges in ranges, sorting them to revoke adjacent ranges
+  // together, and then releases their slots.
+  void RevokeBatch(PendingRange* ranges, size_t n);
+
+  // Makes the system call that revokes access to [start, end).
+  static void RevokeRange(uintptr_t start, uintptr_t end, Revocation how);
+
+  // Protects the deallocation queue.
+  mutable absl::base_internal::SpinLock lock_;
+
+  const char* name_;
+  // The reservation.  Atomic so that Contains() may be called while another
+  // thread calls Init().
+  std::atomic<uintptr_t> base_;
+  std::atomic<uintptr_t> end_;
+  size_t coalesce_gap_;
+  size_t batch_size_;
+  void* owner_;
+  ReleaseFn release_;
+
+  PendingRange pending_[kMaxBatch] ABSL_GUARDED_BY(lock_);
+  size_t num_pending_ ABSL_GUARDED_BY(lock_);
+
+  std::atomic<size_t> grants_;
+  std::atomic<size_t> failed_grants_;
+  std::atomic<size_t> revoked_slots_;
+  std::atomic<size_t> revoke_calls_;
+  std::atomic<size_t> batched_slots_;
+  std::atomic<size_t> faults_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_PAGE_PROTECTION_ENGINE_H_
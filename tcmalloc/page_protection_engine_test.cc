@@ -0,0 +1,160 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/page_protection_engine.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/page_size.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Revocation = PageProtectionEngine::Revocation;
+
+// Number of slots reserved by the tests.  Slots are one page, followed by a
+// guard page.
+constexpr size_t kSlots = 8;
+
+class PageProtectionEngineTest : public testing::Test {
+ protected:
+  void Init(size_t batch_size) {
+    page_size_ = GetPageSize();
+    PageProtectionEngine::Options options;
+    options.name = "Test";
+    options.reservation_bytes = 2 * kSlots * page_size_;
+    options.alignment = page_size_;
+    options.tag = MemoryTag::kSampled;
+    options.coalesce_gap = page_size_;
+    options.batch_size = batch_size;
+    options.owner = &released_;
+    options.release = [](void* owner, uint32_t slot) {
+      static_cast<std::vector<uint32_t>*>(owner)->push_back(slot);
+    };
+    ASSERT_TRUE(engine_.Init(options));
+  }
+
+  ~PageProtectionEngineTest() override { engine_.Destroy(); }
+
+  uintptr_t SlotToAddr(uint32_t slot) const {
+    return engine_.base() + 2 * slot * page_size_;
+  }
+
+  char* Allocate(uint32_t slot) {
+    EXPECT_TRUE(engine_.Grant(SlotToAddr(slot), page_size_));
+    return reinterpret_cast<char*>(SlotToAddr(slot));
+  }
+
+  void Revoke(uint32_t slot) {
+    engine_.Revoke(slot, SlotToAddr(slot), page_size_, Revocation::kProtect);
+  }
+
+  PageProtectionEngine engine_;
+  size_t page_size_ = 0;
+  std::vector<uint32_t> released_;
+};
+
+TEST_F(PageProtectionEngineTest, RevokeProtectsAndReleases) {
+  Init(/*batch_size=*/1);
+  char* p = Allocate(3);
+  p[0] = 'A';
+  Revoke(3);
+  EXPECT_THAT(released_, testing::ElementsAre(3));
+  EXPECT_DEATH(p[0] = 'B', "");
+
+  const PageProtectionEngine::Stats stats = engine_.GetStats();
+  EXPECT_EQ(stats.reserved_bytes, 2 * kSlots * page_size_);
+  EXPECT_EQ(stats.grants, 1);
+  EXPECT_EQ(stats.revoked_slots, 1);
+  EXPECT_EQ(stats.revoke_calls, 1);
+  EXPECT_EQ(stats.batched_slots, 0);
+}
+
+TEST_F(PageProtectionEngineTest, BatchesAndCoalescesRevocations) {
+  Init(/*batch_size=*/4);
+  // Slots 0-2 are separated only by guard pages, so they are protected in one
+  // call, and slot 5 in another.
+  const uint32_t slots[] = {2, 5, 0, 1};
+  for (uint32_t slot : slots) {
+    Allocate(slot)[0] = 'A';
+  }
+  for (int i = 0; i < 3; ++i) {
+    Revoke(slots[i]);
+    EXPECT_TRUE(engine_.IsPending(slots[i]));
+  }
+  EXPECT_TRUE(released_.empty());
+  EXPECT_EQ(engine_.GetStats().pending_slots, 3);
+  // Queued slots are not protected yet.
+  reinterpret_cast<char*>(SlotToAddr(2))[0] = 'B';
+
+  Revoke(slots[3]);
+  EXPECT_THAT(released_, testing::UnorderedElementsAre(0, 1, 2, 5));
+  EXPECT_FALSE(engine_.IsPending(2));
+  for (uint32_t slot : slots) {
+    EXPECT_DEATH(reinterpret_cast<char*>(SlotToAddr(slot))[0] = 'C', "");
+  }
+
+  const PageProtectionEngine::Stats stats = engine_.GetStats();
+  EXPECT_EQ(stats.revoked_slots, 4);
+  EXPECT_EQ(stats.batched_slots, 4);
+  EXPECT_EQ(stats.revoke_calls, 2);
+  EXPECT_EQ(stats.pending_slots, 0);
+}
+
+TEST_F(PageProtectionEngineTest, Flush) {
+  Init(/*batch_size=*/4);
+  EXPECT_FALSE(engine_.Flush());
+  Allocate(1);
+  Revoke(1);
+  EXPECT_TRUE(released_.empty());
+  EXPECT_TRUE(engine_.Flush());
+  EXPECT_THAT(released_, testing::ElementsAre(1));
+  EXPECT_FALSE(engine_.Flush());
+}
+
+TEST_F(PageProtectionEngineTest, DiscardDropsContents) {
+  Init(/*batch_size=*/1);
+  char* p = Allocate(0);
+  p[0] = 'A';
+  engine_.RevokeNow(SlotToAddr(0), page_size_, Revocation::kDiscard);
+  EXPECT_DEATH(p[0] = 'B', "");
+  Allocate(0);
+  EXPECT_EQ(p[0], 0);
+  // RevokeNow doesn't release the slot.
+  EXPECT_TRUE(released_.empty());
+}
+
+TEST_F(PageProtectionEngineTest, Find) {
+  Init(/*batch_size=*/1);
+  EXPECT_EQ(PageProtectionEngine::Find(reinterpret_cast<void*>(SlotToAddr(1))),
+            &engine_);
+  EXPECT_EQ(PageProtectionEngine::Find(&engine_), nullptr);
+  engine_.RecordFault();
+  EXPECT_EQ(engine_.GetStats().faults, 1);
+
+  const void* addr = reinterpret_cast<void*>(SlotToAddr(1));
+  engine_.Destroy();
+  EXPECT_EQ(PageProtectionEngine::Find(addr), nullptr);
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -448,6 +448,16 @@ class PageMap {
     return map_.bytes_used();
   }
 
+  // Returns the first page after p that has a descriptor, or std::nullopt if
+  // there is none.  The descriptor may be that of a freed span that is not yet
+  // removed from the PageMap, or p may be in the middle of its span.
+  std::optional<PageId> NextSetPage(PageId p) const
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+    std::optional<uintptr_t> next = map_.get_next_set_page(p.index());
+    if (!next.has_value()) return std::nullopt;
+    return PageId{next.value()};
+  }
+
   void* GetHugepage(PageId p) { return map_.get_hugepage(p.index()); }
 
   void SetHugepage(PageId p, void* v) { map_.set_hugepage(p.index(), v); }
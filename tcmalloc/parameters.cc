@@ -190,6 +190,10 @@ ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_enabled_(
 ABSL_CONST_INIT std::atomic<bool> Parameters::per_cpu_caches_dynamic_slab_(
     true);
 ABSL_CONST_INIT std::atomic<bool> Parameters::madvise_free_(false);
+ABSL_CONST_INIT std::atomic<size_t> Parameters::sampled_quarantine_bytes_(0);
+ABSL_CONST_INIT std::atomic<bool> Parameters::slow_path_latency_histograms_(
+    false);
+ABSL_CONST_INIT std::atomic<bool> Parameters::hot_site_cache_hints_(false);
 ABSL_CONST_INIT std::atomic<tcmalloc::hot_cold_t>
     Parameters::min_hot_access_hint_(static_cast<tcmalloc::hot_cold_t>(128));
 ABSL_CONST_INIT std::atomic<double>
@@ -279,6 +283,10 @@ int32_t Parameters::max_per_cpu_cache_size() {
   return tc_globals.cpu_cache().CacheLimit();
 }
 
+size_t Parameters::guarded_page_pool_size() {
+  return tc_globals.guardedpage_allocator().pool_size();
+}
+
 int ABSL_ATTRIBUTE_WEAK default_want_disable_laze_size_class_resize();
 
 // TODO(b/305723428): remove the default_want_disable_laze_size_class_resize
@@ -334,6 +342,14 @@ void MallocExtension_Internal_SetImprovedGuardedSampling(bool value) {
   Parameters::set_improved_guarded_sampling(value);
 }
 
+size_t MallocExtension_Internal_GetGuardedPagePoolSize() {
+  return Parameters::guarded_page_pool_size();
+}
+
+void MallocExtension_Internal_SetGuardedPagePoolSize(size_t value) {
+  Parameters::set_guarded_page_pool_size(value);
+}
+
 int64_t MallocExtension_Internal_GetMaxTotalThreadCacheBytes() {
   return Parameters::max_total_thread_cache_bytes();
 }
@@ -582,6 +598,44 @@ void TCMalloc_Internal_SetMadviseFree(bool v) {
   Parameters::madvise_free_.store(v, std::memory_order_relaxed);
 }
 
+size_t TCMalloc_Internal_GetSampledQuarantineBytes() {
+  return Parameters::sampled_quarantine_bytes();
+}
+
+void TCMalloc_Internal_SetSampledQuarantineBytes(size_t v) {
+  Parameters::sampled_quarantine_bytes_.store(v, std::memory_order_relaxed);
+}
+
+size_t TCMalloc_Internal_GetGuardedPagePoolSize() {
+  return Parameters::guarded_page_pool_size();
+}
+
+void TCMalloc_Internal_SetGuardedPagePoolSize(size_t v) {
+  tc_globals.InitIfNecessary();
+  // As at initialization, only half of the slots are allocated at a time, and
+  // up to a pool's worth of allocations are guarded per window.
+  if (tc_globals.guardedpage_allocator().SetPoolSize(
+          /*max_alloced_pages=*/v / 2, /*total_pages=*/v)) {
+    tc_globals.guarded_sampling_policy().set_guards_per_window(v);
+  }
+}
+
+bool TCMalloc_Internal_GetSlowPathLatencyHistograms() {
+  return Parameters::slow_path_latency_histograms();
+}
+
+void TCMalloc_Internal_SetSlowPathLatencyHistograms(bool v) {
+  Parameters::slow_path_latency_histograms_.store(v, std::memory_order_relaxed);
+}
+
+bool TCMalloc_Internal_GetHotSiteCacheHints() {
+  return Parameters::hot_site_cache_hints();
+}
+
+void TCMalloc_Internal_SetHotSiteCacheHints(bool v) {
+  Parameters::hot_site_cache_hints_.store(v, std::memory_order_relaxed);
+}
+
 uint8_t TCMalloc_Internal_GetMinHotAccessHint() {
   return static_cast<uint8_t>(Parameters::min_hot_access_hint());
 }
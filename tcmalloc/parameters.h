@@ -86,6 +86,43 @@ class Parameters {
     TCMalloc_Internal_SetMadviseFree(value);
   }
 
+  // Bytes of freed sampled spans held in SampledSpanQuarantine.  0 disables
+  // the quarantine.
+  static size_t sampled_quarantine_bytes() {
+    return sampled_quarantine_bytes_.load(std::memory_order_relaxed);
+  }
+
+  static void set_sampled_quarantine_bytes(size_t value) {
+    TCMalloc_Internal_SetSampledQuarantineBytes(value);
+  }
+
+  // Number of slots in the guarded page pool.  The pool is mapped the first
+  // time an allocation is guarded, so changes made after that are ignored.
+  static size_t guarded_page_pool_size();
+
+  static void set_guarded_page_pool_size(size_t value) {
+    TCMalloc_Internal_SetGuardedPagePoolSize(value);
+  }
+
+  // Whether ScopedSlowPathTimer records the latency of allocator slow paths.
+  static bool slow_path_latency_histograms() {
+    return slow_path_latency_histograms_.load(std::memory_order_relaxed);
+  }
+
+  static void set_slow_path_latency_histograms(bool value) {
+    TCMalloc_Internal_SetSlowPathLatencyHistograms(value);
+  }
+
+  // Whether the per-CPU cache grows size classes that HotSiteTracker reports
+  // as hot by a batch on every underflow.
+  static bool hot_site_cache_hints() {
+    return hot_site_cache_hints_.load(std::memory_order_relaxed);
+  }
+
+  static void set_hot_site_cache_hints(bool value) {
+    TCMalloc_Internal_SetHotSiteCacheHints(value);
+  }
+
   static tcmalloc::hot_cold_t min_hot_access_hint() {
     return min_hot_access_hint_.load(std::memory_order_relaxed);
   }
@@ -217,6 +254,9 @@ class Parameters {
       absl::string_view s);
   friend void ::TCMalloc_Internal_SetMadviseFree(bool v);
   friend void ::TCMalloc_Internal_SetMinHotAccessHint(uint8_t v);
+  friend void ::TCMalloc_Internal_SetSampledQuarantineBytes(size_t v);
+  friend void ::TCMalloc_Internal_SetSlowPathLatencyHistograms(bool v);
+  friend void ::TCMalloc_Internal_SetHotSiteCacheHints(bool v);
 
   static std::atomic<MallocExtension::BytesPerSecond> background_release_rate_;
   static std::atomic<int64_t> guarded_sampling_rate_;
@@ -231,6 +271,9 @@ class Parameters {
   static std::atomic<int64_t> profile_sampling_rate_;
   static std::atomic<bool> per_cpu_caches_dynamic_slab_;
   static std::atomic<bool> madvise_free_;
+  static std::atomic<size_t> sampled_quarantine_bytes_;
+  static std::atomic<bool> slow_path_latency_histograms_;
+  static std::atomic<bool> hot_site_cache_hints_;
   static std::atomic<tcmalloc::hot_cold_t> min_hot_access_hint_;
   static std::atomic<double> per_cpu_caches_dynamic_slab_grow_threshold_;
   static std::atomic<double> per_cpu_caches_dynamic_slab_shrink_threshold_;
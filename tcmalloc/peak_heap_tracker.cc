@@ -15,16 +15,23 @@
 #include "tcmalloc/peak_heap_tracker.h"
 
 #include <stdio.h>
+#include <sys/mman.h>
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <utility>
 
 #include "absl/base/internal/spinlock.h"
 #include "absl/memory/memory.h"
+#include "absl/time/time.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/syscall_stats.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/stack_trace_table.h"
@@ -34,14 +41,27 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
-bool PeakHeapTracker::IsNewPeak() {
-  size_t current_peak_size = CurrentPeakSize();
-  return (static_cast<double>(tc_globals.sampled_objects_size_.value()) >
-          current_peak_size * Parameters::peak_sampling_heap_growth_fraction());
+int64_t PeakHeapTracker::CurrentWindow() const {
+  const double ticks_per_window =
+      clock_.freq() * absl::ToDoubleSeconds(kWindowLength);
+  return static_cast<int64_t>(clock_.now() / ticks_per_window);
+}
+
+bool PeakHeapTracker::IsNewPeak(int64_t window) {
+  const double fraction = Parameters::peak_sampling_heap_growth_fraction();
+  const double size = tc_globals.sampled_objects_size_.value();
+  return size > CurrentPeakSize() * fraction ||
+         window != last_window_.load(std::memory_order_relaxed) ||
+         size > last_window_peak_size_.load(std::memory_order_relaxed) *
+                    fraction;
 }
 
 void PeakHeapTracker::MaybeSaveSample() {
-  if (Parameters::peak_sampling_heap_growth_fraction() <= 0 || !IsNewPeak()) {
+  if (Parameters::peak_sampling_heap_growth_fraction() <= 0) {
+    return;
+  }
+  const int64_t window = CurrentWindow();
+  if (!IsNewPeak(window)) {
     return;
   }
 
@@ -49,30 +69,129 @@ void PeakHeapTracker::MaybeSaveSample() {
 
   // double-check in case another allocation was sampled (or a sampled
   // allocation freed) while we were waiting for the lock
-  if (!IsNewPeak()) {
+  const double fraction = Parameters::peak_sampling_heap_growth_fraction();
+  const int64_t size = tc_globals.sampled_objects_size_.value();
+  uint32_t refs = 0;
+  if (size > CurrentPeakSize() * fraction) {
+    refs |= kAllTimeRef;
+  }
+  const size_t slot = window % kNumWindows;
+  Window& w = windows_[slot];
+  if (w.number != window || size > w.peak_size * fraction) {
+    refs |= uint32_t{1} << slot;
+  }
+  if (refs == 0) {
+    return;
+  }
+  // Only record the new peaks once they are saved, so that they always
+  // describe the saved samples.
+  if (!SaveSample(refs)) {
     return;
   }
-  SetCurrentPeakSize(tc_globals.sampled_objects_size_.value());
+  if (refs & kAllTimeRef) {
+    SetCurrentPeakSize(size);
+  }
+  if (refs & (uint32_t{1} << slot)) {
+    w.number = window;
+    w.peak_size = size;
+    last_window_.store(window, std::memory_order_relaxed);
+    last_window_peak_size_.store(size, std::memory_order_relaxed);
+  }
+}
+
+bool PeakHeapTracker::GrowIndex(size_t n) {
+  const size_t bytes = std::max(n, 2 * index_capacity_) * sizeof(IndexEntry);
+  const size_t page = GetPageSize();
+  const size_t mapped = (bytes + page - 1) & ~(page - 1);
+  void* index = CountedMmap(nullptr, mapped, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (index == MAP_FAILED) {
+    return false;
+  }
+  if (index_ != nullptr) {
+    CountedMunmap(index_, index_capacity_ * sizeof(IndexEntry));
+  }
+  index_ = static_cast<IndexEntry*>(index);
+  index_capacity_ = mapped / sizeof(IndexEntry);
+  return true;
+}
+
+bool PeakHeapTracker::SaveSample(uint32_t refs) {
+  if (index_capacity_ < num_records_ && !GrowIndex(num_records_)) {
+    // Without an index we cannot find the existing copies, so keep the peaks
+    // saved before rather than saving duplicates.
+    return false;
+  }
+
+  // Drop the references of the peaks being replaced, and index the copies
+  // that are still part of other peaks.
+  auto& recorder = peak_heap_recorder_.get_mutable();
+  size_t n = 0;
+  recorder.UnregisterIf([&](SampledAllocation& record) {
+    recorder_lock_.AssertHeld();
+    record.refs &= ~refs;
+    if (record.refs == 0) {
+      --num_records_;
+      return true;
+    }
+    index_[n++] = {record.sampled_stack.sampled_alloc_handle, &record};
+    return false;
+  });
+  ASSERT(n == num_records_);
+  std::sort(index_, index_ + n, [](const IndexEntry& a, const IndexEntry& b) {
+    return a.handle < b.handle;
+  });
 
-  // Guaranteed to have no live sample after this call since we are doing this
-  // under `recorder_lock_`.
-  peak_heap_recorder_.get_mutable().UnregisterAll();
   tc_globals.sampled_allocation_recorder().Iterate(
-      [this](const SampledAllocation& sampled_allocation) {
+      [&](const SampledAllocation& sampled_allocation) {
         recorder_lock_.AssertHeld();
+        const AllocHandle handle =
+            sampled_allocation.sampled_stack.sampled_alloc_handle;
+        const IndexEntry* it = std::lower_bound(
+            index_, index_ + n, handle,
+            [](const IndexEntry& e, AllocHandle h) { return e.handle < h; });
+        if (it != index_ + n && it->handle == handle) {
+          it->record->refs |= refs;
+          return;
+        }
         StackTrace st = sampled_allocation.sampled_stack;
-        peak_heap_recorder_.get_mutable().Register(std::move(st));
+        SampledAllocation* record = recorder.Register(std::move(st));
+        record->refs = refs;
+        ++num_records_;
+      });
+  return true;
+}
+
+void PeakHeapTracker::DumpRefs(uint32_t refs, StackTraceTable& profile) {
+  peak_heap_recorder_.get_mutable().Iterate(
+      [&profile, refs](const SampledAllocation& peak_heap_record) {
+        if (peak_heap_record.refs & refs) {
+          profile.AddTrace(1.0, peak_heap_record.sampled_stack);
+        }
       });
 }
 
 std::unique_ptr<ProfileBase> PeakHeapTracker::DumpSample() {
+  // Allocate the table before taking recorder_lock_: if the allocation is
+  // sampled, MaybeSaveSample takes the lock.
   auto profile = std::make_unique<StackTraceTable>(ProfileType::kPeakHeap);
+  AllocationGuardSpinLockHolder h(&recorder_lock_);
+  DumpRefs(kAllTimeRef, *profile);
+  return profile;
+}
+
+std::unique_ptr<ProfileBase> PeakHeapTracker::DumpWindowSample(size_t window) {
+  auto profile = std::make_unique<StackTraceTable>(ProfileType::kPeakHeap);
+  if (window >= kNumWindows) {
+    return profile;
+  }
 
   AllocationGuardSpinLockHolder h(&recorder_lock_);
-  peak_heap_recorder_.get_mutable().Iterate(
-      [&profile](const SampledAllocation& peak_heap_record) {
-        profile->AddTrace(1.0, peak_heap_record.sampled_stack);
-      });
+  const int64_t number = CurrentWindow() - window;
+  if (number < 0 || windows_[number % kNumWindows].number != number) {
+    return profile;
+  }
+  DumpRefs(uint32_t{1} << (number % kNumWindows), *profile);
   return profile;
 }
 
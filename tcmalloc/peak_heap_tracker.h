@@ -23,30 +23,48 @@
 #include "absl/base/const_init.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/thread_annotations.h"
+#include "absl/time/time.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
+#include "tcmalloc/internal/clock.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
 #include "tcmalloc/internal/sampled_allocation.h"
 #include "tcmalloc/internal/sampled_allocation_recorder.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
+#include "tcmalloc/stack_trace_table.h"
 
 GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// Besides the all-time peak, the tracker keeps the peak of each of the last
+// kNumWindows windows of kWindowLength, e.g. to find the daily peaks of a
+// process whose all-time peak was an early spike.
+//
+// All the peaks are saved in one recorder.  An allocation that was live at
+// several of them is saved once, and SampledAllocation::refs records which
+// peaks it is part of, so memory is bounded by the number of distinct
+// allocations live at any of the kNumWindows + 1 peaks.
 class PeakHeapTracker {
  public:
+  static constexpr size_t kNumWindows = 24;
+  static constexpr absl::Duration kWindowLength = absl::Hours(1);
+
   constexpr PeakHeapTracker()
       : recorder_lock_(absl::kConstInit,
                        absl::base_internal::SCHEDULE_KERNEL_ONLY),
         peak_heap_recorder_() {}
 
-  void Init(Arena* arena) ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock)
-      ABSL_LOCKS_EXCLUDED(recorder_lock_) {
+  // Called once, before any allocation is sampled, so it does not take
+  // recorder_lock_: the lock order is recorder_lock_ before pageheap_lock,
+  // as SaveSample allocates records under recorder_lock_.
+  void Init(Arena* arena, Clock clock)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock)
+          ABSL_NO_THREAD_SAFETY_ANALYSIS {
     peak_heap_record_allocator_.Init(arena);
-    AllocationGuardSpinLockHolder h(&recorder_lock_);
+    clock_ = clock;
     peak_heap_recorder_.Construct(&peak_heap_record_allocator_);
     peak_heap_recorder_.get_mutable().Init();
   }
@@ -54,24 +72,60 @@ class PeakHeapTracker {
   // Possibly save high-water-mark allocation stack traces for peak-heap
   // profile. Should be called immediately after sampling an allocation. If
   // the heap has grown by a sufficient amount since the last high-water-mark,
-  // it will save a copy of the sample profile.
+  // either all-time or in the current window, it will save a copy of the
+  // sample profile.
   void MaybeSaveSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
   // Return the saved high-water-mark heap profile, if any.
   std::unique_ptr<ProfileBase> DumpSample() ABSL_LOCKS_EXCLUDED(recorder_lock_);
 
+  // Returns the high-water-mark heap profile of a window: 0 is the current
+  // window, 1 the previous one, and so on.  The profile is empty if no
+  // allocation was sampled during the window, or if window >= kNumWindows.
+  std::unique_ptr<ProfileBase> DumpWindowSample(size_t window)
+      ABSL_LOCKS_EXCLUDED(recorder_lock_);
+
   size_t CurrentPeakSize() const {
     return do_not_access_directly_peak_sampled_heap_size_.load(
         std::memory_order_relaxed);
   }
 
  private:
+  // The bit of SampledAllocation::refs for the all-time peak.  Bit i <
+  // kNumWindows is for the window stored in windows_[i].
+  static constexpr uint32_t kAllTimeRef = uint32_t{1} << kNumWindows;
+  static_assert(kNumWindows < 32, "refs is a 32-bit mask");
+
+  struct Window {
+    // Index of the window since the start of the clock, or -1 if unused.
+    int64_t number = -1;
+    int64_t peak_size = 0;
+  };
+
+  // An entry of the index of saved allocations, used to find the existing
+  // copy of an allocation when it is part of a new peak.
+  struct IndexEntry {
+    AllocHandle handle;
+    SampledAllocation* record;
+  };
+
   void SetCurrentPeakSize(int64_t value)
       ABSL_EXCLUSIVE_LOCKS_REQUIRED(recorder_lock_) {
     return do_not_access_directly_peak_sampled_heap_size_.store(
         value, std::memory_order_relaxed);
   }
 
+  int64_t CurrentWindow() const;
+
+  // Saves the currently live samples as the peaks in `refs`, replacing the
+  // ones saved before.  Returns false, keeping the saved peaks, if it could
+  // not.
+  bool SaveSample(uint32_t refs) ABSL_EXCLUSIVE_LOCKS_REQUIRED(recorder_lock_);
+
+  // Adds the saved samples that are part of the peaks in `refs` to profile.
+  void DumpRefs(uint32_t refs, StackTraceTable& profile)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(recorder_lock_);
+
   using PeakHeapRecorder =
       SampleRecorder<SampledAllocation, SampledAllocationAllocator>;
 
@@ -94,7 +148,28 @@ class PeakHeapTracker {
   // under `recorder_lock_`; may be read without it.
   std::atomic<int64_t> do_not_access_directly_peak_sampled_heap_size_{0};
 
-  bool IsNewPeak();
+  // The number and peak size of the window saved last, to check for new
+  // peaks without taking `recorder_lock_`.  Only written under
+  // `recorder_lock_`.
+  std::atomic<int64_t> last_window_{-1};
+  std::atomic<int64_t> last_window_peak_size_{0};
+
+  Window windows_[kNumWindows] ABSL_GUARDED_BY(recorder_lock_);
+
+  // Scratch space for SaveSample, mapped from the system as needed.  An
+  // outgrown index is unmapped, as the arena could not reuse its memory.
+  IndexEntry* index_ ABSL_GUARDED_BY(recorder_lock_) = nullptr;
+  size_t index_capacity_ ABSL_GUARDED_BY(recorder_lock_) = 0;
+  // The number of allocations saved in peak_heap_recorder_.
+  size_t num_records_ ABSL_GUARDED_BY(recorder_lock_) = 0;
+
+  Clock clock_ = {nullptr, nullptr};
+
+  bool IsNewPeak(int64_t window);
+
+  // Grows index_ to hold at least n entries.  Returns false if the memory
+  // could not be mapped.
+  bool GrowIndex(size_t n) ABSL_EXCLUSIVE_LOCKS_REQUIRED(recorder_lock_);
 };
 
 }  // namespace tcmalloc_internal
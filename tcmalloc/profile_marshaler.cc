@@ -16,6 +16,7 @@
 
 #include <string>
 
+#include "absl/status/status.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 #include "tcmalloc/internal/profile_builder.h"
@@ -43,4 +44,18 @@ absl::StatusOr<std::string> Marshal(const tcmalloc::Profile& profile) {
   return output;
 }
 
+absl::Status Marshal(const tcmalloc::Profile& profile, int fd) {
+  google::protobuf::io::FileOutputStream stream(fd);
+  google::protobuf::io::GzipOutputStream gzip_stream(&stream);
+  absl::Status status =
+      tcmalloc_internal::WriteProfileProto(profile, &gzip_stream);
+  if (!status.ok()) {
+    return status;
+  }
+  if (!gzip_stream.Close() || !stream.Flush()) {
+    return absl::InternalError("Failed to write gzip stream");
+  }
+  return absl::OkStatus();
+}
+
 }  // namespace tcmalloc
@@ -17,6 +17,7 @@
 
 #include <string>
 
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "tcmalloc/malloc_extension.h"
 
@@ -27,6 +28,12 @@ namespace tcmalloc {
 // (https://github.com/google/pprof).
 absl::StatusOr<std::string> Marshal(const tcmalloc::Profile& profile);
 
+// Writes profile, gzip-compressed and in the same format as above, to fd.
+// Samples are converted and written incrementally instead of building the
+// whole profile in memory first.  Samples with the same stack and labels are
+// not merged; pprof combines them when the profile is read.  fd is not closed.
+absl::Status Marshal(const tcmalloc::Profile& profile, int fd);
+
 }  // namespace tcmalloc
 
 #endif  // TCMALLOC_PROFILE_MARSHALER_H_
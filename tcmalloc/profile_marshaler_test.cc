@@ -14,6 +14,9 @@
 
 #include "tcmalloc/profile_marshaler.h"
 
+#include <stdio.h>
+
+#include <cstdint>
 #include <memory>
 #include <string>
 #include <utility>
@@ -23,6 +26,7 @@
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/memory/memory.h"
+#include "absl/status/status.h"
 #include "absl/status/statusor.h"
 #include "absl/strings/string_view.h"
 #include "absl/time/time.h"
@@ -81,6 +85,59 @@ TEST(ProfileMarshalTest, Smoke) {
   EXPECT_EQ(converted.string_table(converted.default_sample_type()), "objects");
 }
 
+TEST(ProfileMarshalTest, FileDescriptor) {
+  constexpr int kSamples = 5000;
+
+  auto fake_profile = std::make_unique<FakeProfile>();
+  fake_profile->SetType(ProfileType::kAllocations);
+
+  std::vector<Profile::Sample> samples;
+  for (int i = 0; i < kSamples; ++i) {
+    auto& sample = samples.emplace_back();
+    sample.sum = 32;
+    sample.count = 2;
+    sample.allocated_size = 16;
+    sample.depth = 1;
+    sample.stack[0] = reinterpret_cast<void*>(uintptr_t{0x10000} + 16 * i);
+  }
+  fake_profile->SetSamples(std::move(samples));
+
+  Profile profile =
+      tcmalloc_internal::ProfileAccessor::MakeProfile(std::move(fake_profile));
+
+  FILE* file = tmpfile();
+  ASSERT_NE(file, nullptr);
+  ASSERT_TRUE(Marshal(profile, fileno(file)).ok());
+
+  std::string encoded;
+  rewind(file);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) {
+    encoded.append(buf, n);
+  }
+  fclose(file);
+
+  google::protobuf::io::ArrayInputStream stream(encoded.data(), encoded.size());
+  google::protobuf::io::GzipInputStream gzip_stream(&stream);
+  google::protobuf::io::CodedInputStream coded_stream(&gzip_stream);
+
+  perftools::profiles::Profile converted;
+  ASSERT_TRUE(converted.ParseFromCodedStream(&coded_stream));
+
+  EXPECT_EQ(converted.string_table(converted.default_sample_type()), "objects");
+  ASSERT_EQ(converted.sample_size(), kSamples);
+  EXPECT_EQ(converted.location_size(), kSamples);
+  int64_t total = 0;
+  for (const auto& sample : converted.sample()) {
+    ASSERT_EQ(sample.location_id_size(), 1);
+    EXPECT_GT(sample.location_id(0), 0);
+    EXPECT_LE(sample.location_id(0), kSamples);
+    total += sample.value(1);
+  }
+  EXPECT_EQ(total, 32 * kSamples);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -0,0 +1,296 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/residency_scanner.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <optional>
+
+#include "absl/time/clock.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/cpu_cache.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/residency.h"
+#include "tcmalloc/pagemap.h"
+#include "tcmalloc/pages.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+ResidencyScanner::SpanKind KindOf(const Span& span,
+                                  CompactSizeClass size_class)
+    ABSL_EXCLUSIVE_LOCKS_REQUIRED(pageheap_lock) {
+  switch (span.location()) {
+    case Span::ON_NORMAL_FREELIST:
+      return ResidencyScanner::kFree;
+    case Span::ON_RETURNED_FREELIST:
+      return ResidencyScanner::kReturned;
+    case Span::QUARANTINED:
+      return ResidencyScanner::kQuarantined;
+    case Span::IN_USE:
+      break;
+  }
+  if (size_class != 0) return ResidencyScanner::kSmall;
+  return span.sampled() ? ResidencyScanner::kSampled : ResidencyScanner::kLarge;
+}
+
+}  // namespace
+
+const char* ResidencyScanner::SpanKindName(SpanKind kind) {
+  switch (kind) {
+    case kSmall:
+      return "SMALL";
+    case kLarge:
+      return "LARGE";
+    case kSampled:
+      return "SAMPLED";
+    case kQuarantined:
+      return "QUARANTINED";
+    case kFree:
+      return "FREE";
+    case kReturned:
+      return "RETURNED";
+    case kNumSpanKinds:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+bool ResidencyScanner::Tick() {
+  VisitedSpan spans[kMaxSpansPerTick];
+  size_t n;
+  bool done;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    // Another Tick() visited the last spans of the pass, and is still reading
+    // them.
+    if (visited_all_) return false;
+    if (pass_start_ns_ == 0) {
+      pass_start_ns_ = absl::GetCurrentTimeNanos();
+    }
+    n = VisitSpans(spans, &done);
+    visited_all_ = done;
+    ++readers_;
+  }
+
+  // The returned spans are unbacked, so the hugepages that they share with
+  // other spans don't need their pagemap entries read where they cover them.
+  // Spans are visited in address order, so the ranges are sorted.
+  Residency::Range returned[kMaxSpansPerTick];
+  size_t num_returned = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (spans[i].kind == kReturned) {
+      returned[num_returned++] = {reinterpret_cast<const void*>(spans[i].start),
+                                  spans[i].bytes};
+    }
+  }
+
+  // Reading the pagemap doesn't fault on spans that were unmapped since we
+  // visited them, so we can do without pageheap_lock, and without lock_.
+  Summary delta = {};
+  Residency residency;
+  for (size_t i = 0; i < n; ++i) {
+    Scan(spans[i], absl::MakeConstSpan(returned, num_returned), residency,
+         delta);
+  }
+  if (done) {
+    ScanMetadata(delta);
+  }
+
+  AllocationGuardSpinLockHolder h(&lock_);
+  Merge(delta, done);
+  --readers_;
+  if (!visited_all_ || readers_ != 0) return false;
+
+  const int64_t now = absl::GetCurrentTimeNanos();
+  pass_.timestamp_ns = now;
+  pass_.duration_ns = now - pass_start_ns_;
+  pass_.passes = published_.writes() + 1;
+  published_.Write(pass_);
+
+  pass_ = {};
+  cursor_ = PageId{0};
+  pass_start_ns_ = 0;
+  last_hugepage_ = 0;
+  visited_all_ = false;
+  return true;
+}
+
+size_t ResidencyScanner::VisitSpans(VisitedSpan* spans, bool* done) {
+  AllocationGuardSpinLockHolder h(&pageheap_lock);
+  PageMap& pagemap = tc_globals.pagemap();
+  const Length max_pages = BytesToLengthFloor(kMaxBytesPerTick);
+  Length pages;
+  size_t n = 0;
+  *done = false;
+  while (n < kMaxSpansPerTick && pages < max_pages) {
+    std::optional<PageId> p = pagemap.NextSetPage(cursor_);
+    if (!p.has_value()) {
+      *done = true;
+      break;
+    }
+    cursor_ = *p;
+    Span* span = pagemap.GetDescriptor(*p);
+    // Freed span that's not yet removed from the PageMap.
+    if (span == nullptr || *p < span->first_page() ||
+        span->last_page() < *p) {
+      continue;
+    }
+    cursor_ = span->last_page();
+    // Spans of small objects have every page set, so we may land in the middle
+    // of one that was allocated behind the cursor.  We only count spans from
+    // their first page.
+    if (span->first_page() != *p) continue;
+
+    VisitedSpan& visited = spans[n++];
+    visited.start = span->first_page().start_uintptr();
+    visited.bytes = span->bytes_in_span();
+    visited.kind = KindOf(*span, pagemap.sizeclass(*p));
+    visited.first_hugepage =
+        std::max(visited.start >> kHugePageShift, last_hugepage_);
+    last_hugepage_ = std::max(
+        last_hugepage_,
+        ((visited.start + visited.bytes - 1) >> kHugePageShift) + 1);
+    if (visited.kind != kReturned) {
+      pages += span->num_pages();
+    }
+  }
+  return n;
+}
+
+void ResidencyScanner::Scan(const VisitedSpan& span,
+                            absl::Span<const Residency::Range> returned,
+                            Residency& residency, Summary& summary) {
+  KindSummary& kind = summary.kinds[span.kind];
+  ++kind.spans;
+  kind.bytes += span.bytes;
+  if (span.kind != kReturned) {
+    if (std::optional<Residency::Info> info =
+            residency.Get(reinterpret_cast<const void*>(span.start),
+                          span.bytes)) {
+      kind.resident_bytes += info->bytes_resident;
+      kind.swapped_bytes += info->bytes_swapped;
+    }
+  }
+
+  const uintptr_t last = (span.start + span.bytes - 1) >> kHugePageShift;
+  for (uintptr_t hugepage = span.first_hugepage; hugepage <= last;
+       ++hugepage) {
+    const uintptr_t start = hugepage << kHugePageShift;
+    // A hugepage that a returned span covers entirely isn't read at all.
+    std::optional<Residency::Info> info = residency.Get(
+        reinterpret_cast<const void*>(start), kHugePageSize, returned);
+    if (!info.has_value()) continue;
+    if (info->bytes_resident == kHugePageSize) {
+      ++summary.hugepages.full;
+    } else if (info->bytes_resident > 0) {
+      ++summary.hugepages.partial;
+    } else {
+      ++summary.hugepages.empty;
+    }
+  }
+}
+
+void ResidencyScanner::ScanMetadata(Summary& summary) {
+  summary.pagemap_root_resident_bytes = tc_globals.pagemap_residence();
+  if (UsePerCpuCache(tc_globals)) {
+    const auto percpu_metadata = tc_globals.cpu_cache().MetadataMemoryUsage();
+    summary.percpu_metadata_bytes = percpu_metadata.virtual_size;
+    summary.percpu_metadata_resident_bytes = percpu_metadata.resident_size;
+  }
+  if (tc_globals.IsInited()) {
+    summary.alias_resident_bytes =
+        tc_globals.virtual_page_allocator()
+            .GetAliasStats(/*report_residence=*/true)
+            .resident_bytes;
+  }
+}
+
+void ResidencyScanner::Merge(const Summary& delta, bool measured_metadata) {
+  for (int i = 0; i < kNumSpanKinds; ++i) {
+    pass_.kinds[i].spans += delta.kinds[i].spans;
+    pass_.kinds[i].bytes += delta.kinds[i].bytes;
+    pass_.kinds[i].resident_bytes += delta.kinds[i].resident_bytes;
+    pass_.kinds[i].swapped_bytes += delta.kinds[i].swapped_bytes;
+  }
+  pass_.hugepages.full += delta.hugepages.full;
+  pass_.hugepages.partial += delta.hugepages.partial;
+  pass_.hugepages.empty += delta.hugepages.empty;
+  if (measured_metadata) {
+    pass_.pagemap_root_resident_bytes = delta.pagemap_root_resident_bytes;
+    pass_.percpu_metadata_bytes = delta.percpu_metadata_bytes;
+    pass_.percpu_metadata_resident_bytes =
+        delta.percpu_metadata_resident_bytes;
+    pass_.alias_resident_bytes = delta.alias_resident_bytes;
+  }
+}
+
+void ResidencyScanner::Print(Printer* out) const {
+  const Summary summary = GetSummary();
+  if (summary.passes == 0) {
+    out->printf("Residency scan: no pass completed yet\n");
+    return;
+  }
+  const double age_s =
+      (absl::GetCurrentTimeNanos() - summary.timestamp_ns) / 1e9;
+  out->printf("Residency scan: pass %zu completed %.1f s ago, took %.1f s\n",
+              summary.passes, age_s, summary.duration_ns / 1e9);
+  for (int i = 0; i < kNumSpanKinds; ++i) {
+    const KindSummary& kind = summary.kinds[i];
+    out->printf(
+        "Residency scan: %-11s %8zu spans %12zu bytes %12zu resident "
+        "%12zu swapped\n",
+        SpanKindName(static_cast<SpanKind>(i)), kind.spans, kind.bytes,
+        kind.resident_bytes, kind.swapped_bytes);
+  }
+  out->printf("Residency scan: hugepages %zu full, %zu partial, %zu empty\n",
+              summary.hugepages.full, summary.hugepages.partial,
+              summary.hugepages.empty);
+}
+
+void ResidencyScanner::PrintInPbtxt(PbtxtRegion* region) const {
+  const Summary summary = GetSummary();
+  region->PrintI64("passes", summary.passes);
+  if (summary.passes == 0) return;
+  region->PrintI64("age_ns",
+                   absl::GetCurrentTimeNanos() - summary.timestamp_ns);
+  region->PrintI64("duration_ns", summary.duration_ns);
+  for (int i = 0; i < kNumSpanKinds; ++i) {
+    const KindSummary& kind = summary.kinds[i];
+    auto entry = region->CreateSubRegion("span_kind");
+    entry.PrintRaw("kind", SpanKindName(static_cast<SpanKind>(i)));
+    entry.PrintI64("spans", kind.spans);
+    entry.PrintI64("bytes", kind.bytes);
+    entry.PrintI64("resident_bytes", kind.resident_bytes);
+    entry.PrintI64("swapped_bytes", kind.swapped_bytes);
+  }
+  region->PrintI64("hugepages_full", summary.hugepages.full);
+  region->PrintI64("hugepages_partial", summary.hugepages.partial);
+  region->PrintI64("hugepages_empty", summary.hugepages.empty);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
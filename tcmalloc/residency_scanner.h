@@ -0,0 +1,180 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_RESIDENCY_SCANNER_H_
+#define TCMALLOC_RESIDENCY_SCANNER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/types/span.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/residency.h"
+#include "tcmalloc/internal/seqlock.h"
+#include "tcmalloc/pages.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Walks the heap a bounded amount at a time and summarizes how much of each
+// kind of span is resident, and how well resident memory covers hugepages.
+//
+// The background thread calls Tick(), which visits the next spans of the
+// pagemap in address order and reads their residency.  Spans on the returned
+// freelist are known to be unbacked, so their residency isn't read.  When a
+// pass over the pagemap completes, its summary replaces the previous one, so
+// that stats report the summary, with the time its pass completed, without
+// reading /proc on the caller's thread.  Spans change while a pass runs, so
+// the summary is approximate.  The pass also measures the residency of
+// metadata and of the virtual page aliases when it completes, so GetStats()
+// can report those from the summary as well.
+//
+// Residency is read without holding lock_, so a slow read doesn't block other
+// Tick() or stats callers.
+//
+// Is safe to use with static storage duration and is thread safe.
+class ResidencyScanner {
+ public:
+  // Tick() stops visiting spans once it has visited this many, or spans of this
+  // many bytes, whichever comes first.  It visits at least one span, however
+  // large.  Returned spans don't count towards the bytes.
+  static constexpr size_t kMaxSpansPerTick = 256;
+  static constexpr size_t kMaxBytesPerTick = size_t{256} << 20;
+
+  enum SpanKind {
+    kSmall,        // holds small objects
+    kLarge,        // holds a large object
+    kSampled,      // holds a sampled object
+    kQuarantined,  // freed sampled span in SampledSpanQuarantine
+    kFree,         // on the normal freelist of the page heap
+    kReturned,     // on the returned freelist of the page heap
+    kNumSpanKinds,
+  };
+
+  struct KindSummary {
+    uint64_t spans;
+    uint64_t bytes;
+    uint64_t resident_bytes;
+    uint64_t swapped_bytes;
+  };
+
+  // The hugepages that hold part of a scanned span, by how many of their pages
+  // are resident.
+  struct HugePageCoverage {
+    uint64_t full;
+    uint64_t partial;
+    uint64_t empty;
+  };
+
+  struct Summary {
+    // When the pass completed, and how long it took, or 0 if no pass has
+    // completed yet.
+    int64_t timestamp_ns;
+    int64_t duration_ns;
+    uint64_t passes;
+    KindSummary kinds[kNumSpanKinds];
+    HugePageCoverage hugepages;
+    // Measured when the pass completed.
+    uint64_t pagemap_root_resident_bytes;
+    uint64_t percpu_metadata_bytes;
+    uint64_t percpu_metadata_resident_bytes;
+    uint64_t alias_resident_bytes;
+  };
+
+  constexpr ResidencyScanner()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        cursor_(),
+        pass_start_ns_(0),
+        last_hugepage_(0),
+        visited_all_(false),
+        readers_(0),
+        pass_{} {}
+
+  ResidencyScanner(const ResidencyScanner&) = delete;
+  ResidencyScanner& operator=(const ResidencyScanner&) = delete;
+
+  // Scans the next spans of the current pass.  Returns true if that completed
+  // the pass and published its summary.
+  bool Tick() ABSL_LOCKS_EXCLUDED(lock_, pageheap_lock);
+
+  // Returns the summary of the last completed pass.  Doesn't block.
+  Summary GetSummary() const { return published_.Read(); }
+
+  static const char* SpanKindName(SpanKind kind);
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  struct VisitedSpan {
+    uintptr_t start;
+    size_t bytes;
+    SpanKind kind;
+    // The first hugepage of the span that no earlier span counted.
+    uintptr_t first_hugepage;
+  };
+
+  // Copies up to kMaxSpansPerTick spans that follow cursor_ to spans, and
+  // advances cursor_ and last_hugepage_ past them.  Returns the number of spans
+  // copied, and sets *done if no spans remain in the pass.
+  size_t VisitSpans(VisitedSpan* spans, bool* done)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_) ABSL_LOCKS_EXCLUDED(pageheap_lock);
+
+  // Adds the residency of span, and of the hugepages it is in that were not
+  // counted yet, to summary.  `returned` are the ranges of the returned spans
+  // visited with span, which are not read where they share a hugepage.
+  static void Scan(const VisitedSpan& span,
+                   absl::Span<const Residency::Range> returned,
+                   Residency& residency, Summary& summary);
+
+  // Measures the residency of metadata and aliases into summary.
+  static void ScanMetadata(Summary& summary);
+
+  // Adds the counts of delta to pass_, and takes its metadata residency if it
+  // measured it.
+  void Merge(const Summary& delta, bool measured_metadata)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Acquired before pageheap_lock.
+  absl::base_internal::SpinLock lock_;
+
+  // The last page visited by the current pass.
+  PageId cursor_ ABSL_GUARDED_BY(lock_);
+  // When the current pass started, or 0 if it hasn't.
+  int64_t pass_start_ns_ ABSL_GUARDED_BY(lock_);
+  // The last hugepage counted by the current pass, plus one.  Spans are
+  // visited in address order, so hugepages at or below it are already counted.
+  uintptr_t last_hugepage_ ABSL_GUARDED_BY(lock_);
+  // Whether the current pass visited its last spans.  No more spans are
+  // visited until it is published.
+  bool visited_all_ ABSL_GUARDED_BY(lock_);
+  // The number of Tick() calls reading the residency of the spans they
+  // visited.  The pass is published once the last of them merges its reads.
+  int readers_ ABSL_GUARDED_BY(lock_);
+  Summary pass_ ABSL_GUARDED_BY(lock_);
+
+  Seqlock<Summary> published_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_RESIDENCY_SCANNER_H_
@@ -0,0 +1,151 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/sampled_span_quarantine.h"
+
+#include <stddef.h>
+
+#include <atomic>
+
+#include "absl/base/optimization.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/allocation_guard.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/poison.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/span.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+bool SampledSpanQuarantine::Quarantine(Span* span) {
+  CHECK_CONDITION(span->location() != Span::QUARANTINED &&
+                  "Possible double free detected");
+  const size_t budget = Parameters::sampled_quarantine_bytes();
+  const size_t bytes = span->bytes_in_span();
+  const bool quarantine = bytes <= budget;
+  if (quarantine) {
+    // Poison before publishing the span, so that other threads never check a
+    // span that is still being filled.
+    Poison(span->start_address(), bytes, kPoisonPattern);
+  } else if (quarantined_spans_.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+
+  SpanList evicted;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    if (quarantine) {
+      span->set_location(Span::QUARANTINED);
+      spans_.append(span);
+      quarantined_bytes_.store(
+          quarantined_bytes_.load(std::memory_order_relaxed) + bytes,
+          std::memory_order_relaxed);
+      quarantined_spans_.store(
+          quarantined_spans_.load(std::memory_order_relaxed) + 1,
+          std::memory_order_relaxed);
+    }
+    // Also evict when the budget was lowered, so that the quarantine drains
+    // once it is disabled.
+    EvictOverBudget(budget, &evicted);
+  }
+  Recycle(&evicted);
+  return quarantine;
+}
+
+void SampledSpanQuarantine::Drain() {
+  SpanList evicted;
+  {
+    AllocationGuardSpinLockHolder h(&lock_);
+    EvictOverBudget(0, &evicted);
+  }
+  Recycle(&evicted);
+}
+
+void SampledSpanQuarantine::EvictOverBudget(size_t budget, SpanList* evicted) {
+  size_t bytes = quarantined_bytes_.load(std::memory_order_relaxed);
+  size_t spans = quarantined_spans_.load(std::memory_order_relaxed);
+  while (bytes > budget) {
+    ASSERT(!spans_.empty());
+    Span* span = spans_.first();
+    spans_.remove(span);
+    evicted->append(span);
+    bytes -= span->bytes_in_span();
+    --spans;
+  }
+  quarantined_bytes_.store(bytes, std::memory_order_relaxed);
+  quarantined_spans_.store(spans, std::memory_order_relaxed);
+}
+
+void SampledSpanQuarantine::Recycle(SpanList* evicted) {
+  if (evicted->empty()) return;
+
+  size_t recycled = 0;
+  for (Span* span : *evicted) {
+    const size_t bytes = span->bytes_in_span();
+    const size_t offset =
+        FindUnpoisoned(span->start_address(), bytes, kPoisonPattern);
+    if (ABSL_PREDICT_FALSE(offset != bytes)) {
+      Crash(kCrash, __FILE__, __LINE__,
+            "Write after free detected in sampled allocation",
+            span->start_address(), "at offset", offset, "of size", bytes);
+    }
+    ++recycled;
+  }
+
+  {
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    while (!evicted->empty()) {
+      Span* span = evicted->first();
+      evicted->remove(span);
+      span->set_location(Span::IN_USE);
+      tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
+                                         MemoryTag::kSampled);
+    }
+  }
+  recycled_spans_.fetch_add(recycled, std::memory_order_relaxed);
+}
+
+SampledSpanQuarantine::Stats SampledSpanQuarantine::GetStats() const {
+  Stats stats;
+  stats.budget_bytes = Parameters::sampled_quarantine_bytes();
+  stats.quarantined_bytes = quarantined_bytes_.load(std::memory_order_relaxed);
+  stats.quarantined_spans = quarantined_spans_.load(std::memory_order_relaxed);
+  stats.recycled_spans = recycled_spans_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void SampledSpanQuarantine::Print(Printer* out) const {
+  const Stats stats = GetStats();
+  out->printf(
+      "Sampled Quarantine: %zu bytes in %zu spans (budget %zu bytes), "
+      "%zu spans recycled\n",
+      stats.quarantined_bytes, stats.quarantined_spans, stats.budget_bytes,
+      stats.recycled_spans);
+}
+
+void SampledSpanQuarantine::PrintInPbtxt(PbtxtRegion* region) const {
+  const Stats stats = GetStats();
+  region->PrintI64("budget_bytes", stats.budget_bytes);
+  region->PrintI64("quarantined_bytes", stats.quarantined_bytes);
+  region->PrintI64("quarantined_spans", stats.quarantined_spans);
+  region->PrintI64("recycled_spans", stats.recycled_spans);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
@@ -0,0 +1,110 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SAMPLED_SPAN_QUARANTINE_H_
+#define TCMALLOC_SAMPLED_SPAN_QUARANTINE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/const_init.h"
+#include "absl/base/internal/spinlock.h"
+#include "absl/base/thread_annotations.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/span.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// Holds freed sampled spans for a while before returning them to the page
+// heap, to detect writes after free across all sampled allocations rather
+// than just the guarded ones.
+//
+// A quarantined span is filled with kPoisonPattern.  Spans are kept in the
+// order they were freed, and the oldest ones are recycled once the quarantine
+// holds more than Parameters::sampled_quarantine_bytes().  Before a span is
+// recycled, its contents are checked against the pattern, and we crash if the
+// span was written to while it was quarantined.  Reads after free are not
+// detected.
+//
+// Is safe to use with static storage duration and is thread safe.
+class SampledSpanQuarantine {
+ public:
+  static constexpr uint8_t kPoisonPattern = 0xf5;
+
+  struct Stats {
+    size_t budget_bytes;
+    // Spans, and bytes in them, currently quarantined.
+    size_t quarantined_bytes;
+    size_t quarantined_spans;
+    // Spans that passed through the quarantine and were returned to the page
+    // heap.
+    size_t recycled_spans;
+  };
+
+  constexpr SampledSpanQuarantine()
+      : lock_(absl::kConstInit, absl::base_internal::SCHEDULE_KERNEL_ONLY),
+        quarantined_bytes_(0),
+        quarantined_spans_(0),
+        recycled_spans_(0) {}
+
+  SampledSpanQuarantine(const SampledSpanQuarantine&) = delete;
+  SampledSpanQuarantine& operator=(const SampledSpanQuarantine&) = delete;
+
+  // Quarantines span, a freed sampled span with MemoryTag::kSampled, and
+  // recycles the oldest quarantined spans that exceed the budget.  Returns
+  // false, without taking ownership of span, if span is not quarantined
+  // because the quarantine is disabled or span is larger than the budget.
+  // Crashes if span is already quarantined, which indicates a double free.
+  bool Quarantine(Span* span) ABSL_LOCKS_EXCLUDED(lock_, pageheap_lock);
+
+  // Recycles all quarantined spans.
+  void Drain() ABSL_LOCKS_EXCLUDED(lock_, pageheap_lock);
+
+  Stats GetStats() const ABSL_LOCKS_EXCLUDED(lock_);
+
+  void Print(Printer* out) const ABSL_LOCKS_EXCLUDED(lock_);
+  void PrintInPbtxt(PbtxtRegion* region) const ABSL_LOCKS_EXCLUDED(lock_);
+
+ private:
+  // Moves the oldest spans to *evicted until at most budget bytes remain
+  // quarantined.
+  void EvictOverBudget(size_t budget, SpanList* evicted)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
+  // Checks that the spans in *evicted were not written to, and returns them to
+  // the page heap.
+  void Recycle(SpanList* evicted) ABSL_LOCKS_EXCLUDED(lock_, pageheap_lock);
+
+  mutable absl::base_internal::SpinLock lock_;
+
+  // Quarantined spans, oldest first.
+  SpanList spans_ ABSL_GUARDED_BY(lock_);
+
+  // Read without lock_ for stats.
+  std::atomic<size_t> quarantined_bytes_;
+  std::atomic<size_t> quarantined_spans_;
+  std::atomic<size_t> recycled_spans_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SAMPLED_SPAN_QUARANTINE_H_
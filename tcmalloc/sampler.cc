@@ -45,6 +45,26 @@ ssize_t Sampler::GetSamplePeriod() {
   return Parameters::profile_sampling_rate();
 }
 
+ssize_t Sampler::GetEffectiveSamplePeriod() const {
+  if (sample_period_override_ != 0) {
+    return sample_period_override_;
+  }
+  return GetSamplePeriod();
+}
+
+void Sampler::SetSamplePeriodOverride(int64_t period) {
+  sample_period_override_ =
+      period <= 0 ? 0
+                  : std::min<int64_t>(period,
+                                      std::numeric_limits<uint32_t>::max());
+  if (initialized_) {
+    // The distance to the next sampling point is memoryless, so drawing it
+    // again with the new period does not bias the samples.  Without this, the
+    // new period would only take effect after the next sample.
+    bytes_until_sample_ = PickNextSamplingPoint();
+  }
+}
+
 // Run this before using your sampler
 ABSL_ATTRIBUTE_NOINLINE void Sampler::Init(uint64_t seed) {
   ASSERT(seed != 0);
@@ -65,7 +85,7 @@ ABSL_ATTRIBUTE_NOINLINE void Sampler::Init(uint64_t seed) {
 }
 
 ssize_t Sampler::PickNextSamplingPoint() {
-  sample_period_ = GetSamplePeriod();
+  sample_period_ = GetEffectiveSamplePeriod();
   if (sample_period_ <= 0) {
     // In this case, we don't want to sample ever, and the larger a
     // value we put here, the longer until we hit the slow path
@@ -86,7 +106,7 @@ ssize_t Sampler::PickNextSamplingPoint() {
 
 ssize_t Sampler::PickNextGuardedSamplingPoint() {
   double guarded_sample_rate = Parameters::guarded_sampling_rate();
-  double profile_sample_rate = Parameters::profile_sampling_rate();
+  double profile_sample_rate = GetEffectiveSamplePeriod();
   if (guarded_sample_rate < 0 || profile_sample_rate <= 0) {
     // Guarded sampling is disabled but could be turned on at run time.  So we
     // return a sampling point (default mean=100) in case guarded sampling is
@@ -161,9 +181,12 @@ size_t Sampler::RecordAllocationSlow(size_t k) {
   // total samples. Multiplying by T, the mean number of bytes between samples,
   // gives us a weight of T + k - f.
   //
+  // T is the period this sampling point was picked with, which may be a
+  // per-thread override, so StackTraceTable::AddTrace and the other consumers
+  // of StackTrace::weight weigh each sample by its own period.
   size_t weight = sample_period_ - bytes_until_sample_ - kIntervalOffset;
   bytes_until_sample_ = PickNextSamplingPoint();
-  return GetSamplePeriod() <= 0 ? 0 : weight;
+  return GetEffectiveSamplePeriod() <= 0 ? 0 : weight;
 }
 
 double AllocatedBytes(const StackTrace& stack) {
@@ -129,6 +129,16 @@ class Sampler {
   // Returns the current sample period
   static ssize_t GetSamplePeriod();
 
+  // Overrides the sample period of this sampler, and hence of the thread that
+  // owns it, with `period` bytes.  Values above 4 GiB are clamped.  A period
+  // <= 0 removes the override, so that GetSamplePeriod() applies again.
+  //
+  // Each sample is weighted by the period its sampling point was picked with,
+  // so profiles stay unbiased when threads sample at different rates.
+  void SetSamplePeriodOverride(int64_t period);
+  // Returns the period set by SetSamplePeriodOverride(), or 0 if none.
+  int64_t GetSamplePeriodOverride() const { return sample_period_override_; }
+
   // The following are public for the purposes of testing
 
   // Used to ensure that the hot fields are collocated in the same cache line
@@ -142,6 +152,7 @@ class Sampler {
         allocs_until_guarded_sample_(0),
         rnd_(0),
         initialized_(false),
+        sample_period_override_(0),
         bytes_until_sample_(0) {}
 
  private:
@@ -155,6 +166,10 @@ class Sampler {
 
   uint64_t rnd_;  // Cheap random number generator
   bool initialized_;
+  // Per-thread sample period, or 0 to use GetSamplePeriod().  Kept in what
+  // would otherwise be padding, so that the hot data stays in the same cache
+  // line as __rseq_abi.
+  uint32_t sample_period_override_;
 
   // Bytes until we sample next.
   //
@@ -172,6 +187,8 @@ class Sampler {
   void Init(uint64_t seed);
   size_t RecordAllocationSlow(size_t k);
   ssize_t GetGeometricVariable(ssize_t mean);
+  // Returns the sample period that applies to this sampler.
+  ssize_t GetEffectiveSamplePeriod() const;
 };
 
 inline size_t Sampler::RecordAllocation(size_t k) {
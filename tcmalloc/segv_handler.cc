@@ -24,15 +24,19 @@
 #include <cstring>
 #include <tuple>
 
+#include "absl/base/attributes.h"
 #include "absl/base/call_once.h"
 #include "absl/base/internal/sysinfo.h"
 #include "absl/debugging/stacktrace.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/string_view.h"
 #include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/guarded_crash_report.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/optimization.h"
+#include "tcmalloc/page_protection_engine.h"
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 
@@ -110,6 +114,37 @@ static void PrintStackTraceFromSignalHandler(void* context) {
   PrintStackTrace(stack_frames, depth);
 }
 
+// Writes a binary report of the error at fault to fd.  Kept out of line, so
+// that the stack it needs is only used when reports are enabled.
+static ABSL_ATTRIBUTE_NOINLINE void WriteCrashReport(
+    int fd, void* fault, GuardedAllocationsErrorType error,
+    WriteFlag write_flag, pid_t current_thread,
+    const GuardedAllocationsStackTrace* alloc_trace,
+    const GuardedAllocationsStackTrace* dealloc_trace, void* context) {
+  void* stack_frames[kMaxStackDepth];
+  const size_t depth = absl::GetStackTraceWithContext(
+      stack_frames, kMaxStackDepth, 1, context, nullptr);
+  const GuardedPageAllocator::SlotInfo slot =
+      tc_globals.guardedpage_allocator().GetSlotInfo(fault);
+
+  GuardedCrashReport report;
+  report.fault_address = reinterpret_cast<uintptr_t>(fault);
+  report.error = error;
+  report.write_flag = write_flag;
+  report.tid = current_thread;
+  report.slot_start = slot.slot_start;
+  report.slot_size = slot.slot_size;
+  report.slot_index = slot.slot_index;
+  report.large = slot.large;
+  report.allocation_start = slot.allocation_start;
+  report.requested_size = slot.requested_size;
+  report.alloc_trace = alloc_trace;
+  report.dealloc_trace = dealloc_trace;
+  report.fault_stack = stack_frames;
+  report.fault_depth = depth;
+  (void)WriteGuardedCrashReport(fd, report);
+}
+
 constexpr const char* WriteFlagToString(WriteFlag write_flag) {
   switch (write_flag) {
     case WriteFlag::Unknown:
@@ -211,13 +246,31 @@ GuardedAllocationsErrorType RefineErrorTypeBasedOnContext(
   return RefineErrorTypeBasedOnWriteFlag(error, write_flag);
 }
 
+// Reports a fault in memory managed by a PageProtectionEngine other than the
+// guarded page allocator's, which keeps no allocation metadata to report.
+static void ReportProtectedPageFault(const PageProtectionEngine& engine,
+                                     void* fault, void* context) {
+  const WriteFlag write_flag = ExtractWriteFlagFromContext(context);
+  Log(kLog, __FILE__, __LINE__, "*** Access at", fault,
+      "to a freed or unallocated page of the", engine.name(), "allocator ***");
+  Log(kLog, __FILE__, __LINE__, "Access", WriteFlagToString(write_flag),
+      "occurs in thread", absl::base_internal::GetTID(), "at:");
+  PrintStackTraceFromSignalHandler(context);
+  RecordCrash("protected-page-fault");
+}
+
 // A SEGV handler that prints stack traces for the allocation and deallocation
 // of relevant memory as well as the location of the memory error.
 void SegvHandler(int signo, siginfo_t* info, void* context) {
   if (signo != SIGSEGV) return;
   void* fault = info->si_addr;
-  if (!tc_globals.guardedpage_allocator().PointerIsMine(fault)) return;
-
+  PageProtectionEngine* engine = PageProtectionEngine::Find(fault);
+  if (engine == nullptr) return;
+  engine->RecordFault();
+  if (!tc_globals.guardedpage_allocator().PointerIsMine(fault)) {
+    ReportProtectedPageFault(*engine, fault, context);
+    return;
+  }
 
   GuardedAllocationsStackTrace *alloc_trace, *dealloc_trace;
   GuardedAllocationsErrorType error =
@@ -231,6 +284,12 @@ void SegvHandler(int signo, siginfo_t* info, void* context) {
   size_t size;
   std::tie(offset, size) =
       tc_globals.guardedpage_allocator().GetAllocationOffsetAndSize(fault);
+  // Write the binary report first, as it doesn't depend on the log.
+  const int report_fd = GetGuardedCrashReportFd();
+  if (report_fd >= 0) {
+    WriteCrashReport(report_fd, fault, error, write_flag, current_thread,
+                     alloc_trace, dealloc_trace, context);
+  }
 
   Log(kLog, __FILE__, __LINE__,
       "*** GWP-ASan "
@@ -323,9 +382,25 @@ static void HandleSegvAndForward(int signo, siginfo_t* info, void* context) {
   ForwardSignal(signo, info, context);
 }
 
+// Returns the descriptor to write binary crash reports to, which a crash
+// collector can pass in TCMALLOC_GWP_ASAN_REPORT_FD, or -1.
+static int GuardedCrashReportFdFromEnv() {
+  const char* e = thread_safe_getenv("TCMALLOC_GWP_ASAN_REPORT_FD");
+  if (e == nullptr) return -1;
+  int fd;
+  if (!absl::SimpleAtoi(e, &fd) || fd < 0) {
+    Crash(kCrash, __FILE__, __LINE__, "bad TCMALLOC_GWP_ASAN_REPORT_FD env var",
+          e);
+  }
+  return fd;
+}
+
 extern "C" void MallocExtension_Internal_ActivateGuardedSampling() {
   static absl::once_flag flag;
   absl::base_internal::LowLevelCallOnce(&flag, []() {
+    if (GetGuardedCrashReportFd() < 0) {
+      SetGuardedCrashReportFd(GuardedCrashReportFdFromEnv());
+    }
     struct sigaction action = {};
     action.sa_sigaction = HandleSegvAndForward;
     sigemptyset(&action.sa_mask);
@@ -14,10 +14,21 @@
 
 #include "tcmalloc/segv_handler.h"
 
+#include <setjmp.h>
 #include <sys/mman.h>
 #include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
 
 #include "gtest/gtest.h"
+#include "absl/strings/string_view.h"
+#include "tcmalloc/guarded_allocations.h"
+#include "tcmalloc/guarded_crash_report.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/static_vars.h"
 
@@ -94,6 +105,174 @@ TEST(SegvHandlerTest, SignalHandlerStackConsumption) {
   EXPECT_GT(usage, kExpectedUsage * (100 - kUsageSlack) / 100);
 }
 
+struct ReportRecord {
+  CrashReportTag tag;
+  std::string payload;
+};
+
+// Splits a binary crash report into its records.
+std::vector<ReportRecord> ParseReport(absl::string_view data) {
+  std::vector<ReportRecord> records;
+  while (data.size() >= sizeof(CrashReportRecordHeader)) {
+    CrashReportRecordHeader header;
+    memcpy(&header, data.data(), sizeof(header));
+    data.remove_prefix(sizeof(header));
+    if (data.size() < header.length) break;
+    records.push_back({static_cast<CrashReportTag>(header.tag),
+                       std::string(data.substr(0, header.length))});
+    data.remove_prefix(header.length);
+  }
+  EXPECT_TRUE(data.empty()) << "truncated report";
+  return records;
+}
+
+template <typename T>
+T PayloadAs(const ReportRecord& record) {
+  T value = {};
+  EXPECT_GE(record.payload.size(), sizeof(T));
+  memcpy(&value, record.payload.data(),
+         std::min(sizeof(T), record.payload.size()));
+  return value;
+}
+
+// Returns the frames of a stack record.
+std::vector<uint64_t> StackFrames(const ReportRecord& record) {
+  const CrashReportStack stack = PayloadAs<CrashReportStack>(record);
+  EXPECT_EQ(record.payload.size(),
+            sizeof(stack) + stack.depth * sizeof(uint64_t));
+  std::vector<uint64_t> frames(stack.depth);
+  memcpy(frames.data(), record.payload.data() + sizeof(stack),
+         frames.size() * sizeof(uint64_t));
+  return frames;
+}
+
+class CrashReportTest : public testing::Test {
+ protected:
+  // Accesses addr, which must fault, from a SIGSEGV handler that runs
+  // SegvHandler with crash reports enabled and then returns here.  Returns the
+  // records of the report written from inside the handler.
+  std::vector<ReportRecord> FaultAndReport(void* addr, bool write) {
+    int fds[2];
+    EXPECT_EQ(pipe(fds), 0);
+    SetGuardedCrashReportFd(fds[1]);
+
+    struct sigaction act = {};
+    act.sa_flags = SA_SIGINFO;
+    act.sa_sigaction = [](int sig, siginfo_t* info, void* ctx) {
+      SegvHandler(sig, info, ctx);
+      siglongjmp(jmp_env_, 1);
+    };
+    sigemptyset(&act.sa_mask);
+    struct sigaction oldact;
+    EXPECT_EQ(sigaction(SIGSEGV, &act, &oldact), 0);
+    if (sigsetjmp(jmp_env_, /*savesigs=*/1) == 0) {
+      volatile char* p = static_cast<volatile char*>(addr);
+      if (write) {
+        *p = 'A';
+      } else {
+        (void)*p;
+      }
+      ADD_FAILURE() << "access did not fault";
+    }
+    EXPECT_EQ(sigaction(SIGSEGV, &oldact, nullptr), 0);
+    SetGuardedCrashReportFd(-1);
+
+    close(fds[1]);
+    std::string data;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) > 0) {
+      data.append(buf, n);
+    }
+    close(fds[0]);
+    return ParseReport(data);
+  }
+
+  static sigjmp_buf jmp_env_;
+};
+
+sigjmp_buf CrashReportTest::jmp_env_;
+
+TEST_F(CrashReportTest, UseAfterFree) {
+  constexpr size_t kSize = 24;
+  auto ptr = tc_globals.guardedpage_allocator().Allocate(kSize, 0);
+  if (ptr.status != Profile::Sample::GuardedStatus::Guarded) {
+    GTEST_SKIP() << "did not get a guarded allocation";
+  }
+  tc_globals.guardedpage_allocator().Deallocate(ptr.alloc);
+  char* fault = static_cast<char*>(ptr.alloc) + 5;
+  std::vector<ReportRecord> records = FaultAndReport(fault, /*write=*/true);
+
+  ASSERT_EQ(records.size(), 7);
+  EXPECT_EQ(records[0].tag, CrashReportTag::kHeader);
+  const auto header = PayloadAs<CrashReportHeader>(records[0]);
+  EXPECT_EQ(header.magic, kCrashReportMagic);
+  EXPECT_EQ(header.version, kCrashReportVersion);
+  EXPECT_EQ(header.pid, getpid());
+
+  EXPECT_EQ(records[1].tag, CrashReportTag::kFault);
+  const auto report_fault = PayloadAs<CrashReportFault>(records[1]);
+  EXPECT_EQ(report_fault.address, reinterpret_cast<uintptr_t>(fault));
+  EXPECT_EQ(report_fault.tid, syscall(SYS_gettid));
+#if defined(__x86_64__) || defined(__aarch64__)
+  EXPECT_EQ(report_fault.error_type,
+            static_cast<uint32_t>(
+                GuardedAllocationsErrorType::kUseAfterFreeWrite));
+  EXPECT_EQ(report_fault.write_flag, static_cast<uint32_t>(WriteFlag::Write));
+#endif
+
+  EXPECT_EQ(records[2].tag, CrashReportTag::kSlot);
+  const auto slot = PayloadAs<CrashReportSlot>(records[2]);
+  EXPECT_EQ(slot.allocation_address, reinterpret_cast<uintptr_t>(ptr.alloc));
+  EXPECT_EQ(slot.requested_size, kSize);
+  EXPECT_EQ(slot.access_offset, 5);
+  EXPECT_EQ(slot.large, 0);
+  EXPECT_LE(slot.slot_address, slot.allocation_address);
+  EXPECT_LE(slot.allocation_address + kSize,
+            slot.slot_address + slot.slot_size);
+
+  EXPECT_EQ(records[3].tag, CrashReportTag::kAllocStack);
+  EXPECT_EQ(records[4].tag, CrashReportTag::kDeallocStack);
+  EXPECT_EQ(records[5].tag, CrashReportTag::kFaultStack);
+  for (int i = 3; i <= 5; ++i) {
+    EXPECT_EQ(PayloadAs<CrashReportStack>(records[i]).tid,
+              syscall(SYS_gettid));
+    EXPECT_FALSE(StackFrames(records[i]).empty());
+  }
+  EXPECT_EQ(records[6].tag, CrashReportTag::kEnd);
+  EXPECT_TRUE(records[6].payload.empty());
+}
+
+TEST_F(CrashReportTest, BufferOverflow) {
+  constexpr size_t kSize = 100;
+  auto ptr = tc_globals.guardedpage_allocator().Allocate(kSize, 0);
+  if (ptr.status != Profile::Sample::GuardedStatus::Guarded) {
+    GTEST_SKIP() << "did not get a guarded allocation";
+  }
+  // Whether or not the allocation is right-aligned, this is in the guard page
+  // after its slot.
+  const size_t offset = tc_globals.guardedpage_allocator().page_size();
+  char* fault = static_cast<char*>(ptr.alloc) + offset;
+  std::vector<ReportRecord> records = FaultAndReport(fault, /*write=*/false);
+  tc_globals.guardedpage_allocator().Deallocate(ptr.alloc);
+
+  // A live allocation has no deallocation stack.
+  ASSERT_EQ(records.size(), 6);
+  EXPECT_EQ(records[1].tag, CrashReportTag::kFault);
+#if defined(__x86_64__) || defined(__aarch64__)
+  EXPECT_EQ(PayloadAs<CrashReportFault>(records[1]).error_type,
+            static_cast<uint32_t>(
+                GuardedAllocationsErrorType::kBufferOverflowRead));
+#endif
+  EXPECT_EQ(records[2].tag, CrashReportTag::kSlot);
+  const auto slot = PayloadAs<CrashReportSlot>(records[2]);
+  EXPECT_EQ(slot.requested_size, kSize);
+  EXPECT_EQ(slot.access_offset, offset);
+  EXPECT_EQ(records[3].tag, CrashReportTag::kAllocStack);
+  EXPECT_EQ(records[4].tag, CrashReportTag::kFaultStack);
+  EXPECT_EQ(records[5].tag, CrashReportTag::kEnd);
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
@@ -0,0 +1,166 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/slow_path_latency.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+
+#include "absl/base/internal/cycleclock.h"
+#include "absl/numeric/bits.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/internal/percpu.h"
+#include "tcmalloc/static_vars.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+size_t BucketFor(int64_t cycles) {
+  // The cycle counter may go backwards if we migrated between CPUs.
+  if (cycles <= 0) return 0;
+  return std::min<size_t>(absl::bit_width(static_cast<uint64_t>(cycles)),
+                          SlowPathLatency::kNumBuckets - 1);
+}
+
+// Returns the latency that the latencies counted by bucket are less than, or
+// infinity for the last bucket.
+double BucketBoundNs(size_t bucket, double ns_per_cycle) {
+  if (bucket == SlowPathLatency::kNumBuckets - 1) {
+    return std::numeric_limits<double>::infinity();
+  }
+  return static_cast<double>(uint64_t{1} << bucket) * ns_per_cycle;
+}
+
+// Returns the bucket that holds the given quantile of h.
+size_t QuantileBucket(const SlowPathLatency::Histogram& h, double quantile) {
+  const uint64_t rank = static_cast<uint64_t>(quantile * h.count);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < SlowPathLatency::kNumBuckets; ++i) {
+    seen += h.buckets[i];
+    if (seen > rank) return i;
+  }
+  return SlowPathLatency::kNumBuckets - 1;
+}
+
+}  // namespace
+
+const char* SlowPathLatency::SlowPathName(SlowPath path) {
+  switch (path) {
+    case SlowPath::kSlowAllocSmall:
+      return "slow_alloc_small";
+    case SlowPath::kCpuCacheRefill:
+      return "cpu_cache_refill";
+    case SlowPath::kCentralFreeListPopulate:
+      return "central_freelist_populate";
+    case SlowPath::kPageAllocatorNew:
+      return "page_allocator_new";
+    case SlowPath::kRegionManagerAllocate:
+      return "region_manager_allocate";
+    case SlowPath::kAliasMmap:
+      return "alias_mmap";
+    case SlowPath::kNumSlowPaths:
+      break;
+  }
+  ASSUME(false);
+  return "";
+}
+
+SlowPathLatency::Shard& SlowPathLatency::LocalShard() {
+  const int cpu = subtle::percpu::GetCurrentCpu();
+  // The CPU may be unknown if neither rseq nor sched_getcpu() is available.
+  return shards_[cpu >= 0 ? cpu % kShards : 0];
+}
+
+void SlowPathLatency::Record(SlowPath path, int64_t cycles) {
+  PathCounts& counts = LocalShard().paths[static_cast<int>(path)];
+  counts.buckets[BucketFor(cycles)].fetch_add(1, std::memory_order_relaxed);
+  counts.total_cycles.fetch_add(std::max<int64_t>(cycles, 0),
+                                std::memory_order_relaxed);
+}
+
+SlowPathLatency::Histogram SlowPathLatency::GetHistogram(SlowPath path) const {
+  Histogram h = {};
+  for (const Shard& shard : shards_) {
+    const PathCounts& counts = shard.paths[static_cast<int>(path)];
+    h.total_cycles += counts.total_cycles.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < kNumBuckets; ++i) {
+      const uint64_t n = counts.buckets[i].load(std::memory_order_relaxed);
+      h.buckets[i] += n;
+      h.count += n;
+    }
+  }
+  return h;
+}
+
+void SlowPathLatency::Print(Printer* out) const {
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  out->printf("------------------------------------------------\n");
+  out->printf("Slow path latency\n");
+  out->printf("------------------------------------------------\n");
+  for (int i = 0; i < kNumSlowPaths; ++i) {
+    const SlowPath path = static_cast<SlowPath>(i);
+    const Histogram h = GetHistogram(path);
+    if (h.count == 0) continue;
+    out->printf(
+        "%-26s %12zu calls, mean %10.0f ns, p50 < %10.0f ns, "
+        "p99 < %10.0f ns, p99.9 < %10.0f ns\n",
+        SlowPathName(path), h.count, h.total_cycles * ns_per_cycle / h.count,
+        BucketBoundNs(QuantileBucket(h, 0.5), ns_per_cycle),
+        BucketBoundNs(QuantileBucket(h, 0.99), ns_per_cycle),
+        BucketBoundNs(QuantileBucket(h, 0.999), ns_per_cycle));
+    for (size_t b = 0; b < kNumBuckets; ++b) {
+      if (h.buckets[b] == 0) continue;
+      out->printf("%-26s   < %12.0f ns: %12zu\n", SlowPathName(path),
+                  BucketBoundNs(b, ns_per_cycle), h.buckets[b]);
+    }
+  }
+}
+
+void SlowPathLatency::PrintInPbtxt(PbtxtRegion* region) const {
+  const double ns_per_cycle =
+      1e9 / absl::base_internal::CycleClock::Frequency();
+  for (int i = 0; i < kNumSlowPaths; ++i) {
+    const SlowPath path = static_cast<SlowPath>(i);
+    const Histogram h = GetHistogram(path);
+    auto entry = region->CreateSubRegion("slow_path");
+    entry.PrintRaw("path", SlowPathName(path));
+    entry.PrintI64("count", h.count);
+    entry.PrintI64("total_ns", h.total_cycles * ns_per_cycle);
+    for (size_t b = 0; b < kNumBuckets; ++b) {
+      if (h.buckets[b] == 0) continue;
+      auto bucket = entry.CreateSubRegion("bucket");
+      // The last bucket has no upper bound.
+      bucket.PrintI64("upper_bound_ns",
+                      b == kNumBuckets - 1 ? -1
+                                           : BucketBoundNs(b, ns_per_cycle));
+      bucket.PrintI64("count", h.buckets[b]);
+    }
+  }
+}
+
+void RecordSlowPathLatency(SlowPath path, int64_t cycles) {
+  tc_globals.slow_path_latency().Record(path, cycles);
+}
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
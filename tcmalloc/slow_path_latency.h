@@ -0,0 +1,131 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TCMALLOC_SLOW_PATH_LATENCY_H_
+#define TCMALLOC_SLOW_PATH_LATENCY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "absl/base/attributes.h"
+#include "absl/base/internal/cycleclock.h"
+#include "absl/base/optimization.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/parameters.h"
+
+GOOGLE_MALLOC_SECTION_BEGIN
+namespace tcmalloc {
+namespace tcmalloc_internal {
+
+// The slow paths of the allocator whose latency is recorded.
+enum class SlowPath {
+  kSlowAllocSmall,           // slow_alloc_small
+  kCpuCacheRefill,           // CpuCache::Refill
+  kCentralFreeListPopulate,  // CentralFreeList::Populate
+  kPageAllocatorNew,         // PageAllocator::New and NewAligned
+  kRegionManagerAllocate,    // RegionManager::Alloc
+  kAliasMmap,                // mapping a virtual page alias
+  kNumSlowPaths,
+};
+
+// Histograms of the latency of each SlowPath, in cycles.
+//
+// Bucket 0 counts latencies of 0 cycles, and bucket i > 0 counts latencies in
+// [2^(i-1), 2^i) cycles.  The last bucket also counts every longer latency.
+//
+// Latencies are recorded to one of kShards cache-line-aligned shards, picked
+// by the current CPU, so that CPUs don't contend on the same cache lines.
+// Reports sum the shards.
+//
+// Is safe to use with static storage duration and is thread safe.
+class SlowPathLatency {
+ public:
+  static constexpr size_t kNumBuckets = 32;
+  static constexpr size_t kShards = 32;
+  static constexpr int kNumSlowPaths =
+      static_cast<int>(SlowPath::kNumSlowPaths);
+
+  struct Histogram {
+    uint64_t count;
+    uint64_t total_cycles;
+    uint64_t buckets[kNumBuckets];
+  };
+
+  constexpr SlowPathLatency() = default;
+
+  SlowPathLatency(const SlowPathLatency&) = delete;
+  SlowPathLatency& operator=(const SlowPathLatency&) = delete;
+
+  void Record(SlowPath path, int64_t cycles);
+
+  // Returns the sum of the shards for path.  Shards are read while they are
+  // being written, so the result is approximate.
+  Histogram GetHistogram(SlowPath path) const;
+
+  static const char* SlowPathName(SlowPath path);
+
+  void Print(Printer* out) const;
+  void PrintInPbtxt(PbtxtRegion* region) const;
+
+ private:
+  struct PathCounts {
+    std::atomic<uint64_t> total_cycles{0};
+    std::atomic<uint64_t> buckets[kNumBuckets] = {};
+  };
+
+  struct ABSL_CACHELINE_ALIGNED Shard {
+    PathCounts paths[kNumSlowPaths];
+  };
+
+  Shard& LocalShard();
+
+  Shard shards_[kShards];
+};
+
+// Records the latency of a slow path to tc_globals.slow_path_latency().
+void RecordSlowPathLatency(SlowPath path, int64_t cycles);
+
+// Records the time from its construction to its destruction as the latency of
+// path, if Parameters::slow_path_latency_histograms() was enabled when it was
+// constructed.
+class ScopedSlowPathTimer {
+ public:
+  explicit ScopedSlowPathTimer(SlowPath path)
+      : path_(path),
+        start_(ABSL_PREDICT_FALSE(Parameters::slow_path_latency_histograms())
+                   ? absl::base_internal::CycleClock::Now()
+                   : 0) {}
+
+  ~ScopedSlowPathTimer() {
+    if (ABSL_PREDICT_TRUE(start_ == 0)) return;
+    RecordSlowPathLatency(path_,
+                          absl::base_internal::CycleClock::Now() - start_);
+  }
+
+  ScopedSlowPathTimer(const ScopedSlowPathTimer&) = delete;
+  ScopedSlowPathTimer& operator=(const ScopedSlowPathTimer&) = delete;
+
+ private:
+  const SlowPath path_;
+  const int64_t start_;
+};
+
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
+GOOGLE_MALLOC_SECTION_END
+
+#endif  // TCMALLOC_SLOW_PATH_LATENCY_H_
@@ -84,6 +84,9 @@ struct SpanAllocInfo {
 //  - ON_RETURNED_FREELIST: the span has no allocated objects, owned by PageHeap
 //    and is on returned PageHeap list.
 //    location_ == ON_RETURNED_FREELIST.
+//  - QUARANTINED: a freed sampled span that SampledSpanQuarantine holds before
+//    returning it to PageHeap.
+//    location_ == QUARANTINED.
 class Span;
 typedef TList<Span> SpanList;
 
@@ -102,6 +105,7 @@ class Span : public SpanList::Elem {
     IN_USE,                // not on PageHeap lists
     ON_NORMAL_FREELIST,    // on normal PageHeap list
     ON_RETURNED_FREELIST,  // on returned PageHeap list
+    QUARANTINED,           // freed sampled span held by SampledSpanQuarantine
   };
   Location location() const;
   void set_location(Location loc);
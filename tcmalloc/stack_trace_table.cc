@@ -33,6 +33,41 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+void StackTraceToSample(double sample_weight, const StackTrace& t,
+                        Profile::Sample& sample) {
+  // Report total bytes that are a multiple of the object size.
+  size_t allocated_size = t.allocated_size;
+  size_t requested_size = t.requested_size;
+
+  uintptr_t bytes = sample_weight * AllocatedBytes(t) + 0.5;
+  // We want sum to be a multiple of allocated_size; pick the nearest
+  // multiple rather than always rounding up or down.
+  //
+  // TODO(b/215362992): Revisit this assertion when GWP-ASan guards
+  // zero-byte allocations.
+  ASSERT(allocated_size > 0);
+  // The reported count of samples, with possible rounding up for unsample.
+  sample.count = (bytes + allocated_size / 2) / allocated_size;
+  sample.sum = sample.count * allocated_size;
+  sample.requested_size = requested_size;
+  sample.requested_alignment = t.requested_alignment;
+  sample.requested_size_returning = t.requested_size_returning;
+  sample.allocated_size = allocated_size;
+  sample.access_hint = static_cast<hot_cold_t>(t.access_hint);
+  sample.access_allocated = t.cold_allocated ? Profile::Sample::Access::Cold
+                                             : Profile::Sample::Access::Hot;
+  sample.depth = t.depth;
+  sample.allocation_time = t.allocation_time;
+
+  sample.span_start_address = t.span_start_address;
+  sample.guarded_status =
+      static_cast<Profile::Sample::GuardedStatus>(t.guarded_status);
+
+  static_assert(kMaxStackDepth <= Profile::Sample::kMaxStackDepth,
+                "Profile stack size smaller than internal stack sizes");
+  memcpy(sample.stack, t.stack, sizeof(sample.stack[0]) * sample.depth);
+}
+
 StackTraceTable::StackTraceTable(ProfileType type)
     : type_(type), depth_total_(0), all_(nullptr) {}
 
@@ -70,38 +105,7 @@ void StackTraceTable::AddTrace(double sample_weight, const StackTrace& t) {
   }
   s = new (s) LinkedSample;
 
-  // Report total bytes that are a multiple of the object size.
-  size_t allocated_size = t.allocated_size;
-  size_t requested_size = t.requested_size;
-
-  uintptr_t bytes = sample_weight * AllocatedBytes(t) + 0.5;
-  // We want sum to be a multiple of allocated_size; pick the nearest
-  // multiple rather than always rounding up or down.
-  //
-  // TODO(b/215362992): Revisit this assertion when GWP-ASan guards
-  // zero-byte allocations.
-  ASSERT(allocated_size > 0);
-  // The reported count of samples, with possible rounding up for unsample.
-  s->sample.count = (bytes + allocated_size / 2) / allocated_size;
-  s->sample.sum = s->sample.count * allocated_size;
-  s->sample.requested_size = requested_size;
-  s->sample.requested_alignment = t.requested_alignment;
-  s->sample.requested_size_returning = t.requested_size_returning;
-  s->sample.allocated_size = allocated_size;
-  s->sample.access_hint = static_cast<hot_cold_t>(t.access_hint);
-  s->sample.access_allocated = t.cold_allocated ? Profile::Sample::Access::Cold
-                                                : Profile::Sample::Access::Hot;
-  s->sample.depth = t.depth;
-  s->sample.allocation_time = t.allocation_time;
-
-  s->sample.span_start_address = t.span_start_address;
-  s->sample.guarded_status =
-      static_cast<Profile::Sample::GuardedStatus>(t.guarded_status);
-
-  static_assert(kMaxStackDepth <= Profile::Sample::kMaxStackDepth,
-                "Profile stack size smaller than internal stack sizes");
-  memcpy(s->sample.stack, t.stack,
-         sizeof(s->sample.stack[0]) * s->sample.depth);
+  StackTraceToSample(sample_weight, t, s->sample);
 
   s->next = all_;
   all_ = s;
@@ -30,6 +30,11 @@ GOOGLE_MALLOC_SECTION_BEGIN
 namespace tcmalloc {
 namespace tcmalloc_internal {
 
+// Fills sample with the information recorded in stack trace "t", scaling its
+// count and sum by `sample_weight` as described for StackTraceTable::AddTrace.
+void StackTraceToSample(double sample_weight, const StackTrace& t,
+                        Profile::Sample& sample);
+
 class StackTraceTable final : public ProfileBase {
  public:
   StackTraceTable(ProfileType type) ABSL_LOCKS_EXCLUDED(pageheap_lock);
@@ -20,9 +20,12 @@
 
 #include "absl/base/attributes.h"
 #include "absl/base/const_init.h"
+#include "absl/base/internal/cycleclock.h"
 #include "absl/base/internal/spinlock.h"
 #include "absl/base/optimization.h"
+#include "absl/strings/numbers.h"
 #include "absl/types/span.h"
+#include "tcmalloc/allocation_rate_tracker.h"
 #include "tcmalloc/allocation_sample.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/common.h"
@@ -31,10 +34,14 @@
 #include "tcmalloc/experiment.h"
 #include "tcmalloc/experiment_config.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/guarded_sampling_policy.h"
+#include "tcmalloc/hot_site_tracker.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
 #include "tcmalloc/internal/cache_topology.h"
+#include "tcmalloc/internal/clock.h"
 #include "tcmalloc/internal/config.h"
+#include "tcmalloc/internal/environment.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/mincore.h"
@@ -45,10 +52,14 @@
 #include "tcmalloc/page_allocator.h"
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pagemap.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/peak_heap_tracker.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
+#include "tcmalloc/residency_scanner.h"
+#include "tcmalloc/sampled_span_quarantine.h"
 #include "tcmalloc/size_class_info.h"
 #include "tcmalloc/sizemap.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
 #include "tcmalloc/thread_cache.h"
@@ -88,6 +99,8 @@ ABSL_CONST_INIT deallocationz::DeallocationProfilerList
 ABSL_CONST_INIT std::atomic<AllocHandle> Static::sampled_alloc_handle_generator{
     0};
 ABSL_CONST_INIT PeakHeapTracker Static::peak_heap_tracker_;
+ABSL_CONST_INIT AllocationRateTracker Static::allocation_rate_tracker_;
+ABSL_CONST_INIT HotSiteTracker Static::hot_site_tracker_;
 ABSL_CONST_INIT PageHeapAllocator<StackTraceTable::LinkedSample>
     Static::linked_sample_allocator_;
 ABSL_CONST_INIT std::atomic<bool> Static::inited_{false};
@@ -97,6 +110,10 @@ ABSL_CONST_INIT Static::VirtualPageAllocatorStorage Static::virtual_page_allocat
 ABSL_CONST_INIT PageMap Static::pagemap_;
 ABSL_CONST_INIT GuardedPageAllocator Static::guardedpage_allocator_;
 ABSL_CONST_INIT StackTraceFilter Static::stacktrace_filter_;
+ABSL_CONST_INIT GuardedSamplingPolicy Static::guarded_sampling_policy_;
+ABSL_CONST_INIT SampledSpanQuarantine Static::sampled_span_quarantine_;
+ABSL_CONST_INIT ResidencyScanner Static::residency_scanner_;
+ABSL_CONST_INIT SlowPathLatency Static::slow_path_latency_;
 ABSL_CONST_INIT NumaTopology<kNumaPartitions, kNumBaseClasses>
     Static::numa_topology_;
 // LINT.ThenChange(:static_vars_size)
@@ -123,8 +140,12 @@ size_t Static::metadata_bytes() {
       sizeof(sampled_objects_size_) + sizeof(sampled_internal_fragmentation_) +
       sizeof(total_sampled_count_) + sizeof(allocation_samples) +
       sizeof(deallocation_samples) + sizeof(sampled_alloc_handle_generator) +
-      sizeof(peak_heap_tracker_) + sizeof(guardedpage_allocator_) +
-      sizeof(stacktrace_filter_) + sizeof(numa_topology_) +
+      sizeof(peak_heap_tracker_) + sizeof(allocation_rate_tracker_) +
+      sizeof(hot_site_tracker_) +
+      sizeof(guardedpage_allocator_) +
+      sizeof(stacktrace_filter_) + sizeof(guarded_sampling_policy_) +
+      sizeof(sampled_span_quarantine_) + sizeof(residency_scanner_) +
+      sizeof(slow_path_latency_) + sizeof(numa_topology_) +
       sizeof(CacheTopology::Instance());
   // LINT.ThenChange(:static_vars)
 
@@ -141,6 +162,70 @@ size_t Static::pagemap_residence() {
 
 int ABSL_ATTRIBUTE_WEAK default_want_legacy_size_classes();
 
+// Returns the initial number of slots of the guarded page pool.  The default
+// can be overridden with TCMALLOC_GUARDED_PAGE_POOL_SIZE, e.g. to sample more
+// allocations concurrently on large hosts, and changed with
+// Parameters::set_guarded_page_pool_size() until the pool is first used.
+static size_t GuardedPagePoolSize() {
+  constexpr size_t kDefaultPoolSize = 128;
+  const char* e = thread_safe_getenv("TCMALLOC_GUARDED_PAGE_POOL_SIZE");
+  if (e == nullptr) return kDefaultPoolSize;
+  size_t pool_size;
+  if (!absl::SimpleAtoi(e, &pool_size) || pool_size < 2 ||
+      pool_size > GuardedPageAllocator::kGpaMaxPages) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "bad TCMALLOC_GUARDED_PAGE_POOL_SIZE env var", e);
+  }
+  return pool_size;
+}
+
+// Returns the number of guarded deallocations to protect together.  Defaults
+// to 1, which protects every deallocation immediately; larger batches, set
+// with TCMALLOC_GUARDED_PAGE_DEALLOCATION_BATCH, save system calls at high
+// guarded sampling rates but detect uses after free later.
+static size_t GuardedPageDeallocationBatch() {
+  const char* e =
+      thread_safe_getenv("TCMALLOC_GUARDED_PAGE_DEALLOCATION_BATCH");
+  if (e == nullptr) return 1;
+  size_t batch_size;
+  if (!absl::SimpleAtoi(e, &batch_size) || batch_size < 1 ||
+      batch_size > GuardedPageAllocator::kMaxDeallocationBatch) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "bad TCMALLOC_GUARDED_PAGE_DEALLOCATION_BATCH env var", e);
+  }
+  return batch_size;
+}
+
+// Returns the number of freed virtual pages whose aliases are discarded
+// together.  Like GuardedPageDeallocationBatch(), defaults to 1, which discards
+// every alias immediately; larger batches, set with
+// TCMALLOC_VIRTUAL_PAGE_REVOCATION_BATCH, save system calls but leave freed
+// pages accessible for longer.
+static size_t VirtualPageRevocationBatch() {
+  const char* e = thread_safe_getenv("TCMALLOC_VIRTUAL_PAGE_REVOCATION_BATCH");
+  if (e == nullptr) return 1;
+  size_t batch_size;
+  if (!absl::SimpleAtoi(e, &batch_size) || batch_size < 1 ||
+      batch_size > VirtualPageAllocator::kMaxRevocationBatch) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "bad TCMALLOC_VIRTUAL_PAGE_REVOCATION_BATCH env var", e);
+  }
+  return batch_size;
+}
+
+// Applies TCMALLOC_SAMPLED_QUARANTINE_BYTES, which enables the quarantine of
+// freed sampled spans with a budget of that many bytes.
+static void InitSampledQuarantineBytes() {
+  const char* e = thread_safe_getenv("TCMALLOC_SAMPLED_QUARANTINE_BYTES");
+  if (e == nullptr) return;
+  size_t bytes;
+  if (!absl::SimpleAtoi(e, &bytes)) {
+    Crash(kCrash, __FILE__, __LINE__,
+          "bad TCMALLOC_SAMPLED_QUARANTINE_BYTES env var", e);
+  }
+  Parameters::set_sampled_quarantine_bytes(bytes);
+}
+
 ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
   AllocationGuardSpinLockHolder h(&pageheap_lock);
 
@@ -170,7 +255,12 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
     sampledallocation_allocator_.Init(&arena_);
     sampled_allocation_recorder_.Construct(&sampledallocation_allocator_);
     sampled_allocation_recorder().Init();
-    peak_heap_tracker_.Init(&arena_);
+    peak_heap_tracker_.Init(
+        &arena_, Clock{.now = absl::base_internal::CycleClock::Now,
+                       .freq = absl::base_internal::CycleClock::Frequency});
+    allocation_rate_tracker_.Init(
+        Clock{.now = absl::base_internal::CycleClock::Now,
+              .freq = absl::base_internal::CycleClock::Frequency});
     span_allocator_.Init(&arena_);
     span_allocator_.New();  // Reduce cache conflicts
     span_allocator_.New();  // Reduce cache conflicts
@@ -182,10 +272,24 @@ ABSL_ATTRIBUTE_COLD ABSL_ATTRIBUTE_NOINLINE void Static::SlowInitIfNecessary() {
     // state.
     sharded_transfer_cache_.Init();
     new (page_allocator_.memory) PageAllocator;
-    new (virtual_page_allocator_.memory) VirtualPageAllocator;
+    new (virtual_page_allocator_.memory)
+        VirtualPageAllocator(VirtualPageRevocationBatch());
     threadcache_allocator_.Init(&arena_);
     pagemap_.MapRootWithSmallPages();
-    guardedpage_allocator_.Init(/*max_alloced_pages=*/64, /*total_pages=*/128);
+    // Only half of the slots are allocated at a time, so that freed slots stay
+    // protected for a while to catch uses after free.
+    const size_t guarded_pool_size = GuardedPagePoolSize();
+    guardedpage_allocator_.Init(
+        /*max_alloced_pages=*/guarded_pool_size / 2,
+        /*total_pages=*/guarded_pool_size,
+        /*deallocation_batch_size=*/GuardedPageDeallocationBatch());
+    // Guard up to a pool's worth of allocations per window, spread over as
+    // many sites as possible.
+    guarded_sampling_policy_.Init(
+        Clock{.now = absl::base_internal::CycleClock::Now,
+              .freq = absl::base_internal::CycleClock::Frequency},
+        /*guards_per_window=*/guarded_pool_size);
+    InitSampledQuarantineBytes();
     inited_.store(true, std::memory_order_release);
   }
 }
@@ -26,12 +26,15 @@
 #include "absl/base/attributes.h"
 #include "absl/base/optimization.h"
 #include "absl/base/thread_annotations.h"
+#include "tcmalloc/allocation_rate_tracker.h"
 #include "tcmalloc/allocation_sample.h"
 #include "tcmalloc/arena.h"
 #include "tcmalloc/central_freelist.h"
 #include "tcmalloc/common.h"
 #include "tcmalloc/deallocation_profiler.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/guarded_sampling_policy.h"
+#include "tcmalloc/hot_site_tracker.h"
 #include "tcmalloc/internal/atomic_stats_counter.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/explicitly_constructed.h"
@@ -45,8 +48,11 @@
 #include "tcmalloc/page_heap_allocator.h"
 #include "tcmalloc/pages.h"
 #include "tcmalloc/peak_heap_tracker.h"
+#include "tcmalloc/residency_scanner.h"
 #include "tcmalloc/sampled_allocation_allocator.h"
+#include "tcmalloc/sampled_span_quarantine.h"
 #include "tcmalloc/sizemap.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/stack_trace_table.h"
 #include "tcmalloc/transfer_cache.h"
@@ -93,6 +99,12 @@ class Static final {
 
   static PeakHeapTracker& peak_heap_tracker() { return peak_heap_tracker_; }
 
+  static AllocationRateTracker& allocation_rate_tracker() {
+    return allocation_rate_tracker_;
+  }
+
+  static HotSiteTracker& hot_site_tracker() { return hot_site_tracker_; }
+
   static NumaTopology<kNumaPartitions, kNumBaseClasses>& numa_topology() {
     return numa_topology_;
   }
@@ -120,6 +132,17 @@ class Static final {
 
   static StackTraceFilter& stacktrace_filter() { return stacktrace_filter_; }
 
+  static GuardedSamplingPolicy& guarded_sampling_policy() {
+    return guarded_sampling_policy_;
+  }
+
+  static SampledSpanQuarantine& sampled_span_quarantine() {
+    return sampled_span_quarantine_;
+  }
+
+  static ResidencyScanner& residency_scanner() { return residency_scanner_; }
+  static SlowPathLatency& slow_path_latency() { return slow_path_latency_; }
+
   static SampledAllocationAllocator& sampledallocation_allocator() {
     return sampledallocation_allocator_;
   }
@@ -197,6 +220,10 @@ class Static final {
   static CpuCache cpu_cache_;
   ABSL_CONST_INIT static GuardedPageAllocator guardedpage_allocator_;
   ABSL_CONST_INIT static StackTraceFilter stacktrace_filter_;
+  ABSL_CONST_INIT static GuardedSamplingPolicy guarded_sampling_policy_;
+  ABSL_CONST_INIT static SampledSpanQuarantine sampled_span_quarantine_;
+  ABSL_CONST_INIT static ResidencyScanner residency_scanner_;
+  ABSL_CONST_INIT static SlowPathLatency slow_path_latency_;
   static SampledAllocationAllocator sampledallocation_allocator_;
   static PageHeapAllocator<Span> span_allocator_;
   static PageHeapAllocator<ThreadCache> threadcache_allocator_;
@@ -205,6 +232,8 @@ class Static final {
   ABSL_CONST_INIT static std::atomic<bool> inited_;
   ABSL_CONST_INIT static std::atomic<bool> cpu_cache_active_;
   ABSL_CONST_INIT static PeakHeapTracker peak_heap_tracker_;
+  ABSL_CONST_INIT static AllocationRateTracker allocation_rate_tracker_;
+  ABSL_CONST_INIT static HotSiteTracker hot_site_tracker_;
   ABSL_CONST_INIT static NumaTopology<kNumaPartitions, kNumBaseClasses>
       numa_topology_;
 
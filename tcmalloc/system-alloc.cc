@@ -53,8 +53,10 @@
 #include "tcmalloc/internal/numa.h"
 #include "tcmalloc/internal/optimization.h"
 #include "tcmalloc/internal/page_size.h"
+#include "tcmalloc/internal/syscall_stats.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/parameters.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/static_vars.h"
 
 // On systems (like freebsd) that don't define MAP_ANONYMOUS, use the old
@@ -218,7 +220,7 @@ std::tuple<int, void*, size_t> MmapRegion::Alloc(size_t request_size,
 
   ASSERT(result % GetPageSize() == 0);
   void* result_ptr = reinterpret_cast<void*>(result);
-  if (mprotect(result_ptr, actual_size, PROT_READ | PROT_WRITE) != 0) {
+  if (CountedMprotect(result_ptr, actual_size, PROT_READ | PROT_WRITE) != 0) {
     Log(kLogWithStack, __FILE__, __LINE__,
         "mprotect() region failed (ptr, size, error)", result_ptr, actual_size,
         strerror(errno));
@@ -285,6 +287,7 @@ static AddressRegionFactory::UsageHint TagToHint(MemoryTag tag) {
 std::tuple<int, void*, size_t> RegionManager::Alloc(size_t request_size,
                                               size_t alignment,
                                               const MemoryTag tag) {
+  ScopedSlowPathTimer timer(SlowPath::kRegionManagerAllocate);
   constexpr uintptr_t kTagFree = uintptr_t{1} << kTagShift;
 
   // We do not support size or alignment larger than kTagFree.
@@ -306,7 +309,7 @@ std::tuple<int, void*, size_t> RegionManager::Alloc(size_t request_size,
     const auto region_type = TagToHint(tag);
     AddressRegion* region = region_factory->Create(file, size, region_type);
     if (!region) {
-      munmap(ptr, size);
+      CountedMunmap(ptr, size);
       close(file.fd);
       return {-1, nullptr, 0};
     }
@@ -347,7 +350,7 @@ std::tuple<int, void*, size_t> RegionManager::Allocate(size_t size, size_t align
   const auto region_type = TagToHint(tag);
   region = region_factory->Create(file, kMinMmapAlloc, region_type);
   if (!region) {
-    munmap(ptr, kMinMmapAlloc);
+    CountedMunmap(ptr, kMinMmapAlloc);
     close(file.fd);
     return {-1, nullptr, 0};
   }
@@ -539,14 +542,14 @@ static uintptr_t RandomMmapHint(size_t size, size_t alignment,
   ABSL_CONST_INIT static absl::once_flag flag;
 
   absl::base_internal::LowLevelCallOnce(&flag, [&]() {
-    void* seed =
-        mmap(nullptr, kPageSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    void* seed = CountedMmap(nullptr, kPageSize, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (seed == MAP_FAILED) {
       Crash(kCrash, __FILE__, __LINE__,
             "Initial mmap() reservation failed (errno, size)", errno,
             kPageSize);
     }
-    munmap(seed, kPageSize);
+    CountedMunmap(seed, kPageSize);
     rnd = reinterpret_cast<uintptr_t>(seed);
   });
 
@@ -618,8 +621,8 @@ AnonymousFile CreateAnonFile(size_t size, size_t alignment, const MemoryTag tag)
   char name[256];
   absl::SNPrintF(name, sizeof(name), "securemalloc_region_%s",
     MemoryTagToLabel(tag));
-  file.fd = memfd_create(name, MFD_CLOEXEC);
-  int truncate_returnval = ftruncate(fd, size);
+  file.fd = CountedMemfdCreate(name, MFD_CLOEXEC);
+  int truncate_returnval = CountedFtruncate(fd, size);
   if (truncate_returnval != 0) {
     close(file.fd);
     return file;
@@ -628,7 +631,7 @@ AnonymousFile CreateAnonFile(size_t size, size_t alignment, const MemoryTag tag)
   for (int i = 0; i < 1000; ++i) {
     hint = reinterpret_cast<void*>(next_addr);
     ASSERT(GetMemoryTag(hint) == tag);
-    file.ptr = mmap(hint, size, PROT_NONE, MAP_SHARED, file.fd, 0);
+    file.ptr = CountedMmap(hint, size, PROT_NONE, MAP_SHARED, file.fd, 0);
     if (file.ptr == hint) {
       // Attempt to keep the next mmap contiguous in the common case.
       next_addr += size;
@@ -646,7 +649,7 @@ AnonymousFile CreateAnonFile(size_t size, size_t alignment, const MemoryTag tag)
       file.ptr = nullptr;
       return file;
     }
-    if (int err = munmap(result, size)) {
+    if (int err = CountedMunmap(result, size)) {
       Log(kLogWithStack, __FILE__, __LINE__, "munmap() failed (error)",
           strerror(errno));
       ASSERT(err == 0);
@@ -659,6 +662,81 @@ AnonymousFile CreateAnonFile(size_t size, size_t alignment, const MemoryTag tag)
   return file;
 }
 
+void* MmapAligned(size_t size, size_t alignment, const MemoryTag tag) {
+  ASSERT(size <= kTagMask);
+  ASSERT(alignment <= kTagMask);
+
+  AllocationGuardSpinLockHolder lock_holder(&spinlock);
+
+  ABSL_CONST_INIT static uintptr_t next_sampled_addr = 0;
+  ABSL_CONST_INIT static std::array<uintptr_t, kNumaPartitions>
+      next_normal_addr = {0};
+  ABSL_CONST_INIT static uintptr_t next_cold_addr = 0;
+
+  std::optional<int> numa_partition;
+  uintptr_t& next_addr = *[&]() {
+    switch (tag) {
+      case MemoryTag::kSampled:
+        return &next_sampled_addr;
+      case MemoryTag::kNormalP0:
+        numa_partition = 0;
+        return &next_normal_addr[0];
+      case MemoryTag::kNormalP1:
+        numa_partition = 1;
+        return &next_normal_addr[1];
+      case MemoryTag::kCold:
+        return &next_cold_addr;
+      default:
+        ASSUME(false);
+        __builtin_unreachable();
+    }
+  }();
+
+  if (!next_addr || next_addr & (alignment - 1) ||
+      GetMemoryTag(reinterpret_cast<void*>(next_addr)) != tag ||
+      GetMemoryTag(reinterpret_cast<void*>(next_addr + size - 1)) != tag) {
+    next_addr = RandomMmapHint(size, alignment, tag);
+  }
+  void* hint;
+  for (int i = 0; i < 1000; ++i) {
+    hint = reinterpret_cast<void*>(next_addr);
+    ASSERT(GetMemoryTag(hint) == tag);
+    void* result = CountedMmap(hint, size, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                               -1, 0);
+    if (result == hint) {
+      if (numa_partition.has_value()) {
+        BindMemory(result, size, *numa_partition);
+      }
+      // Attempt to keep the next mmap contiguous in the common case.
+      next_addr += size;
+      CHECK_CONDITION(kAddressBits == std::numeric_limits<uintptr_t>::digits ||
+                      next_addr <= uintptr_t{1} << kAddressBits);
+
+      ASSERT((reinterpret_cast<uintptr_t>(result) & (alignment - 1)) == 0);
+      return result;
+    }
+    if (result == MAP_FAILED) {
+      Log(kLogWithStack, __FILE__, __LINE__,
+          "mmap() reservation failed (hint, size, error)", hint, size,
+          strerror(errno));
+      return nullptr;
+    }
+    if (int err = CountedMunmap(result, size)) {
+      Log(kLogWithStack, __FILE__, __LINE__, "munmap() failed (error)",
+          strerror(errno));
+      ASSERT(err == 0);
+    }
+    next_addr = RandomMmapHint(size, alignment, tag);
+  }
+
+  Log(kLogWithStack, __FILE__, __LINE__,
+      "MmapAligned() failed - unable to allocate with tag (hint, size, "
+      "alignment) - is something limiting address placement?",
+      hint, size, alignment);
+  return nullptr;
+}
+
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
 GOOGLE_MALLOC_SECTION_END
@@ -87,6 +87,7 @@
 #include "tcmalloc/global_stats.h"
 #include "tcmalloc/guarded_allocations.h"
 #include "tcmalloc/guarded_page_allocator.h"
+#include "tcmalloc/heap_delta.h"
 #include "tcmalloc/internal/allocation_guard.h"
 #include "tcmalloc/internal/config.h"
 #include "tcmalloc/internal/logging.h"
@@ -95,6 +96,7 @@
 #include "tcmalloc/internal/page_size.h"
 #include "tcmalloc/internal/percpu.h"
 #include "tcmalloc/internal/sampled_allocation.h"
+#include "tcmalloc/internal/syscall_stats.h"
 #include "tcmalloc/internal_malloc_extension.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/malloc_tracing_extension.h"
@@ -106,6 +108,7 @@
 #include "tcmalloc/parameters.h"
 #include "tcmalloc/sampler.h"
 #include "tcmalloc/segv_handler.h"
+#include "tcmalloc/slow_path_latency.h"
 #include "tcmalloc/span.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/stats.h"
@@ -229,6 +232,26 @@ extern "C" const ProfileBase* MallocExtension_Internal_SnapshotCurrent(
   }
 }
 
+extern "C" const ProfileBase* MallocExtension_Internal_LiveHeapProfile() {
+  return new LiveHeapProfile<Static>(tc_globals);
+}
+
+extern "C" const ProfileBase* MallocExtension_Internal_SnapshotAllocationRate(
+    absl::Duration window) {
+  return tc_globals.allocation_rate_tracker().Dump(window).release();
+}
+
+extern "C" const ProfileBase* MallocExtension_Internal_SnapshotPeakHeapWindow(
+    size_t window) {
+  return tc_globals.peak_heap_tracker().DumpWindowSample(window).release();
+}
+
+extern "C" const ProfileBase* MallocExtension_Internal_SnapshotHeapDelta(
+    HeapDeltaBaseline* baseline, size_t min_change_bytes) {
+  LiveHeapProfile<Static> heap(tc_globals);
+  return ComputeHeapDelta(heap, *baseline, min_change_bytes).release();
+}
+
 extern "C" AllocationProfilingTokenBase*
 MallocExtension_Internal_StartAllocationProfiling() {
   return new AllocationSample(&tc_globals.allocation_samples, absl::Now());
@@ -240,6 +263,18 @@ MallocExtension_Internal_StartLifetimeProfiling() {
       &tc_globals.deallocation_samples);
 }
 
+extern "C" void MallocExtension_Internal_SetLifetimeRecordingEnabled(
+    bool enabled) {
+  tc_globals.deallocation_samples.lifetime_records().SetEnabled(enabled);
+}
+
+extern "C" size_t MallocExtension_Internal_DrainLifetimeRecords(
+    MallocExtension::LifetimeRecord* records, size_t max_records,
+    uint64_t* dropped) {
+  return tc_globals.deallocation_samples.lifetime_records().Drain(
+      absl::MakeSpan(records, max_records), dropped);
+}
+
 MallocExtension::Ownership GetOwnership(const void* ptr) {
   const PageId p = PageIdContaining(ptr);
   return tc_globals.pagemap().GetDescriptor(p)
@@ -252,6 +287,12 @@ extern "C" bool MallocExtension_Internal_GetNumericProperty(
   return GetNumericProperty(name_data, name_size, value);
 }
 
+extern "C" bool MallocExtension_Internal_GetStatsSnapshot(
+    tcmalloc::MallocExtension::StatsV1* stats) {
+  GetStatsSnapshot(stats);
+  return true;
+}
+
 // Make sure the two definitions are in sync.
 static_assert(static_cast<int>(tcmalloc::MallocExtension::LimitKind::kSoft) ==
               PageAllocator::kSoft);
@@ -326,6 +367,9 @@ extern "C" size_t MallocExtension_Internal_ReleaseMemoryToSystem(
   }
   size_t bytes_released =
       tc_globals.page_allocator().ReleaseAtLeastNPages(num_pages).in_bytes();
+  // The background thread releases memory periodically, which keeps the
+  // totals reported by GetStatsSnapshot fresh.
+  PublishPageHeapStats();
   if (bytes_released > num_bytes) {
     extra_bytes_released = bytes_released - num_bytes;
     return num_bytes;
@@ -445,6 +489,28 @@ extern "C" void MallocExtension_Internal_GetProperties(
       stats.pageheap.unmapped_bytes + stats.arena.bytes_nonresident;
   (*result)["tcmalloc.sampled_internal_fragmentation"].value =
       tc_globals.sampled_internal_fragmentation_.value();
+  // Metadata of the guarded page pool, which is only allocated once the first
+  // allocation is guarded.
+  (*result)["tcmalloc.guarded_pool_metadata_bytes"].value =
+      tc_globals.guardedpage_allocator().metadata_bytes();
+  // Freed sampled memory that is held in quarantine rather than reused.
+  (*result)["tcmalloc.sampled_quarantine_bytes"].value =
+      tc_globals.sampled_span_quarantine().GetStats().quarantined_bytes;
+  // Pages that alias the heap, and their page tables.  Their residency is only
+  // available as its own property, since sampling it reads /proc.
+  (*result)["tcmalloc.virtual_page_aliases"].value = stats.aliases.aliases;
+  (*result)["tcmalloc.virtual_page_alias_page_table_bytes"].value =
+      stats.aliases.page_table_bytes;
+  // Memory management syscalls made by the allocator, and the time spent in
+  // them, e.g. tcmalloc.mmap_calls and tcmalloc.mmap_ns.
+  for (int i = 0; i < kNumSyscalls; ++i) {
+    const Syscall syscall = static_cast<Syscall>(i);
+    const SyscallCount count = GetSyscallCount(syscall);
+    (*result)[absl::StrCat("tcmalloc.", SyscallName(syscall), "_calls")]
+        .value = count.calls;
+    (*result)[absl::StrCat("tcmalloc.", SyscallName(syscall), "_ns")].value =
+        count.ns;
+  }
 
   (*result)["tcmalloc.page_algorithm"].value =
       tc_globals.page_allocator().algorithm();
@@ -596,18 +662,16 @@ inline sized_ptr_t do_malloc_pages(size_t size, size_t weight, Policy policy) {
       {1, AccessDensityPrediction::kSparse}, tag);
   if (span == nullptr) return {nullptr, 0};
 
-  // Set capacity to the exact size for a page allocation.  This needs to be
-  // revisited if we introduce gwp-asan sampling / guarded allocations to
-  // do_malloc_pages().
-  sized_ptr_t res{span->start_address(), num_pages.in_bytes()};
   ASSERT(!ColdFeatureActive() || tag == GetMemoryTag(span->start_address()));
 
+  // Sampling may replace the allocation with a guarded one, which has
+  // capacity for exactly the requested size.
   if (weight != 0) {
-    auto ptr = SampleLargeAllocation(tc_globals, policy, size, weight, span);
-    CHECK_CONDITION(res.p == ptr.p);
+    return SampleLargeAllocation(tc_globals, policy, size, weight, span);
   }
 
-  return res;
+  // Set capacity to the exact size for a page allocation.
+  return {span->start_address(), num_pages.in_bytes()};
 }
 
 // Handles freeing object that doesn't have size class, i.e. which
@@ -625,17 +689,27 @@ static void InvokeHooksAndFreePages(void* ptr) {
 
   MaybeUnsampleAllocation(tc_globals, ptr, span);
 
+  if (IsSampledMemory(ptr) &&
+      tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
+    ASSERT(span->first_page() == p);
+    // Deallocate() may make system calls, so call it before taking the lock.
+    tc_globals.guardedpage_allocator().Deallocate(ptr);
+    AllocationGuardSpinLockHolder h(&pageheap_lock);
+    Span::Delete(span);
+    return;
+  }
+
+  if (IsSampledMemory(ptr) && !IsColdMemory(ptr)) {
+    ASSERT(span->first_page() == p);
+    // Quarantine() poisons the span, so call it before taking the lock.
+    if (tc_globals.sampled_span_quarantine().Quarantine(span)) return;
+  }
+
   {
     AllocationGuardSpinLockHolder h(&pageheap_lock);
     ASSERT(span->first_page() == p);
     if (IsSampledMemory(ptr)) {
-      if (tc_globals.guardedpage_allocator().PointerIsMine(ptr)) {
-        // Release lock while calling Deallocate() since it does a system call.
-        pageheap_lock.Unlock();
-        tc_globals.guardedpage_allocator().Deallocate(ptr);
-        pageheap_lock.Lock();
-        Span::Delete(span);
-      } else if (IsColdMemory(ptr)) {
+      if (IsColdMemory(ptr)) {
         ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
         tc_globals.page_allocator().Delete(span, /*objects_per_span=*/1,
                                            MemoryTag::kCold);
@@ -928,7 +1002,7 @@ try_allocate_dedicated_virtual_page(Policy policy, void* ptr, size_t size) {
     PageId source_page = PageIdContaining(ptr);
     const Span* span = tc_globals.pagemap().GetExistingDescriptor(source_page);
     char* page = tc_globals.virtual_page_allocator().Allocate();
-    mmap(page, 4096, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+    tc_globals.virtual_page_allocator().Alias(page,
       span->file_descriptor(),
       span->offset() +
       (source_page - span->first_page() << kPageShift) +
@@ -956,6 +1030,7 @@ __attribute__((flatten))
 #endif
 ABSL_ATTRIBUTE_NOINLINE static typename Policy::pointer_type
 slow_alloc_small(size_t size, uint32_t size_class, Policy policy) {
+  ScopedSlowPathTimer timer(SlowPath::kSlowAllocSmall);
   size_t weight = GetThreadSampler()->RecordedAllocationFast(size);
   if (ABSL_PREDICT_FALSE(weight != 0) ||
       ABSL_PREDICT_FALSE(tcmalloc::tcmalloc_internal::Static::HaveHooks()) ||
@@ -1054,6 +1129,15 @@ extern "C" void MallocExtension_Internal_MarkThreadBusy() {
   tcmalloc::tcmalloc_internal::ThreadCache::GetCache();
 }
 
+extern "C" int64_t MallocExtension_Internal_GetThreadProfileSamplingRate() {
+  return GetThreadSampler()->GetSamplePeriodOverride();
+}
+
+extern "C" void MallocExtension_Internal_SetThreadProfileSamplingRate(
+    int64_t rate) {
+  GetThreadSampler()->SetSamplePeriodOverride(rate);
+}
+
 absl::StatusOr<tcmalloc::malloc_tracing_extension::AllocatedAddressRanges>
 MallocTracingExtension_Internal_GetAllocatedAddressRanges() {
   tcmalloc::malloc_tracing_extension::AllocatedAddressRanges
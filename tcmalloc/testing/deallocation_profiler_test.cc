@@ -32,6 +32,7 @@
 #include "absl/strings/match.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "tcmalloc/malloc_extension.h"
 #include "tcmalloc/testing/testutil.h"
 
@@ -762,4 +763,72 @@ TEST(LifetimeProfiler, LifetimeBucketing) {
   EXPECT_EQ(absl::Nanoseconds(34000000), BucketizeDuration(34200040));
 }
 
+TEST(LifetimeProfiler, DrainLifetimeRecords) {
+  if (CheckerIsActive()) {
+    return;
+  }
+
+  using LifetimeRecord = tcmalloc::MallocExtension::LifetimeRecord;
+  const size_t kMallocSize = 4 * 1024 * 1024;
+  const size_t kNumAllocations = 100;
+  const absl::Duration duration = absl::Microseconds(100);
+
+  tcmalloc::ScopedProfileSamplingRate test_sample_rate(1);
+  tcmalloc::MallocExtension::SetLifetimeRecordingEnabled(true);
+  std::vector<LifetimeRecord> records(
+      deallocationz::LifetimeRecordRings::kNumRings *
+      deallocationz::LifetimeRecordRings::kCapacity);
+  // Discard anything left over from earlier tests.
+  tcmalloc::MallocExtension::DrainLifetimeRecords(absl::MakeSpan(records));
+
+  auto token = tcmalloc::MallocExtension::StartLifetimeProfiling();
+  for (size_t i = 0; i < kNumAllocations; i++) {
+    void *ptr = SingleAlloc(2, kMallocSize);
+    absl::SleepFor(duration);
+    SingleDealloc(3, ptr);
+  }
+  std::move(token).Stop();
+
+  uint64_t dropped;
+  size_t n = tcmalloc::MallocExtension::DrainLifetimeRecords(
+      absl::MakeSpan(records), &dropped);
+  EXPECT_EQ(dropped, 0);
+
+  // Other allocations made by the test may be recorded too.
+  std::vector<LifetimeRecord> found;
+  for (size_t i = 0; i < n; ++i) {
+    if (records[i].allocated_size >= kMallocSize) {
+      found.push_back(records[i]);
+    }
+  }
+  ASSERT_EQ(found.size(), kNumAllocations);
+  for (const LifetimeRecord &record : found) {
+    EXPECT_GE(record.lifetime_ns, absl::ToInt64Nanoseconds(duration));
+    EXPECT_TRUE(record.same_thread);
+    EXPECT_NE(record.alloc_stack_hash, record.dealloc_stack_hash);
+    // All allocations share one stack, and so do all deallocations.
+    EXPECT_EQ(record.alloc_stack_hash, found[0].alloc_stack_hash);
+    EXPECT_EQ(record.dealloc_stack_hash, found[0].dealloc_stack_hash);
+  }
+
+  // Nothing is recorded once profiling stopped.
+  EXPECT_EQ(
+      tcmalloc::MallocExtension::DrainLifetimeRecords(absl::MakeSpan(records)),
+      0);
+
+  // When the rings overflow, records are dropped and counted.
+  token = tcmalloc::MallocExtension::StartLifetimeProfiling();
+  for (size_t i = 0; i < 2 * records.size(); i++) {
+    SingleDealloc(3, SingleAlloc(2, kMallocSize));
+  }
+  std::move(token).Stop();
+  n = tcmalloc::MallocExtension::DrainLifetimeRecords(absl::MakeSpan(records),
+                                                      &dropped);
+  EXPECT_LE(n, records.size());
+  EXPECT_GE(n + dropped, 2 * records.size());
+  EXPECT_GE(dropped, records.size());
+
+  tcmalloc::MallocExtension::SetLifetimeRecordingEnabled(false);
+}
+
 }  // namespace
@@ -21,6 +21,7 @@
 #include <optional>
 #include <string>
 
+#include "benchmark/benchmark.h"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
 #include "absl/base/config.h"
@@ -314,5 +315,86 @@ TEST_F(GetStatsTest, StackDepth) {
   ASSERT_EQ(pthread_attr_destroy(&thread_attributes), 0);
 }
 
+TEST_F(GetStatsTest, Snapshot) {
+  constexpr size_t kSize = 64 << 20;
+  auto alloc = std::make_unique<char[]>(kSize);
+  // Gathering stats publishes the page heap totals.
+  const std::string stats = MallocExtension::GetStats();
+
+  MallocExtension::StatsV1 snapshot;
+  ASSERT_TRUE(MallocExtension::GetStatsSnapshot(&snapshot));
+  EXPECT_EQ(snapshot.version, MallocExtension::StatsV1::kVersion);
+  EXPECT_EQ(snapshot.size, sizeof(snapshot));
+  EXPECT_GT(snapshot.pageheap_timestamp_ns, 0);
+  EXPECT_GE(snapshot.current_allocated_bytes, kSize);
+  EXPECT_GE(snapshot.heap_size, snapshot.current_allocated_bytes);
+  EXPECT_GE(snapshot.virtual_memory_used, snapshot.physical_memory_used);
+  EXPECT_GT(snapshot.metadata_bytes, 0);
+
+  // The snapshot doesn't take pageheap_lock, so it doesn't deadlock while the
+  // lock is held.
+  tcmalloc_internal::pageheap_lock.Lock();
+  MallocExtension::StatsV1 locked_snapshot;
+  const bool ok = MallocExtension::GetStatsSnapshot(&locked_snapshot);
+  tcmalloc_internal::pageheap_lock.Unlock();
+  EXPECT_TRUE(ok);
+  EXPECT_GE(locked_snapshot.pageheap_timestamp_ns,
+            snapshot.pageheap_timestamp_ns);
+}
+
+TEST_F(GetStatsTest, VirtualPageAliases) {
+  // Small sampled allocations are moved to a page of their own that aliases
+  // the heap.
+  constexpr size_t kSize = 100;
+  char* alloc;
+  {
+    ScopedAlwaysSample s;
+    alloc = static_cast<char*>(::operator new(kSize));
+  }
+  memset(alloc, 1, kSize);
+
+  std::optional<size_t> aliases =
+      MallocExtension::GetNumericProperty("tcmalloc.virtual_page_aliases");
+  ASSERT_THAT(aliases, testing::Ne(std::nullopt));
+  EXPECT_GE(*aliases, 1);
+  // The alias needs at least one page table.
+  std::optional<size_t> page_table_bytes = MallocExtension::GetNumericProperty(
+      "tcmalloc.virtual_page_alias_page_table_bytes");
+  ASSERT_THAT(page_table_bytes, testing::Ne(std::nullopt));
+  EXPECT_GE(*page_table_bytes, 4096);
+  std::optional<size_t> resident_bytes = MallocExtension::GetNumericProperty(
+      "tcmalloc.virtual_page_alias_resident_bytes");
+  ASSERT_THAT(resident_bytes, testing::Ne(std::nullopt));
+  EXPECT_GT(*resident_bytes, 0);
+
+  EXPECT_THAT(MallocExtension::GetStats(),
+              HasSubstr("Bytes in virtual page alias page tables"));
+  EXPECT_THAT(GetStatsInPbTxt(),
+              ContainsRegex(R"(virtual_page_aliases: [1-9][0-9]*)"));
+
+  ::operator delete(alloc);
+}
+
+TEST_F(GetStatsTest, FastPathCounts) {
+#ifndef TCMALLOC_PER_CPU_CLASS_COUNTERS
+  GTEST_SKIP() << "fast path counters are not compiled in";
+#endif
+  if (!MallocExtension::PerCpuCachesActive()) {
+    GTEST_SKIP() << "per-CPU caches are not active";
+  }
+
+  for (int i = 0; i < 10000; ++i) {
+    void* ptr = ::operator new(64);
+    benchmark::DoNotOptimize(ptr);
+    ::operator delete(ptr);
+  }
+
+  EXPECT_THAT(
+      MallocExtension::GetStats(),
+      ContainsRegex(R"(bytes \] : +[1-9][0-9]* allocs +[1-9][0-9]* frees)"));
+  EXPECT_THAT(GetStatsInPbTxt(),
+              ContainsRegex(R"(fast_path_allocs: [1-9][0-9]*)"));
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -28,6 +28,7 @@
 #include "absl/time/time.h"
 #include "tcmalloc/cpu_cache.h"
 #include "tcmalloc/static_vars.h"
+#include "tcmalloc/testing/testutil.h"
 
 namespace tcmalloc {
 namespace tcmalloc_internal {
@@ -84,6 +85,23 @@ TEST(MallocExtension, SkipSubreleaseIntervals) {
             absl::ZeroDuration());
 }
 
+TEST(MallocExtension, GuardedPagePoolSize) {
+  // Guarded sampling is not activated in this test, so the pool is not mapped
+  // yet and can be resized.
+  const size_t pool_size = MallocExtension::GetGuardedPagePoolSize();
+  ASSERT_GT(pool_size, 0);
+
+  MallocExtension::SetGuardedPagePoolSize(2 * pool_size);
+  EXPECT_EQ(MallocExtension::GetGuardedPagePoolSize(), 2 * pool_size);
+
+  // Out of range sizes are ignored.
+  MallocExtension::SetGuardedPagePoolSize(0);
+  EXPECT_EQ(MallocExtension::GetGuardedPagePoolSize(), 2 * pool_size);
+
+  MallocExtension::SetGuardedPagePoolSize(pool_size);
+  EXPECT_EQ(MallocExtension::GetGuardedPagePoolSize(), pool_size);
+}
+
 TEST(MallocExtension, Properties) {
   // Verify that every property under GetProperties also works with
   // GetNumericProperty.
@@ -112,11 +130,21 @@ TEST(MallocExtension, Properties) {
       "tcmalloc.current_total_thread_cache_bytes",
       "tcmalloc.desired_usage_limit_bytes",
       "tcmalloc.external_fragmentation_bytes",
+      "tcmalloc.ftruncate_calls",
+      "tcmalloc.ftruncate_ns",
       "tcmalloc.hard_limit_hits",
       "tcmalloc.hard_usage_limit_bytes",
       "tcmalloc.local_bytes",
       "tcmalloc.max_total_thread_cache_bytes",
+      "tcmalloc.memfd_create_calls",
+      "tcmalloc.memfd_create_ns",
       "tcmalloc.metadata_bytes",
+      "tcmalloc.mmap_calls",
+      "tcmalloc.mmap_ns",
+      "tcmalloc.mprotect_calls",
+      "tcmalloc.mprotect_ns",
+      "tcmalloc.munmap_calls",
+      "tcmalloc.munmap_ns",
       "tcmalloc.page_algorithm",
       "tcmalloc.page_heap_free",
       "tcmalloc.page_heap_unmapped",
@@ -125,6 +153,7 @@ TEST(MallocExtension, Properties) {
       "tcmalloc.per_cpu_caches_active",
       "tcmalloc.required_bytes",
       "tcmalloc.sampled_internal_fragmentation",
+      "tcmalloc.sampled_quarantine_bytes",
       "tcmalloc.sharded_transfer_cache_free",
       "tcmalloc.slack_bytes",
       "tcmalloc.soft_limit_hits",
@@ -133,6 +162,8 @@ TEST(MallocExtension, Properties) {
       "tcmalloc.thread_cache_count",
       "tcmalloc.thread_cache_free",
       "tcmalloc.transfer_cache_free",
+      "tcmalloc.virtual_page_alias_page_table_bytes",
+      "tcmalloc.virtual_page_aliases",
       // go/keep-sorted end
       // clang-format on
   };
@@ -145,6 +176,47 @@ TEST(MallocExtension, Properties) {
   }
 }
 
+size_t SyscallCalls(absl::string_view property) {
+  std::optional<size_t> calls = MallocExtension::GetNumericProperty(property);
+  EXPECT_THAT(calls, testing::Ne(std::nullopt));
+  return calls.value_or(0);
+}
+
+// Guarded allocations make their page accessible with mprotect.
+TEST(MallocExtension, GuardedAllocationCountsSyscalls) {
+  ScopedAlwaysSample always_sample;
+
+  bool guarded = false;
+  for (int i = 0; i < 1000 && !guarded; ++i) {
+    const size_t before = SyscallCalls("tcmalloc.mprotect_calls");
+    void* ptr = ::operator new(42);
+    guarded = tc_globals.guardedpage_allocator().PointerIsMine(ptr);
+    if (guarded) {
+      EXPECT_GT(SyscallCalls("tcmalloc.mprotect_calls"), before);
+    }
+    ::operator delete(ptr);
+  }
+  EXPECT_TRUE(guarded) << "Failed to allocate with GWP-ASan";
+}
+
+// Unguarded small sampled allocations map an alias of the heap with mmap.
+TEST(MallocExtension, VirtualPageAliasCountsSyscalls) {
+  ScopedGuardedSamplingRate gs(-1);
+  ScopedProfileSamplingRate s(1);
+
+  bool aliased = false;
+  for (int i = 0; i < 1000 && !aliased; ++i) {
+    const size_t before = SyscallCalls("tcmalloc.mmap_calls");
+    void* ptr = ::operator new(42);
+    aliased = tc_globals.virtual_page_allocator().protection().Contains(ptr);
+    if (aliased) {
+      EXPECT_GT(SyscallCalls("tcmalloc.mmap_calls"), before);
+    }
+    ::operator delete(ptr);
+  }
+  EXPECT_TRUE(aliased) << "Failed to allocate a virtual page alias";
+}
+
 // Test that when we resize the slab repeatedly, the metadata metric is
 // positive.
 TEST(MallocExtension, DynamicSlabMallocMetadata) {
@@ -37,6 +37,7 @@
 #include "tcmalloc/internal/logging.h"
 #include "tcmalloc/internal/stacktrace_filter.h"
 #include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
 #include "tcmalloc/static_vars.h"
 #include "tcmalloc/testing/testutil.h"
 
@@ -141,7 +142,7 @@ TEST_F(GuardedAllocAlignmentTest, AlignedNew) {
 }  // namespace
 
 // By placing this class in the tcmalloc namespace, it may call the private
-// method StackTraceFilter::Reset as a friend.
+// methods StackTraceFilter::Reset and GuardedSamplingPolicy::Reset as a friend.
 class TcMallocTest : public testing::Test {
  protected:
   TcMallocTest() {
@@ -156,6 +157,9 @@ class TcMallocTest : public testing::Test {
     if (!improved_coverage_enabled) {
       return;
     }
+    // The sampling policy skips sites it has seen often, and the tests below
+    // repeatedly allocate from the same site.
+    tc_globals.guarded_sampling_policy().Reset();
     ++reset_request_count_;
     // Only reset when the requests (expected to be matched to detected guards)
     // exceeds the maximum number of guards for a single location provided by
@@ -494,5 +498,68 @@ TEST_P(ParameterizedTcMallocTest, ReallocUseAfterFree) {
 
 INSTANTIATE_TEST_SUITE_P(ptmt, ParameterizedTcMallocTest, testing::Bool());
 
+// Samples every allocation without guarding it, and quarantines freed sampled
+// allocations while in scope.
+class ScopedSampledQuarantine {
+ public:
+  explicit ScopedSampledQuarantine(size_t bytes)
+      : guarded_sampling_rate_(-1),
+        profile_sampling_rate_(1),
+        previous_(tcmalloc_internal::Parameters::sampled_quarantine_bytes()) {
+    tcmalloc_internal::Parameters::set_sampled_quarantine_bytes(bytes);
+  }
+
+  ~ScopedSampledQuarantine() {
+    tcmalloc_internal::Parameters::set_sampled_quarantine_bytes(previous_);
+    tc_globals.sampled_span_quarantine().Drain();
+  }
+
+ private:
+  ScopedGuardedSamplingRate guarded_sampling_rate_;
+  ScopedProfileSamplingRate profile_sampling_rate_;
+  size_t previous_;
+};
+
+TEST(SampledQuarantineTest, HoldsFreedAllocations) {
+  constexpr size_t kBudget = 16 * kPageSize;
+  ScopedSampledQuarantine quarantine(kBudget);
+  for (size_t size : {size_t{8}, size_t{100}, size_t{5000}, 3 * kPageSize}) {
+    SCOPED_TRACE(absl::StrCat("size=", size));
+    for (int i = 0; i < 100; ++i) {
+      void* volatile p = malloc(size);
+      free(p);
+    }
+    const size_t quarantined = *MallocExtension::GetNumericProperty(
+        "tcmalloc.sampled_quarantine_bytes");
+    EXPECT_GT(quarantined, 0);
+    EXPECT_LE(quarantined, kBudget);
+  }
+  // Allocations larger than the budget are freed right away.
+  void* volatile p = malloc(2 * kBudget);
+  free(p);
+}
+
+TEST(SampledQuarantineTest, WriteAfterFreeDetected) {
+#ifdef ABSL_HAVE_ADDRESS_SANITIZER
+  GTEST_SKIP() << "ASan will trap ahead of us";
+#endif
+  for (size_t size : {size_t{8}, size_t{505}, 2 * kPageSize}) {
+    SCOPED_TRACE(absl::StrCat("size=", size));
+    EXPECT_DEATH(
+        {
+          ScopedSampledQuarantine quarantine(16 * kPageSize);
+          char* volatile p = static_cast<char*>(malloc(size));
+          free(p);
+          p[size - 1] = 'A';
+          // Push the freed allocation out of the quarantine.
+          for (int i = 0; i < 1000; ++i) {
+            void* volatile q = malloc(size);
+            free(q);
+          }
+        },
+        "Write after free detected in sampled allocation");
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -26,14 +26,17 @@
 namespace tcmalloc {
 namespace {
 
-int64_t ProfileSize(ProfileType type) {
+int64_t ProfileSize(const Profile& profile) {
   int64_t total = 0;
 
-  MallocExtension::SnapshotCurrent(type).Iterate(
-      [&](const Profile::Sample& e) { total += e.sum; });
+  profile.Iterate([&](const Profile::Sample& e) { total += e.sum; });
   return total;
 }
 
+int64_t ProfileSize(ProfileType type) {
+  return ProfileSize(MallocExtension::SnapshotCurrent(type));
+}
+
 size_t PeakMemoryUsage() {
   const auto usage = tcmalloc::MallocExtension::GetNumericProperty(
       "generic.peak_memory_usage");
@@ -143,5 +146,25 @@ TEST(PeakHeapProfilingTest, PeakHeapTracking) {
   }
 }
 
+TEST(PeakHeapProfilingTest, WindowedPeaks) {
+  ScopedPeakGrowthFraction s(1.25);
+
+  // The peak of the current hour includes at least this allocation, whatever
+  // the earlier tests left behind.
+  void* ptr = ::operator new(50 << 20);
+  benchmark::DoNotOptimize(ptr);
+  const int64_t window_peak =
+      ProfileSize(MallocExtension::SnapshotPeakHeapWindow(0));
+  EXPECT_GE(window_peak, 40 << 20);
+
+  // Freeing it doesn't affect the peak.
+  ::operator delete(ptr);
+  EXPECT_EQ(ProfileSize(MallocExtension::SnapshotPeakHeapWindow(0)),
+            window_peak);
+
+  // Only the last 24 hours are kept.
+  EXPECT_EQ(ProfileSize(MallocExtension::SnapshotPeakHeapWindow(24)), 0);
+}
+
 }  // namespace
 }  // namespace tcmalloc
@@ -0,0 +1,106 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/residency_scanner.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/static_vars.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using Summary = ResidencyScanner::Summary;
+
+// Runs the pass in progress to completion, and returns the number of ticks it
+// took.
+int FinishPass() {
+  int ticks = 1;
+  while (!tc_globals.residency_scanner().Tick()) {
+    ++ticks;
+  }
+  return ticks;
+}
+
+TEST(ResidencyScannerTest, SummarizesResidentSpans) {
+  constexpr size_t kSize = 64 << 20;
+  void* p = ::operator new(kSize);
+  memset(p, 1, kSize);
+
+  // The pass in progress may have started past p.
+  FinishPass();
+  const uint64_t passes = tc_globals.residency_scanner().GetSummary().passes;
+  FinishPass();
+  const Summary summary = tc_globals.residency_scanner().GetSummary();
+  EXPECT_EQ(summary.passes, passes + 1);
+  EXPECT_GT(summary.timestamp_ns, 0);
+  EXPECT_GE(summary.duration_ns, 0);
+
+  // p is likely to be sampled, so it is either kind of span.
+  const ResidencyScanner::KindSummary& large =
+      summary.kinds[ResidencyScanner::kLarge];
+  const ResidencyScanner::KindSummary& sampled =
+      summary.kinds[ResidencyScanner::kSampled];
+  EXPECT_GE(large.spans + sampled.spans, 1);
+  EXPECT_GE(large.bytes + sampled.bytes, kSize);
+  EXPECT_GE(large.resident_bytes + sampled.resident_bytes, kSize);
+  for (const auto& kind : summary.kinds) {
+    EXPECT_LE(kind.resident_bytes + kind.swapped_bytes, kind.bytes);
+  }
+  EXPECT_GT(summary.kinds[ResidencyScanner::kSmall].resident_bytes, 0);
+  EXPECT_EQ(summary.kinds[ResidencyScanner::kReturned].resident_bytes, 0);
+
+  // All but the hugepages at either end of p are fully resident.
+  EXPECT_GE(summary.hugepages.full, kSize / kHugePageSize - 2);
+
+  ::operator delete(p);
+}
+
+TEST(ResidencyScannerTest, BoundsWorkPerTick) {
+  // Each allocation is a span of its own.
+  constexpr size_t kSize = 512 << 10;
+  std::vector<void*> ptrs;
+  for (size_t i = 0; i < 2 * ResidencyScanner::kMaxSpansPerTick; ++i) {
+    ptrs.push_back(::operator new(kSize));
+  }
+
+  FinishPass();
+  EXPECT_GE(FinishPass(), 2);
+
+  for (void* p : ptrs) {
+    ::operator delete(p);
+  }
+}
+
+TEST(ResidencyScannerTest, ReportsSummaryInStats) {
+  FinishPass();
+  const std::string stats = MallocExtension::GetStats();
+  EXPECT_THAT(stats, testing::HasSubstr("Residency scan: pass "));
+  EXPECT_THAT(stats, testing::HasSubstr("Residency scan: hugepages "));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
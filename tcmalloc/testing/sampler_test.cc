@@ -21,6 +21,7 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <limits>
 #include <vector>
 
 #include "gtest/gtest.h"
@@ -334,6 +335,52 @@ TEST(Sampler, weight_distribution) {
   }
 }
 
+// Tests that a per-sampler override changes the sampling period, and that
+// removing it restores the process-wide one.
+TEST(Sampler, SamplePeriodOverride) {
+  Sampler sampler;
+  SamplerTest::Init(&sampler, 1);
+  EXPECT_EQ(sampler.GetSamplePeriodOverride(), 0);
+
+  const size_t kOverride = kSamplingInterval / 8;
+  sampler.SetSamplePeriodOverride(kOverride);
+  EXPECT_EQ(sampler.GetSamplePeriodOverride(), kOverride);
+  DoCheckMean(kOverride, 1000,
+              [&sampler]() { return sampler.PickNextSamplingPoint(); });
+
+  sampler.SetSamplePeriodOverride(int64_t{1} << 40);
+  EXPECT_EQ(sampler.GetSamplePeriodOverride(),
+            std::numeric_limits<uint32_t>::max());
+
+  sampler.SetSamplePeriodOverride(0);
+  EXPECT_EQ(sampler.GetSamplePeriodOverride(), 0);
+  DoCheckMean(kSamplingInterval, 1000,
+              [&sampler]() { return sampler.PickNextSamplingPoint(); });
+}
+
+// Tests that samples taken with an override are weighted by the overridden
+// period, so that they remain unbiased.
+TEST(Sampler, weight_distribution_with_override) {
+  static constexpr size_t sizes[] = {1024, 1 << 16, 1 << 25};
+  const size_t kOverride = kSamplingInterval / 16;
+
+  for (auto size : sizes) {
+    SCOPED_TRACE(size);
+
+    Sampler s;
+    SamplerTest::Init(&s, 1);
+    s.SetSamplePeriodOverride(kOverride);
+
+    double expected = (size + 1) / (1.0 - exp(-1.0 * (size + 1) / kOverride));
+    DoCheckMean(expected, 10000, [size, &s]() {
+      size_t weight = 0;
+      while (!(weight = s.RecordAllocation(size))) {
+      }
+      return weight;
+    });
+  }
+}
+
 }  // namespace
 }  // namespace tcmalloc_internal
 }  // namespace tcmalloc
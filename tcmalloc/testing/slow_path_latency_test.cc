@@ -0,0 +1,111 @@
+// Copyright 2023 The TCMalloc Authors
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "tcmalloc/slow_path_latency.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "tcmalloc/internal/config.h"
+#include "tcmalloc/malloc_extension.h"
+#include "tcmalloc/parameters.h"
+#include "tcmalloc/static_vars.h"
+#include "tcmalloc/testing/testutil.h"
+
+namespace tcmalloc {
+namespace tcmalloc_internal {
+namespace {
+
+using ::testing::ContainsRegex;
+using ::testing::HasSubstr;
+
+class SlowPathLatencyTest : public ::testing::Test {
+ protected:
+  SlowPathLatencyTest()
+      : previous_(Parameters::slow_path_latency_histograms()) {}
+  ~SlowPathLatencyTest() override {
+    Parameters::set_slow_path_latency_histograms(previous_);
+  }
+
+  static uint64_t Count(SlowPath path) {
+    return tc_globals.slow_path_latency().GetHistogram(path).count;
+  }
+
+  // Allocates enough distinct large objects to go to the page allocator.
+  static void AllocateLarge() {
+    std::vector<void*> ptrs;
+    for (int i = 0; i < 16; ++i) {
+      void* ptr = ::operator new(1 << 20);
+      benchmark::DoNotOptimize(ptr);
+      ptrs.push_back(ptr);
+    }
+    for (void* ptr : ptrs) {
+      ::operator delete(ptr);
+    }
+  }
+
+ private:
+  const bool previous_;
+};
+
+TEST_F(SlowPathLatencyTest, RecordsOnlyWhenEnabled) {
+  Parameters::set_slow_path_latency_histograms(false);
+  const uint64_t before = Count(SlowPath::kPageAllocatorNew);
+  AllocateLarge();
+  EXPECT_EQ(Count(SlowPath::kPageAllocatorNew), before);
+
+  Parameters::set_slow_path_latency_histograms(true);
+  AllocateLarge();
+  EXPECT_GE(Count(SlowPath::kPageAllocatorNew), before + 16);
+}
+
+TEST_F(SlowPathLatencyTest, HistogramIsConsistent) {
+  Parameters::set_slow_path_latency_histograms(true);
+  AllocateLarge();
+
+  const SlowPathLatency::Histogram h =
+      tc_globals.slow_path_latency().GetHistogram(SlowPath::kPageAllocatorNew);
+  uint64_t sum = 0;
+  for (uint64_t n : h.buckets) {
+    sum += n;
+  }
+  EXPECT_EQ(sum, h.count);
+  EXPECT_GT(h.total_cycles, 0);
+}
+
+TEST_F(SlowPathLatencyTest, ReportsInStats) {
+  Parameters::set_slow_path_latency_histograms(true);
+  AllocateLarge();
+
+  const std::string stats = MallocExtension::GetStats();
+  EXPECT_THAT(stats, HasSubstr("Slow path latency"));
+  EXPECT_THAT(stats, ContainsRegex(R"(page_allocator_new +[1-9][0-9]* calls)"));
+  EXPECT_THAT(stats,
+              HasSubstr("PARAMETER tcmalloc_slow_path_latency_histograms 1"));
+
+  const std::string pbtxt = GetStatsInPbTxt();
+  EXPECT_THAT(pbtxt, HasSubstr("slow_path_latency {"));
+  EXPECT_THAT(pbtxt, HasSubstr("path: page_allocator_new"));
+}
+
+}  // namespace
+}  // namespace tcmalloc_internal
+}  // namespace tcmalloc
@@ -75,5 +75,14 @@ TEST(StartupSizeTest, Basic) {
   EXPECT_LE(physical, metadata_limit * 1.5);
 }
 
+TEST(StartupSizeTest, GuardedPoolIsReservedOnly) {
+  // The guarded page pool only reserves address space at startup.  Its slot
+  // metadata is not allocated until an allocation is first guarded.
+  PropertyMap map = MallocExtension::GetProperties();
+  ASSERT_NE(map.count("tcmalloc.metadata_bytes"), 0)
+      << "couldn't run - no tcmalloc data. Check your malloc configuration.";
+  EXPECT_EQ(Property(map, "tcmalloc.guarded_pool_metadata_bytes"), 0);
+}
+
 }  // namespace
 }  // namespace tcmalloc
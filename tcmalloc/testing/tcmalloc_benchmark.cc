@@ -271,7 +271,11 @@ BENCHMARK(BM_get_stats_internal)
     ->Range(1, 1 << 20)
     ->Unit(benchmark::kMillisecond);
 
-static void BM_get_stats_pageheap_lock(benchmark::State& state) {
+// Measures the time taken to acquire pageheap_lock while another thread
+// busy-loops calling poll().
+template <typename Poll>
+static void PageHeapLockLatencyWhilePolling(benchmark::State& state,
+                                            Poll poll) {
   std::vector<std::unique_ptr<char[]>> allocations;
   const int num_allocations = state.range(0);
   allocations.reserve(num_allocations);
@@ -285,15 +289,13 @@ static void BM_get_stats_pageheap_lock(benchmark::State& state) {
     allocations.emplace_back(new char[size]);
   }
 
-  // Create a background thread which busy-loops calling
-  // MallocExtension::GetStats().
+  // Create a background thread which busy-loops calling poll().
   absl::Notification done;
   std::atomic<size_t> counter = 0;
   std::thread stats_thread([&] {
     while (!done.HasBeenNotified()) {
-      const std::string stats = MallocExtension::GetStats();
+      poll();
       counter.fetch_add(1, std::memory_order_seq_cst);
-      benchmark::DoNotOptimize(stats);
     }
   });
 
@@ -322,11 +324,30 @@ static void BM_get_stats_pageheap_lock(benchmark::State& state) {
   done.Notify();
   stats_thread.join();
 }
+
+static void BM_get_stats_pageheap_lock(benchmark::State& state) {
+  PageHeapLockLatencyWhilePolling(state, [] {
+    const std::string stats = MallocExtension::GetStats();
+    benchmark::DoNotOptimize(stats);
+  });
+}
 BENCHMARK(BM_get_stats_pageheap_lock)
     ->Range(1, 1 << 20)
     ->UseRealTime()
     ->Unit(benchmark::kMillisecond);
 
+static void BM_get_stats_snapshot_pageheap_lock(benchmark::State& state) {
+  PageHeapLockLatencyWhilePolling(state, [] {
+    MallocExtension::StatsV1 stats;
+    MallocExtension::GetStatsSnapshot(&stats);
+    benchmark::DoNotOptimize(stats);
+  });
+}
+BENCHMARK(BM_get_stats_snapshot_pageheap_lock)
+    ->Range(1, 1 << 20)
+    ->UseRealTime()
+    ->Unit(benchmark::kMillisecond);
+
 static void BM_get_stats_pbtxt_internal(benchmark::State& state) {
   if (&MallocExtension_Internal_GetStatsInPbtxt == nullptr) {
     // Sanitizer builds don't provide this function.
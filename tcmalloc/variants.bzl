@@ -40,6 +40,10 @@ build_variants = [
         "name": "numa_aware",
         "copts": ["-DTCMALLOC_NUMA_AWARE"],
     },
+    {
+        "name": "class_counters",
+        "copts": ["-DTCMALLOC_PER_CPU_CLASS_COUNTERS"],
+    },
 ]
 
 test_variants = [
@@ -185,6 +189,14 @@ test_variants = [
         "deps": ["//tcmalloc:common_8k_pages"],
         "env": {"BORG_EXPERIMENTS": "TEST_ONLY_TCMALLOC_USE_EXTENDED_SIZE_CLASS_FOR_COLD"},
     },
+    {
+        "name": "class_counters",
+        "malloc": "//tcmalloc:tcmalloc_class_counters",
+        "copts": ["-DTCMALLOC_PER_CPU_CLASS_COUNTERS"],
+        "deps": [
+            "//tcmalloc:common_class_counters",
+        ],
+    },
 ]
 
 def create_tcmalloc_library(
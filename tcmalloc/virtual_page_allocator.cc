@@ -3,8 +3,15 @@
 #define _GNU_SOURCE
 
 #include <cstddef>
+#include <optional>
 #include <sys/mman.h>
 
+#include "absl/numeric/bits.h"
+#include "tcmalloc/common.h"
+#include "tcmalloc/internal/residency.h"
+#include "tcmalloc/internal/syscall_stats.h"
+#include "tcmalloc/slow_path_latency.h"
+
 namespace tcmalloc::tcmalloc_internal {
 
 namespace {
@@ -31,17 +38,33 @@ namespace {
   static constexpr std::uint32_t flag_allocated = static_cast<std::uint32_t>(1) << 31;
 }
 
-VirtualPageAllocator::VirtualPageAllocator() :
+VirtualPageAllocator::VirtualPageAllocator(std::size_t revocation_batch) :
+  num_page_tables_(0),
   page_bufferused_(static_cast<std::uint64_t>(num_buffer_slots) << 32) {
-  pages_ = mmap(nullptr, static_cast<size_t>(64) << 30, PROT_NONE,
-    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
-  free_page_buffer_ = mmap(nullptr,
+  PageProtectionEngine::Options options;
+  options.name = "Virtual Page";
+  options.reservation_bytes = kReservationBytes;
+  options.alignment = page_size;
+  // Like the guarded page pool, keep the pages out of the normal range, so that
+  // the fast deallocation path never sees them.
+  options.tag = MemoryTag::kSampled;
+  options.batch_size = revocation_batch;
+  options.owner = this;
+  options.release = [](void* owner, std::uint32_t page_index) {
+    static_cast<VirtualPageAllocator*>(owner)->Release(page_index);
+  };
+  CHECK_CONDITION(protection_.Init(options));
+  pages_ = reinterpret_cast<char*>(protection_.base());
+  free_page_buffer_ = CountedMmap(nullptr,
     num_buffer_slots * sizeof(std::atomic<std::uint32_t>), PROT_READ | PROT_WRITE,
     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
   for (std::uint32_t i = 0; i < num_buffer_slots; ++i) {
     new (free_page_buffer_ + i) std::atomic<std::uint32_t>(i);
   }
+  for (auto& word : page_tables_) {
+    word.store(0, std::memory_order_relaxed);
+  }
 }
 
 char* VirtualPageAllocator::Allocate() {
@@ -83,12 +106,88 @@ char* VirtualPageAllocator::Allocate() {
   return page;
 }
 
-void VirtualPageAllocator::Free(char* page) {
-  // Mark the memory as inaccessible.
-  mprotect(page, page_size, PROT_NONE);
+bool VirtualPageAllocator::Alias(char* page, int fd, off_t offset) {
+  ScopedSlowPathTimer timer(SlowPath::kAliasMmap);
+  if (!protection_.GrantAlias(reinterpret_cast<uintptr_t>(page), page_size,
+    fd, offset)) {
+    return false;
+  }
+  MarkPageTable(page);
+  return true;
+}
 
+void VirtualPageAllocator::MarkPageTable(const char* page) {
+  const std::size_t range = (page - pages_) / kPageTableSpan;
+  const std::uint64_t bit = static_cast<std::uint64_t>(1) << (range % 64);
+  std::atomic<std::uint64_t>& word = page_tables_[range / 64];
+  // Pages are handed out in order, so the bit is almost always set already.
+  // Check before writing to keep the cache line shared.
+  if ((word.load(std::memory_order_relaxed) & bit) != 0) {
+    return;
+  }
+  if ((word.fetch_or(bit, std::memory_order_relaxed) & bit) == 0) {
+    num_page_tables_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+VirtualPageAllocator::AliasStats VirtualPageAllocator::GetAliasStats(
+  bool report_residence) const {
+  AliasStats stats;
+  // Pages that aren't in the ring buffer are either allocated, or freed with
+  // their alias still mapped until the revocation batch completes.
+  stats.aliases = num_buffer_slots -
+    (page_bufferused_.load(std::memory_order_relaxed) >> 32);
+  const std::size_t page_tables =
+    num_page_tables_.load(std::memory_order_relaxed);
+  stats.page_table_bytes = page_tables * page_size;
+  stats.resident_bytes = 0;
+  if (!report_residence || page_tables == 0) {
+    return stats;
+  }
+
+  /* Read every stride-th range that has a page table, so that the samples
+  spread over all of them, and extrapolate. Each range takes a single read of
+  its page table entries. */
+  const std::size_t stride =
+    (page_tables + kMaxResidencySamples - 1) / kMaxResidencySamples;
+  Residency residency;
+  std::size_t seen = 0;
+  std::size_t sampled = 0;
+  std::size_t resident = 0;
+  for (std::size_t i = 0; i < kPageTableRanges / 64; ++i) {
+    std::uint64_t bits = page_tables_[i].load(std::memory_order_relaxed);
+    for (; bits != 0; bits &= bits - 1) {
+      if (seen++ % stride != 0) {
+        continue;
+      }
+      const char* range =
+        pages_ + (64 * i + absl::countr_zero(bits)) * kPageTableSpan;
+      std::optional<Residency::Info> info =
+        residency.Get(range, kPageTableSpan);
+      if (!info.has_value()) {
+        return stats;
+      }
+      resident += info->bytes_resident;
+      ++sampled;
+    }
+  }
+  if (sampled != 0) {
+    stats.resident_bytes = resident * seen / sampled;
+  }
+  return stats;
+}
+
+void VirtualPageAllocator::Free(char* page) {
   std::uint32_t page_index = (page - pages_) / page_size;
 
+  /* Drop the alias and mark the memory as inaccessible. The page only goes back
+  into the ring buffer once that's done, which may be when a later Free()
+  completes a batch. */
+  protection_.Revoke(page_index, reinterpret_cast<uintptr_t>(page), page_size,
+    PageProtectionEngine::Revocation::kDiscard);
+}
+
+void VirtualPageAllocator::Release(std::uint32_t page_index) {
   // Atomically increase the number of free pages by 1 and fetch the previous value of
   // page_bufferused_, from which we can compute the first index that was free before
   // this modification.
@@ -1,28 +1,96 @@
 #pragma once
 
 #include <atomic>
+#include <cstddef>
 #include <cstdint>
 
+#include "tcmalloc/internal/logging.h"
+#include "tcmalloc/page_protection_engine.h"
 #include "tcmalloc/pages.h"
 
 namespace tcmalloc::tcmalloc_internal {
 
 class VirtualPageAllocator {
   public:
-    VirtualPageAllocator();
+    /* Largest number of freed pages that can lose access together, see
+    PageProtectionEngine. */
+    static constexpr std::size_t kMaxRevocationBatch =
+      PageProtectionEngine::kMaxBatch;
+
+    /* Address space that all the pages live in. */
+    static constexpr std::size_t kReservationBytes =
+      static_cast<std::size_t>(64) << 30;
+
+    /* Bytes mapped by one last-level page table. The kernel only frees a page
+    table once the whole range it maps is unmapped, which never happens inside
+    the reservation, so each range that ever held an alias costs a page. */
+    static constexpr std::size_t kPageTableSpan = 2 << 20;
+
+    /* At most this many page table ranges are read from /proc/self/pagemap
+    when estimating alias residency. */
+    static constexpr std::size_t kMaxResidencySamples = 64;
+
+    /* What aliasing the heap costs on top of the heap itself. */
+    struct AliasStats {
+      /* Pages that currently alias a heap page, including freed pages whose
+      alias hasn't been discarded yet. */
+      std::size_t aliases;
+      /* Memory taken up by the page tables of the aliases. */
+      std::size_t page_table_bytes;
+      /* Estimated resident shmem bytes that the aliases map a second time.
+      /proc counts them in RSS once per mapping, but they take up no memory
+      beyond the heap's own. Only computed if residency was requested. */
+      std::size_t resident_bytes;
+    };
+
+    /* Freed pages lose access in batches of revocation_batch pages, where
+    1 <= revocation_batch <= kMaxRevocationBatch. 1 discards each page's alias
+    as soon as the page is freed; larger batches save system calls, but a
+    freed page stays accessible until its batch is discarded. */
+    explicit VirtualPageAllocator(std::size_t revocation_batch = 1);
 
     /* Allocate a page. */
     char* Allocate();
 
+    /* Map the page-sized part of fd at offset into page, which must have been
+    returned by Allocate(). Returns false on failure. */
+    bool Alias(char* page, int fd, off_t offset);
+
     // Free a page.
     void Free(char* page);
 
+    /* Cheap apart from report_residence, which reads the page table entries
+    of up to kMaxResidencySamples page table ranges and extrapolates. */
+    AliasStats GetAliasStats(bool report_residence) const;
+
+    /* Write the allocator's stats to *out. */
+    void Print(Printer* out) const { protection_.Print(out); }
+
+    const PageProtectionEngine& protection() const { return protection_; }
+
   private:
-    /* All the virtual pages this allocator manages.
-    64 GB of virtual address space, but the pages only become mapped if they're
-    allocated. */
+    /* Hand a page whose alias has been discarded back to the ring buffer. */
+    void Release(std::uint32_t page_index);
+
+    /* Sets the bit of the page table range that page is in. */
+    void MarkPageTable(const char* page);
+
+    /* Reserves the address space all the pages live in, and revokes access to
+    freed pages. The pages only become mapped while they're allocated. */
+    PageProtectionEngine protection_;
+
+    /* The first page in protection_. */
     char* pages_;
 
+    /* One bit per page table range of the reservation, set once an alias was
+    placed in the range. */
+    static constexpr std::size_t kPageTableRanges =
+      kReservationBytes / kPageTableSpan;
+    std::atomic<std::uint64_t> page_tables_[kPageTableRanges / 64];
+
+    /* The number of bits set in page_tables_. */
+    std::atomic<std::size_t> num_page_tables_;
+
     /* A ring buffer that stores indices of all free pages.
     page_bufferused_ stores the necessary information to determine which parts
     of the ring buffer are in use.